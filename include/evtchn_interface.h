@@ -56,6 +56,43 @@ typedef enum _XENBUS_EVTCHN_TYPE {
 */
 typedef struct _XENBUS_EVTCHN_CHANNEL XENBUS_EVTCHN_CHANNEL, *PXENBUS_EVTCHN_CHANNEL;
 
+/*! \typedef XENBUS_EVTCHN_GROUP
+    \brief Event channel group handle
+*/
+typedef struct _XENBUS_EVTCHN_GROUP XENBUS_EVTCHN_GROUP, *PXENBUS_EVTCHN_GROUP;
+
+/*! \struct _XENBUS_EVTCHN_STATISTICS
+    \brief Event channel statistics
+*/
+typedef struct _XENBUS_EVTCHN_STATISTICS {
+    PVOID       Caller;         /*!< The caller of XENBUS_EVTCHN_OPEN */
+    ULONG       LocalPort;      /*!< The local port */
+    ULONGLONG   Delivered;      /*!< Number of callback invocations */
+    ULONGLONG   Spurious;       /*!< Number of times found pending while closed */
+    ULONGLONG   DoneSomething;  /*!< Number of callbacks that returned TRUE */
+    ULONGLONG   CallbackTime;   /*!< Time spent in the callback (TSC cycles) */
+    ULONGLONG   Masked;         /*!< Number of times the port was masked */
+    ULONGLONG   Unmasked;       /*!< Number of times the port was unmasked */
+} XENBUS_EVTCHN_STATISTICS, *PXENBUS_EVTCHN_STATISTICS;
+
+/*! \def XENBUS_EVTCHN_LATENCY_BUCKETS
+    \brief Number of buckets in a latency histogram
+*/
+#define XENBUS_EVTCHN_LATENCY_BUCKETS   32
+
+/*! \struct _XENBUS_EVTCHN_LATENCY
+    \brief Event delivery latency histograms for a CPU
+
+    Bucket N of each histogram counts callback invocations whose latency
+    was at least 2^N (but less than 2^(N+1)) TSC cycles. The final bucket
+    also counts anything longer.
+*/
+typedef struct _XENBUS_EVTCHN_LATENCY {
+    ULONGLONG   Upcall[XENBUS_EVTCHN_LATENCY_BUCKETS];      /*!< Upcall entry to callback */
+    ULONGLONG   Dpc[XENBUS_EVTCHN_LATENCY_BUCKETS];         /*!< DPC queued to callback */
+    ULONGLONG   ThreadedDpc[XENBUS_EVTCHN_LATENCY_BUCKETS]; /*!< Threaded DPC queued to callback */
+} XENBUS_EVTCHN_LATENCY, *PXENBUS_EVTCHN_LATENCY;
+
 /*! \typedef XENBUS_EVTCHN_ACQUIRE
     \brief Acquire a reference to the EVTCHN interface
 
@@ -126,6 +163,11 @@ typedef NTSTATUS
     \param Channel The channel handle
     \param Group The group number of the CPU that should handle events
     \param Number The relative number of the CPU that should handle events
+
+    A channel cannot be moved while an event on it is queued for delivery
+    (including while it is in polling mode or awaiting its threaded
+    callback); in that case STATUS_DEVICE_BUSY is returned and the call
+    may be retried.
 */
 typedef NTSTATUS
 (*XENBUS_EVTCHN_BIND)(
@@ -219,6 +261,359 @@ typedef NTSTATUS
     OUT ULONG                   *Status
     );
 
+/*! \typedef XENBUS_EVTCHN_SET_PRIORITY
+    \brief Set the delivery priority of a channel
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Priority The priority, from 0 (highest) to 15 (lowest). Channels
+    are opened with priority 7.
+
+    Pending channels bound to the same CPU are serviced in priority order.
+    Priorities are only supported by the FIFO ABI; if the 2-level ABI is in
+    use then STATUS_NOT_SUPPORTED is returned and the channel continues to
+    be serviced in port order.
+    The priority is a property of the bound port. It is restored when a
+    channel is re-opened after resume by XENBUS_EVTCHN_REOPEN or
+    XENBUS_EVTCHN_GROUP_REOPEN, but a channel that is closed and opened
+    again starts at the default priority.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_SET_PRIORITY)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Priority
+    );
+
+/*! \typedef XENBUS_EVTCHN_SET_MODERATION
+    \brief Configure interrupt moderation (polling mode) for a channel
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Rate The event rate (events per second) at or above which the
+    channel will be switched into polling mode. A value of zero disables
+    moderation.
+    \param Time The maximum time (in microseconds) the channel callback
+    may be repeatedly invoked for in a single polling pass
+
+    When a moderated channel's callback returns TRUE, indicating that more
+    work is pending, and its event rate has reached \a Rate then the
+    channel is left masked and its callback is re-invoked from a per-CPU
+    polling DPC. Each pass re-invokes the callback until it returns FALSE
+    or \a Time has elapsed, in which case the channel is re-queued for a
+    subsequent pass. Once the callback returns FALSE, or the event rate
+    (which continues to be sampled while polling) drops below \a Rate,
+    the channel is unmasked and returns to interrupt mode. It also
+    returns to interrupt mode after a bounded number of consecutive
+    passes, so that a callback which never drains cannot keep the CPU
+    at DISPATCH_LEVEL indefinitely; it is next invoked when the port is
+    signalled again.
+    While the channel is in polling mode the mask is owned by XENBUS and
+    calls to XENBUS_EVTCHN_UNMASK have no effect.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_SET_MODERATION)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Rate,
+    IN  ULONG                   Time
+    );
+
+/*! \typedef XENBUS_EVTCHN_SET_AFFINITY
+    \brief Set the processors that a channel may be moved between
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Affinity The set of processors the channel may be bound to,
+    or NULL to allow any processor
+
+    If automatic balancing is enabled then channels may be re-bound at
+    any time to spread event load across processors. A channel that has
+    been explicitly bound using XENBUS_EVTCHN_BIND is pinned to that
+    processor until an affinity is set. If the channel is not currently
+    bound to a processor within \a Affinity then it will be re-bound to
+    the first one, which may fail with STATUS_DEVICE_BUSY as for
+    XENBUS_EVTCHN_BIND.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_SET_AFFINITY)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  PGROUP_AFFINITY         Affinity OPTIONAL
+    );
+
+/*! \typedef XENBUS_EVTCHN_QUERY_STATISTICS
+    \brief Query the statistics of open channels
+
+    \param Interface The interface header
+    \param Owner Any address within the module that opened the channels
+    of interest, or NULL for all channels
+    \param Statistics A buffer to receive one record per channel
+    \param Count On entry, the number of records \a Statistics can hold.
+    On exit, the number of matching channels.
+
+    If \a Statistics is NULL or too small then STATUS_BUFFER_OVERFLOW is
+    returned and \a Count is set to the number of records required.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_QUERY_STATISTICS)(
+    IN      PINTERFACE                  Interface,
+    IN      PVOID                       Owner OPTIONAL,
+    OUT     PXENBUS_EVTCHN_STATISTICS   Statistics OPTIONAL,
+    IN OUT  PULONG                      Count
+    );
+
+/*! \typedef XENBUS_EVTCHN_SET_THREADED
+    \brief Deliver a channel's events at PASSIVE_LEVEL
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Enable Set to TRUE to invoke the callback from a threaded DPC,
+    or FALSE to invoke it from the upcall (the default)
+
+    When a threaded channel becomes pending the port is masked and the
+    channel is queued for a per-CPU threaded DPC, which normally runs at
+    PASSIVE_LEVEL (but will run at DISPATCH_LEVEL if threaded DPCs have
+    been disabled). The port stays masked until the callback returns, so
+    any events that arrive in the meantime are handled by a single
+    invocation, and all channels queued on a CPU are serviced in one pass.
+    The port is then unmasked unless the channel was opened with \a Mask
+    set, in which case the owner must unmask it as usual.
+    No lock is held while a threaded callback runs, so XENBUS_EVTCHN_UNMASK
+    must be called with \a InCallback set to FALSE. Threaded channels are
+    not subject to moderation.
+    A threaded callback must not wait for anything (other than briefly
+    for a lock) since it holds up every other threaded channel on the
+    CPU, and releasing the last reference on the interface waits for it
+    to return.
+    This setting is preserved when a channel is re-opened after resume.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_SET_THREADED)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 Enable
+    );
+
+/*! \typedef XENBUS_EVTCHN_QUERY_LATENCY
+    \brief Query the event delivery latency histograms of a CPU
+
+    \param Interface The interface header
+    \param Index The index of the CPU
+    \param Latency A buffer to receive the histograms
+
+    Latency is measured from the point at which the upcall was taken, or
+    at which a DPC was queued to carry on the work, to the point at which
+    a channel callback is invoked.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_QUERY_LATENCY)(
+    IN  PINTERFACE              Interface,
+    IN  ULONG                   Index,
+    OUT PXENBUS_EVTCHN_LATENCY  Latency
+    );
+
+/*! \typedef XENBUS_EVTCHN_NOTIFY
+    \brief Send an event to the remote end of the channel, if it is
+    waiting for one
+
+    \param Interface The interface header
+    \param Channel The channel handle
+    \param Old The value of the producer index before it was advanced
+    \param New The value of the producer index after it was advanced
+    \param Event The location of the index at which the remote end has
+    asked to be notified (e.g. req_event or rsp_event in a shared ring)
+    \return TRUE if an event was sent
+
+    This implements the shared ring notification check: a full barrier is
+    issued so that the new producer index is visible before \a Event is
+    read, and then an event is only sent if \a Event lies in the range
+    (\a Old, \a New].
+*/
+typedef BOOLEAN
+(*XENBUS_EVTCHN_NOTIFY)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Old,
+    IN  ULONG                   New,
+    IN  volatile ULONG          *Event
+    );
+
+/*! \typedef XENBUS_EVTCHN_SEND_MULTIPLE
+    \brief Send an event to the remote end of a number of channels
+
+    \param Interface The interface header
+    \param Channel An array of channel handles
+    \param Count The number of entries in \a Channel
+
+    A channel that appears more than once in \a Channel is only sent
+    a single event.
+*/
+typedef VOID
+(*XENBUS_EVTCHN_SEND_MULTIPLE)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count
+    );
+
+/*! \typedef XENBUS_EVTCHN_REOPEN
+    \brief Re-open a number of channels that lost their ports across
+    a suspend/resume
+
+    \param Interface The interface header
+    \param Channel An array of channel handles
+    \param Count The number of entries in \a Channel
+
+    Each channel is re-opened with the parameters it was originally
+    opened with, re-bound to the CPU it was bound to before suspend
+    and unmasked. The hypercalls are batched. Channels that are still
+    active are left alone. Channels that could not be re-opened are
+    left inactive, and the status of the last failure is returned.
+    Unbound channels are given new local ports, which may need to be
+    re-advertised (see \ref XENBUS_EVTCHN_GET_PORT).
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_REOPEN)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_OPEN
+    \brief Open a group of event channels, e.g. one per queue of a
+    multi-queue device, spread over a set of CPUs
+
+    \param Interface The interface header
+    \param Type The type of event channel to open
+    \param Count The number of channels in the group
+    \param Affinity The set of CPUs to spread the channels over (NULL for all CPUs)
+    \param Function The callback function
+    \param Argument An optional array of \a Count context arguments, one of which is passed to the callback of each channel
+    \param ... Additional parameters required by \a Type
+
+    \b Unbound:
+    \param RemoteDomain The domid of the remote domain which will bind the channels
+    \param Mask Set to TRUE if the channels should be automatically masked before invoking the callback
+
+    \b Interdomain:
+    \param RemoteDomain The domid of the remote domain which has already bound the channels
+    \param RemotePort An array of \a Count port numbers bound to the channels in the remote domain
+    \param Mask Set to TRUE if the channels should be automatically masked before invoking the callback
+
+    \return Event channel group handle
+
+    The channels are spread as evenly as possible over the CPUs in
+    \a Affinity that can take events directly, NUMA node by NUMA node,
+    and are pinned there (see \ref XENBUS_EVTCHN_BIND). If no such CPU
+    exists the channels are left bound to CPU 0.
+*/
+typedef PXENBUS_EVTCHN_GROUP
+(*XENBUS_EVTCHN_GROUP_OPEN)(
+    IN  PINTERFACE          Interface,
+    IN  XENBUS_EVTCHN_TYPE  Type,
+    IN  ULONG               Count,
+    IN  PGROUP_AFFINITY     Affinity OPTIONAL,
+    IN  PKSERVICE_ROUTINE   Function,
+    IN  PVOID               *Argument OPTIONAL,
+    ...
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_CHANNEL
+    \brief Get the handle of a channel in a group
+
+    \param Interface The interface header
+    \param Group The group handle
+    \param Index The index of the channel within the group
+    \return Event channel handle
+*/
+typedef PXENBUS_EVTCHN_CHANNEL
+(*XENBUS_EVTCHN_GROUP_CHANNEL)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group,
+    IN  ULONG                   Index
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_MASK
+    \brief Mask all the channels in a group
+
+    \param Interface The interface header
+    \param Group The group handle
+
+    The channels stay masked, whatever else happens to them, until
+    the group is unmasked.
+*/
+typedef VOID
+(*XENBUS_EVTCHN_GROUP_MASK)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_UNMASK
+    \brief Unmask all the channels in a group
+
+    \param Interface The interface header
+    \param Group The group handle
+*/
+typedef VOID
+(*XENBUS_EVTCHN_GROUP_UNMASK)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_REOPEN
+    \brief Re-open all the channels in a group after resume
+
+    \param Interface The interface header
+    \param Group The group handle
+
+    See \ref XENBUS_EVTCHN_REOPEN.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_GROUP_REOPEN)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    );
+
+/*! \typedef XENBUS_EVTCHN_GROUP_CLOSE
+    \brief Close all the channels in a group and free the group
+
+    \param Interface The interface header
+    \param Group The group handle
+*/
+typedef VOID
+(*XENBUS_EVTCHN_GROUP_CLOSE)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    );
+
+/*! \typedef XENBUS_EVTCHN_WAIT
+    \brief Block the current vCPU in the hypervisor until an event is
+    pending on one of a number of channels
+
+    \param Interface The interface header
+    \param Channel An array of channel handles
+    \param Count The number of entries in \a Channel (at most
+    \ref XENBUS_EVTCHN_WAIT_MAXIMUM)
+    \param Timeout An optional relative timeout, in 100ns units
+
+    This is intended to replace busy-waiting at DISPATCH_LEVEL: the
+    physical CPU is given up until the wait completes. The wait may
+    complete early, e.g. if any other event needs delivering to the
+    vCPU, so the caller must re-check its wait condition.
+*/
+typedef NTSTATUS
+(*XENBUS_EVTCHN_WAIT)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count,
+    IN  PLARGE_INTEGER          Timeout OPTIONAL
+    );
+
+/*! \def XENBUS_EVTCHN_WAIT_MAXIMUM
+    \brief The maximum number of channels that can be waited on at once
+*/
+#define XENBUS_EVTCHN_WAIT_MAXIMUM  16
+
 // {BE2440AC-1098-4150-AF4D-452FADCEF923}
 DEFINE_GUID(GUID_XENBUS_EVTCHN_INTERFACE,
 0xbe2440ac, 0x1098, 0x4150, 0xaf, 0x4d, 0x45, 0x2f, 0xad, 0xce, 0xf9, 0x23);
@@ -308,7 +703,41 @@ struct _XENBUS_EVTCHN_INTERFACE_V5 {
     XENBUS_EVTCHN_STATUS    EvtchnStatus;
 };
 
-typedef struct _XENBUS_EVTCHN_INTERFACE_V5 XENBUS_EVTCHN_INTERFACE, *PXENBUS_EVTCHN_INTERFACE;
+/*! \struct _XENBUS_EVTCHN_INTERFACE_V6
+    \brief EVTCHN interface version 6
+    \ingroup interfaces
+*/
+struct _XENBUS_EVTCHN_INTERFACE_V6 {
+    INTERFACE                       Interface;
+    XENBUS_EVTCHN_ACQUIRE           EvtchnAcquire;
+    XENBUS_EVTCHN_RELEASE           EvtchnRelease;
+    XENBUS_EVTCHN_OPEN              EvtchnOpen;
+    XENBUS_EVTCHN_BIND              EvtchnBind;
+    XENBUS_EVTCHN_UNMASK            EvtchnUnmask;
+    XENBUS_EVTCHN_SEND              EvtchnSend;
+    XENBUS_EVTCHN_TRIGGER           EvtchnTrigger;
+    XENBUS_EVTCHN_GET_PORT          EvtchnGetPort;
+    XENBUS_EVTCHN_CLOSE             EvtchnClose;
+    XENBUS_EVTCHN_STATUS            EvtchnStatus;
+    XENBUS_EVTCHN_SET_PRIORITY      EvtchnSetPriority;
+    XENBUS_EVTCHN_SET_MODERATION    EvtchnSetModeration;
+    XENBUS_EVTCHN_SET_AFFINITY      EvtchnSetAffinity;
+    XENBUS_EVTCHN_QUERY_STATISTICS  EvtchnQueryStatistics;
+    XENBUS_EVTCHN_SET_THREADED      EvtchnSetThreaded;
+    XENBUS_EVTCHN_QUERY_LATENCY     EvtchnQueryLatency;
+    XENBUS_EVTCHN_NOTIFY            EvtchnNotify;
+    XENBUS_EVTCHN_SEND_MULTIPLE     EvtchnSendMultiple;
+    XENBUS_EVTCHN_REOPEN            EvtchnReopen;
+    XENBUS_EVTCHN_GROUP_OPEN        EvtchnGroupOpen;
+    XENBUS_EVTCHN_GROUP_CHANNEL     EvtchnGroupChannel;
+    XENBUS_EVTCHN_GROUP_MASK        EvtchnGroupMask;
+    XENBUS_EVTCHN_GROUP_UNMASK      EvtchnGroupUnmask;
+    XENBUS_EVTCHN_GROUP_REOPEN      EvtchnGroupReopen;
+    XENBUS_EVTCHN_GROUP_CLOSE       EvtchnGroupClose;
+    XENBUS_EVTCHN_WAIT              EvtchnWait;
+};
+
+typedef struct _XENBUS_EVTCHN_INTERFACE_V6 XENBUS_EVTCHN_INTERFACE, *PXENBUS_EVTCHN_INTERFACE;
 
 /*! \def XENBUS_EVTCHN
     \brief Macro at assist in method invocation
@@ -319,6 +748,6 @@ typedef struct _XENBUS_EVTCHN_INTERFACE_V5 XENBUS_EVTCHN_INTERFACE, *PXENBUS_EVT
 #endif  // _WINDLL
 
 #define XENBUS_EVTCHN_INTERFACE_VERSION_MIN 3
-#define XENBUS_EVTCHN_INTERFACE_VERSION_MAX 5
+#define XENBUS_EVTCHN_INTERFACE_VERSION_MAX 6
 
 #endif  // _XENBUS_EVTCHN_INTERFACE_H
@@ -204,6 +204,83 @@ typedef NTSTATUS
     IN  PULONG                  Handles
     );
 
+/*! \typedef XENBUS_GNTTAB_PERMIT_FOREIGN_ACCESS_MULTIPLE
+    \brief Get \a Count table entries from the \a Cache permitting access
+    to each of the frames in \a Pfn
+
+    \param Interface The interface header
+    \param Cache The grant table cache handle
+    \param Locked If mutually exclusive access to the cache is already
+    guaranteed then set this to TRUE
+    \param Domain The domid of the domain being granted access
+    \param Pfn An array of frame numbers of the pages that we are granting
+    access to
+    \param Count The number of entries in \a Pfn and \a Entry
+    \param ReadOnly Set to TRUE if the foreign domain is only being granted
+    read access
+    \param Entry An array of grant table entry handles to be initialized
+
+    Either all the entries are granted or none are
+*/
+typedef NTSTATUS
+(*XENBUS_GNTTAB_PERMIT_FOREIGN_ACCESS_MULTIPLE)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  USHORT                      Domain,
+    IN  PFN_NUMBER                  Pfn[],
+    IN  ULONG                       Count,
+    IN  BOOLEAN                     ReadOnly,
+    OUT PXENBUS_GNTTAB_ENTRY        Entry[]
+    );
+
+/*! \typedef XENBUS_GNTTAB_REVOKE_FOREIGN_ACCESS_MULTIPLE
+    \brief Revoke foreign access to \a Count entries and return them to
+    the \a Cache
+
+    \param Interface The interface header
+    \param Cache The grant table cache handle
+    \param Locked If mutually exclusive access to the cache is already
+    guaranteed then set this to TRUE
+    \param Entry An array of grant table entry handles
+    \param Count The number of entries in \a Entry
+
+    As with \ref XENBUS_GNTTAB_REVOKE_FOREIGN_ACCESS, an entry that is
+    still in use by the foreign domain is not returned to the cache and
+    the call fails, but all the other entries are still revoked
+*/
+typedef NTSTATUS
+(*XENBUS_GNTTAB_REVOKE_FOREIGN_ACCESS_MULTIPLE)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  BOOLEAN                     Locked,
+    IN  PXENBUS_GNTTAB_ENTRY        Entry[],
+    IN  ULONG                       Count
+    );
+
+/*! \typedef XENBUS_GNTTAB_SET_PERSISTENT
+    \brief Make grants from the \a Cache persistent
+
+    \param Interface The interface header
+    \param Cache The grant table cache handle
+    \param Size The maximum number of persistent grants to keep (0 to stop
+    keeping them)
+
+    Once set, revoking an entry from the cache leaves the page granted, and
+    permitting access to the same page for the same domain and access mode
+    returns the same entry. Up to \a Size such grants are kept, the least
+    recently used unused grant being really revoked to make room. This is
+    intended for use with backends that support feature-persistent; the
+    caller must make sure that pages granted this way never hold data the
+    backend should not see. Must be called at PASSIVE_LEVEL.
+*/
+typedef NTSTATUS
+(*XENBUS_GNTTAB_SET_PERSISTENT)(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_GNTTAB_CACHE        Cache,
+    IN  ULONG                       Size
+    );
+
 // {763679C5-E5C2-4A6D-8B88-6BB02EC42D8E}
 DEFINE_GUID(GUID_XENBUS_GNTTAB_INTERFACE, 
 0x763679c5, 0xe5c2, 0x4a6d, 0x8b, 0x88, 0x6b, 0xb0, 0x2e, 0xc4, 0x2d, 0x8e);
@@ -240,7 +317,27 @@ struct _XENBUS_GNTTAB_INTERFACE_V2 {
     XENBUS_GNTTAB_UNMAP_FOREIGN_PAGES   GnttabUnmapForeignPages;
 };
 
-typedef struct _XENBUS_GNTTAB_INTERFACE_V2 XENBUS_GNTTAB_INTERFACE, *PXENBUS_GNTTAB_INTERFACE;
+/*! \struct _XENBUS_GNTTAB_INTERFACE_V3
+\brief GNTTAB interface version 3 (added multiple permit/revoke and persistent grants)
+\ingroup interfaces
+*/
+struct _XENBUS_GNTTAB_INTERFACE_V3 {
+    INTERFACE                                       Interface;
+    XENBUS_GNTTAB_ACQUIRE                           GnttabAcquire;
+    XENBUS_GNTTAB_RELEASE                           GnttabRelease;
+    XENBUS_GNTTAB_CREATE_CACHE                      GnttabCreateCache;
+    XENBUS_GNTTAB_PERMIT_FOREIGN_ACCESS             GnttabPermitForeignAccess;
+    XENBUS_GNTTAB_REVOKE_FOREIGN_ACCESS             GnttabRevokeForeignAccess;
+    XENBUS_GNTTAB_GET_REFERENCE                     GnttabGetReference;
+    XENBUS_GNTTAB_DESTROY_CACHE                     GnttabDestroyCache;
+    XENBUS_GNTTAB_MAP_FOREIGN_PAGES                 GnttabMapForeignPages;
+    XENBUS_GNTTAB_UNMAP_FOREIGN_PAGES               GnttabUnmapForeignPages;
+    XENBUS_GNTTAB_PERMIT_FOREIGN_ACCESS_MULTIPLE    GnttabPermitForeignAccessMultiple;
+    XENBUS_GNTTAB_REVOKE_FOREIGN_ACCESS_MULTIPLE    GnttabRevokeForeignAccessMultiple;
+    XENBUS_GNTTAB_SET_PERSISTENT                    GnttabSetPersistent;
+};
+
+typedef struct _XENBUS_GNTTAB_INTERFACE_V3 XENBUS_GNTTAB_INTERFACE, *PXENBUS_GNTTAB_INTERFACE;
 
 /*! \def XENBUS_GNTTAB
     \brief Macro at assist in method invocation
@@ -251,6 +348,6 @@ typedef struct _XENBUS_GNTTAB_INTERFACE_V2 XENBUS_GNTTAB_INTERFACE, *PXENBUS_GNT
 #endif  // _WINDLL
 
 #define XENBUS_GNTTAB_INTERFACE_VERSION_MIN 1
-#define XENBUS_GNTTAB_INTERFACE_VERSION_MAX 2
+#define XENBUS_GNTTAB_INTERFACE_VERSION_MAX 3
 
 #endif  // _XENBUS_GNTTAB_INTERFACE_H
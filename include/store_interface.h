@@ -67,6 +67,42 @@ typedef struct _XENBUS_STORE_PERMISSION {
     XENBUS_STORE_PERMISSION_MASK Mask;
 } XENBUS_STORE_PERMISSION, *PXENBUS_STORE_PERMISSION;
 
+/*! \def XENBUS_STORE_CAPTURE_PAYLOAD_MAX
+    \brief The maximum number of payload bytes held in a capture record
+*/
+#define XENBUS_STORE_CAPTURE_PAYLOAD_MAX    64
+
+/*! \typedef XENBUS_STORE_CAPTURE_TYPE
+    \brief Type of a captured XenStore message
+*/
+typedef enum _XENBUS_STORE_CAPTURE_TYPE {
+    XENBUS_STORE_CAPTURE_TYPE_INVALID = 0,
+    XENBUS_STORE_CAPTURE_TYPE_REQUEST,
+    XENBUS_STORE_CAPTURE_TYPE_RESPONSE,
+    XENBUS_STORE_CAPTURE_TYPE_WATCH_EVENT
+} XENBUS_STORE_CAPTURE_TYPE, *PXENBUS_STORE_CAPTURE_TYPE;
+
+#pragma pack(push, 1)
+
+/*! \typedef XENBUS_STORE_CAPTURE_RECORD
+    \brief A captured XenStore message
+
+    Each record is immediately followed by \a DataLength bytes of
+    (possibly truncated) payload
+*/
+typedef struct _XENBUS_STORE_CAPTURE_RECORD {
+    ULONGLONG   TimeStamp;      /*!< System time (100ns units) */
+    ULONGLONG   Caller;         /*!< Address of the code making the request */
+    ULONG       Type;           /*!< xsd_sockmsg type */
+    ULONG       RequestId;      /*!< xsd_sockmsg req_id */
+    ULONG       TransactionId;  /*!< xsd_sockmsg tx_id */
+    ULONG       Length;         /*!< xsd_sockmsg len (untruncated) */
+    UCHAR       CaptureType;    /*!< XENBUS_STORE_CAPTURE_TYPE */
+    UCHAR       DataLength;     /*!< Number of payload bytes that follow */
+} XENBUS_STORE_CAPTURE_RECORD, *PXENBUS_STORE_CAPTURE_RECORD;
+
+#pragma pack(pop)
+
 /*! \typedef XENBUS_STORE_ACQUIRE
     \brief Acquire a reference to the STORE interface
 
@@ -286,6 +322,29 @@ typedef NTSTATUS
     IN  ULONG                       NumberPermissions
     );
 
+/*! \typedef XENBUS_STORE_CAPTURE_EXPORT
+    \brief Export the contents of the XenStore capture ring
+
+    \param Interface The interface header
+    \param Buffer A buffer to receive the capture records (or NULL to
+    query the required size)
+    \param Length On entry the size of \a Buffer, on exit the number of
+    bytes required or copied
+
+    Records are exported oldest first as a packed sequence of
+    XENBUS_STORE_CAPTURE_RECORD structures, each followed by its
+    payload. The capture ring is only present if the StoreCapture
+    parameter is set in the registry, otherwise STATUS_NOT_SUPPORTED
+    is returned. If \a Buffer is too small then STATUS_BUFFER_OVERFLOW
+    is returned.
+*/
+typedef NTSTATUS
+(*XENBUS_STORE_CAPTURE_EXPORT)(
+    IN      PINTERFACE  Interface,
+    OUT     PVOID       Buffer OPTIONAL,
+    IN OUT  PULONG      Length
+    );
+
 // {86824C3B-D34E-4753-B281-2F1E3AD214D7}
 DEFINE_GUID(GUID_XENBUS_STORE_INTERFACE,
 0x86824c3b, 0xd34e, 0x4753, 0xb2, 0x81, 0x2f, 0x1e, 0x3a, 0xd2, 0x14, 0xd7);
@@ -331,7 +390,29 @@ struct _XENBUS_STORE_INTERFACE_V2 {
     XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
 };
 
-typedef struct _XENBUS_STORE_INTERFACE_V2 XENBUS_STORE_INTERFACE, *PXENBUS_STORE_INTERFACE;
+/*! \struct _XENBUS_STORE_INTERFACE_V3
+    \brief STORE interface version 3
+    \ingroup interfaces
+*/
+struct _XENBUS_STORE_INTERFACE_V3 {
+    INTERFACE                       Interface;
+    XENBUS_STORE_ACQUIRE            StoreAcquire;
+    XENBUS_STORE_RELEASE            StoreRelease;
+    XENBUS_STORE_FREE               StoreFree;
+    XENBUS_STORE_READ               StoreRead;
+    XENBUS_STORE_PRINTF             StorePrintf;
+    XENBUS_STORE_REMOVE             StoreRemove;
+    XENBUS_STORE_DIRECTORY          StoreDirectory;
+    XENBUS_STORE_TRANSACTION_START  StoreTransactionStart;
+    XENBUS_STORE_TRANSACTION_END    StoreTransactionEnd;
+    XENBUS_STORE_WATCH_ADD          StoreWatchAdd;
+    XENBUS_STORE_WATCH_REMOVE       StoreWatchRemove;
+    XENBUS_STORE_POLL               StorePoll;
+    XENBUS_STORE_PERMISSIONS_SET    StorePermissionsSet;
+    XENBUS_STORE_CAPTURE_EXPORT     StoreCaptureExport;
+};
+
+typedef struct _XENBUS_STORE_INTERFACE_V3 XENBUS_STORE_INTERFACE, *PXENBUS_STORE_INTERFACE;
 
 /*! \def XENBUS_STORE
     \brief Macro at assist in method invocation
@@ -342,6 +423,6 @@ typedef struct _XENBUS_STORE_INTERFACE_V2 XENBUS_STORE_INTERFACE, *PXENBUS_STORE
 #endif  // _WINDLL
 
 #define XENBUS_STORE_INTERFACE_VERSION_MIN  1
-#define XENBUS_STORE_INTERFACE_VERSION_MAX  2
+#define XENBUS_STORE_INTERFACE_VERSION_MAX  3
 
 #endif  // _XENBUS_STORE_INTERFACE_H
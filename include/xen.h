@@ -80,6 +80,14 @@ HypercallPopulate(
     VOID
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallMulticall(
+    IN  multicall_entry_t   *Entry,
+    IN  ULONG               Count
+    );
+
 // HVM
 
 __checkReturn
@@ -242,6 +250,14 @@ EventChannelStatus(
     OUT uint32_t            *Status // EVTCHNSTAT_*
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelSetPriority(
+    IN  ULONG               LocalPort,
+    IN  ULONG               Priority    // EVTCHN_FIFO_PRIORITY_*
+    );
+
 // GRANT TABLE
 
 __checkReturn
@@ -258,6 +274,14 @@ GrantTableGetVersion(
     OUT uint32_t    *Version
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableQuerySize(
+    OUT uint32_t    *Current OPTIONAL,
+    OUT uint32_t    *Maximum
+    );
+
 __checkReturn
 XEN_API
 NTSTATUS
@@ -285,6 +309,28 @@ GrantTableUnmapForeignPage(
     IN  PHYSICAL_ADDRESS        Address
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableMapForeignPages(
+    IN  USHORT                  Domain,
+    IN  ULONG                   Count,
+    IN  PULONG                  Reference,
+    IN  PHYSICAL_ADDRESS        Address,
+    IN  BOOLEAN                 ReadOnly,
+    OUT ULONG                   Handle[],
+    OUT PBOOLEAN                Leaked
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableUnmapForeignPages(
+    IN  ULONG                   Count,
+    IN  PULONG                  Handle,
+    IN  PHYSICAL_ADDRESS        Address
+    );
+
 // SCHED
 
 __checkReturn
@@ -307,6 +353,24 @@ SchedYield(
     VOID
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+SchedPoll(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+SchedPollDeadline(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Deadline OPTIONAL
+    );
+
 // XEN VERSION
 
 __checkReturn
@@ -106,6 +106,48 @@ fail1:
     return status;
 }
 
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableQuerySize(
+    OUT uint32_t                *Current OPTIONAL,
+    OUT uint32_t                *Maximum
+    )
+{
+    struct gnttab_query_size    op;
+    LONG_PTR                    rc;
+    NTSTATUS                    status;
+
+    RtlZeroMemory(&op, sizeof (op));
+    op.dom = DOMID_SELF;
+
+    rc = GrantTableOp(GNTTABOP_query_size, &op, 1);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    status = STATUS_UNSUCCESSFUL;
+    if (op.status != GNTST_okay)
+        goto fail2;
+
+    if (Current != NULL)
+        *Current = op.nr_frames;
+
+    *Maximum = op.max_nr_frames;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2 (op.status = %d)\n", op.status);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 __checkReturn
 XEN_API
 NTSTATUS
@@ -216,3 +258,203 @@ fail1:
 
     return status;
 }
+
+// Maximum number of map or unmap operations submitted in one hypercall
+#define GRANT_TABLE_BATCH   32
+
+static ULONG
+GrantTableUnmapBatch(
+    IN  ULONG                           Count,
+    IN  struct gnttab_unmap_grant_ref   op[]
+    )
+{
+    LONG_PTR                            rc;
+    ULONG                               Index;
+    ULONG                               Failed;
+
+    rc = GrantTableOp(GNTTABOP_unmap_grant_ref, &op[0], Count);
+
+    if (rc < 0) {
+        Error("rc = %d\n", (LONG)rc);
+        return Count;
+    }
+
+    Failed = 0;
+    for (Index = 0; Index < Count; Index++) {
+        if (op[Index].status == GNTST_okay)
+            continue;
+
+        Error("handle %u: op.status = %d\n",
+              op[Index].handle,
+              op[Index].status);
+        Failed++;
+    }
+
+    return Failed;
+}
+
+//
+// Map Count foreign grant references onto consecutive pages starting at
+// Address, GRANT_TABLE_BATCH references per hypercall. If any reference
+// cannot be mapped then all the references that were mapped are unmapped
+// again before returning. Should any of those unmaps fail then *Leaked is
+// set, since some of the pages are still in use by the foreign mapping.
+//
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableMapForeignPages(
+    IN  USHORT                      Domain,
+    IN  ULONG                       Count,
+    IN  PULONG                      Reference,
+    IN  PHYSICAL_ADDRESS            Address,
+    IN  BOOLEAN                     ReadOnly,
+    OUT ULONG                       Handle[],
+    OUT PBOOLEAN                    Leaked
+    )
+{
+    struct gnttab_map_grant_ref     op[GRANT_TABLE_BATCH];
+    struct gnttab_unmap_grant_ref   unmap[GRANT_TABLE_BATCH];
+    ULONG                           Done;
+    ULONG                           Index;
+    ULONG                           Batch;
+    LONG_PTR                        rc;
+    NTSTATUS                        status;
+
+    *Leaked = FALSE;
+
+    status = STATUS_SUCCESS;
+    for (Done = 0; Done < Count; Done += Batch) {
+        Batch = __min(Count - Done, GRANT_TABLE_BATCH);
+
+        //
+        // Xen only writes the status of the ops it gets to, so start them
+        // all off as failed in case it gives up part way through the batch.
+        //
+        RtlZeroMemory(op, sizeof (op));
+        for (Index = 0; Index < Batch; Index++) {
+            op[Index].status = GNTST_general_error;
+            op[Index].dom = Domain;
+            op[Index].ref = Reference[Done + Index];
+            op[Index].flags = GNTMAP_host_map;
+            if (ReadOnly)
+                op[Index].flags |= GNTMAP_readonly;
+            op[Index].host_addr = Address.QuadPart +
+                                  ((ULONGLONG)(Done + Index) << PAGE_SHIFT);
+        }
+
+        rc = GrantTableOp(GNTTABOP_map_grant_ref, &op[0], Batch);
+
+        if (rc < 0) {
+            ERRNO_TO_STATUS(-rc, status);
+            goto fail1;
+        }
+
+        //
+        // Each entry has its own status. Record the handles of those
+        // that worked and, if any did not, unmap them straight away.
+        //
+        for (Index = 0; Index < Batch; Index++) {
+            if (op[Index].status == GNTST_okay) {
+                Handle[Done + Index] = op[Index].handle;
+                continue;
+            }
+
+            Error("ref %u: op.status = %d\n",
+                  op[Index].ref,
+                  op[Index].status);
+            status = STATUS_UNSUCCESSFUL;
+        }
+
+        if (!NT_SUCCESS(status))
+            goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    // Unmap whatever part of the current batch was mapped
+    {
+        ULONG   Unmaps = 0;
+
+        RtlZeroMemory(unmap, sizeof (unmap));
+        for (Index = 0; Index < Batch; Index++) {
+            if (op[Index].status != GNTST_okay)
+                continue;
+
+            unmap[Unmaps].handle = op[Index].handle;
+            unmap[Unmaps].host_addr = op[Index].host_addr;
+            Unmaps++;
+        }
+
+        if (Unmaps != 0 && GrantTableUnmapBatch(Unmaps, unmap) != 0)
+            *Leaked = TRUE;
+    }
+
+    // Undo the batches that were mapped completely
+    while (Done != 0) {
+        Batch = __min(Done, GRANT_TABLE_BATCH);
+        Done -= Batch;
+
+        RtlZeroMemory(unmap, sizeof (unmap));
+        for (Index = 0; Index < Batch; Index++) {
+            unmap[Index].handle = Handle[Done + Index];
+            unmap[Index].host_addr = Address.QuadPart +
+                                     ((ULONGLONG)(Done + Index) << PAGE_SHIFT);
+        }
+
+        if (GrantTableUnmapBatch(Batch, unmap) != 0)
+            *Leaked = TRUE;
+    }
+
+    return status;
+}
+
+//
+// Unmap Count foreign mappings from consecutive pages starting at Address,
+// GRANT_TABLE_BATCH per hypercall. All the mappings are attempted even if
+// some fail.
+//
+__checkReturn
+XEN_API
+NTSTATUS
+GrantTableUnmapForeignPages(
+    IN  ULONG                       Count,
+    IN  PULONG                      Handle,
+    IN  PHYSICAL_ADDRESS            Address
+    )
+{
+    struct gnttab_unmap_grant_ref   op[GRANT_TABLE_BATCH];
+    ULONG                           Done;
+    ULONG                           Index;
+    ULONG                           Batch;
+    ULONG                           Failed;
+    NTSTATUS                        status;
+
+    Failed = 0;
+    for (Done = 0; Done < Count; Done += Batch) {
+        Batch = __min(Count - Done, GRANT_TABLE_BATCH);
+
+        RtlZeroMemory(op, sizeof (op));
+        for (Index = 0; Index < Batch; Index++) {
+            op[Index].handle = Handle[Done + Index];
+            op[Index].host_addr = Address.QuadPart +
+                                  ((ULONGLONG)(Done + Index) << PAGE_SHIFT);
+        }
+
+        Failed += GrantTableUnmapBatch(Batch, op);
+    }
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Failed != 0)
+        goto fail1;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x) %u of %u failed\n", status, Failed, Count);
+
+    return status;
+}
@@ -174,6 +174,37 @@ __Hypercall(
     return Value;
 }
 
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallMulticall(
+    IN  multicall_entry_t   *Entry,
+    IN  ULONG               Count
+    )
+{
+    LONG_PTR                rc;
+    NTSTATUS                status;
+
+    //
+    // NOTE: Only a failure of the multicall itself is reported here.
+    //       The result of each individual call is returned in the
+    //       result field of its entry.
+    //
+    rc = HYPERCALL(LONG_PTR, multicall, 2, Entry, Count);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 VOID
 HypercallTeardown(
     VOID
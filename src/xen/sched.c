@@ -111,3 +111,78 @@ SchedYield(
 {
     (VOID) SchedOp(SCHEDOP_yield, NULL);
 }
+
+//
+// Block the vCPU until one of the given ports is pending, some other
+// event needs delivering to the vCPU or the deadline (an absolute Xen
+// system time, in nanoseconds, as returned by HvmGetTime()) passes. With
+// no ports, any event wakes the vCPU. Success does not mean that a port
+// is pending so callers must always re-check whatever it is they are
+// waiting for.
+//
+__checkReturn
+XEN_API
+NTSTATUS
+SchedPollDeadline(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Deadline OPTIONAL
+    )
+{
+    struct sched_poll   op;
+    LONG_PTR            rc;
+    NTSTATUS            status;
+
+    set_xen_guest_handle(op.ports, Port);
+    op.nr_ports = Count;
+    op.timeout = (Deadline != NULL) ? Deadline->QuadPart : 0;
+
+    rc = SchedOp(SCHEDOP_poll, &op);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+//
+// As SchedPollDeadline() but with an optional timeout relative to now,
+// in 100ns units. This costs an extra hypercall to read the time.
+//
+__checkReturn
+XEN_API
+NTSTATUS
+SchedPoll(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    )
+{
+    LARGE_INTEGER       Deadline;
+    NTSTATUS            status;
+
+    if (Timeout == NULL)
+        return SchedPollDeadline(Port, Count, NULL);
+
+    ASSERT3S(Timeout->QuadPart, >=, 0);
+
+    status = HvmGetTime(&Deadline);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Deadline.QuadPart += Timeout->QuadPart * 100;
+
+    return SchedPollDeadline(Port, Count, &Deadline);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
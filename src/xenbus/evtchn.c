@@ -38,8 +38,8 @@
 #include "evtchn_2l.h"
 #include "evtchn_fifo.h"
 #include "fdo.h"
-#include "hash_table.h"
 #include "registry.h"
+#include "thread.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -72,37 +72,149 @@ typedef struct _XENBUS_EVTCHN_PARAMETERS {
 
 #define XENBUS_EVTCHN_CHANNEL_MAGIC 'NAHC'
 
+//
+// The fields at the head of a channel are the ones touched every time an
+// event is delivered, so that delivery pulls in as few cache lines as
+// possible. Everything from ListEntry onwards is only touched when the
+// channel is opened, bound, re-configured or closed, or by the sending
+// side and the debug and balance code.
+//
 struct _XENBUS_EVTCHN_CHANNEL {
     ULONG                       Magic;
-    KSPIN_LOCK                  Lock;
-    LIST_ENTRY                  ListEntry;
-    LIST_ENTRY                  PendingListEntry;
-    PVOID                       Caller;
+    ULONG                       LocalPort;
+    BOOLEAN                     Active; // Must be tested at >= DISPATCH_LEVEL
+    BOOLEAN                     Mask;
+    BOOLEAN                     Polling;
+    BOOLEAN                     Threaded;
+    BOOLEAN                     Closed;
+    BOOLEAN                     Held;   // Masked by its group
+    BOOLEAN                     Retrigger;  // Triggered while queued for the threaded DPC
+    LONG                        Triggered;
+    ULONG                       ProcIndex;  // Copy of ProcNumber that can be read without the lock
     PKSERVICE_ROUTINE           Callback;
     PVOID                       Argument;
-    BOOLEAN                     Active; // Must be tested at >= DISPATCH_LEVEL
+    LIST_ENTRY                  PendingListEntry;
+    LIST_ENTRY                  TriggerListEntry;
+    LONGLONG                    ModerationTicks;
+    ULONG                       ModerationRate;
+    ULONG                       PollPasses;
+    ULONG                       EventCount;
+    ULONGLONG                   EventTime;
+    ULONG                       EventRate;
+    ULONGLONG                   Delivered;
+    ULONGLONG                   DoneSomething;
+    ULONGLONG                   CallbackTime;
+    ULONGLONG                   Masked;
+    ULONGLONG                   Unmasked;
+    ULONGLONG                   LatencySamples;
+    ULONGLONG                   LatencyTotal;
+    ULONGLONG                   LatencyMax;
+    LIST_ENTRY                  ListEntry;
+    KSPIN_LOCK                  Lock;
+    PVOID                       Caller;
     XENBUS_EVTCHN_TYPE          Type;
     XENBUS_EVTCHN_PARAMETERS    Parameters;
-    BOOLEAN                     Mask;
-    ULONG                       LocalPort;
     PROCESSOR_NUMBER            ProcNumber;
-    BOOLEAN                     Closed;
+    GROUP_AFFINITY              Affinity;
+    ULONG                       Priority;
+    ULONG                       ModerationTime;
+    ULONGLONG                   Spurious;
+    LONGLONG                    Sent;       // Updated by senders on any CPU
+    LONGLONG                    Suppressed;
+    ULONGLONG                   BalanceTime;
+    ULONGLONG                   BalanceLoad;
+    ULONG                       BalanceHold;
 };
 
+// Interval (in 100ns units) over which a moderated channel's event rate
+// is sampled
+#define XENBUS_EVTCHN_RATE_INTERVAL 1000000ull
+
+// Maximum number of callbacks, and time (in microseconds), that a single
+// poll pass may spend before deferring the rest of its work to the DPC
+#define XENBUS_EVTCHN_POLL_BUDGET   64
+#define XENBUS_EVTCHN_POLL_TIME     100
+
+// Maximum number of consecutive DPC passes for which a channel may stay in
+// polling mode before it is put back into interrupt mode
+#define XENBUS_EVTCHN_POLL_PASSES   16
+
+// The port table is a two-level radix tree: a fixed directory, covering
+// the largest port space of any ABI, of page-sized leaves that are
+// allocated on demand and never freed until teardown. This means lookups
+// can be done without taking any lock.
+#define XENBUS_EVTCHN_TABLE_LEAF_SIZE \
+        (PAGE_SIZE / sizeof (PXENBUS_EVTCHN_CHANNEL))
+
+#define XENBUS_EVTCHN_TABLE_DIRECTORY_SIZE \
+        (EVTCHN_FIFO_NR_CHANNELS / XENBUS_EVTCHN_TABLE_LEAF_SIZE)
+
+#pragma warning(push)
+#pragma warning(disable:4324)   // structure was padded due to __declspec(align())
+
+//
+// Each processor's state lives in its own page, allocated from the
+// processor's NUMA node, and is laid out so that the fields written by
+// other processors (the trigger list and DPC request time stamps) and
+// by the balance thread do not share a cache line with the fields that
+// are only written by the processor itself on the event delivery path.
+//
 typedef struct _XENBUS_EVTCHN_PROCESSOR {
-    PXENBUS_INTERRUPT   Interrupt;
-    LIST_ENTRY          PendingList;
-    KDPC                Dpc;
-    BOOLEAN             UpcallEnabled;
+    DECLSPEC_CACHEALIGN PLIST_ENTRY TriggerList;
+    LONGLONG                        DpcTimeStamp;
+    LONGLONG                        ThreadedDpcTimeStamp;
+    DECLSPEC_CACHEALIGN PXENBUS_INTERRUPT Interrupt;
+    BOOLEAN                         UpcallEnabled;
+    LIST_ENTRY                      PendingList;
+    KDPC                            Dpc;
+    LIST_ENTRY                      ThreadedList;
+    KDPC                            ThreadedDpc;
+    PXENBUS_EVTCHN_CHANNEL          ThreadedChannel;
+    ULONGLONG                       Upcalls;
+    ULONGLONG                       Dpcs;
+    ULONGLONG                       ThreadedDpcs;
+    ULONGLONG                       Spurious;
+    ULONGLONG                       BudgetExhausted;
+    ULONGLONG                       TimeExhausted;
+    ULONGLONG                       UpcallTimeStamp;
+    ULONGLONG                       DpcOrigin;
+    XENBUS_EVTCHN_LATENCY           Latency;
+    DECLSPEC_CACHEALIGN ULONGLONG   BalanceLoad;
+    PMDL                            Mdl;    // Must be last
 } XENBUS_EVTCHN_PROCESSOR, *PXENBUS_EVTCHN_PROCESSOR;
 
+#pragma warning(pop)
+
+C_ASSERT(sizeof (XENBUS_EVTCHN_PROCESSOR) <= PAGE_SIZE);
+
+//
+// A pool of pre-allocated channels, each already holding an unbound port
+// for a particular remote domain, so that opening an unbound channel
+// needs neither a pool allocation nor a hypercall. Pooled channels are
+// linked through their ListEntry and are otherwise zero apart from
+// LocalPort, which is zeroed if the port is lost across suspend/resume.
+//
+typedef struct _XENBUS_EVTCHN_POOL {
+    LIST_ENTRY  ListEntry;
+    USHORT      RemoteDomain;
+    LIST_ENTRY  List;
+    ULONG       Count;
+    ULONGLONG   Hits;
+    ULONGLONG   Misses;
+} XENBUS_EVTCHN_POOL, *PXENBUS_EVTCHN_POOL;
+
+// Maximum number of remote domains waiting for the filler to create a pool
+#define XENBUS_EVTCHN_POOL_REQUESTS 8
+
 struct _XENBUS_EVTCHN_CONTEXT {
     PXENBUS_FDO                     Fdo;
     KSPIN_LOCK                      Lock;
     LONG                            References;
     PXENBUS_INTERRUPT               Interrupt;
-    PXENBUS_EVTCHN_PROCESSOR        Processor;
+    PXENBUS_EVTCHN_PROCESSOR        *Processor;
+    ULONG                           ProcessorMaximum;
     ULONG                           ProcessorCount;
+    BOOLEAN                         ThreadedStopped;
     XENBUS_SUSPEND_INTERFACE        SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK        SuspendCallbackEarly;
     PXENBUS_SUSPEND_CALLBACK        SuspendCallbackLate;
@@ -113,8 +225,24 @@ struct _XENBUS_EVTCHN_CONTEXT {
     PXENBUS_EVTCHN_ABI_CONTEXT      EvtchnFifoContext;
     XENBUS_EVTCHN_ABI               EvtchnAbi;
     BOOLEAN                         UseEvtchnFifoAbi;
-    PXENBUS_HASH_TABLE              Table;
+    ULONG                           PortCount;
+    LONGLONG                        PollTicks;
+    PXENBUS_EVTCHN_CHANNEL          *Table[XENBUS_EVTCHN_TABLE_DIRECTORY_SIZE];
     LIST_ENTRY                      List;
+    ULONG                           LatencySampling;
+    BOOLEAN                         Balance;
+    PXENBUS_THREAD                  BalanceThread;
+    ULONGLONG                       BalanceTimeStamp;
+    ULONG                           PoolSize;
+    LIST_ENTRY                      PoolList;
+    USHORT                          PoolRequest[XENBUS_EVTCHN_POOL_REQUESTS];
+    ULONG                           PoolRequests;
+    PXENBUS_THREAD                  PoolThread;
+    LIST_ENTRY                      ReapList;
+    LONG                            ReapPending;
+    LONGLONG                        Reaped;
+    LONGLONG                        ReapBatches;
+    PXENBUS_THREAD                  ReapThread;
 };
 
 #define XENBUS_EVTCHN_TAG  'CTVE'
@@ -135,6 +263,220 @@ __EvtchnFree(
     ExFreePoolWithTag(Buffer, XENBUS_EVTCHN_TAG);
 }
 
+static USHORT
+EvtchnProcessorNode(
+    IN  ULONG           Index
+    )
+{
+    PROCESSOR_NUMBER    ProcNumber;
+    USHORT              Node;
+    NTSTATUS            status;
+
+    status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+    ASSERT(NT_SUCCESS(status));
+
+    for (Node = 0; Node <= KeQueryHighestNodeNumber(); Node++) {
+        GROUP_AFFINITY  Affinity;
+
+        KeQueryNodeActiveAffinity(Node, &Affinity, NULL);
+
+        if (Affinity.Group == ProcNumber.Group &&
+            (Affinity.Mask & ((KAFFINITY)1 << ProcNumber.Number)) != 0)
+            return Node;
+    }
+
+    return 0;
+}
+
+static PXENBUS_EVTCHN_PROCESSOR
+EvtchnAllocateProcessor(
+    IN  ULONG                   Index
+    )
+{
+    PHYSICAL_ADDRESS            LowAddress;
+    PHYSICAL_ADDRESS            HighAddress;
+    LARGE_INTEGER               SkipBytes;
+    PMDL                        Mdl;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), <=, APC_LEVEL);
+
+    LowAddress.QuadPart = 0ull;
+    HighAddress.QuadPart = ~0ull;
+    SkipBytes.QuadPart = 0ull;
+
+    Mdl = MmAllocateNodePagesForMdlEx(LowAddress,
+                                      HighAddress,
+                                      SkipBytes,
+                                      PAGE_SIZE,
+                                      MmCached,
+                                      EvtchnProcessorNode(Index),
+                                      0);
+
+    status = STATUS_NO_MEMORY;
+    if (Mdl == NULL)
+        goto fail1;
+
+    Processor = MmMapLockedPagesSpecifyCache(Mdl,
+                                             KernelMode,
+                                             MmCached,
+                                             NULL,
+                                             FALSE,
+                                             NormalPagePriority);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Processor == NULL)
+        goto fail2;
+
+    RtlZeroMemory(Processor, PAGE_SIZE);
+    Processor->Mdl = Mdl;
+
+    return Processor;
+
+fail2:
+    Error("fail2\n");
+
+    MmFreePagesFromMdl(Mdl);
+    ExFreePool(Mdl);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
+static VOID
+EvtchnFreeProcessor(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor
+    )
+{
+    PMDL                            Mdl;
+
+    Mdl = Processor->Mdl;
+    Processor->Mdl = NULL;
+
+    ASSERT(IsZeroMemory(Processor, sizeof (XENBUS_EVTCHN_PROCESSOR)));
+
+    __FreePage(Mdl);
+    ExFreePool(Mdl);
+}
+
+static NTSTATUS
+EvtchnTableAdd(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    ULONG                       Index;
+    PXENBUS_EVTCHN_CHANNEL      *Leaf;
+    NTSTATUS                    status;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Port >= Context->PortCount)
+        goto fail1;
+
+    Index = Port / XENBUS_EVTCHN_TABLE_LEAF_SIZE;
+    ASSERT3U(Index, <, XENBUS_EVTCHN_TABLE_DIRECTORY_SIZE);
+
+    Leaf = Context->Table[Index];
+    if (Leaf == NULL) {
+        PXENBUS_EVTCHN_CHANNEL  *Old;
+
+        Leaf = __EvtchnAllocate(PAGE_SIZE);
+
+        status = STATUS_NO_MEMORY;
+        if (Leaf == NULL)
+            goto fail2;
+
+        Old = InterlockedCompareExchangePointer((PVOID *)&Context->Table[Index],
+                                                Leaf,
+                                                NULL);
+        if (Old != NULL) {
+            __EvtchnFree(Leaf);
+            Leaf = Old;
+        }
+    }
+
+    status = STATUS_OBJECTID_EXISTS;
+    if (InterlockedCompareExchangePointer((PVOID *)&Leaf[Port % XENBUS_EVTCHN_TABLE_LEAF_SIZE],
+                                          Channel,
+                                          NULL) != NULL)
+        goto fail3;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+EvtchnTableRemove(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    PXENBUS_EVTCHN_CHANNEL      *Leaf;
+    PXENBUS_EVTCHN_CHANNEL      Old;
+
+    ASSERT3U(Port, <, Context->PortCount);
+
+    Leaf = Context->Table[Port / XENBUS_EVTCHN_TABLE_LEAF_SIZE];
+    ASSERT(Leaf != NULL);
+
+    Old = InterlockedExchangePointer((PVOID *)&Leaf[Port % XENBUS_EVTCHN_TABLE_LEAF_SIZE],
+                                     NULL);
+    ASSERT3P(Old, ==, Channel);
+}
+
+static FORCEINLINE PXENBUS_EVTCHN_CHANNEL
+__EvtchnTableLookup(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Port
+    )
+{
+    PXENBUS_EVTCHN_CHANNEL      *Leaf;
+
+    if (Port >= Context->PortCount)
+        return NULL;
+
+    Leaf = Context->Table[Port / XENBUS_EVTCHN_TABLE_LEAF_SIZE];
+    if (Leaf == NULL)
+        return NULL;
+
+    return Leaf[Port % XENBUS_EVTCHN_TABLE_LEAF_SIZE];
+}
+
+static VOID
+EvtchnTableDestroy(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+
+    for (Index = 0; Index < XENBUS_EVTCHN_TABLE_DIRECTORY_SIZE; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  *Leaf = Context->Table[Index];
+
+        if (Leaf == NULL)
+            continue;
+
+        Context->Table[Index] = NULL;
+
+        ASSERT(IsZeroMemory(Leaf, PAGE_SIZE));
+        __EvtchnFree(Leaf);
+    }
+}
+
 static NTSTATUS
 EvtchnOpenFixed(
     IN  PXENBUS_EVTCHN_CHANNEL  Channel,
@@ -167,10 +509,16 @@ EvtchnOpenUnbound(
     RemoteDomain = va_arg(Arguments, USHORT);
     Mask = va_arg(Arguments, BOOLEAN);
 
+    // A channel taken from a pool already has a port
+    LocalPort = Channel->LocalPort;
+    if (LocalPort != 0)
+        goto done;
+
     status = EventChannelAllocateUnbound(RemoteDomain, &LocalPort);
     if (!NT_SUCCESS(status))
         goto fail1;
 
+done:
     Channel->Parameters.Unbound.RemoteDomain = RemoteDomain;
 
     Channel->Mask = Mask;
@@ -248,1075 +596,3973 @@ fail1:
     return status;
 }
 
-extern USHORT
-RtlCaptureStackBackTrace(
-    __in        ULONG   FramesToSkip,
-    __in        ULONG   FramesToCapture,
-    __out       PVOID   *BackTrace,
-    __out_opt   PULONG  BackTraceHash
-    );
-
-static PXENBUS_EVTCHN_CHANNEL
-EvtchnOpen(
-    IN  PINTERFACE          Interface,
-    IN  XENBUS_EVTCHN_TYPE  Type,
-    IN  PKSERVICE_ROUTINE   Callback,
-    IN  PVOID               Argument OPTIONAL,
-    ...
+static PXENBUS_EVTCHN_POOL
+EvtchnPoolLookup(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  USHORT                  RemoteDomain
     )
 {
-    PXENBUS_EVTCHN_CONTEXT  Context = Interface->Context;
-    va_list                 Arguments;
-    PXENBUS_EVTCHN_CHANNEL  Channel;
-    ULONG                   LocalPort;
-    KIRQL                   Irql;
-    NTSTATUS                status;
+    PLIST_ENTRY                 ListEntry;
 
-    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
+    for (ListEntry = Context->PoolList.Flink;
+         ListEntry != &Context->PoolList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_POOL     Pool;
 
-    Channel = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_CHANNEL));
+        Pool = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_POOL, ListEntry);
 
-    status = STATUS_NO_MEMORY;
-    if (Channel == NULL)
-        goto fail1;
+        if (Pool->RemoteDomain == RemoteDomain)
+            return Pool;
+    }
 
-    Channel->Magic = XENBUS_EVTCHN_CHANNEL_MAGIC;
+    return NULL;
+}
 
-    (VOID) RtlCaptureStackBackTrace(1, 1, &Channel->Caller, NULL);    
+static VOID
+EvtchnPoolRequest(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  USHORT                  RemoteDomain
+    )
+{
+    ULONG                       Index;
 
-    Channel->Type = Type;
-    Channel->Callback = Callback;
-    Channel->Argument = Argument;
+    for (Index = 0; Index < Context->PoolRequests; Index++) {
+        if (Context->PoolRequest[Index] == RemoteDomain)
+            return;
+    }
 
-    va_start(Arguments, Argument);
-    switch (Type) {
-    case XENBUS_EVTCHN_TYPE_FIXED:
-        status = EvtchnOpenFixed(Channel, Arguments);
-        break;
+    // If there is no room then a later open will ask again
+    if (Context->PoolRequests == XENBUS_EVTCHN_POOL_REQUESTS)
+        return;
 
-    case XENBUS_EVTCHN_TYPE_UNBOUND:
-        status = EvtchnOpenUnbound(Channel, Arguments);
-        break;
+    Context->PoolRequest[Context->PoolRequests++] = RemoteDomain;
+}
 
-    case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
-        status = EvtchnOpenInterDomain(Channel, Arguments);
-        break;
+static PXENBUS_EVTCHN_CHANNEL
+EvtchnPoolGet(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  USHORT                  RemoteDomain
+    )
+{
+    PXENBUS_EVTCHN_POOL         Pool;
+    PLIST_ENTRY                 ListEntry;
+    PXENBUS_EVTCHN_CHANNEL      Channel;
 
-    case XENBUS_EVTCHN_TYPE_VIRQ:
-        status = EvtchnOpenVirq(Channel, Arguments);
-        break;
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
 
-    default:
-        status = STATUS_INVALID_PARAMETER;
-        break;
+    Channel = NULL;
+
+    //
+    // The first open for a remote domain asks the filler thread to
+    // create its pool, so only domains that are actually used get ports
+    // reserved for them.
+    //
+    Pool = EvtchnPoolLookup(Context, RemoteDomain);
+    if (Pool == NULL) {
+        EvtchnPoolRequest(Context, RemoteDomain);
+        goto done;
     }
-    va_end(Arguments);
 
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    if (IsListEmpty(&Pool->List)) {
+        Pool->Misses++;
+        goto done;
+    }
 
-    LocalPort = Channel->LocalPort;
+    ListEntry = RemoveHeadList(&Pool->List);
+    RtlZeroMemory(ListEntry, sizeof (LIST_ENTRY));
 
-    Trace("%u\n", LocalPort);
+    ASSERT(Pool->Count != 0);
+    --Pool->Count;
 
-    InitializeListHead(&Channel->PendingListEntry);
+    Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-    status = XENBUS_EVTCHN_ABI(PortEnable,
-                               &Context->EvtchnAbi,
-                               LocalPort);
-    if (!NT_SUCCESS(status))
-        goto fail3;
+    if (Channel->LocalPort != 0)
+        Pool->Hits++;
+    else
+        Pool->Misses++;
 
-    status = HashTableAdd(Context->Table,
-                          LocalPort,
-                          (ULONG_PTR)Channel);
-    if (!NT_SUCCESS(status))
-        goto fail4;
+done:
+    ThreadWake(Context->PoolThread);
 
-    Channel->Active = TRUE;
+    return Channel;
+}
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
-    InsertTailList(&Context->List, &Channel->ListEntry);
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+//
+// Create the pools that EvtchnPoolGet() has asked for. This is called
+// by the filler thread, at PASSIVE_LEVEL, so that opening a channel never
+// has to allocate one.
+//
+static VOID
+EvtchnPoolCreate(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    PXENBUS_EVTCHN_POOL         Pool;
 
-    KeLowerIrql(Irql);
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
 
-    KeInitializeSpinLock(&Channel->Lock);
+    Pool = NULL;
+    for (;;) {
+        KIRQL   Irql;
+        USHORT  RemoteDomain;
 
-    return Channel;
+        if (Pool == NULL) {
+            Pool = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_POOL));
+            if (Pool == NULL)
+                break;
+        }
 
-fail4:
-    Error("fail4\n");
+        KeAcquireSpinLock(&Context->Lock, &Irql);
 
-    XENBUS_EVTCHN_ABI(PortDisable,
-                      &Context->EvtchnAbi,
-                      LocalPort);
+        if (Context->References == 0 || Context->PoolRequests == 0) {
+            KeReleaseSpinLock(&Context->Lock, Irql);
+            break;
+        }
 
-fail3:
-    Error("fail3\n");
+        RemoteDomain = Context->PoolRequest[--Context->PoolRequests];
+        Context->PoolRequest[Context->PoolRequests] = 0;
 
-    ASSERT(IsListEmpty(&Channel->PendingListEntry));
-    RtlZeroMemory(&Channel->PendingListEntry, sizeof (LIST_ENTRY));
+        if (EvtchnPoolLookup(Context, RemoteDomain) == NULL) {
+            Pool->RemoteDomain = RemoteDomain;
+            InitializeListHead(&Pool->List);
 
-    Channel->LocalPort = 0;
-    Channel->Mask = FALSE;
-    RtlZeroMemory(&Channel->Parameters, sizeof (XENBUS_EVTCHN_PARAMETERS));
-
-    if (Channel->Type != XENBUS_EVTCHN_TYPE_FIXED)
-        (VOID) EventChannelClose(LocalPort);
-
-fail2:
-    Error("fail2\n");
-
-    Channel->Argument = NULL;
-    Channel->Callback = NULL;
-    Channel->Type = 0;
-
-    Channel->Caller = NULL;
-
-    Channel->Magic = 0;
-
-    ASSERT(IsZeroMemory(Channel, sizeof (XENBUS_EVTCHN_CHANNEL)));
-    __EvtchnFree(Channel);
-
-fail1:
-    Error("fail1 (%08x)\n", status);
+            InsertTailList(&Context->PoolList, &Pool->ListEntry);
+            Pool = NULL;    // Now owned by the context
+        }
 
-    KeLowerIrql(Irql);
+        KeReleaseSpinLock(&Context->Lock, Irql);
+    }
 
-    return NULL;
+    if (Pool != NULL)
+        __EvtchnFree(Pool);
 }
 
-static VOID
-EvtchnReap(
+//
+// Find a pool that is short of a port. Ports lost across suspend/resume
+// are replaced first.
+//
+static BOOLEAN
+EvtchnPoolNeed(
     IN  PXENBUS_EVTCHN_CONTEXT  Context,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
-    IN  BOOLEAN                 Close
+    OUT PUSHORT                 RemoteDomain
     )
 {
-    ULONG                       LocalPort = Channel->LocalPort;
-
-    UNREFERENCED_PARAMETER(Context);
-
-    Trace("%u\n", LocalPort);
-
-    ASSERT(Channel->Closed);
-    Channel->Closed = FALSE;
-
-    RtlZeroMemory(&Channel->Lock, sizeof (KSPIN_LOCK));
+    PLIST_ENTRY                 PoolEntry;
+    PXENBUS_EVTCHN_POOL         Pool;
 
-    RemoveEntryList(&Channel->ListEntry);
-    RtlZeroMemory(&Channel->ListEntry, sizeof (LIST_ENTRY));
-
-    RtlZeroMemory(&Channel->ProcNumber, sizeof (PROCESSOR_NUMBER));
+    for (PoolEntry = Context->PoolList.Flink;
+         PoolEntry != &Context->PoolList;
+         PoolEntry = PoolEntry->Flink) {
+        PLIST_ENTRY ListEntry;
 
-    ASSERT(IsListEmpty(&Channel->PendingListEntry));
-    RtlZeroMemory(&Channel->PendingListEntry, sizeof (LIST_ENTRY));
+        Pool = CONTAINING_RECORD(PoolEntry, XENBUS_EVTCHN_POOL, ListEntry);
 
-    Channel->LocalPort = 0;
-    Channel->Mask = FALSE;
-    RtlZeroMemory(&Channel->Parameters, sizeof (XENBUS_EVTCHN_PARAMETERS));
+        for (ListEntry = Pool->List.Flink;
+             ListEntry != &Pool->List;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_EVTCHN_CHANNEL  Channel;
 
-    if (Close && Channel->Type != XENBUS_EVTCHN_TYPE_FIXED)
-        (VOID) EventChannelClose(LocalPort);
+            Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-    Channel->Argument = NULL;
-    Channel->Callback = NULL;
-    Channel->Type = 0;
+            if (Channel->LocalPort == 0) {
+                *RemoteDomain = Pool->RemoteDomain;
+                return TRUE;
+            }
+        }
+    }
 
-    Channel->Caller = NULL;
+    for (PoolEntry = Context->PoolList.Flink;
+         PoolEntry != &Context->PoolList;
+         PoolEntry = PoolEntry->Flink) {
+        Pool = CONTAINING_RECORD(PoolEntry, XENBUS_EVTCHN_POOL, ListEntry);
 
-    Channel->Magic = 0;
+        if (Pool->Count < Context->PoolSize) {
+            *RemoteDomain = Pool->RemoteDomain;
+            return TRUE;
+        }
+    }
 
-    ASSERT(IsZeroMemory(Channel, sizeof (XENBUS_EVTCHN_CHANNEL)));
-    __EvtchnFree(Channel);
+    return FALSE;
 }
 
+//
+// Give a newly allocated port to the remote domain's pool, either in
+// place of a lost one or using the spare channel. Returns FALSE if the
+// pool no longer needs it.
+//
 static BOOLEAN
-EvtchnPollCallback(
-    IN  PVOID                   Argument,
-    IN  ULONG                   LocalPort
+EvtchnPoolPut(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  USHORT                  RemoteDomain,
+    IN  ULONG                   LocalPort,
+    IN  PXENBUS_EVTCHN_CHANNEL  Spare
     )
 {
-    PXENBUS_EVTCHN_CONTEXT      Context = Argument;
-    ULONG                       Index;
-    PXENBUS_EVTCHN_PROCESSOR    Processor;
-    PXENBUS_EVTCHN_CHANNEL      Channel;
-    BOOLEAN                     Pending;
-    NTSTATUS                    status;
+    PXENBUS_EVTCHN_POOL         Pool;
+    PLIST_ENTRY                 ListEntry;
 
-    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
-    Index = KeGetCurrentProcessorNumberEx(NULL);
+    Pool = EvtchnPoolLookup(Context, RemoteDomain);
+    if (Pool == NULL)
+        return FALSE;
 
-    ASSERT3U(Index, <, Context->ProcessorCount);
-    Processor = &Context->Processor[Index];
+    for (ListEntry = Pool->List.Flink;
+         ListEntry != &Pool->List;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_CHANNEL  Channel;
 
-    status = HashTableLookup(Context->Table,
-                             LocalPort,
-                             (PULONG_PTR)&Channel);
-    if (!NT_SUCCESS(status))
-        goto done;
+        Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-    ASSERT3U(Channel->LocalPort, ==, LocalPort);
+        if (Channel->LocalPort == 0) {
+            Channel->LocalPort = LocalPort;
+            return TRUE;
+        }
+    }
 
-    Pending = !IsListEmpty(&Channel->PendingListEntry);
+    if (Pool->Count >= Context->PoolSize)
+        return FALSE;
 
-    if (!Pending)
-        InsertTailList(&Processor->PendingList,
-                       &Channel->PendingListEntry);
+    ASSERT(IsZeroMemory(Spare, sizeof (XENBUS_EVTCHN_CHANNEL)));
+    Spare->LocalPort = LocalPort;
 
-done:
-    return FALSE;
+    InsertTailList(&Pool->List, &Spare->ListEntry);
+    Pool->Count++;
+
+    return TRUE;
 }
 
-static BOOLEAN
-EvtchnPoll(
-    IN  PXENBUS_EVTCHN_CONTEXT  Context,
-    IN  ULONG                   Index,
-    IN  PLIST_ENTRY             List
+static VOID
+EvtchnPoolInvalidate(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
     )
 {
-    PXENBUS_EVTCHN_PROCESSOR    Processor;
-    BOOLEAN                     DoneSomething;
-    PLIST_ENTRY                 ListEntry;
-
-    ASSERT3U(Index, <, Context->ProcessorCount);
-    Processor = &Context->Processor[Index];
-
-    (VOID) XENBUS_EVTCHN_ABI(Poll,
-                             &Context->EvtchnAbi,
-                             Index,
-                             EvtchnPollCallback,
-                             Context);
-
-    DoneSomething = FALSE;
-
-    ListEntry = Processor->PendingList.Flink;
-    while (ListEntry != &Processor->PendingList) {
-        PLIST_ENTRY             Next = ListEntry->Flink;
-        PXENBUS_EVTCHN_CHANNEL  Channel;
-
-        Channel = CONTAINING_RECORD(ListEntry,
-                                    XENBUS_EVTCHN_CHANNEL,
-                                    PendingListEntry);
-
-        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    PLIST_ENTRY                 PoolEntry;
 
-        KeMemoryBarrier();
-        if (!Channel->Closed) {
-            RemoveEntryList(&Channel->PendingListEntry);
-            InitializeListHead(&Channel->PendingListEntry);
+    for (PoolEntry = Context->PoolList.Flink;
+         PoolEntry != &Context->PoolList;
+         PoolEntry = PoolEntry->Flink) {
+        PXENBUS_EVTCHN_POOL     Pool;
+        PLIST_ENTRY             ListEntry;
 
-            if (Channel->Mask)
-                XENBUS_EVTCHN_ABI(PortMask,
-                                  &Context->EvtchnAbi,
-                                  Channel->LocalPort);
+        Pool = CONTAINING_RECORD(PoolEntry, XENBUS_EVTCHN_POOL, ListEntry);
 
-            XENBUS_EVTCHN_ABI(PortAck,
-                              &Context->EvtchnAbi,
-                              Channel->LocalPort);
+        for (ListEntry = Pool->List.Flink;
+             ListEntry != &Pool->List;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_EVTCHN_CHANNEL  Channel;
 
-#pragma warning(suppress:6387)  // NULL argument
-            DoneSomething |= Channel->Callback(NULL, Channel->Argument);
-        } else if (List != NULL) {
-            RemoveEntryList(&Channel->PendingListEntry);
-            InsertTailList(List, &Channel->PendingListEntry);
+            Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+            Channel->LocalPort = 0;
         }
-
-        ListEntry = Next;
     }
-
-    return DoneSomething;
 }
 
 static VOID
-EvtchnFlush(
-    IN  PXENBUS_EVTCHN_CONTEXT  Context,
-    IN  ULONG                   Index
+EvtchnPoolFlush(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
     )
 {
-    PXENBUS_EVTCHN_PROCESSOR    Processor;
-    LIST_ENTRY                  List;
-    PXENBUS_INTERRUPT           Interrupt;
-    KIRQL                       Irql;
+    while (!IsListEmpty(&Context->PoolList)) {
+        PLIST_ENTRY             PoolEntry;
+        PXENBUS_EVTCHN_POOL     Pool;
 
-    ASSERT3U(Index, <, Context->ProcessorCount);
-    Processor = &Context->Processor[Index];
+        PoolEntry = RemoveHeadList(&Context->PoolList);
+        Pool = CONTAINING_RECORD(PoolEntry, XENBUS_EVTCHN_POOL, ListEntry);
 
-    Interrupt = (Processor->UpcallEnabled) ?
-                Processor->Interrupt :
-                Context->Interrupt;
+        while (!IsListEmpty(&Pool->List)) {
+            PLIST_ENTRY             ListEntry;
+            PXENBUS_EVTCHN_CHANNEL  Channel;
 
-    InitializeListHead(&List);
+            ListEntry = RemoveHeadList(&Pool->List);
+            RtlZeroMemory(ListEntry, sizeof (LIST_ENTRY));
 
-    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
-    (VOID) EvtchnPoll(Context, Index, &List);
-    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+            Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-    while (!IsListEmpty(&List)) {
-        PLIST_ENTRY             ListEntry;
-        PXENBUS_EVTCHN_CHANNEL  Channel;
+            if (Channel->LocalPort != 0) {
+                (VOID) EventChannelClose(Channel->LocalPort);
+                Channel->LocalPort = 0;
+            }
 
-        ListEntry = RemoveHeadList(&List);
-        ASSERT(ListEntry != &List);
+            ASSERT(IsZeroMemory(Channel, sizeof (XENBUS_EVTCHN_CHANNEL)));
+            __EvtchnFree(Channel);
 
-        Channel = CONTAINING_RECORD(ListEntry,
-                                    XENBUS_EVTCHN_CHANNEL,
-                                    PendingListEntry);
+            --Pool->Count;
+        }
 
-        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+        ASSERT3U(Pool->Count, ==, 0);
 
-        InitializeListHead(&Channel->PendingListEntry);
+        RtlZeroMemory(&Pool->List, sizeof (LIST_ENTRY));
+        RtlZeroMemory(&Pool->ListEntry, sizeof (LIST_ENTRY));
+        Pool->RemoteDomain = 0;
+        Pool->Hits = 0;
+        Pool->Misses = 0;
 
-        EvtchnReap(Context, Channel, TRUE);
+        ASSERT(IsZeroMemory(Pool, sizeof (XENBUS_EVTCHN_POOL)));
+        __EvtchnFree(Pool);
     }
 }
 
-static
-_Function_class_(KDEFERRED_ROUTINE)
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_min_(DISPATCH_LEVEL)
-_IRQL_requires_(DISPATCH_LEVEL)
-_IRQL_requires_same_
-VOID
-EvtchnDpc(
-    IN  PKDPC               Dpc,
-    IN  PVOID               _Context,
-    IN  PVOID               Argument1,
-    IN  PVOID               Argument2
+static NTSTATUS
+EvtchnPoolFiller(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
     )
 {
     PXENBUS_EVTCHN_CONTEXT  Context = _Context;
-    ULONG                   Index;
+    PKEVENT                 Event;
 
-    UNREFERENCED_PARAMETER(Dpc);
-    UNREFERENCED_PARAMETER(Argument1);
-    UNREFERENCED_PARAMETER(Argument2);
+    Trace("====>\n");
 
-    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
-    Index = KeGetCurrentProcessorNumberEx(NULL);
+    Event = ThreadGetEvent(Self);
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    for (;;) {
+        PXENBUS_EVTCHN_CHANNEL  Spare;
 
-    if (Context->References == 0)
-        goto done;
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
 
-    EvtchnFlush(Context, Index);
+        if (ThreadIsAlerted(Self))
+            break;
 
-done:
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
-}
+        EvtchnPoolCreate(Context);
 
-static VOID
-EvtchnTrigger(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel
-    )
-{
-    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
-    KIRQL                       Irql;
-    PROCESSOR_NUMBER            ProcNumber;
-    ULONG                       Index;
-    PXENBUS_EVTCHN_PROCESSOR    Processor;
-    PXENBUS_INTERRUPT           Interrupt;
-    BOOLEAN                     Pending;
+        //
+        // One port is allocated per pass. The hypercall is made at
+        // DISPATCH_LEVEL, so that the VM cannot be suspended underneath
+        // it, but without the context lock; the interface may therefore
+        // have been released, or the pool filled by then.
+        //
+        Spare = NULL;
+        for (;;) {
+            KIRQL       Irql;
+            BOOLEAN     Needed;
+            USHORT      RemoteDomain;
+            ULONG       LocalPort;
+            NTSTATUS    status;
 
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+            if (Spare == NULL) {
+                Spare = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_CHANNEL));
+                if (Spare == NULL)
+                    break;
+            }
 
-    KeAcquireSpinLock(&Channel->Lock, &Irql);
-    ProcNumber = Channel->ProcNumber;
-    KeReleaseSpinLock(&Channel->Lock, Irql);
+            RemoteDomain = DOMID_INVALID;
+            LocalPort = 0;
 
-    Index = KeGetProcessorIndexFromNumber(&ProcNumber);
+            KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
-    ASSERT3U(Index, <, Context->ProcessorCount);
-    Processor = &Context->Processor[Index];
+            KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+            Needed = (Context->References != 0) ?
+                     EvtchnPoolNeed(Context, &RemoteDomain) :
+                     FALSE;
+            KeReleaseSpinLockFromDpcLevel(&Context->Lock);
 
-    Interrupt = (Processor->UpcallEnabled) ?
-                Processor->Interrupt :
-                Context->Interrupt;
+            status = STATUS_UNSUCCESSFUL;
+            if (Needed)
+                status = EventChannelAllocateUnbound(RemoteDomain, &LocalPort);
 
-    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+            if (NT_SUCCESS(status)) {
+                BOOLEAN Put;
 
-    Pending = !IsListEmpty(&Channel->PendingListEntry);
+                KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+                Put = (Context->References != 0) ?
+                      EvtchnPoolPut(Context, RemoteDomain, LocalPort, Spare) :
+                      FALSE;
+                KeReleaseSpinLockFromDpcLevel(&Context->Lock);
 
-    if (!Pending)
-        InsertTailList(&Processor->PendingList,
-                       &Channel->PendingListEntry);
+                if (!Put)
+                    (VOID) EventChannelClose(LocalPort);
+                else if (Spare->LocalPort != 0)
+                    Spare = NULL;   // Now owned by a pool
+            }
 
-    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+            KeLowerIrql(Irql);
 
-    if (Pending)
-        return;
+            if (!NT_SUCCESS(status))
+                break;
+        }
 
-    KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+        if (Spare != NULL)
+            __EvtchnFree(Spare);
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
 }
 
-static NTSTATUS
-EvtchnBind(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
-    IN  USHORT                  Group,
-    IN  UCHAR                   Number
-    )
-{
-    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
-    PROCESSOR_NUMBER            ProcNumber;
-    ULONG                       Index;
-    PXENBUS_EVTCHN_PROCESSOR    Processor;
-    ULONG                       LocalPort;
-    unsigned int                vcpu_id;
-    KIRQL                       Irql;
-    NTSTATUS                    status;
+extern USHORT
+RtlCaptureStackBackTrace(
+    __in        ULONG   FramesToSkip,
+    __in        ULONG   FramesToCapture,
+    __out       PVOID   *BackTrace,
+    __out_opt   PULONG  BackTraceHash
+    );
 
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+static PXENBUS_EVTCHN_CHANNEL
+EvtchnOpen(
+    IN  PINTERFACE          Interface,
+    IN  XENBUS_EVTCHN_TYPE  Type,
+    IN  PKSERVICE_ROUTINE   Callback,
+    IN  PVOID               Argument OPTIONAL,
+    ...
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Interface->Context;
+    va_list                 Arguments;
+    PXENBUS_EVTCHN_CHANNEL  Channel;
+    ULONG                   LocalPort;
+    KIRQL                   Irql;
+    NTSTATUS                status;
 
-    RtlZeroMemory(&ProcNumber, sizeof (PROCESSOR_NUMBER));
-    ProcNumber.Group = Group;
-    ProcNumber.Number = Number;
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
 
-    Index = KeGetProcessorIndexFromNumber(&ProcNumber);
+    Channel = NULL;
 
-    ASSERT3U(Index, <, Context->ProcessorCount);
-    Processor = &Context->Processor[Index];
+    if (Type == XENBUS_EVTCHN_TYPE_UNBOUND && Context->PoolThread != NULL) {
+        USHORT  RemoteDomain;
 
-    status = STATUS_NOT_SUPPORTED;
-    if (!Processor->UpcallEnabled)
+        va_start(Arguments, Argument);
+        RemoteDomain = va_arg(Arguments, USHORT);
+        va_end(Arguments);
+
+        KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+        Channel = EvtchnPoolGet(Context, RemoteDomain);
+        KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    }
+
+    if (Channel == NULL)
+        Channel = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_CHANNEL));
+
+    status = STATUS_NO_MEMORY;
+    if (Channel == NULL)
         goto fail1;
 
-    KeAcquireSpinLock(&Channel->Lock, &Irql);
+    Channel->Magic = XENBUS_EVTCHN_CHANNEL_MAGIC;
 
-    if (!Channel->Active)
-        goto done;
+    (VOID) RtlCaptureStackBackTrace(1, 1, &Channel->Caller, NULL);    
 
-    if (Channel->ProcNumber.Group == Group &&
-        Channel->ProcNumber.Number == Number)
-        goto done;
+    Channel->Type = Type;
+    Channel->Callback = Callback;
+    Channel->Argument = Argument;
+    Channel->Priority = EVTCHN_FIFO_PRIORITY_DEFAULT;
 
-    LocalPort = Channel->LocalPort;
-    vcpu_id = SystemVirtualCpuIndex(Index);
+    va_start(Arguments, Argument);
+    switch (Type) {
+    case XENBUS_EVTCHN_TYPE_FIXED:
+        status = EvtchnOpenFixed(Channel, Arguments);
+        break;
 
-    status = EventChannelBindVirtualCpu(LocalPort, vcpu_id);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    case XENBUS_EVTCHN_TYPE_UNBOUND:
+        status = EvtchnOpenUnbound(Channel, Arguments);
+        break;
 
-    Channel->ProcNumber = ProcNumber;
+    case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
+        status = EvtchnOpenInterDomain(Channel, Arguments);
+        break;
 
-    Info("[%u]: CPU %u:%u\n", LocalPort, Group, Number);
+    case XENBUS_EVTCHN_TYPE_VIRQ:
+        status = EvtchnOpenVirq(Channel, Arguments);
+        break;
 
-done:
-    KeReleaseSpinLock(&Channel->Lock, Irql);
+    default:
+        status = STATUS_INVALID_PARAMETER;
+        break;
+    }
+    va_end(Arguments);
 
-    return STATUS_SUCCESS;
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
-fail2:
-    Error("fail2\n");
+    LocalPort = Channel->LocalPort;
 
-    KeReleaseSpinLock(&Channel->Lock, Irql);
+    Trace("%u\n", LocalPort);
 
-fail1:
-    Error("fail1 (%08x)\n", status);
+    InitializeListHead(&Channel->PendingListEntry);
 
-    return status;
-}
+    status = XENBUS_EVTCHN_ABI(PortEnable,
+                               &Context->EvtchnAbi,
+                               LocalPort);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-static NTSTATUS
-EvtchnBindVersion2(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
-    IN  ULONG                   Cpu
-    )
-{
-    ASSERT3U(Cpu, <, MAXIMUM_PROCESSORS);
+    status = EvtchnTableAdd(Context, LocalPort, Channel);
+    if (!NT_SUCCESS(status))
+        goto fail4;
 
-    return EvtchnBind(Interface, Channel, 0, (CHAR)Cpu);
-}
+    Channel->Active = TRUE;
 
-static VOID
-EvtchnUnmask(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
-    IN  BOOLEAN                 InUpcall
-    )
-{
-    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
-    KIRQL                       Irql = PASSIVE_LEVEL;
-    ULONG                       LocalPort;
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    InsertTailList(&Context->List, &Channel->ListEntry);
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
 
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    KeLowerIrql(Irql);
 
-    if (!InUpcall)
-        KeAcquireSpinLock(&Channel->Lock, &Irql);
+    KeInitializeSpinLock(&Channel->Lock);
 
-    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
+    return Channel;
 
-    if (!Channel->Active)
-        goto done;
+fail4:
+    Error("fail4\n");
 
-    LocalPort = Channel->LocalPort;
+    XENBUS_EVTCHN_ABI(PortDisable,
+                      &Context->EvtchnAbi,
+                      LocalPort);
 
-    if (XENBUS_EVTCHN_ABI(PortUnmask,
-                          &Context->EvtchnAbi,
-                          LocalPort)) {
-        //
-        // The event was pending so we must re-mask and use
-        // a hypercall to do the unmask and raise the event
-        //
-        XENBUS_EVTCHN_ABI(PortMask,
-                          &Context->EvtchnAbi,
-                          LocalPort);
-        (VOID) EventChannelUnmask(LocalPort);
-    }
+fail3:
+    Error("fail3\n");
 
-done:
-    if (!InUpcall)
-        KeReleaseSpinLock(&Channel->Lock, Irql);
-}
+    ASSERT(IsListEmpty(&Channel->PendingListEntry));
+    RtlZeroMemory(&Channel->PendingListEntry, sizeof (LIST_ENTRY));
 
-static BOOLEAN
-EvtchnUnmaskVersion1(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
-    IN  BOOLEAN                 InUpcall
-    )
-{
-    EvtchnUnmask(Interface, Channel, InUpcall);
+    Channel->LocalPort = 0;
+    Channel->Mask = FALSE;
+    RtlZeroMemory(&Channel->Parameters, sizeof (XENBUS_EVTCHN_PARAMETERS));
 
-    return FALSE;
-}
+    if (Channel->Type != XENBUS_EVTCHN_TYPE_FIXED)
+        (VOID) EventChannelClose(LocalPort);
 
-static NTSTATUS
-EvtchnSend(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel
-    )
-{
-    KIRQL                       Irql;
-    NTSTATUS                    status;
+fail2:
+    Error("fail2\n");
 
-    UNREFERENCED_PARAMETER(Interface);
+    Channel->Priority = 0;
+    Channel->Argument = NULL;
+    Channel->Callback = NULL;
+    Channel->Type = 0;
 
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    Channel->Caller = NULL;
 
-    // Make sure we don't suspend
-    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    Channel->Magic = 0;
 
-    status = STATUS_UNSUCCESSFUL;
-    if (!Channel->Active)
-        goto done;
+    ASSERT(IsZeroMemory(Channel, sizeof (XENBUS_EVTCHN_CHANNEL)));
+    __EvtchnFree(Channel);
 
-    status = EventChannelSend(Channel->LocalPort);
+fail1:
+    Error("fail1 (%08x)\n", status);
 
-done:
     KeLowerIrql(Irql);
 
-    return status;
+    return NULL;
 }
 
 static VOID
-EvtchnClose(
-    IN  PINTERFACE              Interface,
-    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+EvtchnReap(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 Close
     )
 {
-    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
     ULONG                       LocalPort = Channel->LocalPort;
-    KIRQL                       Irql;
-
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
-
-    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
 
     Trace("%u\n", LocalPort);
 
-    if (Channel->Active) {
-        NTSTATUS    status;
+    ASSERT(Channel->Closed);
+    Channel->Closed = FALSE;
 
-        Channel->Active = FALSE;
+    RtlZeroMemory(&Channel->Lock, sizeof (KSPIN_LOCK));
 
-        XENBUS_EVTCHN_ABI(PortDisable,
-                          &Context->EvtchnAbi,
-                          LocalPort);
+    RemoveEntryList(&Channel->ListEntry);
+    RtlZeroMemory(&Channel->ListEntry, sizeof (LIST_ENTRY));
 
-        status = HashTableRemove(Context->Table, LocalPort);
-        ASSERT(NT_SUCCESS(status));
+    RtlZeroMemory(&Channel->ProcNumber, sizeof (PROCESSOR_NUMBER));
+    Channel->ProcIndex = 0;
+    Channel->Priority = 0;
+
+    Channel->BalanceHold = 0;
+    Channel->BalanceLoad = 0;
+    Channel->BalanceTime = 0;
+
+    Channel->LatencyMax = 0;
+    Channel->LatencyTotal = 0;
+    Channel->LatencySamples = 0;
+
+    Channel->Suppressed = 0;
+    Channel->Sent = 0;
+
+    Channel->Unmasked = 0;
+    Channel->Masked = 0;
+    Channel->CallbackTime = 0;
+    Channel->DoneSomething = 0;
+    Channel->Spurious = 0;
+    Channel->Delivered = 0;
+
+    RtlZeroMemory(&Channel->Affinity, sizeof (GROUP_AFFINITY));
+
+    Channel->Held = FALSE;
+    Channel->Retrigger = FALSE;
+    Channel->Threaded = FALSE;
+
+    ASSERT(!Channel->Polling);
+    Channel->EventRate = 0;
+    Channel->EventTime = 0;
+    Channel->EventCount = 0;
+    Channel->ModerationTicks = 0;
+    Channel->ModerationTime = 0;
+    Channel->ModerationRate = 0;
+    Channel->PollPasses = 0;
 
-        //
-        // The event may be pending on a CPU queue so we mark it as
-        // closed but defer the rest of the work to the correct
-        // DPC, which will make sure the queue is polled first.
-        //
+    ASSERT(IsListEmpty(&Channel->PendingListEntry));
+    RtlZeroMemory(&Channel->PendingListEntry, sizeof (LIST_ENTRY));
 
-        Channel->Closed = TRUE;
-        KeMemoryBarrier();
+    ASSERT3U(Channel->Triggered, ==, 0);
+    ASSERT(IsZeroMemory(&Channel->TriggerListEntry, sizeof (LIST_ENTRY)));
 
-        EvtchnTrigger(Interface, Channel);
-        goto done;
-    }
+    Channel->Mask = FALSE;
+    RtlZeroMemory(&Channel->Parameters, sizeof (XENBUS_EVTCHN_PARAMETERS));
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    Channel->Argument = NULL;
+    Channel->Callback = NULL;
 
-    Channel->Closed = TRUE;
-    EvtchnReap(Context, Channel, FALSE);
+    Channel->Caller = NULL;
 
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    Channel->Magic = 0;
+
+    //
+    // Rather than closing the port here, with the context lock held, the
+    // channel (now zero apart from LocalPort) is queued for the reaper
+    // thread, which closes ports in batches.
+    //
+    if (Close && Channel->Type != XENBUS_EVTCHN_TYPE_FIXED) {
+        Channel->Type = 0;
+
+        InsertTailList(&Context->ReapList, &Channel->ListEntry);
+        (VOID) InterlockedIncrement(&Context->ReapPending);
+
+        ThreadWake(Context->ReapThread);
+        return;
+    }
+
+    Channel->Type = 0;
+    Channel->LocalPort = 0;
+
+    ASSERT(IsZeroMemory(Channel, sizeof (XENBUS_EVTCHN_CHANNEL)));
+    __EvtchnFree(Channel);
+}
+
+static VOID
+EvtchnSwizzle(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor
+    )
+{
+    PLIST_ENTRY                     List;
+
+    List = InterlockedExchangePointer(&Processor->TriggerList, NULL);
+
+    // Not really a doubly-linked list; it's actually a singly-linked
+    // list via the Flink field.
+    while (List != NULL) {
+        PLIST_ENTRY             Next;
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+
+        Next = List->Flink;
+        List->Flink = NULL;
+        ASSERT3P(List->Blink, ==, NULL);
+
+        Channel = CONTAINING_RECORD(List,
+                                    XENBUS_EVTCHN_CHANNEL,
+                                    TriggerListEntry);
+
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        // The channel may now be triggered again
+        (VOID) InterlockedExchange(&Channel->Triggered, 0);
+
+        //
+        // A threaded channel may already be queued for, or running in,
+        // the threaded DPC, in which case the trigger is noted so that
+        // the DPC can invoke the callback again.
+        //
+        if (IsListEmpty(&Channel->PendingListEntry))
+            InsertTailList(&Processor->PendingList,
+                           &Channel->PendingListEntry);
+        else if (Channel->Threaded)
+            Channel->Retrigger = TRUE;
+
+        List = Next;
+    }
+}
+
+static BOOLEAN
+EvtchnPollCallback(
+    IN  PVOID                   Argument,
+    IN  ULONG                   LocalPort
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Argument;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    PXENBUS_EVTCHN_CHANNEL      Channel;
+    BOOLEAN                     Pending;
+
+    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
+    Index = KeGetCurrentProcessorNumberEx(NULL);
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    Channel = __EvtchnTableLookup(Context, LocalPort);
+    if (Channel == NULL) {
+        Processor->Spurious++;
+        goto done;
+    }
+
+    ASSERT3U(Channel->LocalPort, ==, LocalPort);
+
+    Pending = !IsListEmpty(&Channel->PendingListEntry);
+
+    if (!Pending)
+        InsertTailList(&Processor->PendingList,
+                       &Channel->PendingListEntry);
 
 done:
-    KeLowerIrql(Irql);
+    return FALSE;
 }
 
-static ULONG
-EvtchnGetPort(
-    IN  PINTERFACE              Interface,
+static VOID
+EvtchnPortUnmask(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   LocalPort
+    )
+{
+    if (XENBUS_EVTCHN_ABI(PortUnmask,
+                          &Context->EvtchnAbi,
+                          LocalPort)) {
+        //
+        // The event was pending so we must re-mask and use
+        // a hypercall to do the unmask and raise the event
+        //
+        XENBUS_EVTCHN_ABI(PortMask,
+                          &Context->EvtchnAbi,
+                          LocalPort);
+        (VOID) EventChannelUnmask(LocalPort);
+    }
+}
+
+static FORCEINLINE VOID
+__EvtchnChannelUnmask(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
     IN  PXENBUS_EVTCHN_CHANNEL  Channel
     )
 {
-    UNREFERENCED_PARAMETER(Interface);
+    // A channel masked by its group stays masked until the group is unmasked
+    if (Channel->Held)
+        return;
 
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
-    ASSERT(Channel->Active);
+    EvtchnPortUnmask(Context, Channel->LocalPort);
+    Channel->Unmasked++;
+}
 
-    return Channel->LocalPort;
+static FORCEINLINE BOOLEAN
+__EvtchnSampleRate(
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    ULONGLONG                   Now;
+    ULONGLONG                   Delta;
+
+    Channel->EventCount++;
+
+    Now = KeQueryInterruptTime();
+    Delta = Now - Channel->EventTime;
+
+    if (Delta >= XENBUS_EVTCHN_RATE_INTERVAL) {
+        Channel->EventRate = (ULONG)((Channel->EventCount * 10000000ull) / Delta);
+        Channel->EventCount = 0;
+        Channel->EventTime = Now;
+    }
+
+    return (Channel->EventRate >= Channel->ModerationRate) ? TRUE : FALSE;
 }
 
-static NTSTATUS
-EvtchnStatus(
-    IN  PINTERFACE              Interface,
+static FORCEINLINE BOOLEAN
+__EvtchnCallback(
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    ULONGLONG                   TimeStamp;
+    BOOLEAN                     DoneSomething;
+
+    TimeStamp = __rdtsc();
+
+#pragma warning(suppress:6387)  // NULL argument
+    DoneSomething = Channel->Callback(NULL, Channel->Argument);
+
+    Channel->CallbackTime += __rdtsc() - TimeStamp;
+
+    Channel->Delivered++;
+    if (DoneSomething)
+        Channel->DoneSomething++;
+
+    return DoneSomething;
+}
+
+static FORCEINLINE VOID
+__EvtchnLatency(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
     IN  PXENBUS_EVTCHN_CHANNEL  Channel,
-    OUT ULONG                   *Status
+    IN  PULONGLONG              Histogram,
+    IN  ULONGLONG               Origin
     )
 {
-    KIRQL                       Irql;
-    NTSTATUS                    status;
+    ULONGLONG                   Delta;
+    ULONG                       Bucket;
 
-    UNREFERENCED_PARAMETER(Interface);
+    if (Origin == 0)
+        return;
 
-    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    Delta = __rdtsc() - Origin;
 
-    // Make sure we don't suspend
-    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+    // The TSC may not be exactly in step across CPUs
+    if ((LONGLONG)Delta < 0)
+        Delta = 0;
 
-    status = STATUS_UNSUCCESSFUL;
-    if (!Channel->Active)
-        goto done;
+    if ((ULONG)(Delta >> 32) != 0) {
+        (VOID) _BitScanReverse(&Bucket, (ULONG)(Delta >> 32));
+        Bucket += 32;
+    } else if (!_BitScanReverse(&Bucket, (ULONG)Delta)) {
+        Bucket = 0;
+    }
+
+    Histogram[__min(Bucket, XENBUS_EVTCHN_LATENCY_BUCKETS - 1)]++;
+
+    if (Context->LatencySampling == 0 ||
+        (Channel->Delivered % Context->LatencySampling) != 0)
+        return;
+
+    Channel->LatencySamples++;
+    Channel->LatencyTotal += Delta;
+    Channel->LatencyMax = __max(Channel->LatencyMax, Delta);
+}
+
+static FORCEINLINE VOID
+__EvtchnQueueDpc(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor
+    )
+{
+    // Latency is measured from the earliest request
+    (VOID) InterlockedCompareExchange64(&Processor->DpcTimeStamp,
+                                        (LONGLONG)__rdtsc(),
+                                        0);
+
+    KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+}
+
+static FORCEINLINE VOID
+__EvtchnQueueThreadedDpc(
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor
+    )
+{
+    (VOID) InterlockedCompareExchange64(&Processor->ThreadedDpcTimeStamp,
+                                        (LONGLONG)__rdtsc(),
+                                        0);
+
+    KeInsertQueueDpc(&Processor->ThreadedDpc, NULL, NULL);
+}
+
+//
+// Re-invoke a polled channel's callback for at most its moderation time,
+// and no later than the end of the current poll pass. Returns TRUE if the
+// channel should stay in polling mode for another pass.
+//
+static BOOLEAN
+EvtchnPollChannel(
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  PLARGE_INTEGER          Limit
+    )
+{
+    LARGE_INTEGER               Deadline;
+    LARGE_INTEGER               Now;
+    BOOLEAN                     Pending;
+    BOOLEAN                     Busy;
+
+    Deadline = KeQueryPerformanceCounter(NULL);
+    Deadline.QuadPart += Channel->ModerationTicks;
+
+    if (Deadline.QuadPart > Limit->QuadPart)
+        Deadline = *Limit;
+
+    for (;;) {
+        Pending = __EvtchnCallback(Channel);
+
+        // Keep sampling so that polling stops once the rate drops
+        Busy = Channel->ModerationRate != 0 && __EvtchnSampleRate(Channel);
+
+        if (!Pending || !Busy)
+            break;
+
+        Now = KeQueryPerformanceCounter(NULL);
+        if (Now.QuadPart >= Deadline.QuadPart)
+            break;
+    }
+
+    if (!Pending || !Busy)
+        return FALSE;
+
+    //
+    // Don't let a channel that never drains keep the DPC re-queuing
+    // itself indefinitely; put it back into interrupt mode from time to
+    // time. The rate check will put it back into polling mode on the
+    // next upcall if it is still busy.
+    //
+    if (++Channel->PollPasses >= XENBUS_EVTCHN_POLL_PASSES)
+        return FALSE;
+
+    return TRUE;
+}
+
+static BOOLEAN
+EvtchnPoll(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Index,
+    IN  PLIST_ENTRY             List
+    )
+{
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    BOOLEAN                     DoneSomething;
+    LIST_ENTRY                  PollList;
+    BOOLEAN                     Threaded;
+    ULONG                       Budget;
+    LARGE_INTEGER               Deadline;
+    BOOLEAN                     Exhausted;
+    ULONGLONG                   Origin;
+    PULONGLONG                  Histogram;
+    PLIST_ENTRY                 ListEntry;
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    if (List == NULL) {
+        Origin = Processor->UpcallTimeStamp;
+        Histogram = Processor->Latency.Upcall;
+    } else {
+        Origin = Processor->DpcOrigin;
+        Histogram = Processor->Latency.Dpc;
+    }
+
+    EvtchnSwizzle(Processor);
+
+    (VOID) XENBUS_EVTCHN_ABI(Poll,
+                             &Context->EvtchnAbi,
+                             Index,
+                             EvtchnPollCallback,
+                             Context);
+
+    DoneSomething = FALSE;
+
+    InitializeListHead(&PollList);
+    Threaded = FALSE;
+
+    //
+    // Channels that are not serviced before the budget runs out are left
+    // at the front of the list, so they are the first to be serviced by
+    // the next pass.
+    //
+    Budget = XENBUS_EVTCHN_POLL_BUDGET;
+    Deadline = KeQueryPerformanceCounter(NULL);
+    Deadline.QuadPart += Context->PollTicks;
+    Exhausted = FALSE;
+
+    ListEntry = Processor->PendingList.Flink;
+    while (ListEntry != &Processor->PendingList) {
+        PLIST_ENTRY             Next = ListEntry->Flink;
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+        BOOLEAN                 Serviced = FALSE;
+        LARGE_INTEGER           Now;
+
+        Channel = CONTAINING_RECORD(ListEntry,
+                                    XENBUS_EVTCHN_CHANNEL,
+                                    PendingListEntry);
+
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        KeMemoryBarrier();
+        if (!Channel->Closed && Channel->Polling) {
+            //
+            // Channels in polling mode are only serviced by the
+            // DPC, which will already have been queued.
+            //
+            if (List != NULL) {
+                RemoveEntryList(&Channel->PendingListEntry);
+                InitializeListHead(&Channel->PendingListEntry);
+
+                XENBUS_EVTCHN_ABI(PortAck,
+                                  &Context->EvtchnAbi,
+                                  Channel->LocalPort);
+
+                if (EvtchnPollChannel(Channel, &Deadline)) {
+                    InsertTailList(&PollList, &Channel->PendingListEntry);
+                } else {
+                    Channel->Polling = FALSE;
+                    Channel->PollPasses = 0;
+
+                    __EvtchnChannelUnmask(Context, Channel);
+                }
+
+                DoneSomething = TRUE;
+                Serviced = TRUE;
+            }
+        } else if (!Channel->Closed && Channel->Threaded) {
+            RemoveEntryList(&Channel->PendingListEntry);
+
+            //
+            // The port stays masked until the threaded DPC has invoked
+            // the callback, so any further events are batched up.
+            //
+            XENBUS_EVTCHN_ABI(PortMask,
+                              &Context->EvtchnAbi,
+                              Channel->LocalPort);
+            Channel->Masked++;
+
+            XENBUS_EVTCHN_ABI(PortAck,
+                              &Context->EvtchnAbi,
+                              Channel->LocalPort);
+
+            InsertTailList(&Processor->ThreadedList,
+                           &Channel->PendingListEntry);
+            Channel->Retrigger = FALSE;
+
+            Threaded = TRUE;
+            DoneSomething = TRUE;
+        } else if (!Channel->Closed) {
+            BOOLEAN Pending;
+
+            RemoveEntryList(&Channel->PendingListEntry);
+            InitializeListHead(&Channel->PendingListEntry);
+
+            if (Channel->Mask) {
+                XENBUS_EVTCHN_ABI(PortMask,
+                                  &Context->EvtchnAbi,
+                                  Channel->LocalPort);
+                Channel->Masked++;
+            }
+
+            XENBUS_EVTCHN_ABI(PortAck,
+                              &Context->EvtchnAbi,
+                              Channel->LocalPort);
+
+            __EvtchnLatency(Context, Channel, Histogram, Origin);
+
+            Pending = __EvtchnCallback(Channel);
+            DoneSomething |= Pending;
+            Serviced = TRUE;
+
+            if (Channel->ModerationRate != 0 &&
+                __EvtchnSampleRate(Channel) &&
+                Pending) {
+                //
+                // Leave the channel masked and hand it over to the
+                // DPC until its callback reports that it has drained.
+                //
+                XENBUS_EVTCHN_ABI(PortMask,
+                                  &Context->EvtchnAbi,
+                                  Channel->LocalPort);
+                Channel->Masked++;
+
+                Channel->Polling = TRUE;
+                Channel->PollPasses = 0;
+                InsertTailList(&PollList, &Channel->PendingListEntry);
+            }
+        } else {
+            Channel->Spurious++;
+
+            if (List != NULL) {
+                Channel->Polling = FALSE;
+                Channel->PollPasses = 0;
+
+                RemoveEntryList(&Channel->PendingListEntry);
+                InsertTailList(List, &Channel->PendingListEntry);
+            }
+        }
+
+        ListEntry = Next;
+
+        if (!Serviced || ListEntry == &Processor->PendingList)
+            continue;
+
+        if (--Budget == 0) {
+            Processor->BudgetExhausted++;
+            Exhausted = TRUE;
+            break;
+        }
+
+        Now = KeQueryPerformanceCounter(NULL);
+        if (Now.QuadPart >= Deadline.QuadPart) {
+            Processor->TimeExhausted++;
+            Exhausted = TRUE;
+            break;
+        }
+    }
+
+    if (!IsListEmpty(&PollList)) {
+        do {
+            ListEntry = RemoveHeadList(&PollList);
+            InsertTailList(&Processor->PendingList, ListEntry);
+        } while (!IsListEmpty(&PollList));
+
+        __EvtchnQueueDpc(Processor);
+    } else if (Exhausted) {
+        __EvtchnQueueDpc(Processor);
+    }
+
+    if (Threaded)
+        __EvtchnQueueThreadedDpc(Processor);
+
+    return DoneSomething;
+}
+
+static VOID
+EvtchnFlush(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Index
+    )
+{
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    LIST_ENTRY                  List;
+    PXENBUS_INTERRUPT           Interrupt;
+    KIRQL                       Irql;
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    Interrupt = (Processor->UpcallEnabled) ?
+                Processor->Interrupt :
+                Context->Interrupt;
+
+    InitializeListHead(&List);
+
+    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+    (VOID) EvtchnPoll(Context, Index, &List);
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+
+    while (!IsListEmpty(&List)) {
+        PLIST_ENTRY             ListEntry;
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+
+        ListEntry = RemoveHeadList(&List);
+        ASSERT(ListEntry != &List);
+
+        Channel = CONTAINING_RECORD(ListEntry,
+                                    XENBUS_EVTCHN_CHANNEL,
+                                    PendingListEntry);
+
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        InitializeListHead(&Channel->PendingListEntry);
+
+        EvtchnReap(Context, Channel, TRUE);
+    }
+}
+
+static
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+EvtchnDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               _Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = _Context;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
+    Index = KeGetCurrentProcessorNumberEx(NULL);
+
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+
+    if (Context->References == 0)
+        goto done;
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    Processor->Dpcs++;
+    Processor->DpcOrigin = (ULONGLONG)InterlockedExchange64(&Processor->DpcTimeStamp, 0);
+
+    EvtchnFlush(Context, Index);
+
+    Processor->DpcOrigin = 0;
+
+done:
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+}
+
+static PXENBUS_EVTCHN_CHANNEL
+EvtchnThreadedNext(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor
+    )
+{
+    PXENBUS_INTERRUPT               Interrupt;
+    PXENBUS_EVTCHN_CHANNEL          Channel;
+    KIRQL                           Irql;
+
+    Interrupt = (Processor->UpcallEnabled) ?
+                Processor->Interrupt :
+                Context->Interrupt;
+
+    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+
+    Channel = NULL;
+    if (IsListEmpty(&Processor->ThreadedList))
+        goto done;
+
+    ASSERT3P(Processor->ThreadedChannel, ==, NULL);
+
+    //
+    // The channel is left at the head of the list while its callback
+    // runs, so that it can neither be re-queued nor reaped if it is
+    // closed in the meantime.
+    //
+    Channel = CONTAINING_RECORD(Processor->ThreadedList.Flink,
+                                XENBUS_EVTCHN_CHANNEL,
+                                PendingListEntry);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    Processor->ThreadedChannel = Channel;
+
+done:
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+
+    return Channel;
+}
+
+static VOID
+EvtchnThreadedComplete(
+    IN  PXENBUS_EVTCHN_CONTEXT      Context,
+    IN  PXENBUS_EVTCHN_PROCESSOR    Processor,
+    IN  PXENBUS_EVTCHN_CHANNEL      Channel
+    )
+{
+    PXENBUS_INTERRUPT               Interrupt;
+    KIRQL                           Irql;
+
+    Interrupt = (Processor->UpcallEnabled) ?
+                Processor->Interrupt :
+                Context->Interrupt;
+
+    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+
+    ASSERT3P(Processor->ThreadedChannel, ==, Channel);
+    Processor->ThreadedChannel = NULL;
+
+    RemoveEntryList(&Channel->PendingListEntry);
+
+    if (Channel->Closed) {
+        // Hand the channel over to the DPC to be reaped
+        InsertTailList(&Processor->PendingList,
+                       &Channel->PendingListEntry);
+
+        __EvtchnQueueDpc(Processor);
+    } else if (Channel->Retrigger && Channel->Active) {
+        Channel->Retrigger = FALSE;
+
+        // Leave the port masked and go round again
+        InsertTailList(&Processor->ThreadedList,
+                       &Channel->PendingListEntry);
+    } else {
+        InitializeListHead(&Channel->PendingListEntry);
+        Channel->Retrigger = FALSE;
+
+        if (Channel->Active && !Channel->Mask)
+            __EvtchnChannelUnmask(Context, Channel);
+    }
+
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+}
+
+static
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+EvtchnThreadedDpc(
+    IN  PKDPC                   Dpc,
+    IN  PVOID                   _Context,
+    IN  PVOID                   Argument1,
+    IN  PVOID                   Argument2
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = _Context;
+    ULONG                       Index;
+    ULONG                       Count;
+    ULONGLONG                   Origin;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    Index = KeGetCurrentProcessorNumberEx(NULL);
+    Origin = 0;
+
+    //
+    // Service everything that has been queued on this CPU in a single
+    // pass. The callbacks are invoked without any lock held.
+    //
+    for (Count = 0; ; Count++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor;
+        PXENBUS_EVTCHN_CHANNEL      Channel;
+        KIRQL                       Irql;
+
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+
+        Processor = NULL;
+        Channel = NULL;
+
+        if (Context->References == 0 || Context->ThreadedStopped)
+            goto next;
+
+        ASSERT3U(Index, <, Context->ProcessorCount);
+        Processor = Context->Processor[Index];
+
+        if (Count == 0) {
+            Processor->ThreadedDpcs++;
+            Origin = (ULONGLONG)InterlockedExchange64(&Processor->ThreadedDpcTimeStamp, 0);
+        }
+
+        Channel = EvtchnThreadedNext(Context, Processor);
+
+next:
+        KeReleaseSpinLock(&Context->Lock, Irql);
+
+        if (Channel == NULL)
+            break;
+
+        KeMemoryBarrier();
+        if (!Channel->Closed) {
+            __EvtchnLatency(Context,
+                            Channel,
+                            Processor->Latency.ThreadedDpc,
+                            Origin);
+
+            (VOID) __EvtchnCallback(Channel);
+        }
+
+        EvtchnThreadedComplete(Context, Processor, Channel);
+    }
+}
+
+static VOID
+EvtchnThreadedFlush(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  ULONG                   Index
+    )
+{
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    PXENBUS_INTERRUPT           Interrupt;
+    KIRQL                       Irql;
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    Interrupt = (Processor->UpcallEnabled) ?
+                Processor->Interrupt :
+                Context->Interrupt;
+
+    Irql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+
+    ASSERT3P(Processor->ThreadedChannel, ==, NULL);
+
+    //
+    // Anything still queued for the threaded DPC must have been closed
+    // so move it over to the pending list to be reaped.
+    //
+    while (!IsListEmpty(&Processor->ThreadedList)) {
+        PLIST_ENTRY             ListEntry;
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+
+        ListEntry = RemoveHeadList(&Processor->ThreadedList);
+        ASSERT(ListEntry != &Processor->ThreadedList);
+
+        Channel = CONTAINING_RECORD(ListEntry,
+                                    XENBUS_EVTCHN_CHANNEL,
+                                    PendingListEntry);
+
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+        ASSERT(Channel->Closed);
+
+        InsertTailList(&Processor->PendingList, ListEntry);
+    }
+
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, Irql);
+}
+
+static VOID
+EvtchnTrigger(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    PLIST_ENTRY                 Old;
+    PLIST_ENTRY                 New;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    // Only one trigger can be outstanding
+    if (InterlockedExchange(&Channel->Triggered, 1) != 0)
+        return;
+
+    Index = Channel->ProcIndex;
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    //
+    // Push the channel onto the processor's trigger list. This is
+    // swizzled onto the pending list by the next poll, so there is no
+    // need to synchronize with the upcall.
+    //
+    New = &Channel->TriggerListEntry;
+
+    do {
+        Old = Processor->TriggerList;
+        New->Flink = Old;
+    } while (InterlockedCompareExchangePointer(&Processor->TriggerList,
+                                               New,
+                                               Old) != Old);
+
+    __EvtchnQueueDpc(Processor);
+}
+
+static NTSTATUS
+EvtchnBindProcessor(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  USHORT                  Group,
+    IN  UCHAR                   Number
+    )
+{
+    PROCESSOR_NUMBER            ProcNumber;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    PXENBUS_EVTCHN_PROCESSOR    Current;
+    PXENBUS_INTERRUPT           Interrupt;
+    ULONG                       LocalPort;
+    unsigned int                vcpu_id;
+    KIRQL                       Irql;
+    KIRQL                       InterruptIrql;
+    NTSTATUS                    status;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    RtlZeroMemory(&ProcNumber, sizeof (PROCESSOR_NUMBER));
+    ProcNumber.Group = Group;
+    ProcNumber.Number = Number;
+
+    Index = KeGetProcessorIndexFromNumber(&ProcNumber);
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    status = STATUS_NOT_SUPPORTED;
+    if (!Processor->UpcallEnabled)
+        goto fail1;
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    if (!Channel->Active)
+        goto done;
+
+    if (Channel->ProcNumber.Group == Group &&
+        Channel->ProcNumber.Number == Number)
+        goto done;
+
+    ASSERT3U(Channel->ProcIndex, <, Context->ProcessorCount);
+    Current = Context->Processor[Channel->ProcIndex];
+
+    Interrupt = (Current->UpcallEnabled) ?
+                Current->Interrupt :
+                Context->Interrupt;
+
+    //
+    // The pending, threaded and trigger lists are per-processor and each
+    // is only protected by its own processor's interrupt lock. A channel
+    // that is on (or about to be swizzled onto) one of them must not move
+    // until it has been serviced, otherwise the new processor could link
+    // it onto its own list at the same time.
+    //
+    InterruptIrql = FdoAcquireInterruptLock(Context->Fdo, Interrupt);
+
+    status = STATUS_DEVICE_BUSY;
+    if (!IsListEmpty(&Channel->PendingListEntry) ||
+        Channel->Polling ||
+        Channel->Triggered != 0)
+        goto fail2;
+
+    LocalPort = Channel->LocalPort;
+    vcpu_id = SystemVirtualCpuIndex(Index);
+
+    status = EventChannelBindVirtualCpu(LocalPort, vcpu_id);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    Channel->ProcNumber = ProcNumber;
+    Channel->ProcIndex = Index;
+
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, InterruptIrql);
+
+    Info("[%u]: CPU %u:%u\n", LocalPort, Group, Number);
+
+done:
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    FdoReleaseInterruptLock(Context->Fdo, Interrupt, InterruptIrql);
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+EvtchnBind(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  USHORT                  Group,
+    IN  UCHAR                   Number
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    status = EvtchnBindProcessor(Context, Channel, Group, Number);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    // An explicit binding pins the channel until an affinity is set
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+    Channel->Affinity.Group = Group;
+    Channel->Affinity.Mask = (KAFFINITY)1 << Number;
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static FORCEINLINE BOOLEAN
+__EvtchnAffinityIncludes(
+    IN  PGROUP_AFFINITY     Affinity,
+    IN  PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    if (Affinity->Mask == 0)
+        return TRUE;
+
+    if (Affinity->Group != ProcNumber->Group)
+        return FALSE;
+
+    return (Affinity->Mask & ((KAFFINITY)1 << ProcNumber->Number)) ? TRUE : FALSE;
+}
+
+static NTSTATUS
+EvtchnSetAffinity(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  PGROUP_AFFINITY         Affinity OPTIONAL
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    PROCESSOR_NUMBER            ProcNumber;
+    ULONG                       Number;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    if (Affinity != NULL)
+        Channel->Affinity = *Affinity;
+    else
+        RtlZeroMemory(&Channel->Affinity, sizeof (GROUP_AFFINITY));
+
+    ProcNumber = Channel->ProcNumber;
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    if (Affinity == NULL ||
+        __EvtchnAffinityIncludes(Affinity, &ProcNumber))
+        goto done;
+
+    RtlZeroMemory(&ProcNumber, sizeof (PROCESSOR_NUMBER));
+    ProcNumber.Group = Affinity->Group;
+
+    // Move to the first processor in the set that can take upcalls
+    for (Number = 0; Number < sizeof (KAFFINITY) * 8; Number++) {
+        ULONG   Index;
+
+        if ((Affinity->Mask & ((KAFFINITY)1 << Number)) == 0)
+            continue;
+
+        ProcNumber.Number = (UCHAR)Number;
+
+        Index = KeGetProcessorIndexFromNumber(&ProcNumber);
+        if (Index >= Context->ProcessorCount)
+            continue;
+
+        if (Context->Processor[Index]->UpcallEnabled)
+            break;
+    }
+
+    status = STATUS_NOT_SUPPORTED;
+    if (Number == sizeof (KAFFINITY) * 8)
+        goto fail1;
+
+    status = EvtchnBindProcessor(Context,
+                                 Channel,
+                                 ProcNumber.Group,
+                                 ProcNumber.Number);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+done:
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+EvtchnBindVersion2(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Cpu
+    )
+{
+    ASSERT3U(Cpu, <, MAXIMUM_PROCESSORS);
+
+    return EvtchnBind(Interface, Channel, 0, (CHAR)Cpu);
+}
+
+static VOID
+EvtchnUnmask(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 InUpcall
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    KIRQL                       Irql = PASSIVE_LEVEL;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    if (!InUpcall)
+        KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
+
+    if (!Channel->Active)
+        goto done;
+
+    // The mask belongs to the polling DPC until the channel drains
+    if (Channel->Polling)
+        goto done;
+
+    __EvtchnChannelUnmask(Context, Channel);
+
+done:
+    if (!InUpcall)
+        KeReleaseSpinLock(&Channel->Lock, Irql);
+}
+
+static BOOLEAN
+EvtchnUnmaskVersion1(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 InUpcall
+    )
+{
+    EvtchnUnmask(Interface, Channel, InUpcall);
+
+    return FALSE;
+}
+
+static NTSTATUS
+EvtchnSend(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    // Make sure we don't suspend
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!Channel->Active)
+        goto done;
+
+    status = EventChannelSend(Channel->LocalPort);
+    if (NT_SUCCESS(status))
+        (VOID) InterlockedIncrement64(&Channel->Sent);
+
+done:
+    KeLowerIrql(Irql);
+
+    return status;
+}
+
+static BOOLEAN
+EvtchnNotify(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Old,
+    IN  ULONG                   New,
+    IN  volatile ULONG          *Event
+    )
+{
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    // Make sure the new index is visible before sampling the event index
+    KeMemoryBarrier();
+
+    if ((ULONG)(New - *Event) >= (ULONG)(New - Old)) {
+        (VOID) InterlockedIncrement64(&Channel->Suppressed);
+        return FALSE;
+    }
+
+    (VOID) EvtchnSend(Interface, Channel);
+
+    return TRUE;
+}
+
+static VOID
+EvtchnSendMultiple(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count
+    )
+{
+    KIRQL                       Irql;
+    ULONG                       Index;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    // Make sure we don't suspend
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Previous;
+
+        ASSERT3U(Channel[Index]->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        for (Previous = 0; Previous < Index; Previous++)
+            if (Channel[Previous] == Channel[Index])
+                break;
+
+        if (Previous != Index) {
+            (VOID) InterlockedIncrement64(&Channel[Index]->Suppressed);
+            continue;
+        }
+
+        if (!Channel[Index]->Active)
+            continue;
+
+        if (NT_SUCCESS(EventChannelSend(Channel[Index]->LocalPort)))
+            (VOID) InterlockedIncrement64(&Channel[Index]->Sent);
+    }
+
+    KeLowerIrql(Irql);
+}
+
+typedef union _XENBUS_EVTCHN_OP {
+    struct evtchn_alloc_unbound     AllocUnbound;
+    struct evtchn_bind_interdomain  BindInterDomain;
+    struct evtchn_bind_virq         BindVirq;
+    struct evtchn_bind_vcpu         BindVcpu;
+    struct evtchn_set_priority      SetPriority;
+    struct evtchn_close             Close;
+} XENBUS_EVTCHN_OP, *PXENBUS_EVTCHN_OP;
+
+// Maximum number of event channel operations issued in a single multicall
+#define XENBUS_EVTCHN_MULTICALL_BATCH   16
+
+static FORCEINLINE VOID
+__EvtchnMulticallEntry(
+    IN  multicall_entry_t   *Entry,
+    IN  ULONG               Command,
+    IN  PXENBUS_EVTCHN_OP   Op
+    )
+{
+    RtlZeroMemory(Entry, sizeof (multicall_entry_t));
+
+    Entry->op = __HYPERVISOR_event_channel_op;
+    Entry->args[0] = Command;
+    Entry->args[1] = (xen_ulong_t)(ULONG_PTR)Op;
+}
+
+static FORCEINLINE NTSTATUS
+__EvtchnMulticallStatus(
+    IN  multicall_entry_t   *Entry
+    )
+{
+    LONG_PTR                rc = (LONG_PTR)Entry->result;
+    NTSTATUS                status;
+
+    if (rc >= 0)
+        return STATUS_SUCCESS;
+
+    ERRNO_TO_STATUS(-rc, status);
+    return status;
+}
+
+static NTSTATUS
+EvtchnReopenBatch(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count,
+    OUT PULONG                  Reopened
+    )
+{
+    multicall_entry_t           Entry[XENBUS_EVTCHN_MULTICALL_BATCH];
+    XENBUS_EVTCHN_OP            Op[XENBUS_EVTCHN_MULTICALL_BATCH];
+    PXENBUS_EVTCHN_CHANNEL      Call[XENBUS_EVTCHN_MULTICALL_BATCH];
+    PXENBUS_EVTCHN_CHANNEL      Active[XENBUS_EVTCHN_MULTICALL_BATCH];
+    ULONG                       Target[XENBUS_EVTCHN_MULTICALL_BATCH];
+    NTSTATUS                    Result[XENBUS_EVTCHN_MULTICALL_BATCH];
+    ULONG                       Calls;
+    ULONG                       Binds;
+    ULONG                       Priorities;
+    ULONG                       Activated;
+    ULONG                       Index;
+    NTSTATUS                    result;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3U(Count, <=, XENBUS_EVTCHN_MULTICALL_BATCH);
+
+    result = STATUS_SUCCESS;
+
+    // Re-create the ports
+    Calls = 0;
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_EVTCHN_OP   Request = &Op[Calls];
+
+        ASSERT3U(Channel[Index]->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        if (Channel[Index]->Active || Channel[Index]->Closed)
+            continue;
+
+        switch (Channel[Index]->Type) {
+        case XENBUS_EVTCHN_TYPE_UNBOUND:
+            Request->AllocUnbound.dom = DOMID_SELF;
+            Request->AllocUnbound.remote_dom = Channel[Index]->Parameters.Unbound.RemoteDomain;
+
+            __EvtchnMulticallEntry(&Entry[Calls], EVTCHNOP_alloc_unbound, Request);
+            break;
+
+        case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
+            Request->BindInterDomain.remote_dom = Channel[Index]->Parameters.InterDomain.RemoteDomain;
+            Request->BindInterDomain.remote_port = Channel[Index]->Parameters.InterDomain.RemotePort;
+
+            __EvtchnMulticallEntry(&Entry[Calls], EVTCHNOP_bind_interdomain, Request);
+            break;
+
+        case XENBUS_EVTCHN_TYPE_VIRQ:
+            Request->BindVirq.virq = Channel[Index]->Parameters.Virq.Index;
+            Request->BindVirq.vcpu = 0;
+
+            __EvtchnMulticallEntry(&Entry[Calls], EVTCHNOP_bind_virq, Request);
+            break;
+
+        default:
+            // A fixed port belongs to its owner, who must re-open it
+            result = STATUS_NOT_SUPPORTED;
+            continue;
+        }
+
+        Call[Calls++] = Channel[Index];
+    }
+
+    if (Calls == 0)
+        goto done;
+
+    status = HypercallMulticall(Entry, Calls);
+    if (NT_SUCCESS(status)) {
+        for (Index = 0; Index < Calls; Index++)
+            Result[Index] = __EvtchnMulticallStatus(&Entry[Index]);
+    } else {
+        Warning("multicall failed (%08x)\n", status);
+
+        // Fall back to issuing the operations one at a time
+        for (Index = 0; Index < Calls; Index++) {
+            PXENBUS_EVTCHN_OP   Request = &Op[Index];
+
+            switch (Call[Index]->Type) {
+            case XENBUS_EVTCHN_TYPE_UNBOUND:
+                Result[Index] = EventChannelAllocateUnbound(Request->AllocUnbound.remote_dom,
+                                                            &Request->AllocUnbound.port);
+                break;
+
+            case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
+                Result[Index] = EventChannelBindInterDomain(Request->BindInterDomain.remote_dom,
+                                                            Request->BindInterDomain.remote_port,
+                                                            &Request->BindInterDomain.local_port);
+                break;
+
+            case XENBUS_EVTCHN_TYPE_VIRQ:
+                Result[Index] = EventChannelBindVirq(Request->BindVirq.virq,
+                                                     &Request->BindVirq.port);
+                break;
+
+            default:
+                ASSERT(FALSE);
+                Result[Index] = STATUS_NOT_SUPPORTED;
+                break;
+            }
+        }
+    }
+
+    //
+    // Activate the new ports. These are all bound to vCPU 0 so collect
+    // any re-binds that are needed into a second batch. The slots are
+    // re-used in place, which is safe since Binds never exceeds Index.
+    //
+    Binds = 0;
+    Activated = 0;
+    for (Index = 0; Index < Calls; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Next = Call[Index];
+        ULONG                   LocalPort;
+        ULONG                   ProcIndex;
+
+        status = Result[Index];
+        if (!NT_SUCCESS(status)) {
+            result = status;
+            continue;
+        }
+
+        switch (Next->Type) {
+        case XENBUS_EVTCHN_TYPE_UNBOUND:
+            LocalPort = Op[Index].AllocUnbound.port;
+            break;
+
+        case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
+            LocalPort = Op[Index].BindInterDomain.local_port;
+            break;
+
+        case XENBUS_EVTCHN_TYPE_VIRQ:
+            LocalPort = Op[Index].BindVirq.port;
+            break;
+
+        default:
+            ASSERT(FALSE);
+            LocalPort = 0;
+            break;
+        }
+
+        status = XENBUS_EVTCHN_ABI(PortEnable,
+                                   &Context->EvtchnAbi,
+                                   LocalPort);
+        if (!NT_SUCCESS(status)) {
+            (VOID) EventChannelClose(LocalPort);
+            result = status;
+            continue;
+        }
+
+        // The port must be valid before the channel can be looked up
+        KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+        Next->LocalPort = LocalPort;
+        KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+
+        status = EvtchnTableAdd(Context, LocalPort, Next);
+        if (!NT_SUCCESS(status)) {
+            KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+            Next->LocalPort = 0;
+            KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+
+            XENBUS_EVTCHN_ABI(PortDisable,
+                              &Context->EvtchnAbi,
+                              LocalPort);
+            (VOID) EventChannelClose(LocalPort);
+            result = status;
+            continue;
+        }
+
+        KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+
+        ProcIndex = Next->ProcIndex;
+
+        RtlZeroMemory(&Next->ProcNumber, sizeof (PROCESSOR_NUMBER));
+        Next->ProcIndex = 0;
+        Next->Active = TRUE;
+
+        KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+
+        Trace("%u\n", LocalPort);
+
+        Active[Activated++] = Next;
+
+        if (ProcIndex == 0 ||
+            ProcIndex >= Context->ProcessorCount ||
+            !Context->Processor[ProcIndex]->UpcallEnabled)
+            continue;
+
+        Op[Binds].BindVcpu.port = LocalPort;
+        Op[Binds].BindVcpu.vcpu = SystemVirtualCpuIndex(ProcIndex);
+
+        __EvtchnMulticallEntry(&Entry[Binds], EVTCHNOP_bind_vcpu, &Op[Binds]);
+
+        Call[Binds] = Next;
+        Target[Binds] = ProcIndex;
+        Binds++;
+    }
+
+    if (Binds != 0) {
+        status = HypercallMulticall(Entry, Binds);
+        if (!NT_SUCCESS(status))
+            Binds = 0;  // Everything stays on vCPU 0
+    }
+
+    for (Index = 0; Index < Binds; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Next = Call[Index];
+        PROCESSOR_NUMBER        ProcNumber;
+
+        status = __EvtchnMulticallStatus(&Entry[Index]);
+        if (!NT_SUCCESS(status))
+            continue;
+
+        status = KeGetProcessorNumberFromIndex(Target[Index], &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+        Next->ProcNumber = ProcNumber;
+        Next->ProcIndex = Target[Index];
+        KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+    }
+
+    //
+    // A new port starts at the default priority so restore any other
+    // priority, again as a single batch, before the ports are unmasked.
+    //
+    Priorities = 0;
+    for (Index = 0; Index < Activated; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Next = Active[Index];
+        ULONG                   Priority;
+
+        KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+        Op[Priorities].SetPriority.port = Next->LocalPort;
+        Priority = Next->Priority;
+        KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+
+        if (Priority == EVTCHN_FIFO_PRIORITY_DEFAULT)
+            continue;
+
+        Op[Priorities].SetPriority.priority = Priority;
+
+        __EvtchnMulticallEntry(&Entry[Priorities], EVTCHNOP_set_priority, &Op[Priorities]);
+
+        Call[Priorities] = Next;
+        Priorities++;
+    }
+
+    if (Priorities != 0) {
+        status = HypercallMulticall(Entry, Priorities);
+        if (NT_SUCCESS(status)) {
+            for (Index = 0; Index < Priorities; Index++)
+                Result[Index] = __EvtchnMulticallStatus(&Entry[Index]);
+        } else {
+            Warning("multicall failed (%08x)\n", status);
+
+            // Fall back to issuing the operations one at a time
+            for (Index = 0; Index < Priorities; Index++)
+                Result[Index] = EventChannelSetPriority(Op[Index].SetPriority.port,
+                                                        Op[Index].SetPriority.priority);
+        }
+    }
+
+    for (Index = 0; Index < Priorities; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Next = Call[Index];
+
+        if (NT_SUCCESS(Result[Index]))
+            continue;
+
+        Warning("%u: failed to restore priority %u (%08x)\n",
+                Op[Index].SetPriority.port,
+                Op[Index].SetPriority.priority,
+                Result[Index]);
+
+        // Unless the owner has since set a priority of its own
+        KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+        if (Next->Priority == Op[Index].SetPriority.priority)
+            Next->Priority = EVTCHN_FIFO_PRIORITY_DEFAULT;
+        KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+    }
+
+    for (Index = 0; Index < Activated; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Next = Active[Index];
+
+        KeAcquireSpinLockAtDpcLevel(&Next->Lock);
+
+        if (Next->Held) {
+            XENBUS_EVTCHN_ABI(PortMask,
+                              &Context->EvtchnAbi,
+                              Next->LocalPort);
+            Next->Masked++;
+        } else if (!Next->Polling) {
+            __EvtchnChannelUnmask(Context, Next);
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&Next->Lock);
+    }
+
+    *Reopened += Activated;
+
+done:
+    return result;
+}
+
+static NTSTATUS
+EvtchnReopen(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    LARGE_INTEGER               Frequency;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONG                       Reopened;
+    ULONG                       Index;
+    KIRQL                       Irql;
+    NTSTATUS                    result;
+    NTSTATUS                    status;
+
+    Start = KeQueryPerformanceCounter(&Frequency);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
+
+    result = STATUS_SUCCESS;
+    Reopened = 0;
+
+    for (Index = 0; Index < Count; Index += XENBUS_EVTCHN_MULTICALL_BATCH) {
+        status = EvtchnReopenBatch(Context,
+                                   &Channel[Index],
+                                   __min(Count - Index,
+                                         XENBUS_EVTCHN_MULTICALL_BATCH),
+                                   &Reopened);
+        if (!NT_SUCCESS(status))
+            result = status;
+    }
+
+    KeLowerIrql(Irql);
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    Info("%u/%u channel(s) in %lluus\n",
+         Reopened,
+         Count,
+         ((End.QuadPart - Start.QuadPart) * 1000000ull) / Frequency.QuadPart);
+
+    return result;
+}
+
+//
+// Close the ports of, and free, the channels on List. This must be
+// called at DISPATCH_LEVEL, which holds off suspend, so the ports cannot
+// be invalidated half way through.
+//
+static VOID
+EvtchnReapList(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PLIST_ENTRY             List
+    )
+{
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    while (!IsListEmpty(List)) {
+        multicall_entry_t       Entry[XENBUS_EVTCHN_MULTICALL_BATCH];
+        XENBUS_EVTCHN_OP        Op[XENBUS_EVTCHN_MULTICALL_BATCH];
+        PXENBUS_EVTCHN_CHANNEL  Channel[XENBUS_EVTCHN_MULTICALL_BATCH];
+        ULONG                   Count;
+        ULONG                   Calls;
+        ULONG                   Index;
+        NTSTATUS                status;
+
+        Count = 0;
+        Calls = 0;
+        while (!IsListEmpty(List) && Count < XENBUS_EVTCHN_MULTICALL_BATCH) {
+            PLIST_ENTRY ListEntry;
+
+            ListEntry = RemoveHeadList(List);
+            RtlZeroMemory(ListEntry, sizeof (LIST_ENTRY));
+
+            Channel[Count] = CONTAINING_RECORD(ListEntry,
+                                               XENBUS_EVTCHN_CHANNEL,
+                                               ListEntry);
+
+            // The port is zeroed if it was lost across suspend/resume
+            if (Channel[Count]->LocalPort != 0) {
+                Op[Calls].Close.port = Channel[Count]->LocalPort;
+                __EvtchnMulticallEntry(&Entry[Calls], EVTCHNOP_close, &Op[Calls]);
+                Calls++;
+            }
+
+            Count++;
+        }
+
+        if (Calls != 0) {
+            status = HypercallMulticall(Entry, Calls);
+            if (NT_SUCCESS(status)) {
+                for (Index = 0; Index < Calls; Index++) {
+                    status = __EvtchnMulticallStatus(&Entry[Index]);
+                    if (!NT_SUCCESS(status))
+                        Warning("%u: close failed (%08x)\n",
+                                Op[Index].Close.port,
+                                status);
+                }
+            } else {
+                Warning("multicall failed (%08x)\n", status);
+
+                // Fall back to closing the ports one at a time
+                for (Index = 0; Index < Calls; Index++) {
+                    status = EventChannelClose(Op[Index].Close.port);
+                    if (!NT_SUCCESS(status))
+                        Warning("%u: close failed (%08x)\n",
+                                Op[Index].Close.port,
+                                status);
+                }
+            }
+
+            (VOID) InterlockedIncrement64(&Context->ReapBatches);
+        }
+
+        for (Index = 0; Index < Count; Index++) {
+            Channel[Index]->LocalPort = 0;
+
+            ASSERT(IsZeroMemory(Channel[Index], sizeof (XENBUS_EVTCHN_CHANNEL)));
+            __EvtchnFree(Channel[Index]);
+        }
+
+        (VOID) InterlockedAdd64(&Context->Reaped, Count);
+        (VOID) InterlockedAdd(&Context->ReapPending, -(LONG)Count);
+    }
+}
+
+static NTSTATUS
+EvtchnReaper(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = _Context;
+    PKEVENT                 Event;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        LIST_ENTRY  List;
+        KIRQL       Irql;
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        InitializeListHead(&List);
+
+        // Stay at DISPATCH_LEVEL until the ports are closed
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+        KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+
+        while (!IsListEmpty(&Context->ReapList)) {
+            PLIST_ENTRY ListEntry;
+
+            ListEntry = RemoveHeadList(&Context->ReapList);
+            InsertTailList(&List, ListEntry);
+        }
+
+        KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+
+        EvtchnReapList(Context, &List);
+
+        KeLowerIrql(Irql);
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+EvtchnClose(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    ULONG                       LocalPort = Channel->LocalPort;
+    KIRQL                       Irql;
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql); // Prevent suspend
+
+    Trace("%u\n", LocalPort);
+
+    if (Channel->Active) {
+        Channel->Active = FALSE;
+
+        XENBUS_EVTCHN_ABI(PortDisable,
+                          &Context->EvtchnAbi,
+                          LocalPort);
+
+        EvtchnTableRemove(Context, LocalPort, Channel);
+
+        //
+        // The event may be pending on a CPU queue so we mark it as
+        // closed but defer the rest of the work to the correct
+        // DPC, which will make sure the queue is polled first.
+        //
+
+        Channel->Closed = TRUE;
+        KeMemoryBarrier();
+
+        EvtchnTrigger(Interface, Channel);
+        goto done;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+
+    Channel->Closed = TRUE;
+    EvtchnReap(Context, Channel, FALSE);
+
+    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+
+done:
+    KeLowerIrql(Irql);
+}
+
+#define XENBUS_EVTCHN_GROUP_MAGIC   'PORG'
+
+struct _XENBUS_EVTCHN_GROUP {
+    ULONG                   Magic;
+    ULONG                   Count;
+    PXENBUS_EVTCHN_CHANNEL  Channel[1];
+};
+
+static ULONG
+EvtchnGroupCandidates(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PGROUP_AFFINITY         Affinity OPTIONAL,
+    OUT PULONG                  Candidate
+    )
+{
+    ULONG                       Count;
+    ULONG                       Index;
+
+    Count = 0;
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PROCESSOR_NUMBER    ProcNumber;
+        USHORT              Node;
+        ULONG               Slot;
+        NTSTATUS            status;
+
+        if (!Context->Processor[Index]->UpcallEnabled)
+            continue;
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        if (Affinity != NULL &&
+            !__EvtchnAffinityIncludes(Affinity, &ProcNumber))
+            continue;
+
+        //
+        // Keep the candidates ordered by NUMA node (and by index within
+        // a node) so that an even spread over the list is also an even
+        // spread over the nodes.
+        //
+        Node = EvtchnProcessorNode(Index);
+
+        for (Slot = Count; Slot != 0; --Slot) {
+            if (EvtchnProcessorNode(Candidate[Slot - 1]) <= Node)
+                break;
+
+            Candidate[Slot] = Candidate[Slot - 1];
+        }
+
+        Candidate[Slot] = Index;
+        Count++;
+    }
+
+    return Count;
+}
+
+static PXENBUS_EVTCHN_GROUP
+EvtchnGroupOpen(
+    IN  PINTERFACE          Interface,
+    IN  XENBUS_EVTCHN_TYPE  Type,
+    IN  ULONG               Count,
+    IN  PGROUP_AFFINITY     Affinity OPTIONAL,
+    IN  PKSERVICE_ROUTINE   Callback,
+    IN  PVOID               *Argument OPTIONAL,
+    ...
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Interface->Context;
+    va_list                 Arguments;
+    USHORT                  RemoteDomain;
+    PULONG                  RemotePort;
+    BOOLEAN                 Mask;
+    PXENBUS_EVTCHN_GROUP    Group;
+    PULONG                  Candidate;
+    ULONG                   Candidates;
+    ULONG                   Index;
+    NTSTATUS                status;
+
+    va_start(Arguments, Argument);
+    RemoteDomain = va_arg(Arguments, USHORT);
+    RemotePort = (Type == XENBUS_EVTCHN_TYPE_INTER_DOMAIN) ?
+                 va_arg(Arguments, PULONG) :
+                 NULL;
+    Mask = va_arg(Arguments, BOOLEAN);
+    va_end(Arguments);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0 ||
+        (Type != XENBUS_EVTCHN_TYPE_UNBOUND &&
+         Type != XENBUS_EVTCHN_TYPE_INTER_DOMAIN))
+        goto fail1;
+
+    Group = __EvtchnAllocate(FIELD_OFFSET(XENBUS_EVTCHN_GROUP, Channel) +
+                             sizeof (PXENBUS_EVTCHN_CHANNEL) * Count);
+
+    status = STATUS_NO_MEMORY;
+    if (Group == NULL)
+        goto fail2;
+
+    Group->Magic = XENBUS_EVTCHN_GROUP_MAGIC;
+
+    for (Index = 0; Index < Count; Index++) {
+        PVOID   Next = (Argument != NULL) ? Argument[Index] : NULL;
+
+        if (Type == XENBUS_EVTCHN_TYPE_UNBOUND)
+            Group->Channel[Index] = EvtchnOpen(Interface,
+                                               Type,
+                                               Callback,
+                                               Next,
+                                               RemoteDomain,
+                                               Mask);
+        else
+            Group->Channel[Index] = EvtchnOpen(Interface,
+                                               Type,
+                                               Callback,
+                                               Next,
+                                               RemoteDomain,
+                                               RemotePort[Index],
+                                               Mask);
+
+        status = STATUS_UNSUCCESSFUL;
+        if (Group->Channel[Index] == NULL)
+            goto fail3;
+
+        Group->Count++;
+    }
+
+    Candidate = __EvtchnAllocate(sizeof (ULONG) * __max(Context->ProcessorCount, 1));
+
+    status = STATUS_NO_MEMORY;
+    if (Candidate == NULL)
+        goto fail4;
+
+    Candidates = EvtchnGroupCandidates(Context, Affinity, Candidate);
+
+    //
+    // With more CPUs than channels, space the channels out evenly over
+    // the candidates; otherwise deal them out round-robin.
+    //
+    for (Index = 0; Index < Count && Candidates != 0; Index++) {
+        PROCESSOR_NUMBER    ProcNumber;
+        ULONG               Target;
+
+        Target = (Count <= Candidates) ?
+                 Candidate[(Index * Candidates) / Count] :
+                 Candidate[Index % Candidates];
+
+        status = KeGetProcessorNumberFromIndex(Target, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        status = EvtchnBind(Interface,
+                            Group->Channel[Index],
+                            ProcNumber.Group,
+                            ProcNumber.Number);
+        if (!NT_SUCCESS(status))
+            goto fail5;
+    }
+
+    __EvtchnFree(Candidate);
+
+    return Group;
+
+fail5:
+    Error("fail5\n");
+
+    __EvtchnFree(Candidate);
+
+fail4:
+    Error("fail4\n");
+
+    Index = Count;
+
+fail3:
+    Error("fail3\n");
+
+    while (Index != 0) {
+        --Index;
+
+        EvtchnClose(Interface, Group->Channel[Index]);
+        Group->Channel[Index] = NULL;
+    }
+
+    Group->Count = 0;
+    Group->Magic = 0;
+
+    ASSERT(IsZeroMemory(Group, FIELD_OFFSET(XENBUS_EVTCHN_GROUP, Channel) +
+                               sizeof (PXENBUS_EVTCHN_CHANNEL) * Count));
+    __EvtchnFree(Group);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return NULL;
+}
+
+static PXENBUS_EVTCHN_CHANNEL
+EvtchnGroupChannel(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group,
+    IN  ULONG                   Index
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+    ASSERT3U(Index, <, Group->Count);
+
+    return Group->Channel[Index];
+}
+
+static VOID
+EvtchnGroupMask(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    ULONG                       Index;
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+    for (Index = 0; Index < Group->Count; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Channel = Group->Channel[Index];
+        KIRQL                   Irql;
+
+        KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+        Channel->Held = TRUE;
+
+        if (Channel->Active) {
+            XENBUS_EVTCHN_ABI(PortMask,
+                              &Context->EvtchnAbi,
+                              Channel->LocalPort);
+            Channel->Masked++;
+        }
+
+        KeReleaseSpinLock(&Channel->Lock, Irql);
+    }
+}
+
+static VOID
+EvtchnGroupUnmask(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    )
+{
+    ULONG                       Index;
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+    for (Index = 0; Index < Group->Count; Index++) {
+        PXENBUS_EVTCHN_CHANNEL  Channel = Group->Channel[Index];
+        KIRQL                   Irql;
+
+        KeAcquireSpinLock(&Channel->Lock, &Irql);
+        Channel->Held = FALSE;
+        KeReleaseSpinLock(&Channel->Lock, Irql);
+
+        EvtchnUnmask(Interface, Channel, FALSE);
+    }
+}
+
+static NTSTATUS
+EvtchnGroupReopen(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    )
+{
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+    return EvtchnReopen(Interface, Group->Channel, Group->Count);
+}
+
+static VOID
+EvtchnGroupClose(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_GROUP    Group
+    )
+{
+    ULONG                       Count = Group->Count;
+    ULONG                       Index;
+
+    ASSERT3U(Group->Magic, ==, XENBUS_EVTCHN_GROUP_MAGIC);
+
+    for (Index = 0; Index < Count; Index++) {
+        EvtchnClose(Interface, Group->Channel[Index]);
+        Group->Channel[Index] = NULL;
+    }
+
+    Group->Count = 0;
+    Group->Magic = 0;
+
+    ASSERT(IsZeroMemory(Group, FIELD_OFFSET(XENBUS_EVTCHN_GROUP, Channel) +
+                               sizeof (PXENBUS_EVTCHN_CHANNEL) * Count));
+    __EvtchnFree(Group);
+}
+
+static NTSTATUS
+EvtchnWait(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  *Channel,
+    IN  ULONG                   Count,
+    IN  PLARGE_INTEGER          Timeout OPTIONAL
+    )
+{
+    evtchn_port_t               Port[XENBUS_EVTCHN_WAIT_MAXIMUM];
+    ULONG                       Ports;
+    ULONG                       Index;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Count > XENBUS_EVTCHN_WAIT_MAXIMUM)
+        goto fail1;
+
+    // Make sure the ports stay valid
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    Ports = 0;
+    for (Index = 0; Index < Count; Index++) {
+        ASSERT3U(Channel[Index]->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        if (Channel[Index]->Active)
+            Port[Ports++] = Channel[Index]->LocalPort;
+    }
+
+    //
+    // If none of the channels has a port then there is nothing to wait
+    // for; don't let SCHEDOP_poll treat that as a wait for any event.
+    //
+    status = STATUS_SUCCESS;
+    if (Count != 0 && Ports == 0)
+        goto done;
+
+    status = SchedPoll(Port, Ports, Timeout);
+
+done:
+    KeLowerIrql(Irql);
+
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static ULONG
+EvtchnGetPort(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+    ASSERT(Channel->Active);
+
+    return Channel->LocalPort;
+}
+
+static NTSTATUS
+EvtchnStatus(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    OUT ULONG                   *Status
+    )
+{
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    // Make sure we don't suspend
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!Channel->Active)
+        goto done;
+
+    status = EventChannelStatus(Channel->LocalPort, Status);
+
+done:
+    KeLowerIrql(Irql);
+
+    return status;
+}
+
+static NTSTATUS
+EvtchnSetPriority(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Priority
+    )
+{
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Priority > EVTCHN_FIFO_PRIORITY_MIN)
+        goto fail1;
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!Channel->Active)
+        goto fail2;
+
+    if (Channel->Priority == Priority)
+        goto done;
+
+    status = EventChannelSetPriority(Channel->LocalPort, Priority);
+    if (!NT_SUCCESS(status)) {
+        //
+        // The 2-level ABI has no notion of priority; channels are
+        // simply serviced in port order.
+        //
+        if (status == STATUS_NOT_IMPLEMENTED)
+            status = STATUS_NOT_SUPPORTED;
+
+        goto fail3;
+    }
+
+    Channel->Priority = Priority;
+
+    Info("[%u]: PRIORITY %u\n", Channel->LocalPort, Priority);
+
+done:
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+EvtchnSetModeration(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Rate,
+    IN  ULONG                   Time
+    )
+{
+    LARGE_INTEGER               Frequency;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!Channel->Active)
+        goto fail1;
+
+    //
+    // A channel that is currently being polled will carry on until
+    // it drains, so there is no need to synchronize with the DPC.
+    //
+    Channel->ModerationTicks = ((LONGLONG)Time * Frequency.QuadPart) / 1000000;
+    Channel->ModerationTime = Time;
+    Channel->ModerationRate = Rate;
+
+    Info("[%u]: RATE %u TIME %u\n", Channel->LocalPort, Rate, Time);
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return status;
+}
+
+static NTSTATUS
+EvtchnSetThreaded(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 Enable
+    )
+{
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+    KeAcquireSpinLock(&Channel->Lock, &Irql);
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!Channel->Active)
+        goto fail1;
+
+    //
+    // A channel that is already queued for the threaded DPC will still
+    // be serviced there, so there is no need to synchronize with it.
+    //
+    Channel->Threaded = Enable;
+
+    Info("[%u]: %s\n", Channel->LocalPort,
+         (Enable) ? "THREADED" : "UNTHREADED");
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    KeReleaseSpinLock(&Channel->Lock, Irql);
+
+    return status;
+}
+
+static
+_Function_class_(KSERVICE_ROUTINE)
+__drv_requiresIRQL(HIGH_LEVEL)
+BOOLEAN
+EvtchnInterruptCallback(
+    IN  PKINTERRUPT             InterruptObject,
+    IN  PVOID                   Argument
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT      Context = Argument;
+    ULONG                       Index;
+    PXENBUS_EVTCHN_PROCESSOR    Processor;
+    BOOLEAN                     DoneSomething;
+
+    UNREFERENCED_PARAMETER(InterruptObject);
+
+    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
+    Index = KeGetCurrentProcessorNumberEx(NULL);
+
+    ASSERT3U(Index, <, Context->ProcessorCount);
+    Processor = Context->Processor[Index];
+
+    Processor->UpcallTimeStamp = __rdtsc();
+    Processor->Upcalls++;
+
+    DoneSomething = FALSE;
+    while (XENBUS_SHARED_INFO(UpcallPending,
+                              &Context->SharedInfoInterface,
+                              Index)) {
+        ULONGLONG   Exhausted;
+
+        //
+        // The pending list is not a good guide to whether there is more
+        // to do here: channels in polling mode, or closed but not yet
+        // reaped, stay on it for the DPC. Only stop early if a pass ran
+        // out of budget or time, in which case the DPC has been queued
+        // to pick up where it left off.
+        //
+        Exhausted = Processor->BudgetExhausted + Processor->TimeExhausted;
+
+        DoneSomething |= EvtchnPoll(Context, Index, NULL);
+
+        if (Processor->BudgetExhausted + Processor->TimeExhausted != Exhausted)
+            break;
+    }
+
+    return DoneSomething;
+}
+
+VOID
+EvtchnReset(
+    VOID
+    )
+{
+    ULONGLONG                   Value;
+    XENBUS_EVTCHN_CHANNEL       Store;
+    XENBUS_EVTCHN_CHANNEL       Console;
+    NTSTATUS                    status;
+
+    //
+    // When we reset the event channel ABI we will lose our
+    // binding to the any event channel which was set up
+    // by the toolstack during domain build.
+    // We need to get the binding back, so we must query the
+    // remote domain and port, and then re-bind after the
+    // reset.
+    //
+
+    RtlZeroMemory(&Store, sizeof (Store));
+    RtlZeroMemory(&Console, sizeof (Console));
+
+    status = HvmGetParam(HVM_PARAM_STORE_EVTCHN, &Value);
+    if (NT_SUCCESS(status))
+        Store.LocalPort = (ULONG)Value;
+
+    status = HvmGetParam(HVM_PARAM_CONSOLE_EVTCHN, &Value);
+    if (NT_SUCCESS(status))
+        Console.LocalPort = (ULONG)Value;
+
+    if (Store.LocalPort != 0) {
+        domid_t         RemoteDomain;
+        evtchn_port_t   RemotePort;
+
+        status = EventChannelQueryInterDomain(Store.LocalPort,
+                                              &RemoteDomain,
+                                              &RemotePort);
+        ASSERT(NT_SUCCESS(status));
+
+        Store.Parameters.InterDomain.RemoteDomain = RemoteDomain;
+        Store.Parameters.InterDomain.RemotePort = RemotePort;
+
+        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: STORE (%u) -> (%u:%u)\n",
+                  Store.LocalPort,
+                  RemoteDomain,
+                  RemotePort);
+    }
+
+    if (Console.LocalPort != 0) {
+        domid_t         RemoteDomain;
+        evtchn_port_t   RemotePort;
+
+        status = EventChannelQueryInterDomain(Console.LocalPort,
+                                              &RemoteDomain,
+                                              &RemotePort);
+        ASSERT(NT_SUCCESS(status));
+
+        Console.Parameters.InterDomain.RemoteDomain = RemoteDomain;
+        Console.Parameters.InterDomain.RemotePort = RemotePort;
+
+        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: CONSOLE (%u) -> (%u:%u)\n",
+                  Console.LocalPort,
+                  RemoteDomain,
+                  RemotePort);
+    }
+
+    (VOID) EventChannelReset();
+    LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: RESET\n");
+
+    if (Store.LocalPort != 0) {
+        domid_t         RemoteDomain;
+        evtchn_port_t   RemotePort;
+
+        RemoteDomain = Store.Parameters.InterDomain.RemoteDomain;
+        RemotePort = Store.Parameters.InterDomain.RemotePort;
+
+        status = EventChannelBindInterDomain(RemoteDomain,
+                                             RemotePort,
+                                             &Store.LocalPort);
+        ASSERT(NT_SUCCESS(status));
+
+        status = HvmSetParam(HVM_PARAM_STORE_EVTCHN, Store.LocalPort);
+        ASSERT(NT_SUCCESS(status));
+
+        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: STORE (%u:%u) -> %u\n",
+                  RemoteDomain,
+                  RemotePort,
+                  Store.LocalPort);
+    }
+
+    if (Console.LocalPort != 0) {
+        domid_t         RemoteDomain;
+        evtchn_port_t   RemotePort;
+
+        RemoteDomain = Console.Parameters.InterDomain.RemoteDomain;
+        RemotePort = Console.Parameters.InterDomain.RemotePort;
+
+        status = EventChannelBindInterDomain(RemoteDomain,
+                                             RemotePort,
+                                             &Console.LocalPort);
+        ASSERT(NT_SUCCESS(status));
+
+        status = HvmSetParam(HVM_PARAM_CONSOLE_EVTCHN, Console.LocalPort);
+        ASSERT(NT_SUCCESS(status));
+
+        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: CONSOLE (%u:%u) -> %u\n",
+                  RemoteDomain,
+                  RemotePort,
+                  Console.LocalPort);
+    }
+}
+
+
+
+static NTSTATUS
+EvtchnAbiAcquire(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    NTSTATUS                    status;
+
+    if (Context->UseEvtchnFifoAbi) {
+        EvtchnFifoGetAbi(Context->EvtchnFifoContext,
+                         &Context->EvtchnAbi);
+
+        status = XENBUS_EVTCHN_ABI(Acquire,
+                                   &Context->EvtchnAbi);
+        if (!NT_SUCCESS(status))
+            goto use_two_level;
+
+        Info("FIFO\n");
+        goto done;
+    }
+
+use_two_level:
+    EvtchnTwoLevelGetAbi(Context->EvtchnTwoLevelContext,
+                         &Context->EvtchnAbi);
+
+    status = XENBUS_EVTCHN_ABI(Acquire,
+                               &Context->EvtchnAbi);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    Info("TWO LEVEL\n");
+
+done:
+    Context->PortCount = XENBUS_EVTCHN_ABI(GetPortCount,
+                                           &Context->EvtchnAbi);
+    ASSERT3U(Context->PortCount, <=, EVTCHN_FIFO_NR_CHANNELS);
+
+    Info("%u PORTS\n", Context->PortCount);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+EvtchnAbiRelease(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    XENBUS_EVTCHN_ABI(Release, &Context->EvtchnAbi);
+
+    RtlZeroMemory(&Context->EvtchnAbi, sizeof (XENBUS_EVTCHN_ABI));
+    Context->PortCount = 0;
+}
+
+static VOID
+EvtchnInterruptEnable(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+    ULONG                       Line;
+    NTSTATUS                    status;
+
+    Trace("====>\n");
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor;
+        unsigned int                vcpu_id;
+        UCHAR                       Vector;
+        PROCESSOR_NUMBER            ProcNumber;
+
+        Processor = Context->Processor[Index];
+
+        if (Processor->Interrupt == NULL)
+            continue;
+
+        vcpu_id = SystemVirtualCpuIndex(Index);
+        Vector = FdoGetInterruptVector(Context->Fdo, Processor->Interrupt);
+
+        status = HvmSetEvtchnUpcallVector(vcpu_id, Vector);
+        if (!NT_SUCCESS(status)) {
+            if (status != STATUS_NOT_IMPLEMENTED )
+                continue;
+
+            Info("PER-CPU UPCALL NOT IMPLEMENTED\n");
+            break;
+        }
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        Info("CPU %u:%u (Vector = %u)\n",
+             ProcNumber.Group,
+             ProcNumber.Number,
+             Vector);
+        Processor->UpcallEnabled = TRUE;
+    }
+
+    Line = FdoGetInterruptLine(Context->Fdo, Context->Interrupt);
+
+    status = HvmSetParam(HVM_PARAM_CALLBACK_IRQ, Line);
+    ASSERT(NT_SUCCESS(status));
+
+    Info("CALLBACK VIA (Vector = %u)\n", Line);
+
+    Trace("<====\n");
+}
+
+static VOID
+EvtchnInterruptDisable(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context
+    )
+{
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    Trace("====>\n");
+
+    status = HvmSetParam(HVM_PARAM_CALLBACK_IRQ, 0);
+    ASSERT(NT_SUCCESS(status));
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor;
+        unsigned int                vcpu_id;
+
+        Processor = Context->Processor[Index];
+
+        if (!Processor->UpcallEnabled)
+            continue;
+
+        vcpu_id = SystemVirtualCpuIndex(Index);
+
+        (VOID) HvmSetEvtchnUpcallVector(vcpu_id, 0);
+        Processor->UpcallEnabled = FALSE;
+    }
+
+    Trace("<====\n");
+}
+
+static VOID
+EvtchnSuspendCallbackEarly(
+    IN  PVOID               Argument
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
+    PLIST_ENTRY             ListEntry;
+    ULONG                   Index;
+    LARGE_INTEGER           Frequency;
+    LARGE_INTEGER           Start;
+    LARGE_INTEGER           End;
+    ULONG                   Count;
+
+    Start = KeQueryPerformanceCounter(&Frequency);
+    Count = 0;
+
+    // Make sure all triggered channels are on a pending list
+    for (Index = 0; Index < Context->ProcessorCount; Index++)
+        EvtchnSwizzle(Context->Processor[Index]);
+
+    // Pooled ports are gone too; the filler thread replaces them
+    EvtchnPoolInvalidate(Context);
+
+    // As are the ports of channels waiting to be reaped
+    for (ListEntry = Context->ReapList.Flink;
+         ListEntry != &Context->ReapList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+
+        Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+        Channel->LocalPort = 0;
+    }
+
+    for (ListEntry = Context->List.Flink;
+         ListEntry != &Context->List;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+
+        ASSERT(ListEntry->Flink != NULL);
+
+        Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+        if (Channel->Active) {
+            Channel->Active = FALSE;
+
+            EvtchnTableRemove(Context, Channel->LocalPort, Channel);
+            Count++;
+        }
+
+        //
+        // The port is about to go away, so an open channel must not be
+        // left queued for polling or it could not be reaped if its owner
+        // then closes it. Closed channels are left for the DPC to reap.
+        //
+        if (Channel->Polling && !Channel->Closed) {
+            Channel->Polling = FALSE;
+            Channel->PollPasses = 0;
+
+            RemoveEntryList(&Channel->PendingListEntry);
+            InitializeListHead(&Channel->PendingListEntry);
+        }
+    }
+
+    //
+    // The same goes for open channels queued for the threaded DPC,
+    // other than one whose callback is running, which the DPC will
+    // dequeue itself.
+    //
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor;
+
+        Processor = Context->Processor[Index];
+
+        if (Processor->Interrupt == NULL)
+            continue;
+
+        ListEntry = Processor->ThreadedList.Flink;
+        while (ListEntry != &Processor->ThreadedList) {
+            PLIST_ENTRY             Next = ListEntry->Flink;
+            PXENBUS_EVTCHN_CHANNEL  Channel;
+
+            Channel = CONTAINING_RECORD(ListEntry,
+                                        XENBUS_EVTCHN_CHANNEL,
+                                        PendingListEntry);
+
+            ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+            if (Channel != Processor->ThreadedChannel &&
+                !Channel->Closed) {
+                RemoveEntryList(&Channel->PendingListEntry);
+                InitializeListHead(&Channel->PendingListEntry);
+                Channel->Retrigger = FALSE;
+            }
+
+            ListEntry = Next;
+        }
+    }
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    LogPrintf(LOG_LEVEL_INFO,
+              "SUSPEND: EVTCHN: %u channel(s) deactivated in %lluus\n",
+              Count,
+              ((End.QuadPart - Start.QuadPart) * 1000000ull) / Frequency.QuadPart);
+}
+
+static VOID
+EvtchnSuspendCallbackLate(
+    IN  PVOID               Argument
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
+    LARGE_INTEGER           Frequency;
+    LARGE_INTEGER           Start;
+    LARGE_INTEGER           End;
+    NTSTATUS                status;
+
+    Start = KeQueryPerformanceCounter(&Frequency);
+
+    EvtchnAbiRelease(Context);
+
+    status = EvtchnAbiAcquire(Context);
+    ASSERT(NT_SUCCESS(status));
+
+    EvtchnInterruptDisable(Context);
+    EvtchnInterruptEnable(Context);
+
+    if (Context->PoolThread != NULL)
+        ThreadWake(Context->PoolThread);
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    LogPrintf(LOG_LEVEL_INFO,
+              "SUSPEND: EVTCHN: ABI and upcalls restored in %lluus\n",
+              ((End.QuadPart - Start.QuadPart) * 1000000ull) / Frequency.QuadPart);
+}
+
+static VOID
+EvtchnDebugHistogram(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  const CHAR              *Name,
+    IN  PULONGLONG              Histogram
+    )
+{
+    ULONG                       Bucket;
+
+    for (Bucket = 0; Bucket < XENBUS_EVTCHN_LATENCY_BUCKETS; Bucket++) {
+        if (Histogram[Bucket] == 0)
+            continue;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "  %s: 2^%u = %llu\n",
+                     Name,
+                     Bucket,
+                     Histogram[Bucket]);
+    }
+}
+
+static VOID
+EvtchnDebugCallback(
+    IN  PVOID               Argument,
+    IN  BOOLEAN             Crashing
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
+    ULONG                   Index;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "PROCESSORS:\n");
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_EVTCHN_PROCESSOR    Processor;
+        PROCESSOR_NUMBER            ProcNumber;
+        NTSTATUS                    status;
+
+        Processor = Context->Processor[Index];
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "- CPU %u:%u: Upcalls = %llu Dpcs = %llu ThreadedDpcs = %llu Spurious = %llu BudgetExhausted = %llu TimeExhausted = %llu %s\n",
+                     ProcNumber.Group,
+                     ProcNumber.Number,
+                     Processor->Upcalls,
+                     Processor->Dpcs,
+                     Processor->ThreadedDpcs,
+                     Processor->Spurious,
+                     Processor->BudgetExhausted,
+                     Processor->TimeExhausted,
+                     (Processor->UpcallEnabled) ? "UPCALL" : "");
+
+        EvtchnDebugHistogram(Context, "UPCALL", Processor->Latency.Upcall);
+        EvtchnDebugHistogram(Context, "DPC", Processor->Latency.Dpc);
+        EvtchnDebugHistogram(Context, "THREADED", Processor->Latency.ThreadedDpc);
+    }
+
+    if (!IsListEmpty(&Context->List)) {
+        PLIST_ENTRY ListEntry;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "EVENT CHANNELS:\n");
+
+        for (ListEntry = Context->List.Flink;
+             ListEntry != &Context->List;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_EVTCHN_CHANNEL  Channel;
+            PCHAR                   Name;
+            ULONG_PTR               Offset;
+
+            Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+
+            ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+
+            ModuleLookup((ULONG_PTR)Channel->Caller, &Name, &Offset);
+
+            if (Name != NULL) {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- (%04x) BY %s + %p %s%s%s\n",
+                             Channel->LocalPort,
+                             Name,
+                             (PVOID)Offset,
+                             (Channel->Mask) ? "AUTO-MASK " : "",
+                             (Channel->Threaded) ? "THREADED " : "",
+                             (Channel->Active) ? "ACTIVE" : "");
+            } else {
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "- (%04x) BY %p %s%s%s\n",
+                             Channel->LocalPort,
+                             (PVOID)Channel->Caller,
+                             (Channel->Mask) ? "AUTO-MASK " : "",
+                             (Channel->Threaded) ? "THREADED " : "",
+                             (Channel->Active) ? "ACTIVE" : "");
+            }
+
+            switch (Channel->Type) {
+            case XENBUS_EVTCHN_TYPE_FIXED:
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "FIXED\n");
+                break;
+
+            case XENBUS_EVTCHN_TYPE_UNBOUND:
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "UNBOUND: RemoteDomain = %u\n",
+                             Channel->Parameters.Unbound.RemoteDomain);
+                break;
+
+            case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "INTER_DOMAIN: RemoteDomain = %u RemotePort = %u\n",
+                             Channel->Parameters.InterDomain.RemoteDomain,
+                             Channel->Parameters.InterDomain.RemotePort);
+                break;
+
+            case XENBUS_EVTCHN_TYPE_VIRQ:
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "VIRQ: Index = %u\n",
+                             Channel->Parameters.Virq.Index);
+                break;
+
+            default:
+                break;
+            }
 
-    status = EventChannelStatus(Channel->LocalPort, Status);
+            if (Channel->ModerationRate != 0)
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "MODERATION: Rate = %u Time = %u (EventRate = %u) %s\n",
+                             Channel->ModerationRate,
+                             Channel->ModerationTime,
+                             Channel->EventRate,
+                             (Channel->Polling) ? "POLLING" : "");
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "Delivered = %llu Spurious = %llu DoneSomething = %llu CallbackTime = %llu Masked = %llu Unmasked = %llu\n",
+                         Channel->Delivered,
+                         Channel->Spurious,
+                         Channel->DoneSomething,
+                         Channel->CallbackTime,
+                         Channel->Masked,
+                         Channel->Unmasked);
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "Sent = %lld Suppressed = %lld\n",
+                         Channel->Sent,
+                         Channel->Suppressed);
+
+            if (Channel->LatencySamples != 0)
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "LATENCY: Samples = %llu Mean = %llu Max = %llu\n",
+                             Channel->LatencySamples,
+                             Channel->LatencyTotal / Channel->LatencySamples,
+                             Channel->LatencyMax);
 
-done:
-    KeLowerIrql(Irql);
+            if (Context->Balance)
+                XENBUS_DEBUG(Printf,
+                             &Context->DebugInterface,
+                             "CPU %u:%u: Load = %llu%s\n",
+                             Channel->ProcNumber.Group,
+                             Channel->ProcNumber.Number,
+                             Channel->BalanceLoad,
+                             (Channel->BalanceHold != 0) ? " (HELD)" : "");
+        }
+    }
 
-    return status;
-}
+    if (!IsListEmpty(&Context->PoolList)) {
+        PLIST_ENTRY ListEntry;
 
-static
-_Function_class_(KSERVICE_ROUTINE)
-__drv_requiresIRQL(HIGH_LEVEL)
-BOOLEAN
-EvtchnInterruptCallback(
-    IN  PKINTERRUPT         InterruptObject,
-    IN  PVOID               Argument
-    )
-{
-    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
-    ULONG                   Index;
-    BOOLEAN                 DoneSomething;
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "POOLS: (Size = %u)\n",
+                     Context->PoolSize);
 
-    UNREFERENCED_PARAMETER(InterruptObject);
+        for (ListEntry = Context->PoolList.Flink;
+             ListEntry != &Context->PoolList;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_EVTCHN_POOL Pool;
 
-    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
-    Index = KeGetCurrentProcessorNumberEx(NULL);
+            Pool = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_POOL, ListEntry);
 
-    DoneSomething = FALSE;
-    while (XENBUS_SHARED_INFO(UpcallPending,
-                              &Context->SharedInfoInterface,
-                              Index))
-        DoneSomething |= EvtchnPoll(Context, Index, NULL);
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "- DOM%u: Count = %u Hits = %llu Misses = %llu\n",
+                         Pool->RemoteDomain,
+                         Pool->Count,
+                         Pool->Hits,
+                         Pool->Misses);
+        }
+    }
 
-    return DoneSomething;
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "REAP: Pending = %d Reaped = %lld Batches = %lld\n",
+                 Context->ReapPending,
+                 Context->Reaped,
+                 Context->ReapBatches);
 }
 
-VOID
-EvtchnReset(
-    VOID
+static NTSTATUS
+EvtchnQueryStatistics(
+    IN      PINTERFACE                  Interface,
+    IN      PVOID                       Owner OPTIONAL,
+    OUT     PXENBUS_EVTCHN_STATISTICS   Statistics OPTIONAL,
+    IN OUT  PULONG                      Count
     )
 {
-    ULONGLONG                   Value;
-    XENBUS_EVTCHN_CHANNEL       Store;
-    XENBUS_EVTCHN_CHANNEL       Console;
-    NTSTATUS                    status;
+    PXENBUS_EVTCHN_CONTEXT              Context = Interface->Context;
+    PXENBUS_EVTCHN_STATISTICS           Snapshot;
+    ULONG                               Capacity;
+    ULONG                               Total;
+    PCHAR                               OwnerName;
+    ULONG_PTR                           Offset;
+    KIRQL                               Irql;
+    PLIST_ENTRY                         ListEntry;
+    ULONG                               Index;
+    ULONG                               Matched;
+    NTSTATUS                            status;
+
+    OwnerName = NULL;
+    if (Owner != NULL)
+        ModuleLookup((ULONG_PTR)Owner, &OwnerName, &Offset);
 
     //
-    // When we reset the event channel ABI we will lose our
-    // binding to the any event channel which was set up
-    // by the toolstack during domain build.
-    // We need to get the binding back, so we must query the
-    // remote domain and port, and then re-bind after the
-    // reset.
+    // Copy the statistics of every channel under the lock, and only
+    // filter them by module (which means walking the module list for
+    // each one) once the lock has been dropped. If more channels have
+    // been opened than there is room for then go round again.
     //
+    Snapshot = NULL;
+    Capacity = 0;
 
-    RtlZeroMemory(&Store, sizeof (Store));
-    RtlZeroMemory(&Console, sizeof (Console));
+    for (;;) {
+        KeAcquireSpinLock(&Context->Lock, &Irql);
 
-    status = HvmGetParam(HVM_PARAM_STORE_EVTCHN, &Value);
-    if (NT_SUCCESS(status))
-        Store.LocalPort = (ULONG)Value;
+        Total = 0;
+        for (ListEntry = Context->List.Flink;
+             ListEntry != &Context->List;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_EVTCHN_CHANNEL  Channel;
 
-    status = HvmGetParam(HVM_PARAM_CONSOLE_EVTCHN, &Value);
-    if (NT_SUCCESS(status))
-        Console.LocalPort = (ULONG)Value;
+            Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-    if (Store.LocalPort != 0) {
-        domid_t         RemoteDomain;
-        evtchn_port_t   RemotePort;
+            ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
 
-        status = EventChannelQueryInterDomain(Store.LocalPort,
-                                              &RemoteDomain,
-                                              &RemotePort);
-        ASSERT(NT_SUCCESS(status));
+            if (Total < Capacity) {
+                PXENBUS_EVTCHN_STATISTICS   Entry = &Snapshot[Total];
+
+                Entry->Caller = Channel->Caller;
+                Entry->LocalPort = Channel->LocalPort;
+                Entry->Delivered = Channel->Delivered;
+                Entry->Spurious = Channel->Spurious;
+                Entry->DoneSomething = Channel->DoneSomething;
+                Entry->CallbackTime = Channel->CallbackTime;
+                Entry->Masked = Channel->Masked;
+                Entry->Unmasked = Channel->Unmasked;
+            }
 
-        Store.Parameters.InterDomain.RemoteDomain = RemoteDomain;
-        Store.Parameters.InterDomain.RemotePort = RemotePort;
+            Total++;
+        }
 
-        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: STORE (%u) -> (%u:%u)\n",
-                  Store.LocalPort,
-                  RemoteDomain,
-                  RemotePort);
-    }
+        KeReleaseSpinLock(&Context->Lock, Irql);
 
-    if (Console.LocalPort != 0) {
-        domid_t         RemoteDomain;
-        evtchn_port_t   RemotePort;
+        if (Total <= Capacity)
+            break;
 
-        status = EventChannelQueryInterDomain(Console.LocalPort,
-                                              &RemoteDomain,
-                                              &RemotePort);
-        ASSERT(NT_SUCCESS(status));
+        if (Snapshot != NULL)
+            __EvtchnFree(Snapshot);
 
-        Console.Parameters.InterDomain.RemoteDomain = RemoteDomain;
-        Console.Parameters.InterDomain.RemotePort = RemotePort;
+        Capacity = Total;
+        Snapshot = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_STATISTICS) * Capacity);
 
-        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: CONSOLE (%u) -> (%u:%u)\n",
-                  Console.LocalPort,
-                  RemoteDomain,
-                  RemotePort);
+        status = STATUS_NO_MEMORY;
+        if (Snapshot == NULL)
+            goto fail1;
     }
 
-    (VOID) EventChannelReset();
-    LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: RESET\n");
-
-    if (Store.LocalPort != 0) {
-        domid_t         RemoteDomain;
-        evtchn_port_t   RemotePort;
+    Matched = 0;
+    for (Index = 0; Index < Total; Index++) {
+        if (Owner != NULL) {
+            PCHAR   Name;
 
-        RemoteDomain = Store.Parameters.InterDomain.RemoteDomain;
-        RemotePort = Store.Parameters.InterDomain.RemotePort;
+            ModuleLookup((ULONG_PTR)Snapshot[Index].Caller, &Name, &Offset);
 
-        status = EventChannelBindInterDomain(RemoteDomain,
-                                             RemotePort,
-                                             &Store.LocalPort);
-        ASSERT(NT_SUCCESS(status));
+            //
+            // Module names are unique strings so they can be
+            // compared by address.
+            //
+            if (Name == NULL || Name != OwnerName)
+                continue;
+        }
 
-        status = HvmSetParam(HVM_PARAM_STORE_EVTCHN, Store.LocalPort);
-        ASSERT(NT_SUCCESS(status));
+        if (Statistics != NULL && Matched < *Count)
+            Statistics[Matched] = Snapshot[Index];
 
-        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: STORE (%u:%u) -> %u\n",
-                  RemoteDomain,
-                  RemotePort,
-                  Store.LocalPort);
+        Matched++;
     }
 
-    if (Console.LocalPort != 0) {
-        domid_t         RemoteDomain;
-        evtchn_port_t   RemotePort;
-
-        RemoteDomain = Console.Parameters.InterDomain.RemoteDomain;
-        RemotePort = Console.Parameters.InterDomain.RemotePort;
+    if (Snapshot != NULL)
+        __EvtchnFree(Snapshot);
 
-        status = EventChannelBindInterDomain(RemoteDomain,
-                                             RemotePort,
-                                             &Console.LocalPort);
-        ASSERT(NT_SUCCESS(status));
+    status = (Statistics == NULL || Matched > *Count) ?
+             STATUS_BUFFER_OVERFLOW :
+             STATUS_SUCCESS;
 
-        status = HvmSetParam(HVM_PARAM_CONSOLE_EVTCHN, Console.LocalPort);
-        ASSERT(NT_SUCCESS(status));
+    *Count = Matched;
 
-        LogPrintf(LOG_LEVEL_INFO, "EVTCHN_RESET: CONSOLE (%u:%u) -> %u\n",
-                  RemoteDomain,
-                  RemotePort,
-                  Console.LocalPort);
-    }
-}
+    return status;
 
+fail1:
+    Error("fail1 (%08x)\n", status);
 
+    return status;
+}
 
 static NTSTATUS
-EvtchnAbiAcquire(
-    IN  PXENBUS_EVTCHN_CONTEXT  Context
+EvtchnQueryLatency(
+    IN  PINTERFACE              Interface,
+    IN  ULONG                   Index,
+    OUT PXENBUS_EVTCHN_LATENCY  Latency
     )
 {
+    PXENBUS_EVTCHN_CONTEXT      Context = Interface->Context;
+    KIRQL                       Irql;
     NTSTATUS                    status;
 
-    if (Context->UseEvtchnFifoAbi) {
-        EvtchnFifoGetAbi(Context->EvtchnFifoContext,
-                         &Context->EvtchnAbi);
-
-        status = XENBUS_EVTCHN_ABI(Acquire,
-                                   &Context->EvtchnAbi);
-        if (!NT_SUCCESS(status))
-            goto use_two_level;
-
-        Info("FIFO\n");
-        goto done;
-    }
-
-use_two_level:
-    EvtchnTwoLevelGetAbi(Context->EvtchnTwoLevelContext,
-                         &Context->EvtchnAbi);
+    KeAcquireSpinLock(&Context->Lock, &Irql);
 
-    status = XENBUS_EVTCHN_ABI(Acquire,
-                               &Context->EvtchnAbi);
-    if (!NT_SUCCESS(status))
+    status = STATUS_INVALID_PARAMETER;
+    if (Index >= Context->ProcessorCount)
         goto fail1;
 
-    Info("TWO LEVEL\n");
+    // The histograms are updated without a lock so this is a snapshot
+    *Latency = Context->Processor[Index]->Latency;
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
 
-done:
     return STATUS_SUCCESS;
 
 fail1:
     Error("fail1 (%08x)\n", status);
 
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
     return status;
 }
 
-static VOID
-EvtchnAbiRelease(
-    IN  PXENBUS_EVTCHN_CONTEXT  Context
-    )
-{
-    XENBUS_EVTCHN_ABI(Release, &Context->EvtchnAbi);
+#define TIME_US(_us)        ((_us) * 10)
+#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
+#define TIME_S(_s)          (TIME_MS((_s) * 1000))
+#define TIME_RELATIVE(_t)   (-(_t))
 
-    RtlZeroMemory(&Context->EvtchnAbi, sizeof (XENBUS_EVTCHN_ABI));
-}
+#define XENBUS_EVTCHN_BALANCE_PERIOD    1
 
-static VOID
-EvtchnInterruptEnable(
-    IN  PXENBUS_EVTCHN_CONTEXT  Context
+// Ignore processors spending less than 1/20th of the period in callbacks
+#define XENBUS_EVTCHN_BALANCE_THRESHOLD 20
+
+// Only move a channel if the imbalance is at least 1/4 of the busiest load
+#define XENBUS_EVTCHN_BALANCE_MARGIN    4
+
+// Periods for which a channel must stay put once moved
+#define XENBUS_EVTCHN_BALANCE_HOLD      10
+
+static ULONG
+EvtchnBalanceTarget(
+    IN  PXENBUS_EVTCHN_CONTEXT  Context,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  ULONG                   Busiest
     )
 {
+    ULONG                       Target;
     ULONG                       Index;
-    ULONG                       Line;
-    NTSTATUS                    status;
 
-    Trace("====>\n");
+    Target = Context->ProcessorCount;
 
     for (Index = 0; Index < Context->ProcessorCount; Index++) {
         PXENBUS_EVTCHN_PROCESSOR    Processor;
-        unsigned int                vcpu_id;
-        UCHAR                       Vector;
         PROCESSOR_NUMBER            ProcNumber;
+        NTSTATUS                    status;
 
-        Processor = &Context->Processor[Index];
-
-        if (Processor->Interrupt == NULL)
+        if (Index == Busiest)
             continue;
 
-        vcpu_id = SystemVirtualCpuIndex(Index);
-        Vector = FdoGetInterruptVector(Context->Fdo, Processor->Interrupt);
-
-        status = HvmSetEvtchnUpcallVector(vcpu_id, Vector);
-        if (!NT_SUCCESS(status)) {
-            if (status != STATUS_NOT_IMPLEMENTED )
-                continue;
+        Processor = Context->Processor[Index];
 
-            Info("PER-CPU UPCALL NOT IMPLEMENTED\n");
-            break;
-        }
+        if (!Processor->UpcallEnabled)
+            continue;
 
         status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
         ASSERT(NT_SUCCESS(status));
 
-        Info("CPU %u:%u (Vector = %u)\n",
-             ProcNumber.Group,
-             ProcNumber.Number,
-             Vector);
-        Processor->UpcallEnabled = TRUE;
-    }
-
-    Line = FdoGetInterruptLine(Context->Fdo, Context->Interrupt);
-
-    status = HvmSetParam(HVM_PARAM_CALLBACK_IRQ, Line);
-    ASSERT(NT_SUCCESS(status));
+        if (!__EvtchnAffinityIncludes(&Channel->Affinity, &ProcNumber))
+            continue;
 
-    Info("CALLBACK VIA (Vector = %u)\n", Line);
+        if (Target == Context->ProcessorCount ||
+            Processor->BalanceLoad < Context->Processor[Target]->BalanceLoad)
+            Target = Index;
+    }
 
-    Trace("<====\n");
+    return Target;
 }
 
 static VOID
-EvtchnInterruptDisable(
+EvtchnBalance(
     IN  PXENBUS_EVTCHN_CONTEXT  Context
     )
 {
+    ULONGLONG                   TimeStamp;
+    ULONGLONG                   Period;
+    PLIST_ENTRY                 ListEntry;
     ULONG                       Index;
+    ULONG                       Busiest;
+    ULONGLONG                   Load;
+    PXENBUS_EVTCHN_CHANNEL      Candidate;
+    ULONG                       Target;
+    PROCESSOR_NUMBER            ProcNumber;
     NTSTATUS                    status;
 
-    UNREFERENCED_PARAMETER(Context);
+    TimeStamp = __rdtsc();
+    Period = TimeStamp - Context->BalanceTimeStamp;
+    Context->BalanceTimeStamp = TimeStamp;
 
-    Trace("====>\n");
+    for (Index = 0; Index < Context->ProcessorCount; Index++)
+        Context->Processor[Index]->BalanceLoad = 0;
 
-    status = HvmSetParam(HVM_PARAM_CALLBACK_IRQ, 0);
-    ASSERT(NT_SUCCESS(status));
+    for (ListEntry = Context->List.Flink;
+         ListEntry != &Context->List;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_EVTCHN_CHANNEL  Channel;
+        ULONGLONG               Time;
 
-    for (Index = 0; Index < Context->ProcessorCount; Index++) {
-        PXENBUS_EVTCHN_PROCESSOR    Processor;
-        unsigned int                vcpu_id;
+        Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-        Processor = &Context->Processor[Index];
+        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
 
-        if (!Processor->UpcallEnabled)
+        if (!Channel->Active)
             continue;
 
-        vcpu_id = SystemVirtualCpuIndex(Index);
+        // Smooth the load so that one busy period does not cause a move
+        Time = Channel->CallbackTime;
+        Channel->BalanceLoad = (Channel->BalanceLoad +
+                                (Time - Channel->BalanceTime)) / 2;
+        Channel->BalanceTime = Time;
 
-        (VOID) HvmSetEvtchnUpcallVector(vcpu_id, 0);
-        Processor->UpcallEnabled = FALSE;
+        if (Channel->BalanceHold != 0)
+            --Channel->BalanceHold;
+
+        Index = KeGetProcessorIndexFromNumber(&Channel->ProcNumber);
+        ASSERT3U(Index, <, Context->ProcessorCount);
+
+        Context->Processor[Index]->BalanceLoad += Channel->BalanceLoad;
     }
 
-    Trace("<====\n");
-}
+    Busiest = 0;
+    for (Index = 1; Index < Context->ProcessorCount; Index++) {
+        if (Context->Processor[Index]->BalanceLoad >
+            Context->Processor[Busiest]->BalanceLoad)
+            Busiest = Index;
+    }
 
-static VOID
-EvtchnSuspendCallbackEarly(
-    IN  PVOID               Argument
-    )
-{
-    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
-    PLIST_ENTRY             ListEntry;
+    Load = Context->Processor[Busiest]->BalanceLoad;
+    if (Load < Period / XENBUS_EVTCHN_BALANCE_THRESHOLD)
+        return;
+
+    Candidate = NULL;
+    Target = Context->ProcessorCount;
 
     for (ListEntry = Context->List.Flink;
          ListEntry != &Context->List;
          ListEntry = ListEntry->Flink) {
         PXENBUS_EVTCHN_CHANNEL  Channel;
-
-        ASSERT(ListEntry->Flink != NULL);
+        ULONG                   Idlest;
+        ULONGLONG               Imbalance;
 
         Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
 
-        ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+        if (!Channel->Active ||
+            Channel->BalanceHold != 0 ||
+            Channel->Type == XENBUS_EVTCHN_TYPE_VIRQ)
+            continue;
 
-        if (Channel->Active) {
-            ULONG       LocalPort = Channel->LocalPort;
-            NTSTATUS    status;
+        if (KeGetProcessorIndexFromNumber(&Channel->ProcNumber) != Busiest)
+            continue;
 
-            Channel->Active = FALSE;
+        if (Candidate != NULL &&
+            Channel->BalanceLoad <= Candidate->BalanceLoad)
+            continue;
 
-            status = HashTableRemove(Context->Table, LocalPort);
-            ASSERT(NT_SUCCESS(status));
-        }
-    }
-}
+        Idlest = EvtchnBalanceTarget(Context, Channel, Busiest);
+        if (Idlest == Context->ProcessorCount)
+            continue;
 
-static VOID
-EvtchnSuspendCallbackLate(
-    IN  PVOID               Argument
-    )
-{
-    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
-    NTSTATUS                status;
+        //
+        // The move must leave both processors less loaded than the
+        // busiest one is now, and the imbalance must be large enough
+        // that channels do not flap between processors.
+        //
+        Imbalance = Load - Context->Processor[Idlest]->BalanceLoad;
+        if (Imbalance < Load / XENBUS_EVTCHN_BALANCE_MARGIN)
+            continue;
 
-    EvtchnAbiRelease(Context);
+        if (Channel->BalanceLoad == 0 ||
+            Channel->BalanceLoad >= Imbalance)
+            continue;
 
-    status = EvtchnAbiAcquire(Context);
+        Candidate = Channel;
+        Target = Idlest;
+    }
+
+    if (Candidate == NULL)
+        return;
+
+    status = KeGetProcessorNumberFromIndex(Target, &ProcNumber);
     ASSERT(NT_SUCCESS(status));
 
-    EvtchnInterruptDisable(Context);
-    EvtchnInterruptEnable(Context);
+    // A channel that is busy being delivered is simply tried again later
+    status = EvtchnBindProcessor(Context,
+                                 Candidate,
+                                 ProcNumber.Group,
+                                 ProcNumber.Number);
+    if (NT_SUCCESS(status))
+        Candidate->BalanceHold = XENBUS_EVTCHN_BALANCE_HOLD;
 }
 
-static VOID
-EvtchnDebugCallback(
-    IN  PVOID               Argument,
-    IN  BOOLEAN             Crashing
+static NTSTATUS
+EvtchnBalancer(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
     )
 {
-    PXENBUS_EVTCHN_CONTEXT  Context = Argument;
-
-    UNREFERENCED_PARAMETER(Crashing);
+    PXENBUS_EVTCHN_CONTEXT  Context = _Context;
+    PKEVENT                 Event;
+    LARGE_INTEGER           Timeout;
 
-    if (!IsListEmpty(&Context->List)) {
-        PLIST_ENTRY ListEntry;
+    Trace("====>\n");
 
-        XENBUS_DEBUG(Printf,
-                     &Context->DebugInterface,
-                     "EVENT CHANNELS:\n");
+    Event = ThreadGetEvent(Self);
 
-        for (ListEntry = Context->List.Flink;
-             ListEntry != &Context->List;
-             ListEntry = ListEntry->Flink) {
-            PXENBUS_EVTCHN_CHANNEL  Channel;
-            PCHAR                   Name;
-            ULONG_PTR               Offset;
+    Timeout.QuadPart = TIME_RELATIVE(TIME_S(XENBUS_EVTCHN_BALANCE_PERIOD));
 
-            Channel = CONTAINING_RECORD(ListEntry, XENBUS_EVTCHN_CHANNEL, ListEntry);
+    for (;;) {
+        KIRQL   Irql;
 
-            ASSERT3U(Channel->Magic, ==, XENBUS_EVTCHN_CHANNEL_MAGIC);
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     &Timeout);
+        KeClearEvent(Event);
 
-            ModuleLookup((ULONG_PTR)Channel->Caller, &Name, &Offset);
+        if (ThreadIsAlerted(Self))
+            break;
 
-            if (Name != NULL) {
-                XENBUS_DEBUG(Printf,
-                             &Context->DebugInterface,
-                             "- (%04x) BY %s + %p %s%s\n",
-                             Channel->LocalPort,
-                             Name,
-                             (PVOID)Offset,
-                             (Channel->Mask) ? "AUTO-MASK " : "",
-                             (Channel->Active) ? "ACTIVE" : "");
-            } else {
-                XENBUS_DEBUG(Printf,
-                             &Context->DebugInterface,
-                             "- (%04x) BY %p %s%s\n",
-                             Channel->LocalPort,
-                             (PVOID)Channel->Caller,
-                             (Channel->Mask) ? "AUTO-MASK " : "",
-                             (Channel->Active) ? "ACTIVE" : "");
-            }
+        KeAcquireSpinLock(&Context->Lock, &Irql);
 
-            switch (Channel->Type) {
-            case XENBUS_EVTCHN_TYPE_FIXED:
-                XENBUS_DEBUG(Printf,
-                             &Context->DebugInterface,
-                             "FIXED\n");
-                break;
+        if (Context->References == 0)
+            goto loop;
 
-            case XENBUS_EVTCHN_TYPE_UNBOUND:
-                XENBUS_DEBUG(Printf,
-                             &Context->DebugInterface,
-                             "UNBOUND: RemoteDomain = %u\n",
-                             Channel->Parameters.Unbound.RemoteDomain);
-                break;
+        EvtchnBalance(Context);
 
-            case XENBUS_EVTCHN_TYPE_INTER_DOMAIN:
-                XENBUS_DEBUG(Printf,
-                             &Context->DebugInterface,
-                             "INTER_DOMAIN: RemoteDomain = %u RemotePort = %u\n",
-                             Channel->Parameters.InterDomain.RemoteDomain,
-                             Channel->Parameters.InterDomain.RemotePort);
-                break;
+loop:
+        KeReleaseSpinLock(&Context->Lock, Irql);
+    }
 
-            case XENBUS_EVTCHN_TYPE_VIRQ:
-                XENBUS_DEBUG(Printf,
-                             &Context->DebugInterface,
-                             "VIRQ: Index = %u\n",
-                             Channel->Parameters.Virq.Index);
-                break;
+    Trace("<====\n");
 
-            default:
-                break;
-            }
-        }
-    }
+    return STATUS_SUCCESS;
 }
 
 static NTSTATUS
@@ -1328,6 +4574,7 @@ EvtchnAcquire(
     PXENBUS_FDO             Fdo = Context->Fdo;
     KIRQL                   Irql;
     PROCESSOR_NUMBER        ProcNumber;
+    LARGE_INTEGER           Frequency;
     ULONG                   Index;
     NTSTATUS                status;
 
@@ -1395,12 +4642,24 @@ EvtchnAcquire(
     if (Context->Interrupt == NULL)
         goto fail8;
 
+    (VOID) KeQueryPerformanceCounter(&Frequency);
+    Context->PollTicks = (XENBUS_EVTCHN_POLL_TIME * Frequency.QuadPart) / 1000000;
+
+    //
+    // The per-processor state was allocated, node-locally, at
+    // initialization since pages cannot be allocated by node under the
+    // context lock. Processors may have been hot-added since then; they
+    // get no per-processor state, so no channel can be bound to them
+    // until the driver is next loaded.
+    //
     Context->ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
-    Context->Processor = __EvtchnAllocate(sizeof (XENBUS_EVTCHN_PROCESSOR) * Context->ProcessorCount);
+    if (Context->ProcessorCount > Context->ProcessorMaximum) {
+        Warning("%u processor(s) added since initialization: not used\n",
+                Context->ProcessorCount - Context->ProcessorMaximum);
+        Context->ProcessorCount = Context->ProcessorMaximum;
+    }
 
-    status = STATUS_NO_MEMORY;
-    if (Context->Processor == NULL)
-        goto fail9;
+    ASSERT3U(Context->ProcessorCount, <=, Context->ProcessorMaximum);
 
     for (Index = 0; Index < Context->ProcessorCount; Index++) {
         PXENBUS_EVTCHN_PROCESSOR    Processor;
@@ -1413,7 +4672,7 @@ EvtchnAcquire(
         status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
         ASSERT(NT_SUCCESS(status));
 
-        Processor = &Context->Processor[Index];
+        Processor = Context->Processor[Index];
 
         Processor->Interrupt = FdoAllocateInterrupt(Fdo,
                                                     Latched,
@@ -1427,6 +4686,11 @@ EvtchnAcquire(
 
         KeInitializeDpc(&Processor->Dpc, EvtchnDpc, Context);
         KeSetTargetProcessorDpcEx(&Processor->Dpc, &ProcNumber);
+
+        InitializeListHead(&Processor->ThreadedList);
+
+        KeInitializeThreadedDpc(&Processor->ThreadedDpc, EvtchnThreadedDpc, Context);
+        KeSetTargetProcessorDpcEx(&Processor->ThreadedDpc, &ProcNumber);
     }
 
     EvtchnInterruptEnable(Context);
@@ -1438,11 +4702,6 @@ done:
 
     return STATUS_SUCCESS;
 
-fail9:
-    Error("fail9\n");
-
-    Context->ProcessorCount = 0;
-
 fail8:
     Error("fail8\n");
 
@@ -1509,8 +4768,43 @@ EvtchnRelease(
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
 
-    if (--Context->References > 0)
+    if (Context->References > 1) {
+        --Context->References;
+        goto done;
+    }
+
+    //
+    // A threaded callback runs without any lock held, and may be
+    // preempted, so it cannot be waited for under the context lock.
+    // Stop the threaded DPCs from picking up any more channels and then
+    // wait for any callback that is already running to return.
+    //
+    Context->ThreadedStopped = TRUE;
+
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    KeFlushQueuedDpcs();
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    Context->ThreadedStopped = FALSE;
+
+    // Another reference may have been taken while the lock was dropped
+    if (Context->References > 1) {
+        for (Index = 0; Index < Context->ProcessorCount; Index++) {
+            PXENBUS_EVTCHN_PROCESSOR Processor = Context->Processor[Index];
+
+            if (Processor->Interrupt != NULL)
+                __EvtchnQueueThreadedDpc(Processor);
+        }
+
+        --Context->References;
         goto done;
+    }
+
+    --Context->References;
+    ASSERT3S(Context->References, ==, 0);
 
     Trace("====>\n");
 
@@ -1520,12 +4814,35 @@ EvtchnRelease(
         PXENBUS_EVTCHN_PROCESSOR Processor;
 
         ASSERT(Context->Processor != NULL);
-        Processor = &Context->Processor[Index];
+        Processor = Context->Processor[Index];
+
+        RtlZeroMemory(&Processor->Latency, sizeof (XENBUS_EVTCHN_LATENCY));
+        Processor->ThreadedDpcTimeStamp = 0;
+        Processor->DpcOrigin = 0;
+        Processor->DpcTimeStamp = 0;
+        Processor->UpcallTimeStamp = 0;
+
+        Processor->BalanceLoad = 0;
+        Processor->TimeExhausted = 0;
+        Processor->BudgetExhausted = 0;
+        Processor->Spurious = 0;
+        Processor->ThreadedDpcs = 0;
+        Processor->Dpcs = 0;
+        Processor->Upcalls = 0;
 
         if (Processor->Interrupt == NULL)
             continue;
 
+        (VOID) KeRemoveQueueDpc(&Processor->ThreadedDpc);
+        ASSERT3P(Processor->ThreadedChannel, ==, NULL);
+
+        EvtchnThreadedFlush(Context, Index);
+
         EvtchnFlush(Context, Index);
+        ASSERT3P(Processor->TriggerList, ==, NULL);
+
+        RtlZeroMemory(&Processor->ThreadedDpc, sizeof (KDPC));
+        RtlZeroMemory(&Processor->ThreadedList, sizeof (LIST_ENTRY));
 
         (VOID) KeRemoveQueueDpc(&Processor->Dpc);
         RtlZeroMemory(&Processor->Dpc, sizeof (KDPC));
@@ -1535,17 +4852,29 @@ EvtchnRelease(
         Processor->Interrupt = NULL;
     }
 
-    ASSERT(IsZeroMemory(Context->Processor, sizeof (XENBUS_EVTCHN_PROCESSOR) * Context->ProcessorCount));
-    __EvtchnFree(Context->Processor);
-    Context->Processor = NULL;
+    for (Index = 0; Index < Context->ProcessorCount; Index++)
+        ASSERT(IsZeroMemory(Context->Processor[Index],
+                            FIELD_OFFSET(XENBUS_EVTCHN_PROCESSOR, Mdl)));
+
     Context->ProcessorCount = 0;
+    Context->PollTicks = 0;
 
     FdoFreeInterrupt(Fdo, Context->Interrupt);
     Context->Interrupt = NULL;
 
+    EvtchnPoolFlush(Context);
+
+    RtlZeroMemory(Context->PoolRequest, sizeof (Context->PoolRequest));
+    Context->PoolRequests = 0;
+
+    // Don't leave ports for the reaper to close after the ABI has gone
+    EvtchnReapList(Context, &Context->ReapList);
+
     if (!IsListEmpty(&Context->List))
         BUG("OUTSTANDING EVENT CHANNELS");
 
+    Context->BalanceTimeStamp = 0;
+
     EvtchnAbiRelease(Context);
 
     XENBUS_SHARED_INFO(Release, &Context->SharedInfoInterface);
@@ -1640,6 +4969,36 @@ static struct _XENBUS_EVTCHN_INTERFACE_V5 EvtchnInterfaceVersion5 = {
     EvtchnStatus,
 };
 
+static struct _XENBUS_EVTCHN_INTERFACE_V6 EvtchnInterfaceVersion6 = {
+    { sizeof (struct _XENBUS_EVTCHN_INTERFACE_V6), 6, NULL, NULL, NULL },
+    EvtchnAcquire,
+    EvtchnRelease,
+    EvtchnOpen,
+    EvtchnBind,
+    EvtchnUnmask,
+    EvtchnSend,
+    EvtchnTrigger,
+    EvtchnGetPort,
+    EvtchnClose,
+    EvtchnStatus,
+    EvtchnSetPriority,
+    EvtchnSetModeration,
+    EvtchnSetAffinity,
+    EvtchnQueryStatistics,
+    EvtchnSetThreaded,
+    EvtchnQueryLatency,
+    EvtchnNotify,
+    EvtchnSendMultiple,
+    EvtchnReopen,
+    EvtchnGroupOpen,
+    EvtchnGroupChannel,
+    EvtchnGroupMask,
+    EvtchnGroupUnmask,
+    EvtchnGroupReopen,
+    EvtchnGroupClose,
+    EvtchnWait
+};
+
 NTSTATUS
 EvtchnInitialize(
     IN  PXENBUS_FDO             Fdo,
@@ -1648,6 +5007,10 @@ EvtchnInitialize(
 {
     HANDLE                      ParametersKey;
     ULONG                       UseEvtchnFifoAbi;
+    ULONG                       Balance;
+    ULONG                       LatencySampling;
+    ULONG                       PoolSize;
+    ULONG                       Index;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -1658,18 +5021,14 @@ EvtchnInitialize(
     if (*Context == NULL)
         goto fail1;
 
-    status = HashTableCreate(&(*Context)->Table);
-    if (!NT_SUCCESS(status))
-        goto fail2;
-
     status = EvtchnTwoLevelInitialize(Fdo,
                                       &(*Context)->EvtchnTwoLevelContext);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail2;
 
     status = EvtchnFifoInitialize(Fdo, &(*Context)->EvtchnFifoContext);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail3;
 
     ParametersKey = DriverGetParametersKey();
 
@@ -1681,6 +5040,30 @@ EvtchnInitialize(
 
     (*Context)->UseEvtchnFifoAbi = (UseEvtchnFifoAbi != 0) ? TRUE : FALSE;
 
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "EvtchnBalance",
+                                     &Balance);
+    if (!NT_SUCCESS(status))
+        Balance = 0;
+
+    (*Context)->Balance = (Balance != 0) ? TRUE : FALSE;
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "EvtchnLatencySampling",
+                                     &LatencySampling);
+    if (!NT_SUCCESS(status))
+        LatencySampling = 0;
+
+    (*Context)->LatencySampling = LatencySampling;
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "EvtchnUnboundPoolSize",
+                                     &PoolSize);
+    if (!NT_SUCCESS(status))
+        PoolSize = 0;
+
+    (*Context)->PoolSize = PoolSize;
+
     status = SuspendGetInterface(FdoGetSuspendContext(Fdo),
                                  XENBUS_SUSPEND_INTERFACE_VERSION_MAX,
                                  (PINTERFACE)&(*Context)->SuspendInterface,
@@ -1703,25 +5086,120 @@ EvtchnInitialize(
     ASSERT((*Context)->SharedInfoInterface.Interface.Context != NULL);
 
     InitializeListHead(&(*Context)->List);
+    InitializeListHead(&(*Context)->PoolList);
+    InitializeListHead(&(*Context)->ReapList);
     KeInitializeSpinLock(&(*Context)->Lock);
 
+    (*Context)->ProcessorMaximum = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Context)->Processor = __EvtchnAllocate(sizeof (PXENBUS_EVTCHN_PROCESSOR) *
+                                             (*Context)->ProcessorMaximum);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->Processor == NULL)
+        goto fail4;
+
+    for (Index = 0; Index < (*Context)->ProcessorMaximum; Index++) {
+        (*Context)->Processor[Index] = EvtchnAllocateProcessor(Index);
+
+        status = STATUS_NO_MEMORY;
+        if ((*Context)->Processor[Index] == NULL)
+            goto fail5;
+    }
+
+    if ((*Context)->Balance) {
+        status = ThreadCreate(EvtchnBalancer,
+                              *Context,
+                              &(*Context)->BalanceThread);
+        if (!NT_SUCCESS(status))
+            goto fail6;
+    }
+
+    if ((*Context)->PoolSize != 0) {
+        status = ThreadCreate(EvtchnPoolFiller,
+                              *Context,
+                              &(*Context)->PoolThread);
+        if (!NT_SUCCESS(status))
+            goto fail7;
+    }
+
+    status = ThreadCreate(EvtchnReaper,
+                          *Context,
+                          &(*Context)->ReapThread);
+    if (!NT_SUCCESS(status))
+        goto fail8;
+
     (*Context)->Fdo = Fdo;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail8:
+    Error("fail8\n");
+
+    if ((*Context)->PoolThread != NULL) {
+        ThreadAlert((*Context)->PoolThread);
+        ThreadJoin((*Context)->PoolThread);
+        (*Context)->PoolThread = NULL;
+    }
+
+fail7:
+    Error("fail7\n");
+
+    if ((*Context)->BalanceThread != NULL) {
+        ThreadAlert((*Context)->BalanceThread);
+        ThreadJoin((*Context)->BalanceThread);
+        (*Context)->BalanceThread = NULL;
+    }
+
+fail6:
+    Error("fail6\n");
+
+fail5:
+    Error("fail5\n");
+
+    while (Index != 0) {
+        --Index;
+
+        EvtchnFreeProcessor((*Context)->Processor[Index]);
+        (*Context)->Processor[Index] = NULL;
+    }
+
+    __EvtchnFree((*Context)->Processor);
+    (*Context)->Processor = NULL;
+
 fail4:
     Error("fail4\n");
 
-    EvtchnTwoLevelTeardown((*Context)->EvtchnTwoLevelContext);
-    (*Context)->EvtchnTwoLevelContext = NULL;
+    (*Context)->ProcessorMaximum = 0;
+
+    RtlZeroMemory(&(*Context)->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Context)->ReapList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Context)->PoolList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Context)->List, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&(*Context)->SharedInfoInterface,
+                  sizeof (XENBUS_SHARED_INFO_INTERFACE));
+
+    RtlZeroMemory(&(*Context)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    RtlZeroMemory(&(*Context)->SuspendInterface,
+                  sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    (*Context)->PoolSize = 0;
+    (*Context)->LatencySampling = 0;
+    (*Context)->Balance = FALSE;
+    (*Context)->UseEvtchnFifoAbi = FALSE;
+
+    EvtchnFifoTeardown((*Context)->EvtchnFifoContext);
+    (*Context)->EvtchnFifoContext = NULL;
 
 fail3:
     Error("fail3\n");
 
-    HashTableDestroy((*Context)->Table);
-    (*Context)->Table = NULL;
+    EvtchnTwoLevelTeardown((*Context)->EvtchnTwoLevelContext);
+    (*Context)->EvtchnTwoLevelContext = NULL;
 
 fail2:
     Error("fail2\n");
@@ -1833,6 +5311,23 @@ EvtchnGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 6: {
+        struct _XENBUS_EVTCHN_INTERFACE_V6  *EvtchnInterface;
+
+        EvtchnInterface = (struct _XENBUS_EVTCHN_INTERFACE_V6 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_EVTCHN_INTERFACE_V6))
+            break;
+
+        *EvtchnInterface = EvtchnInterfaceVersion6;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -1846,6 +5341,8 @@ EvtchnTeardown(
     IN  PXENBUS_EVTCHN_CONTEXT  Context
     )
 {
+    ULONG                       Index;
+
     Trace("====>\n");
 
     ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
@@ -1853,6 +5350,44 @@ EvtchnTeardown(
 
     Context->Fdo = NULL;
 
+    if (Context->BalanceThread != NULL) {
+        ThreadAlert(Context->BalanceThread);
+        ThreadJoin(Context->BalanceThread);
+        Context->BalanceThread = NULL;
+    }
+
+    if (Context->PoolThread != NULL) {
+        ThreadAlert(Context->PoolThread);
+        ThreadJoin(Context->PoolThread);
+        Context->PoolThread = NULL;
+    }
+
+    ThreadAlert(Context->ReapThread);
+    ThreadJoin(Context->ReapThread);
+    Context->ReapThread = NULL;
+
+    ASSERT(IsListEmpty(&Context->ReapList));
+    RtlZeroMemory(&Context->ReapList, sizeof (LIST_ENTRY));
+    ASSERT3S(Context->ReapPending, ==, 0);
+    Context->Reaped = 0;
+    Context->ReapBatches = 0;
+
+    Context->Balance = FALSE;
+    Context->LatencySampling = 0;
+    Context->PoolSize = 0;
+
+    for (Index = 0; Index < Context->ProcessorMaximum; Index++) {
+        EvtchnFreeProcessor(Context->Processor[Index]);
+        Context->Processor[Index] = NULL;
+    }
+
+    __EvtchnFree(Context->Processor);
+    Context->Processor = NULL;
+    Context->ProcessorMaximum = 0;
+
+    ASSERT(IsListEmpty(&Context->PoolList));
+    RtlZeroMemory(&Context->PoolList, sizeof (LIST_ENTRY));
+
     RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
 
@@ -1873,8 +5408,7 @@ EvtchnTeardown(
     EvtchnTwoLevelTeardown(Context->EvtchnTwoLevelContext);
     Context->EvtchnTwoLevelContext = NULL;
 
-    HashTableDestroy(Context->Table);
-    Context->Table = NULL;
+    EvtchnTableDestroy(Context);
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_EVTCHN_CONTEXT)));
     __EvtchnFree(Context);
@@ -76,6 +76,16 @@ EvtchnTwoLevelIsProcessorEnabled(
     return (SystemVirtualCpuIndex(Index) == 0) ? TRUE : FALSE;
 }
 
+static ULONG
+EvtchnTwoLevelGetPortCount(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT      _Context
+    )
+{
+    UNREFERENCED_PARAMETER(_Context);
+
+    return RTL_FIELD_SIZE(shared_info_t, evtchn_pending) * 8;
+}
+
 static BOOLEAN
 EvtchnTwoLevelPoll(
     IN  PXENBUS_EVTCHN_ABI_CONTEXT      _Context,
@@ -224,6 +234,7 @@ static XENBUS_EVTCHN_ABI EvtchnAbiTwoLevel = {
     EvtchnTwoLevelAcquire,
     EvtchnTwoLevelRelease,
     EvtchnTwoLevelIsProcessorEnabled,
+    EvtchnTwoLevelGetPortCount,
     EvtchnTwoLevelPoll,
     EvtchnTwoLevelPortEnable,
     EvtchnTwoLevelPortDisable,
@@ -53,6 +53,11 @@ typedef BOOLEAN
     IN  ULONG                       Index
     );
 
+typedef ULONG
+(*XENBUS_EVTCHN_ABI_GET_PORT_COUNT)(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context
+    );
+
 typedef BOOLEAN
 (*XENBUS_EVTCHN_ABI_EVENT)(
     IN  PVOID   Argument,
@@ -102,6 +107,7 @@ typedef struct _XENBUS_EVTCHN_ABI {
     XENBUS_EVTCHN_ABI_ACQUIRE               EvtchnAbiAcquire;
     XENBUS_EVTCHN_ABI_RELEASE               EvtchnAbiRelease;
     XENBUS_EVTCHN_ABI_IS_PROCESSOR_ENABLED  EvtchnAbiIsProcessorEnabled;
+    XENBUS_EVTCHN_ABI_GET_PORT_COUNT        EvtchnAbiGetPortCount;
     XENBUS_EVTCHN_ABI_POLL                  EvtchnAbiPoll;
     XENBUS_EVTCHN_ABI_PORT_ENABLE           EvtchnAbiPortEnable;
     XENBUS_EVTCHN_ABI_PORT_DISABLE          EvtchnAbiPortDisable;
@@ -41,18 +41,24 @@
 #include "assert.h"
 #include "util.h"
 
+#define EVENT_WORDS_PER_PAGE    (PAGE_SIZE / sizeof (event_word_t))
+#define EVENT_PAGES_MAX         (EVTCHN_FIFO_NR_CHANNELS / EVENT_WORDS_PER_PAGE)
+
+// The event array page tables are sized for the largest port space the
+// ABI allows, so they never need to be re-allocated and port lookups
+// can be done without taking the lock.
 typedef struct _XENBUS_EVTCHN_FIFO_CONTEXT {
     PXENBUS_FDO                     Fdo;
     KSPIN_LOCK                      Lock;
     LONG                            References;
     PMDL                            ControlBlockMdl[HVM_MAX_VCPUS];
-    PMDL                            *EventPageMdl;
+    evtchn_fifo_control_block_t     *ControlBlock[HVM_MAX_VCPUS];
+    PMDL                            EventPageMdl[EVENT_PAGES_MAX];
+    event_word_t                    *EventPage[EVENT_PAGES_MAX];
     ULONG                           EventPageCount;
     ULONG                           Head[HVM_MAX_VCPUS][EVTCHN_FIFO_MAX_QUEUES];
 } XENBUS_EVTCHN_FIFO_CONTEXT, *PXENBUS_EVTCHN_FIFO_CONTEXT;
 
-#define EVENT_WORDS_PER_PAGE    (PAGE_SIZE / sizeof (event_word_t))
-
 #define XENBUS_EVTCHN_FIFO_TAG  'OFIF'
 
 static FORCEINLINE PVOID
@@ -71,28 +77,18 @@ __EvtchnFifoFree(
     ExFreePoolWithTag(Buffer, XENBUS_EVTCHN_FIFO_TAG);
 }
 
-static event_word_t *
-EvtchnFifoEventWord(
+static FORCEINLINE event_word_t *
+__EvtchnFifoEventWord(
     IN  PXENBUS_EVTCHN_FIFO_CONTEXT Context,
     IN  ULONG                       Port
     )
 {
     ULONG                           Index;
-    PMDL                            Mdl;
-    event_word_t                    *EventWord;
 
     Index = Port / EVENT_WORDS_PER_PAGE;
     ASSERT3U(Index, <, Context->EventPageCount);
 
-    Mdl = Context->EventPageMdl[Index];
-
-    EventWord = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
-    ASSERT(EventWord != NULL);
-
-    ASSERT3U(Port, >=, Index * EVENT_WORDS_PER_PAGE);
-    Port -= Index * EVENT_WORDS_PER_PAGE;
-
-    return &EventWord[Port];
+    return &Context->EventPage[Index][Port % EVENT_WORDS_PER_PAGE];
 }
 
 static FORCEINLINE BOOLEAN
@@ -160,77 +156,56 @@ __EvtchnFifoUnlink(
 }
 
 static NTSTATUS
-EvtchnFifoExpand(
-    IN  PXENBUS_EVTCHN_FIFO_CONTEXT Context,
-    IN  ULONG                       Port
+EvtchnFifoAddEventPage(
+    IN  PXENBUS_EVTCHN_FIFO_CONTEXT Context
     )
 {
-    LONG                            Index;
-    ULONG                           EventPageCount;
-    PMDL                            *EventPageMdl;
+    ULONG                           Index;
     PMDL                            Mdl;
-    ULONG                           Start;
-    ULONG                           End;
+    event_word_t                    *EventWord;
+    ULONG                           Port;
+    PFN_NUMBER                      Pfn;
+    PHYSICAL_ADDRESS                Address;
     NTSTATUS                        status;
 
-    Index = Port / EVENT_WORDS_PER_PAGE;
-    ASSERT3U(Index, >=, (LONG)Context->EventPageCount);
-
-    EventPageCount = Index + 1;
-    EventPageMdl = __EvtchnFifoAllocate(sizeof (PMDL) * EventPageCount);
-
-    status = STATUS_NO_MEMORY;
-    if (EventPageMdl == NULL)
-        goto fail1;
-
-    for (Index = 0; Index < (LONG)Context->EventPageCount; Index++)
-        EventPageMdl[Index] = Context->EventPageMdl[Index];
-
     Index = Context->EventPageCount;
-    while (Index < (LONG)EventPageCount) {
-        event_word_t        *EventWord;
-        PFN_NUMBER          Pfn;
-        PHYSICAL_ADDRESS    Address;
-
-        Mdl = __AllocatePage();
 
-        status = STATUS_NO_MEMORY;
-        if (Mdl == NULL)
-            goto fail2;
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Index >= EVENT_PAGES_MAX)
+        goto fail1;
 
-        EventWord = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
-        ASSERT(EventWord != NULL);
+    Mdl = __AllocatePage();
 
-        for (Port = 0; Port < EVENT_WORDS_PER_PAGE; Port++)
-            __EvtchnFifoSetFlag(&EventWord[Port], EVTCHN_FIFO_MASKED);
+    status = STATUS_NO_MEMORY;
+    if (Mdl == NULL)
+        goto fail2;
 
-        Pfn = MmGetMdlPfnArray(Mdl)[0];
+    EventWord = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+    ASSERT(EventWord != NULL);
 
-        status = EventChannelExpandArray(Pfn);
-        if (!NT_SUCCESS(status))
-            goto fail3;
+    for (Port = 0; Port < EVENT_WORDS_PER_PAGE; Port++)
+        __EvtchnFifoSetFlag(&EventWord[Port], EVTCHN_FIFO_MASKED);
 
-        Address.QuadPart = (ULONGLONG)Pfn << PAGE_SHIFT;
+    Pfn = MmGetMdlPfnArray(Mdl)[0];
 
-        LogPrintf(LOG_LEVEL_INFO,
-                  "EVTCHN_FIFO: EVENTARRAY[%u] @ %08x.%08x\n",
-                  Index,
-                  Address.HighPart,
-                  Address.LowPart);
+    status = EventChannelExpandArray(Pfn);
+    if (!NT_SUCCESS(status))
+        goto fail3;
 
-        EventPageMdl[Index++] = Mdl;
-    }
+    Address.QuadPart = (ULONGLONG)Pfn << PAGE_SHIFT;
 
-    Start = Context->EventPageCount * EVENT_WORDS_PER_PAGE;
-    End = (EventPageCount * EVENT_WORDS_PER_PAGE) - 1;
+    LogPrintf(LOG_LEVEL_INFO,
+              "EVTCHN_FIFO: EVENTARRAY[%u] @ %08x.%08x\n",
+              Index,
+              Address.HighPart,
+              Address.LowPart);
 
-    Info("added ports [%08x - %08x]\n", Start, End);
+    Context->EventPageMdl[Index] = Mdl;
+    Context->EventPage[Index] = EventWord;
 
-    if (Context->EventPageMdl != NULL)
-        __EvtchnFifoFree(Context->EventPageMdl);
+    KeMemoryBarrier();
 
-    Context->EventPageMdl = EventPageMdl;
-    Context->EventPageCount = EventPageCount;
+    Context->EventPageCount = Index + 1;
 
     return STATUS_SUCCESS;
 
@@ -242,13 +217,54 @@ fail3:
 fail2:
     Error("fail2\n");
 
-    while (--Index >= (LONG)Context->EventPageCount) {
-        Mdl = EventPageMdl[Index];
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
 
-        __FreePage(Mdl);
+static NTSTATUS
+EvtchnFifoExpand(
+    IN  PXENBUS_EVTCHN_FIFO_CONTEXT Context,
+    IN  ULONG                       Port
+    )
+{
+    ULONG                           Index;
+    ULONG                           EventPageCount;
+    ULONG                           Start;
+    ULONG                           End;
+    NTSTATUS                        status;
+
+    Index = Port / EVENT_WORDS_PER_PAGE;
+    ASSERT3U(Index, >=, Context->EventPageCount);
+
+    //
+    // Grow the event array geometrically so that the number of
+    // expansions is logarithmic in the number of ports. Pages beyond
+    // the one covering Port are speculative: the hypervisor may refuse
+    // them if the domain's port limit is reached, which is only an
+    // error if Port itself is not covered.
+    //
+    EventPageCount = __max(Index + 1, Context->EventPageCount * 2);
+    EventPageCount = __min(EventPageCount, EVENT_PAGES_MAX);
+
+    Start = Context->EventPageCount * EVENT_WORDS_PER_PAGE;
+
+    status = STATUS_SUCCESS;
+    while (Context->EventPageCount < EventPageCount) {
+        status = EvtchnFifoAddEventPage(Context);
+        if (!NT_SUCCESS(status))
+            break;
     }
 
-    __EvtchnFifoFree(EventPageMdl);
+    if (Context->EventPageCount <= Index)
+        goto fail1;
+
+    End = (Context->EventPageCount * EVENT_WORDS_PER_PAGE) - 1;
+
+    Info("added ports [%08x - %08x]\n", Start, End);
+
+    return STATUS_SUCCESS;
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -269,12 +285,12 @@ EvtchnFifoContract(
 
         Mdl = Context->EventPageMdl[Index];
 
+        Context->EventPage[Index] = NULL;
+        Context->EventPageMdl[Index] = NULL;
+
         __FreePage(Mdl);
     }
 
-    __EvtchnFifoFree(Context->EventPageMdl);
-
-    Context->EventPageMdl = NULL;
     Context->EventPageCount = 0;
 }
 
@@ -290,6 +306,16 @@ EvtchnFifoIsProcessorEnabled(
     return (Context->ControlBlockMdl[vcpu_id] != NULL) ? TRUE : FALSE;
 }
 
+static ULONG
+EvtchnFifoGetPortCount(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  _Context
+    )
+{
+    UNREFERENCED_PARAMETER(_Context);
+
+    return EVTCHN_FIFO_NR_CHANNELS;
+}
+
 static BOOLEAN
 EvtchnFifoPollPriority(
     IN  PXENBUS_EVTCHN_FIFO_CONTEXT Context,
@@ -308,12 +334,9 @@ EvtchnFifoPollPriority(
     Head = Context->Head[vcpu_id][Priority];
 
     if (Head == 0) {
-        PMDL                        Mdl;
         evtchn_fifo_control_block_t *ControlBlock;
 
-        Mdl = Context->ControlBlockMdl[vcpu_id];
-
-        ControlBlock = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
+        ControlBlock = Context->ControlBlock[vcpu_id];
         ASSERT(ControlBlock != NULL);
 
         KeMemoryBarrier();
@@ -321,7 +344,7 @@ EvtchnFifoPollPriority(
     }
 
     Port = Head;
-    EventWord = EvtchnFifoEventWord(Context, Port);
+    EventWord = __EvtchnFifoEventWord(Context, Port);
 
     Head = __EvtchnFifoUnlink(EventWord);
 
@@ -349,24 +372,20 @@ EvtchnFifoPoll(
 {
     PXENBUS_EVTCHN_FIFO_CONTEXT     Context = (PVOID)_Context;
     unsigned int                    vcpu_id = SystemVirtualCpuIndex(Index);
-    PMDL                            Mdl;
     evtchn_fifo_control_block_t     *ControlBlock;
     ULONG                           Ready;
     ULONG                           Priority;
     BOOLEAN                         DoneSomething;
 
-    Mdl = Context->ControlBlockMdl[vcpu_id];
+    ControlBlock = Context->ControlBlock[vcpu_id];
 
     DoneSomething = FALSE;
-    if (Mdl == NULL)
+    if (ControlBlock == NULL)
         goto done;
 
-    ControlBlock = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
-    ASSERT(ControlBlock != NULL);
-
     Ready = InterlockedExchange((LONG *)&ControlBlock->ready, 0);
 
-    while (_BitScanReverse(&Priority, Ready)) {
+    while (_BitScanForward(&Priority, Ready)) {
         DoneSomething |= EvtchnFifoPollPriority(Context,
                                                 vcpu_id,
                                                 Priority,
@@ -420,7 +439,7 @@ EvtchnFifoPortAck(
     PXENBUS_EVTCHN_FIFO_CONTEXT     Context = (PVOID)_Context;
     event_word_t                    *EventWord;
 
-    EventWord = EvtchnFifoEventWord(Context, Port);
+    EventWord = __EvtchnFifoEventWord(Context, Port);
     __EvtchnFifoClearFlag(EventWord, EVTCHN_FIFO_PENDING);
 }
 
@@ -433,7 +452,7 @@ EvtchnFifoPortMask(
     PXENBUS_EVTCHN_FIFO_CONTEXT     Context = (PVOID)_Context;
     event_word_t                    *EventWord;
 
-    EventWord = EvtchnFifoEventWord(Context, Port);
+    EventWord = __EvtchnFifoEventWord(Context, Port);
     __EvtchnFifoSetFlag(EventWord, EVTCHN_FIFO_MASKED);
 }
 
@@ -448,7 +467,7 @@ EvtchnFifoPortUnmask(
     LONG                            Old;
     LONG                            New;
 
-    EventWord = EvtchnFifoEventWord(Context, Port);
+    EventWord = __EvtchnFifoEventWord(Context, Port);
 
     // Clear masked bit, spinning if busy
     do {
@@ -514,6 +533,10 @@ EvtchnFifoAcquire(
                   Address.HighPart,
                   Address.LowPart);
 
+        Context->ControlBlock[vcpu_id] = MmGetSystemAddressForMdlSafe(Mdl,
+                                                                      NormalPagePriority);
+        ASSERT(Context->ControlBlock[vcpu_id] != NULL);
+
         Context->ControlBlockMdl[vcpu_id] = Mdl;
 
         Index++;
@@ -541,6 +564,7 @@ fail1:
 
         Mdl = Context->ControlBlockMdl[vcpu_id];
         Context->ControlBlockMdl[vcpu_id] = NULL;
+        Context->ControlBlock[vcpu_id] = NULL;
 
         __FreePage(Mdl);
     }
@@ -581,6 +605,7 @@ EvtchnFifoRelease(
             continue;
 
         Context->ControlBlockMdl[vcpu_id] = NULL;
+        Context->ControlBlock[vcpu_id] = NULL;
 
         __FreePage(Mdl);
     }
@@ -596,6 +621,7 @@ static XENBUS_EVTCHN_ABI EvtchnAbiFifo = {
     EvtchnFifoAcquire,
     EvtchnFifoRelease,
     EvtchnFifoIsProcessorEnabled,
+    EvtchnFifoGetPortCount,
     EvtchnFifoPoll,
     EvtchnFifoPortEnable,
     EvtchnFifoPortDisable,
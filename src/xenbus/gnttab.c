@@ -37,17 +37,26 @@
 #include "gnttab.h"
 #include "fdo.h"
 #include "range_set.h"
+#include "hash_table.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
 
-#define XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT  32
+// The table is sized from the limit reported by Xen, up to a ceiling that
+// bounds the I/O space it can consume. If Xen cannot be asked, or the I/O
+// space cannot be found, then the old fixed size is used instead.
+#define XENBUS_GNTTAB_DEFAULT_FRAME_COUNT  32
+#define XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT  1024
 #define XENBUS_GNTTAB_ENTRY_PER_FRAME      (PAGE_SIZE / sizeof (grant_entry_v1_t))
 
 // Xen requires that we avoid the first 8 entries of the table and
 // we also reserve some more room for the crash kernel
 #define XENBUS_GNTTAB_RESERVED_ENTRY_COUNT 32
 
+// Relative timeout (in 100ns units) between revocation attempts
+#define XENBUS_GNTTAB_REVOKE_TIMEOUT    1000
+#define XENBUS_GNTTAB_REVOKE_ATTEMPTS   100
+
 #define XENBUS_GNTTAB_ENTRY_MAGIC 'DTNG'
 
 #define MAXNAMELEN  128
@@ -60,12 +69,22 @@ struct _XENBUS_GNTTAB_CACHE {
     VOID                    (*ReleaseLock)(PVOID);
     PVOID                   Argument;
     PXENBUS_CACHE           Cache;
+    ULONG                   PersistentSize;
+    ULONG                   PersistentCount;
+    PXENBUS_HASH_TABLE      PersistentTable;
+    LIST_ENTRY              PersistentList; // Idle entries, least recently used first
+    ULONGLONG               PersistentHits;
+    ULONGLONG               PersistentMisses;
+    ULONGLONG               PersistentEvictions;
 };
 
 struct _XENBUS_GNTTAB_ENTRY {
     ULONG               Magic;
     ULONG               Reference;
     grant_entry_v1_t    Entry;
+    BOOLEAN             Persistent;
+    ULONG               Users;      // Of a persistent entry
+    LIST_ENTRY          ListEntry;  // On PersistentList when there are no users
 };
 
 struct _XENBUS_GNTTAB_CONTEXT {
@@ -73,8 +92,12 @@ struct _XENBUS_GNTTAB_CONTEXT {
     KSPIN_LOCK                  Lock;
     LONG                        References;
     PHYSICAL_ADDRESS            Address;
+    ULONG                       FrameCount;
     LONG                        FrameIndex;
     grant_entry_v1_t            *Table;
+    LONG                        Used;
+    LONG                        Peak;
+    LONG                        Exhausted;
     XENBUS_RANGE_SET_INTERFACE  RangeSetInterface;
     PXENBUS_RANGE_SET           RangeSet;
     XENBUS_CACHE_INTERFACE      CacheInterface;
@@ -103,6 +126,33 @@ __GnttabFree(
     ExFreePoolWithTag(Buffer, XENBUS_GNTTAB_TAG);
 }
 
+static FORCEINLINE VOID
+__GnttabUsed(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  ULONG                   Count
+    )
+{
+    LONG                        Used;
+
+    Used = InterlockedAdd(&Context->Used, (LONG)Count);
+
+    // The high-water mark is only informational so a racy update is fine
+    if (Used > Context->Peak)
+        Context->Peak = Used;
+}
+
+static FORCEINLINE VOID
+__GnttabUnused(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  ULONG                   Count
+    )
+{
+    LONG                        Used;
+
+    Used = InterlockedAdd(&Context->Used, -(LONG)Count);
+    ASSERT3S(Used, >=, 0);
+}
+
 static NTSTATUS
 GnttabExpand(
     IN  PXENBUS_GNTTAB_CONTEXT  Context
@@ -117,9 +167,11 @@ GnttabExpand(
     Index = InterlockedIncrement(&Context->FrameIndex);
 
     status = STATUS_INSUFFICIENT_RESOURCES;
-    ASSERT3U(Index, <=, XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT);
-    if (Index == XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT)
+    ASSERT3U(Index, <=, Context->FrameCount);
+    if (Index == Context->FrameCount) {
+        (VOID) InterlockedIncrement(&Context->Exhausted);
         goto fail1;
+    }
 
     Address = Context->Address;
     Address.QuadPart += (ULONGLONG)Index << PAGE_SHIFT;
@@ -311,6 +363,208 @@ GnttabReleaseLock(
     Cache->ReleaseLock(Cache->Argument);
 }
 
+static BOOLEAN
+__GnttabClearPermit(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_ENTRY    Entry,
+    IN  ULONG                   Attempts
+    )
+{
+    volatile SHORT              *flags;
+    ULONG                       Attempt;
+
+    ASSERT3U(Entry->Magic, ==, XENBUS_GNTTAB_ENTRY_MAGIC);
+    ASSERT3U(Entry->Reference, >=, XENBUS_GNTTAB_RESERVED_ENTRY_COUNT);
+    ASSERT3U(Entry->Reference, <, (Context->FrameIndex + 1) * XENBUS_GNTTAB_ENTRY_PER_FRAME);
+
+    flags = (volatile SHORT *)&Context->Table[Entry->Reference].flags;
+
+    for (Attempt = 0; Attempt < Attempts; Attempt++) {
+        uint16_t        Old;
+        uint16_t        New;
+
+        if (Attempt != 0) {
+            LARGE_INTEGER   Timeout;
+
+            //
+            // The remote end still has the page mapped; there is no port
+            // to wait on so just block this vCPU briefly rather than
+            // spinning.
+            //
+            Timeout.QuadPart = XENBUS_GNTTAB_REVOKE_TIMEOUT;
+            (VOID) SchedPoll(NULL, 0, &Timeout);
+        }
+
+        Old = *flags;
+        Old &= ~(GTF_reading | GTF_writing);
+
+        New = Old & ~GTF_permit_access;
+
+        if (InterlockedCompareExchange16(flags, New, Old) == Old)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+//
+// A cache can be made persistent, in which case revoking an entry leaves
+// it granted and a later grant of the same page, to the same domain with
+// the same access, hands back the same reference. This is only of use
+// with backends that keep such grants mapped (feature-persistent) and it
+// is up to the frontend to make sure that the pages it grants this way
+// only ever hold data that the backend is allowed to see.
+//
+// Entries are registered in a hash table and, when they have no users,
+// kept on an LRU list from which they are evicted (really revoked) when
+// the cache reaches its size cap. All of this is protected by the cache
+// lock.
+//
+static FORCEINLINE ULONG_PTR
+__GnttabPersistentKey(
+    IN  USHORT      Domain,
+    IN  PFN_NUMBER  Pfn,
+    IN  BOOLEAN     ReadOnly
+    )
+{
+    ULONGLONG       Key;
+
+    // On 32-bit builds this is truncated, so a hit must always be checked
+    Key = ((ULONGLONG)Domain << 48) |
+          ((ULONGLONG)Pfn << 1) |
+          ((ReadOnly) ? 1 : 0);
+
+    return (ULONG_PTR)Key;
+}
+
+static FORCEINLINE BOOLEAN
+__GnttabPersistentMatch(
+    IN  PXENBUS_GNTTAB_ENTRY    Entry,
+    IN  USHORT                  Domain,
+    IN  PFN_NUMBER              Pfn,
+    IN  BOOLEAN                 ReadOnly
+    )
+{
+    return (Entry->Entry.domid == Domain &&
+            Entry->Entry.frame == Pfn &&
+            ((Entry->Entry.flags & GTF_readonly) != 0) == ReadOnly) ?
+           TRUE :
+           FALSE;
+}
+
+static BOOLEAN
+GnttabPersistentEvict(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  PXENBUS_GNTTAB_ENTRY    Entry,
+    IN  ULONG                   Attempts
+    )
+{
+    ULONG_PTR                   Key;
+
+    ASSERT(Entry->Persistent);
+    ASSERT3U(Entry->Users, ==, 0);
+
+    if (!__GnttabClearPermit(Context, Entry, Attempts))
+        return FALSE;
+
+    Key = __GnttabPersistentKey(Entry->Entry.domid,
+                                Entry->Entry.frame,
+                                (Entry->Entry.flags & GTF_readonly) ? TRUE : FALSE);
+
+    (VOID) HashTableRemove(Cache->PersistentTable, Key);
+
+    RemoveEntryList(&Entry->ListEntry);
+    RtlZeroMemory(&Entry->ListEntry, sizeof (LIST_ENTRY));
+
+    Entry->Persistent = FALSE;
+
+    --Cache->PersistentCount;
+    Cache->PersistentEvictions++;
+
+    RtlZeroMemory(&Context->Table[Entry->Reference],
+                  sizeof (grant_entry_v1_t));
+    RtlZeroMemory(&Entry->Entry,
+                  sizeof (grant_entry_v1_t));
+
+    __GnttabUnused(Context, 1);
+
+    XENBUS_CACHE(Put,
+                 &Context->CacheInterface,
+                 Cache->Cache,
+                 Entry,
+                 TRUE);
+
+    return TRUE;
+}
+
+// Evict idle entries, oldest first, until the cache is within its cap
+static VOID
+GnttabPersistentTrim(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  ULONG                   Attempts
+    )
+{
+    while (Cache->PersistentCount > Cache->PersistentSize &&
+           !IsListEmpty(&Cache->PersistentList)) {
+        PXENBUS_GNTTAB_ENTRY    Entry;
+
+        Entry = CONTAINING_RECORD(Cache->PersistentList.Flink,
+                                  XENBUS_GNTTAB_ENTRY,
+                                  ListEntry);
+
+        if (!GnttabPersistentEvict(Context, Cache, Entry, Attempts))
+            break;
+    }
+}
+
+// All entries must already have been revoked by their users
+static VOID
+GnttabPersistentFlush(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache
+    )
+{
+    Cache->AcquireLock(Cache->Argument);
+
+    Cache->PersistentSize = 0;
+
+    while (!IsListEmpty(&Cache->PersistentList)) {
+        PXENBUS_GNTTAB_ENTRY    Entry;
+        ULONG_PTR               Key;
+
+        Entry = CONTAINING_RECORD(Cache->PersistentList.Flink,
+                                  XENBUS_GNTTAB_ENTRY,
+                                  ListEntry);
+
+        if (GnttabPersistentEvict(Context,
+                                  Cache,
+                                  Entry,
+                                  XENBUS_GNTTAB_REVOKE_ATTEMPTS))
+            continue;
+
+        // As with any other failed revoke, the entry is leaked
+        Error("%08x: still in use\n", Entry->Reference);
+
+        Key = __GnttabPersistentKey(Entry->Entry.domid,
+                                    Entry->Entry.frame,
+                                    (Entry->Entry.flags & GTF_readonly) ? TRUE : FALSE);
+
+        (VOID) HashTableRemove(Cache->PersistentTable, Key);
+
+        RemoveEntryList(&Entry->ListEntry);
+        RtlZeroMemory(&Entry->ListEntry, sizeof (LIST_ENTRY));
+
+        Entry->Persistent = FALSE;
+        --Cache->PersistentCount;
+    }
+
+    ASSERT3U(Cache->PersistentCount, ==, 0);
+
+    Cache->ReleaseLock(Cache->Argument);
+}
+
 static NTSTATUS
 GnttabCreateCache(
     IN  PINTERFACE              Interface,
@@ -345,6 +599,8 @@ GnttabCreateCache(
     (*Cache)->ReleaseLock = ReleaseLock;
     (*Cache)->Argument = Argument;
 
+    InitializeListHead(&(*Cache)->PersistentList);
+
     status = XENBUS_CACHE(Create,
                           &Context->CacheInterface,
                           (*Cache)->Name,
@@ -368,6 +624,8 @@ GnttabCreateCache(
 fail3:
     Error("fail3\n");
 
+    RtlZeroMemory(&(*Cache)->PersistentList, sizeof (LIST_ENTRY));
+
     (*Cache)->Argument = NULL;
     (*Cache)->ReleaseLock = NULL;
     (*Cache)->AcquireLock = NULL;
@@ -403,6 +661,19 @@ GnttabDestroyCache(
 
     RtlZeroMemory(&Cache->ListEntry, sizeof (LIST_ENTRY));
 
+    if (Cache->PersistentTable != NULL) {
+        GnttabPersistentFlush(Context, Cache);
+
+        HashTableDestroy(Cache->PersistentTable);
+        Cache->PersistentTable = NULL;
+
+        Cache->PersistentEvictions = 0;
+        Cache->PersistentMisses = 0;
+        Cache->PersistentHits = 0;
+    }
+
+    RtlZeroMemory(&Cache->PersistentList, sizeof (LIST_ENTRY));
+
     XENBUS_CACHE(Destroy,
                  &Context->CacheInterface,
                  Cache->Cache);
@@ -421,8 +692,8 @@ GnttabDestroyCache(
 }
 
 static NTSTATUS
-GnttabPermitForeignAccess( 
-    IN  PINTERFACE              Interface,
+GnttabPermit(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
     IN  PXENBUS_GNTTAB_CACHE    Cache,
     IN  BOOLEAN                 Locked,
     IN  USHORT                  Domain,
@@ -431,7 +702,6 @@ GnttabPermitForeignAccess(
     OUT PXENBUS_GNTTAB_ENTRY    *Entry
     )
 {
-    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
     NTSTATUS                    status;
 
     *Entry = XENBUS_CACHE(Get,
@@ -455,6 +725,8 @@ GnttabPermitForeignAccess(
     Context->Table[(*Entry)->Reference].flags |= GTF_permit_access;
     KeMemoryBarrier();
 
+    __GnttabUsed(Context, 1);
+
     return STATUS_SUCCESS;
 
 fail1:
@@ -463,6 +735,194 @@ fail1:
     return status;
 }
 
+static NTSTATUS
+GnttabRevoke(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  BOOLEAN                 Locked,
+    IN  PXENBUS_GNTTAB_ENTRY    Entry
+    )
+{
+    NTSTATUS                    status;
+
+    status = STATUS_UNSUCCESSFUL;
+    if (!__GnttabClearPermit(Context, Entry, XENBUS_GNTTAB_REVOKE_ATTEMPTS))
+        goto fail1;
+
+    RtlZeroMemory(&Context->Table[Entry->Reference],
+                  sizeof (grant_entry_v1_t));
+    RtlZeroMemory(&Entry->Entry,
+                  sizeof (grant_entry_v1_t));
+
+    __GnttabUnused(Context, 1);
+
+    XENBUS_CACHE(Put,
+                 &Context->CacheInterface,
+                 Cache->Cache,
+                 Entry,
+                 Locked);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+GnttabPermitPersistent(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  BOOLEAN                 Locked,
+    IN  USHORT                  Domain,
+    IN  PFN_NUMBER              Pfn,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PXENBUS_GNTTAB_ENTRY    *Entry
+    )
+{
+    ULONG_PTR                   Key;
+    ULONG_PTR                   Value;
+    BOOLEAN                     Collision;
+    NTSTATUS                    status;
+
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    Key = __GnttabPersistentKey(Domain, Pfn, ReadOnly);
+
+    Collision = FALSE;
+    if (NT_SUCCESS(HashTableLookup(Cache->PersistentTable, Key, &Value))) {
+        *Entry = (PXENBUS_GNTTAB_ENTRY)Value;
+
+        if (__GnttabPersistentMatch(*Entry, Domain, Pfn, ReadOnly)) {
+            if ((*Entry)->Users++ == 0) {
+                RemoveEntryList(&(*Entry)->ListEntry);
+                RtlZeroMemory(&(*Entry)->ListEntry, sizeof (LIST_ENTRY));
+            }
+
+            Cache->PersistentHits++;
+            goto done;
+        }
+
+        Collision = TRUE;
+    }
+
+    Cache->PersistentMisses++;
+
+    status = GnttabPermit(Context,
+                          Cache,
+                          TRUE,
+                          Domain,
+                          Pfn,
+                          ReadOnly,
+                          Entry);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    if (Collision)
+        goto done;
+
+    // Make room, if an idle entry can be given up without waiting
+    if (Cache->PersistentCount >= Cache->PersistentSize &&
+        !IsListEmpty(&Cache->PersistentList))
+        (VOID) GnttabPersistentEvict(Context,
+                                     Cache,
+                                     CONTAINING_RECORD(Cache->PersistentList.Flink,
+                                                       XENBUS_GNTTAB_ENTRY,
+                                                       ListEntry),
+                                     1);
+
+    // If there is still no room then this is just an ordinary grant
+    if (Cache->PersistentCount >= Cache->PersistentSize)
+        goto done;
+
+    if (!NT_SUCCESS(HashTableAdd(Cache->PersistentTable,
+                                 Key,
+                                 (ULONG_PTR)*Entry)))
+        goto done;
+
+    (*Entry)->Persistent = TRUE;
+    (*Entry)->Users = 1;
+
+    Cache->PersistentCount++;
+
+done:
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return status;
+}
+
+static VOID
+GnttabRevokePersistent(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  BOOLEAN                 Locked,
+    IN  PXENBUS_GNTTAB_ENTRY    Entry
+    )
+{
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    ASSERT(Entry->Persistent);
+    ASSERT3U(Entry->Users, !=, 0);
+
+    // The entry stays granted; it just becomes the most recently used
+    if (--Entry->Users == 0) {
+        InsertTailList(&Cache->PersistentList, &Entry->ListEntry);
+
+        //
+        // The cap may have been lowered while the entry was in use. Don't
+        // wait for the backend to unmap it though; it will be evicted
+        // later if it can't be evicted now.
+        //
+        GnttabPersistentTrim(Context, Cache, 1);
+    }
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+}
+
+static NTSTATUS
+GnttabPermitForeignAccess(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  BOOLEAN                 Locked,
+    IN  USHORT                  Domain,
+    IN  PFN_NUMBER              Pfn,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PXENBUS_GNTTAB_ENTRY    *Entry
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
+
+    if (Cache->PersistentTable != NULL)
+        return GnttabPermitPersistent(Context,
+                                      Cache,
+                                      Locked,
+                                      Domain,
+                                      Pfn,
+                                      ReadOnly,
+                                      Entry);
+
+    return GnttabPermit(Context,
+                        Cache,
+                        Locked,
+                        Domain,
+                        Pfn,
+                        ReadOnly,
+                        Entry);
+}
+
 static NTSTATUS
 GnttabRevokeForeignAccess(
     IN  PINTERFACE              Interface,
@@ -472,47 +932,297 @@ GnttabRevokeForeignAccess(
     )
 {
     PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
-    volatile SHORT              *flags;
+
+    ASSERT3U(Entry->Magic, ==, XENBUS_GNTTAB_ENTRY_MAGIC);
+
+    if (Entry->Persistent) {
+        GnttabRevokePersistent(Context, Cache, Locked, Entry);
+        return STATUS_SUCCESS;
+    }
+
+    return GnttabRevoke(Context, Cache, Locked, Entry);
+}
+
+static NTSTATUS
+GnttabPermitForeignAccessMultiple(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  BOOLEAN                 Locked,
+    IN  USHORT                  Domain,
+    IN  PFN_NUMBER              Pfn[],
+    IN  ULONG                   Count,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PXENBUS_GNTTAB_ENTRY    Entry[]
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    if (Cache->PersistentTable != NULL)
+        goto persistent;
+
+    // Take the cache lock once for the whole array
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    for (Index = 0; Index < Count; Index++) {
+        Entry[Index] = XENBUS_CACHE(Get,
+                                    &Context->CacheInterface,
+                                    Cache->Cache,
+                                    TRUE);
+
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        if (Entry[Index] == NULL)
+            goto fail1;
+    }
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    //
+    // Write all the entry bodies, then make them all visible before any
+    // of them is marked as granted.
+    //
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_GNTTAB_ENTRY    Next = Entry[Index];
+
+        Next->Entry.flags = (ReadOnly) ? GTF_readonly : 0;
+        Next->Entry.domid = Domain;
+
+        Next->Entry.frame = (uint32_t)Pfn[Index];
+        ASSERT3U(Next->Entry.frame, ==, Pfn[Index]);
+
+        Context->Table[Next->Reference] = Next->Entry;
+    }
+
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Count; Index++)
+        Context->Table[Entry[Index]->Reference].flags |= GTF_permit_access;
+
+    KeMemoryBarrier();
+
+    __GnttabUsed(Context, Count);
+
+    return STATUS_SUCCESS;
+
+persistent:
+    // Each page has to be looked up individually
+    for (Index = 0; Index < Count; Index++) {
+        status = GnttabPermitPersistent(Context,
+                                        Cache,
+                                        Locked,
+                                        Domain,
+                                        Pfn[Index],
+                                        ReadOnly,
+                                        &Entry[Index]);
+        if (!NT_SUCCESS(status))
+            goto fail2;
+    }
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    while (Index != 0) {
+        --Index;
+
+        (VOID) GnttabRevokeForeignAccess(Interface,
+                                         Cache,
+                                         Locked,
+                                         Entry[Index]);
+        Entry[Index] = NULL;
+    }
+
+    return status;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    while (Index != 0) {
+        --Index;
+
+        XENBUS_CACHE(Put,
+                     &Context->CacheInterface,
+                     Cache->Cache,
+                     Entry[Index],
+                     TRUE);
+        Entry[Index] = NULL;
+    }
+
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    return status;
+}
+
+static NTSTATUS
+GnttabRevokeForeignAccessMultiple(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  BOOLEAN                 Locked,
+    IN  PXENBUS_GNTTAB_ENTRY    Entry[],
+    IN  ULONG                   Count
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
     ULONG                       Attempt;
+    ULONG                       Index;
+    ULONG                       Revoked;
     NTSTATUS                    status;
 
-    ASSERT3U(Entry->Magic, ==, XENBUS_GNTTAB_ENTRY_MAGIC);
-    ASSERT3U(Entry->Reference, >=, XENBUS_GNTTAB_RESERVED_ENTRY_COUNT);
-    ASSERT3U(Entry->Reference, <, (Context->FrameIndex + 1) * XENBUS_GNTTAB_ENTRY_PER_FRAME);
+    if (Cache->PersistentTable != NULL)
+        goto persistent;
+
+    //
+    // The reverse of GnttabPermitForeignAccessMultiple(): clear all the
+    // GTF_permit_access flags, then clear all the entry bodies. Any entry
+    // that the foreign domain won't let go of keeps its flag and, as with
+    // the single version, is not returned to the cache.
+    //
+    // Entries that are busy are retried together, so the whole batch
+    // shares a single budget of attempts rather than each entry waiting
+    // out its own.
+    //
+    Revoked = 0;
+    for (Attempt = 0; Attempt < XENBUS_GNTTAB_REVOKE_ATTEMPTS; Attempt++) {
+        BOOLEAN Busy;
+
+        if (Attempt != 0) {
+            LARGE_INTEGER   Timeout;
+
+            Timeout.QuadPart = XENBUS_GNTTAB_REVOKE_TIMEOUT;
+            (VOID) SchedPoll(NULL, 0, &Timeout);
+        }
 
-    flags = (volatile SHORT *)&Context->Table[Entry->Reference].flags;
+        Busy = FALSE;
+        for (Index = 0; Index < Count; Index++) {
+            PXENBUS_GNTTAB_ENTRY    Next = Entry[Index];
 
-    Attempt = 0;
-    while (Attempt++ < 100) {
-        uint16_t    Old;
-        uint16_t    New;
+            // Only go back to the entries that were busy last time round
+            if (Attempt != 0 &&
+                !(Context->Table[Next->Reference].flags & GTF_permit_access))
+                continue;
 
-        Old = *flags;
-        Old &= ~(GTF_reading | GTF_writing);
+            if (!__GnttabClearPermit(Context, Next, 1)) {
+                Busy = TRUE;
+                continue;
+            }
 
-        New = Old & ~GTF_permit_access;
+            Revoked++;
+        }
 
-        if (InterlockedCompareExchange16(flags, New, Old) == Old)
+        if (!Busy)
             break;
+    }
+
+    for (Index = 0; Index < Count && Revoked != Count; Index++) {
+        PXENBUS_GNTTAB_ENTRY    Next = Entry[Index];
+
+        if (Context->Table[Next->Reference].flags & GTF_permit_access)
+            Error("%08x: still in use\n", Next->Reference);
+    }
+
+    KeMemoryBarrier();
+
+    if (!Locked)
+        Cache->AcquireLock(Cache->Argument);
+
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_GNTTAB_ENTRY    Next = Entry[Index];
+
+        if (Context->Table[Next->Reference].flags & GTF_permit_access)
+            continue;
 
-        SchedYield();
+        RtlZeroMemory(&Context->Table[Next->Reference],
+                      sizeof (grant_entry_v1_t));
+        RtlZeroMemory(&Next->Entry,
+                      sizeof (grant_entry_v1_t));
+
+        XENBUS_CACHE(Put,
+                     &Context->CacheInterface,
+                     Cache->Cache,
+                     Next,
+                     TRUE);
     }
 
+    if (!Locked)
+        Cache->ReleaseLock(Cache->Argument);
+
+    __GnttabUnused(Context, Revoked);
+
+    goto done;
+
+persistent:
+    // Persistent entries are not really revoked, so there's nothing to batch
+    Revoked = 0;
+    for (Index = 0; Index < Count; Index++) {
+        status = GnttabRevokeForeignAccess(Interface,
+                                           Cache,
+                                           Locked,
+                                           Entry[Index]);
+        if (NT_SUCCESS(status))
+            Revoked++;
+    }
+
+done:
     status = STATUS_UNSUCCESSFUL;
-    if (Attempt == 100)
+    if (Revoked != Count)
         goto fail1;
 
-    RtlZeroMemory(&Context->Table[Entry->Reference],
-                  sizeof (grant_entry_v1_t));
-    RtlZeroMemory(&Entry->Entry,
-                  sizeof (grant_entry_v1_t));
+    return STATUS_SUCCESS;
 
-    XENBUS_CACHE(Put,
-                 &Context->CacheInterface,
-                 Cache->Cache,
-                 Entry,
-                 Locked);
+fail1:
+    Error("fail1 (%08x)\n", status);
 
+    return status;
+}
+
+static NTSTATUS
+GnttabSetPersistent(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_GNTTAB_CACHE    Cache,
+    IN  ULONG                   Size
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
+    NTSTATUS                    status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    //
+    // Once created, the table stays until the cache is destroyed so
+    // that entries granted persistently can still be found when they
+    // are revoked, even if the cap has since been set to zero.
+    //
+    if (Cache->PersistentTable == NULL) {
+        PXENBUS_HASH_TABLE  Table;
+
+        status = STATUS_SUCCESS;
+        if (Size == 0)
+            goto done;
+
+        status = HashTableCreate(&Table);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        Cache->AcquireLock(Cache->Argument);
+        Cache->PersistentTable = Table;
+        Cache->ReleaseLock(Cache->Argument);
+    }
+
+    Cache->AcquireLock(Cache->Argument);
+
+    Cache->PersistentSize = Size;
+    GnttabPersistentTrim(Context, Cache, XENBUS_GNTTAB_REVOKE_ATTEMPTS);
+
+    Cache->ReleaseLock(Cache->Argument);
+
+    Info("%s: %u\n", Cache->Name, Size);
+
+done:
     return STATUS_SUCCESS;
 
 fail1:
@@ -547,44 +1257,28 @@ GnttabMapForeignPages(
 {
     NTSTATUS                    status;
     PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
-    ULONG                       PageIndex;
-    PHYSICAL_ADDRESS            PageAddress;
-    BOOLEAN                     Leak = FALSE;
+    BOOLEAN                     Leak;
 
     status = FdoAllocateIoSpace(Context->Fdo, NumberPages * PAGE_SIZE, Address);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    PageAddress.QuadPart = Address->QuadPart;
-
-    for (PageIndex = 0; PageIndex < NumberPages; PageIndex++) {
-        status = GrantTableMapForeignPage(Domain,
-                                          References[PageIndex],
-                                          PageAddress,
-                                          ReadOnly,
-                                          &(Handles[PageIndex]));
-        if (!NT_SUCCESS(status))
-            goto fail2;
-
-        PageAddress.QuadPart += PAGE_SIZE;
-    }
+    status = GrantTableMapForeignPages(Domain,
+                                       NumberPages,
+                                       References,
+                                       *Address,
+                                       ReadOnly,
+                                       Handles,
+                                       &Leak);
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
     return STATUS_SUCCESS;
 
 fail2:
-    Error("fail2: PageIndex = %lu, PageAddress = %p, Handle = %lu\n", PageAddress.QuadPart, Handles[PageIndex]);
-
-    while (PageIndex > 0) {
-        --PageIndex;
-        PageAddress.QuadPart -= PAGE_SIZE;
-
-        if (!NT_SUCCESS(GrantTableUnmapForeignPage(Handles[PageIndex], PageAddress))) {
-            // can't reuse the memory since it's still mapped in a foreign domain
-            Error("failed to unmap handle %lu at %p, leaking the whole range\n", Handles[PageIndex], PageAddress.QuadPart);
-            Leak = TRUE;
-        }
-    }
+    Error("fail2\n");
 
+    // can't reuse the memory if it's still mapped in a foreign domain
     if (!Leak)
         FdoFreeIoSpace(Context->Fdo, *Address, NumberPages * PAGE_SIZE);
     else
@@ -605,26 +1299,19 @@ GnttabUnmapForeignPages(
 {
     NTSTATUS                    status;
     PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
-    ULONG                       PageIndex;
-    PHYSICAL_ADDRESS            PageAddress;
 
-    PageAddress.QuadPart = Address.QuadPart;
-
-    for (PageIndex = 0; PageIndex < NumberPages; PageIndex++) {
-        status = GrantTableUnmapForeignPage(Handles[PageIndex],
-                                            PageAddress);
-        if (!NT_SUCCESS(status))
-            goto fail1;
-
-        PageAddress.QuadPart += PAGE_SIZE;
-    }
+    status = GrantTableUnmapForeignPages(NumberPages,
+                                         Handles,
+                                         Address);
+    if (!NT_SUCCESS(status))
+        goto fail1;
 
     FdoFreeIoSpace(Context->Fdo, Address, NumberPages * PAGE_SIZE);
     return STATUS_SUCCESS;
 
 fail1:
-    Error("fail1: (%08x), leaking memory at %p, size 0x%lx. PageIndex = %lu, PageAddress = %p, Handle = %lu\n",
-          status, Address.QuadPart, NumberPages * PAGE_SIZE, PageIndex, PageAddress.QuadPart, Handles[PageIndex]);
+    Error("fail1: (%08x), leaking memory at %p, size 0x%lx\n",
+          status, Address.QuadPart, NumberPages * PAGE_SIZE);
     return status;
 }
 
@@ -656,8 +1343,41 @@ GnttabDebugCallback(
     
     XENBUS_DEBUG(Printf,
                  &Context->DebugInterface,
-                 "FrameIndex = %d\n",
-                 Context->FrameIndex);
+                 "FrameIndex = %d FrameCount = %u\n",
+                 Context->FrameIndex,
+                 Context->FrameCount);
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "Used = %d Peak = %d Exhausted = %d\n",
+                 Context->Used,
+                 Context->Peak,
+                 Context->Exhausted);
+
+    if (!IsListEmpty(&Context->List)) {
+        PLIST_ENTRY ListEntry;
+
+        for (ListEntry = Context->List.Flink;
+             ListEntry != &Context->List;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_GNTTAB_CACHE    Cache;
+
+            Cache = CONTAINING_RECORD(ListEntry, XENBUS_GNTTAB_CACHE, ListEntry);
+
+            if (Cache->PersistentTable == NULL)
+                continue;
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "- %s: PERSISTENT: Size = %u Count = %u Hits = %llu Misses = %llu Evictions = %llu\n",
+                         Cache->Name,
+                         Cache->PersistentSize,
+                         Cache->PersistentCount,
+                         Cache->PersistentHits,
+                         Cache->PersistentMisses,
+                         Cache->PersistentEvictions);
+        }
+    }
 }
                      
 NTSTATUS
@@ -669,6 +1389,7 @@ GnttabAcquire(
     PXENBUS_FDO             Fdo = Context->Fdo;
     KIRQL                   Irql;
     ULONG                   Size;
+    uint32_t                Maximum;
     NTSTATUS                status;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
@@ -678,14 +1399,36 @@ GnttabAcquire(
 
     Trace("====>\n");
 
-    Size = XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT * PAGE_SIZE;
+    status = GrantTableQuerySize(NULL, &Maximum);
+    if (!NT_SUCCESS(status))
+        Maximum = XENBUS_GNTTAB_DEFAULT_FRAME_COUNT;
+
+    Context->FrameCount = __min(__max(Maximum, 1),
+                                XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT);
+
+    Size = Context->FrameCount * PAGE_SIZE;
 
     status = FdoAllocateIoSpace(Fdo,
                                 Size,
                                 &Context->Address);
+    if (!NT_SUCCESS(status) &&
+        Context->FrameCount > XENBUS_GNTTAB_DEFAULT_FRAME_COUNT) {
+        Warning("no room for %u frames\n", Context->FrameCount);
+
+        Context->FrameCount = XENBUS_GNTTAB_DEFAULT_FRAME_COUNT;
+        Size = Context->FrameCount * PAGE_SIZE;
+
+        status = FdoAllocateIoSpace(Fdo,
+                                    Size,
+                                    &Context->Address);
+    }
     if (!NT_SUCCESS(status))
         goto fail1;
 
+    Info("%u frames (%u entries)\n",
+         Context->FrameCount,
+         Context->FrameCount * (ULONG)XENBUS_GNTTAB_ENTRY_PER_FRAME);
+
     Context->Table = (grant_entry_v1_t *)MmMapIoSpace(Context->Address,
                                                       Size,
                                                       MmCached);
@@ -801,6 +1544,8 @@ fail2:
 fail1:
     Error("fail1 (%08x)\n", status);
 
+    Context->FrameCount = 0;
+
     --Context->References;
     ASSERT3U(Context->References, ==, 0);
     KeReleaseSpinLock(&Context->Lock, Irql);
@@ -856,7 +1601,7 @@ GnttabRelease(
 
     XENBUS_RANGE_SET(Release, &Context->RangeSetInterface);
 
-    Size = XENBUS_GNTTAB_MAXIMUM_FRAME_COUNT * PAGE_SIZE;
+    Size = Context->FrameCount * PAGE_SIZE;
 
     MmUnmapIoSpace(Context->Table, Size);
     Context->Table = NULL;
@@ -866,6 +1611,11 @@ GnttabRelease(
                    Size);
     Context->Address.QuadPart = 0;
 
+    ASSERT3S(Context->Used, ==, 0);
+    Context->Peak = 0;
+    Context->Exhausted = 0;
+    Context->FrameCount = 0;
+
     Trace("<====\n");
 
 done:
@@ -896,6 +1646,22 @@ static struct _XENBUS_GNTTAB_INTERFACE_V2   GnttabInterfaceVersion2 = {
     GnttabUnmapForeignPages
 };
 
+static struct _XENBUS_GNTTAB_INTERFACE_V3   GnttabInterfaceVersion3 = {
+    { sizeof(struct _XENBUS_GNTTAB_INTERFACE_V3), 3, NULL, NULL, NULL },
+    GnttabAcquire,
+    GnttabRelease,
+    GnttabCreateCache,
+    GnttabPermitForeignAccess,
+    GnttabRevokeForeignAccess,
+    GnttabGetReference,
+    GnttabDestroyCache,
+    GnttabMapForeignPages,
+    GnttabUnmapForeignPages,
+    GnttabPermitForeignAccessMultiple,
+    GnttabRevokeForeignAccessMultiple,
+    GnttabSetPersistent
+};
+
 NTSTATUS
 GnttabInitialize(
     IN  PXENBUS_FDO             Fdo,
@@ -1002,6 +1768,23 @@ GnttabGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 3: {
+        struct _XENBUS_GNTTAB_INTERFACE_V3  *GnttabInterface;
+
+        GnttabInterface = (struct _XENBUS_GNTTAB_INTERFACE_V3 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof(struct _XENBUS_GNTTAB_INTERFACE_V3))
+            break;
+
+        *GnttabInterface = GnttabInterfaceVersion3;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -90,7 +90,7 @@ HashTableHash(
 
         Accumulator = (Accumulator << 4) + Array[Index];
 
-        Overflow = Accumulator & 0x00000f00;
+        Overflow = Accumulator & 0xFFFFFF00;
         if (Overflow != 0) {
             Accumulator ^= Overflow >> 8;
             Accumulator ^= Overflow;
@@ -255,6 +255,8 @@ HashTableRemove(
 
         if (Node->Key == Key)
             goto found;
+
+        ListEntry = ListEntry->Flink;
     }
 
     HashTableBucketUnlock(Bucket, TRUE, Irql);
@@ -288,7 +290,6 @@ HashTableLookup(
     PLIST_ENTRY                 ListEntry;
     PXENBUS_HASH_TABLE_NODE     Node;
     KIRQL                       Irql;
-    NTSTATUS                    status;
 
     Bucket = &Table->Bucket[HashTableHash(Key)];
     
@@ -300,12 +301,14 @@ HashTableLookup(
 
         if (Node->Key == Key)
             goto found;
+
+        ListEntry = ListEntry->Flink;
     }
 
     HashTableBucketUnlock(Bucket, FALSE, Irql);
 
-    status = STATUS_OBJECT_NAME_NOT_FOUND;
-    goto fail1;
+    // Not finding a key is not an error
+    return STATUS_OBJECT_NAME_NOT_FOUND;
 
 found:
     *Value = Node->Value;
@@ -313,11 +316,6 @@ found:
     HashTableBucketUnlock(Bucket, FALSE, Irql);
 
     return STATUS_SUCCESS;
-
-fail1:
-    Error("fail1 (%08x)\n", status);
-
-    return status;
 }
 
 NTSTATUS
@@ -132,6 +132,21 @@ SharedInfoTestBit(
     return (*Mask & ((ULONG_PTR)1 << Bit)) ? TRUE : FALSE;    // return TRUE if the bit is set
 }
 
+static FORCEINLINE BOOLEAN
+__SharedInfoScanBit(
+    IN  ULONG_PTR   Mask,
+    OUT PULONG      Bit
+    )
+{
+#if defined(__i386__)
+    return (_BitScanForward(Bit, Mask) != 0) ? TRUE : FALSE;
+#elif defined(__x86_64__)
+    return (_BitScanForward64(Bit, Mask) != 0) ? TRUE : FALSE;
+#else
+#error 'Unrecognised architecture'
+#endif
+}
+
 static VOID
 SharedInfoEvtchnMaskAll(
     IN  PXENBUS_SHARED_INFO_CONTEXT Context
@@ -197,34 +212,50 @@ SharedInfoEvtchnPoll(
     Port = Context->Port;
 
     while (SelectorMask != 0) {
-        ULONG   SelectorBit;
-        ULONG   PortBit;
-
+        ULONG       SelectorBit;
+        ULONG       PortBit;
+        ULONG       Bit;
+        ULONG_PTR   Mask;
+        ULONG_PTR   PortMask;
 
         SelectorBit = Port / XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
         PortBit = Port % XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
 
-        if (SharedInfoTestBit(&SelectorMask, SelectorBit)) {
-            ULONG_PTR   PortMask;
-
-            PortMask = Shared->evtchn_pending[SelectorBit];
-            PortMask &= ~Shared->evtchn_mask[SelectorBit];
+        //
+        // Find the first pending selector at or after the current one,
+        // wrapping round if there is none, so that selectors are
+        // serviced round-robin.
+        //
+        Mask = SelectorMask & ~(((ULONG_PTR)1 << SelectorBit) - 1);
+        if (Mask == 0)
+            Mask = SelectorMask;
+
+        (VOID) __SharedInfoScanBit(Mask, &Bit);
+        if (Bit != SelectorBit) {
+            SelectorBit = Bit;
+            PortBit = 0;
+        }
 
-            while (PortMask != 0 && PortBit < XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) {
-                if (SharedInfoTestBit(&PortMask, PortBit)) {
-                    DoneSomething |= Event(Argument, (SelectorBit * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) + PortBit);
+        PortMask = Shared->evtchn_pending[SelectorBit];
+        PortMask &= ~Shared->evtchn_mask[SelectorBit];
 
-                    PortMask &= ~((ULONG_PTR)1 << PortBit);
-                }
+        //
+        // Service the ports at or above the current one. Any below it
+        // are picked up when the selector is next visited.
+        //
+        Mask = PortMask & ~(((ULONG_PTR)1 << PortBit) - 1);
+        PortMask &= ~Mask;
 
-                PortBit++;
-            }
+        while (__SharedInfoScanBit(Mask, &PortBit)) {
+            Mask &= ~((ULONG_PTR)1 << PortBit);
 
-            // Are we done with this selector?
-            if (PortMask == 0)
-                SelectorMask &= ~((ULONG_PTR)1 << SelectorBit);
+            DoneSomething |= Event(Argument, (SelectorBit * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR) + PortBit);
         }
 
+        // Are we done with this selector?
+        if (PortMask == 0)
+            SelectorMask &= ~((ULONG_PTR)1 << SelectorBit);
+
         Port = (SelectorBit + 1) * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR;
 
         if (Port >= XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT * XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR)
@@ -38,6 +38,7 @@
 #include "store.h"
 #include "evtchn.h"
 #include "fdo.h"
+#include "registry.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -48,6 +49,14 @@ RtlRandomEx (
     __inout PULONG Seed
     );
 
+extern USHORT
+RtlCaptureStackBackTrace(
+    __in        ULONG   FramesToSkip,
+    __in        ULONG   FramesToCapture,
+    __out       PVOID   *BackTrace,
+    __out_opt   PULONG  BackTraceHash
+    );
+
 #define STORE_TRANSACTION_MAGIC 'NART'
 
 struct _XENBUS_STORE_TRANSACTION {
@@ -99,12 +108,14 @@ typedef struct _XENBUS_STORE_RESPONSE {
 
 #define XENBUS_STORE_REQUEST_SEGMENT_COUNT  8
 
+// Relative timeout (in 100ns units) for waiting on the store channel
+#define XENBUS_STORE_POLL_TIMEOUT   1000
+
 typedef struct _XENBUS_STORE_REQUEST {
     volatile XENBUS_STORE_REQUEST_STATE State;
     struct xsd_sockmsg                  Header;
     XENBUS_STORE_SEGMENT                Segment[XENBUS_STORE_REQUEST_SEGMENT_COUNT];
     ULONG                               Count;
-    ULONG                               Index;
     LIST_ENTRY                          ListEntry;
     PXENBUS_STORE_RESPONSE              Response;
 } XENBUS_STORE_REQUEST, *PXENBUS_STORE_REQUEST;
@@ -118,13 +129,33 @@ typedef struct _XENBUS_STORE_BUFFER {
     CHAR        Data[1];
 } XENBUS_STORE_BUFFER, *PXENBUS_STORE_BUFFER;
 
+#define XENBUS_STORE_CAPTURE_COUNT  256
+
+typedef struct _XENBUS_STORE_CAPTURE {
+    XENBUS_STORE_CAPTURE_RECORD Record;
+    CHAR                        Data[XENBUS_STORE_CAPTURE_PAYLOAD_MAX];
+} XENBUS_STORE_CAPTURE, *PXENBUS_STORE_CAPTURE;
+
+// Lock ordering: Lock -> SendLock -> ReceiveLock
+//
+// Lock protects the reference count, transactions and buffers.
+// Submitters queue requests without taking any lock; SendLock protects
+// the request side of the ring and ReceiveLock protects the response
+// side of the ring along with the pending requests and watches.
 struct _XENBUS_STORE_CONTEXT {
     PXENBUS_FDO                         Fdo;
     KSPIN_LOCK                          Lock;
     LONG                                References;
     struct xenstore_domain_interface    *Shared;
+    BOOLEAN                             Enabled;
     USHORT                              RequestId;
+    PLIST_ENTRY                         SubmittedQueue;
+    KSPIN_LOCK                          SendLock;
     LIST_ENTRY                          SubmittedList;
+    XENBUS_STORE_SEGMENT                SendSegment[XENBUS_STORE_REQUEST_SEGMENT_COUNT];
+    ULONG                               SendCount;
+    ULONG                               SendIndex;
+    KSPIN_LOCK                          ReceiveLock;
     LIST_ENTRY                          PendingList;
     LIST_ENTRY                          TransactionList;
     USHORT                              WatchId;
@@ -140,9 +171,13 @@ struct _XENBUS_STORE_CONTEXT {
     PXENBUS_SUSPEND_CALLBACK            SuspendCallbackEarly;
     PXENBUS_SUSPEND_CALLBACK            SuspendCallbackLate;
     PXENBUS_DEBUG_CALLBACK              DebugCallback;
+    KSPIN_LOCK                          CaptureLock;
+    PXENBUS_STORE_CAPTURE               Capture;
+    ULONG                               CaptureIndex;
 };
 
 C_ASSERT(sizeof (struct xenstore_domain_interface) <= PAGE_SIZE);
+C_ASSERT(XENBUS_STORE_CAPTURE_PAYLOAD_MAX <= MAXUCHAR);
 
 #define XENBUS_STORE_TAG    'ROTS'
 
@@ -172,7 +207,6 @@ StorePrepareRequest(
     )
 {
     ULONG                           Id;
-    KIRQL                           Irql;
     PXENBUS_STORE_SEGMENT           Segment;
     va_list                         Arguments;
     NTSTATUS                        status;
@@ -193,9 +227,7 @@ StorePrepareRequest(
     Request->Header.tx_id = Id;
     Request->Header.len = 0;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    Request->Header.req_id = Context->RequestId++;
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    Request->Header.req_id = (USHORT)InterlockedIncrement16((SHORT *)&Context->RequestId);
 
     Request->Count = 0;
     Segment = &Request->Segment[Request->Count++];
@@ -248,7 +280,6 @@ StorePrepareRequestFixed(
     )
 {
     ULONG                           Id;
-    KIRQL                           Irql;
     NTSTATUS                        status;
     ULONG                           Index;
 
@@ -272,9 +303,7 @@ StorePrepareRequestFixed(
     Request->Header.tx_id = Id;
     Request->Header.len = 0;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
-    Request->Header.req_id = Context->RequestId++;
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    Request->Header.req_id = (USHORT)InterlockedIncrement16((SHORT *)&Context->RequestId);
 
     // header is the first, then the actual data
     Request->Count = NumberSegments + 1;
@@ -377,46 +406,89 @@ StoreSendSegment(
     return (Segment->Offset == Segment->Length) ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
 }
 
+static VOID
+StoreSwizzle(
+    IN  PXENBUS_STORE_CONTEXT   Context
+    )
+{
+    PLIST_ENTRY                 List;
+    PLIST_ENTRY                 Tail;
+
+    List = InterlockedExchangePointer(&Context->SubmittedQueue, NULL);
+
+    // Not really a doubly-linked list; it's actually a singly-linked
+    // list via the Flink field, most recently submitted request first.
+    // Inserting each entry directly after the current tail of the
+    // SubmittedList therefore restores submission order.
+    Tail = Context->SubmittedList.Blink;
+
+    while (List != NULL) {
+        PLIST_ENTRY Next;
+
+        Next = List->Flink;
+        List->Flink = NULL;
+        ASSERT3P(List->Blink, ==, NULL);
+
+        InsertHeadList(Tail, List);
+
+        List = Next;
+    }
+}
+
 static VOID
 StoreSendRequests(
     IN      PXENBUS_STORE_CONTEXT   Context,
     IN OUT  PULONG                  Written
     )
 {
-    if (IsListEmpty(&Context->SubmittedList))
-        return;
+    StoreSwizzle(Context);
+
+    for (;;) {
+        if (Context->SendIndex == Context->SendCount) {
+            PLIST_ENTRY             ListEntry;
+            PXENBUS_STORE_REQUEST   Request;
 
-    while (!IsListEmpty(&Context->SubmittedList)) {
-        PLIST_ENTRY             ListEntry;
-        PXENBUS_STORE_REQUEST   Request;
+            if (IsListEmpty(&Context->SubmittedList))
+                break;
 
-        ListEntry = Context->SubmittedList.Flink;
-        ASSERT3P(ListEntry, !=, &Context->SubmittedList);
+            ListEntry = RemoveHeadList(&Context->SubmittedList);
+            ASSERT3P(ListEntry, !=, &Context->SubmittedList);
 
-        Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+            Request = CONTAINING_RECORD(ListEntry, XENBUS_STORE_REQUEST, ListEntry);
+
+            ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_SUBMITTED);
 
-        ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_SUBMITTED);
+            // As soon as the last byte of the request hits the ring the
+            // response may be processed on another CPU, and the request
+            // completed and discarded by its submitter. Hence the request
+            // must be pending before anything is written and the sender
+            // must work from its own copy of the segments.
+            RtlCopyMemory(Context->SendSegment,
+                          Request->Segment,
+                          sizeof (XENBUS_STORE_SEGMENT) * Request->Count);
+            Context->SendCount = Request->Count;
+            Context->SendIndex = 0;
+
+            KeAcquireSpinLockAtDpcLevel(&Context->ReceiveLock);
+            Request->State = XENBUS_STORE_REQUEST_PENDING;
+            InsertTailList(&Context->PendingList, &Request->ListEntry);
+            KeReleaseSpinLockFromDpcLevel(&Context->ReceiveLock);
+        }
 
-        while (Request->Index < Request->Count) {
+        while (Context->SendIndex < Context->SendCount) {
             NTSTATUS    status;
 
             status = StoreSendSegment(Context,
-                                      &Request->Segment[Request->Index],
+                                      &Context->SendSegment[Context->SendIndex],
                                       Written);
             if (!NT_SUCCESS(status))
                 break;
 
-            Request->Index++;
+            Context->SendIndex++;
         }
 
-        if (Request->Index < Request->Count)
+        if (Context->SendIndex < Context->SendCount)
             break;
-
-        ListEntry = RemoveHeadList(&Context->SubmittedList);
-        ASSERT3P(ListEntry, ==, &Request->ListEntry);
-
-        InsertTailList(&Context->PendingList, &Request->ListEntry);
-        Request->State = XENBUS_STORE_REQUEST_PENDING;
     }
 }
 
@@ -584,6 +656,56 @@ done:
     return status;    
 }
 
+static VOID
+StoreCaptureMessage(
+    IN  PXENBUS_STORE_CONTEXT       Context,
+    IN  XENBUS_STORE_CAPTURE_TYPE   Type,
+    IN  struct xsd_sockmsg          *Header,
+    IN  PXENBUS_STORE_SEGMENT       Segment,
+    IN  ULONG                       Count,
+    IN  PVOID                       Caller
+    )
+{
+    PXENBUS_STORE_CAPTURE           Capture;
+    LARGE_INTEGER                   Now;
+    ULONG                           Index;
+    KIRQL                           Irql;
+
+    if (Context->Capture == NULL)
+        return;
+
+    KeQuerySystemTime(&Now);
+
+    KeAcquireSpinLock(&Context->CaptureLock, &Irql);
+
+    Capture = &Context->Capture[Context->CaptureIndex++ % XENBUS_STORE_CAPTURE_COUNT];
+    RtlZeroMemory(Capture, sizeof (XENBUS_STORE_CAPTURE));
+
+    Capture->Record.TimeStamp = Now.QuadPart;
+    Capture->Record.Caller = (ULONG_PTR)Caller;
+    Capture->Record.Type = Header->type;
+    Capture->Record.RequestId = Header->req_id;
+    Capture->Record.TransactionId = Header->tx_id;
+    Capture->Record.Length = Header->len;
+    Capture->Record.CaptureType = (UCHAR)Type;
+
+    for (Index = 0; Index < Count; Index++) {
+        ULONG   Length;
+
+        Length = __min(Segment[Index].Length,
+                       XENBUS_STORE_CAPTURE_PAYLOAD_MAX - Capture->Record.DataLength);
+        if (Length == 0)
+            break;
+
+        RtlCopyMemory(&Capture->Data[Capture->Record.DataLength],
+                      Segment[Index].Data,
+                      Length);
+        Capture->Record.DataLength += (UCHAR)Length;
+    }
+
+    KeReleaseSpinLock(&Context->CaptureLock, Irql);
+}
+
 static PXENBUS_STORE_REQUEST
 StoreFindRequest(
     IN  PXENBUS_STORE_CONTEXT   Context,
@@ -748,6 +870,14 @@ StoreProcessWatchEvent(
                                   &Path,
                                   &Caller,
                                   &Id);
+
+    StoreCaptureMessage(Context,
+                        XENBUS_STORE_CAPTURE_TYPE_WATCH_EVENT,
+                        &Response->Header,
+                        &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT],
+                        1,
+                        (NT_SUCCESS(status)) ? Caller : NULL);
+
     if (!NT_SUCCESS(status))
         return;
 
@@ -879,31 +1009,59 @@ StoreProcessResponse(
     Request->Response = StoreCopyResponse(Context);
     StoreResetResponse(Context);
 
+    KeMemoryBarrier();
+
     Request->State = XENBUS_STORE_REQUEST_COMPLETED;
 
     KeMemoryBarrier();
 }
 
-static VOID
-StorePollLocked(
-    IN  PXENBUS_STORE_CONTEXT   Context
+static ULONG
+StorePollSend(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  BOOLEAN                 Wait
     )
 {
-    ULONG                       Read;
     ULONG                       Written;
-    NTSTATUS                    status;
 
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    Written = 0;
 
-    do {
-        Read = Written = 0;
+    if (Wait)
+        KeAcquireSpinLockAtDpcLevel(&Context->SendLock);
+    else if (!KeTryToAcquireSpinLockAtDpcLevel(&Context->SendLock))
+        goto done;
 
+    if (Context->Enabled) {
         StoreSendRequests(Context, &Written);
         if (Written != 0)
             (VOID) XENBUS_EVTCHN(Send,
                                  &Context->EvtchnInterface,
                                  Context->Channel);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Context->SendLock);
+
+done:
+    return Written;
+}
 
+static ULONG
+StorePollReceive(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  BOOLEAN                 Wait
+    )
+{
+    ULONG                       Read;
+    NTSTATUS                    status;
+
+    Read = 0;
+
+    if (Wait)
+        KeAcquireSpinLockAtDpcLevel(&Context->ReceiveLock);
+    else if (!KeTryToAcquireSpinLockAtDpcLevel(&Context->ReceiveLock))
+        goto done;
+
+    if (Context->Enabled) {
         status = StoreReceiveResponse(Context, &Read);
         if (NT_SUCCESS(status))
             StoreProcessResponse(Context);
@@ -912,7 +1070,51 @@ StorePollLocked(
             (VOID) XENBUS_EVTCHN(Send,
                                  &Context->EvtchnInterface,
                                  Context->Channel);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&Context->ReceiveLock);
+
+done:
+    return Read;
+}
+
+static FORCEINLINE BOOLEAN
+__StoreResponsePending(
+    IN  PXENBUS_STORE_CONTEXT           Context
+    )
+{
+    struct xenstore_domain_interface    *Shared;
+    XENSTORE_RING_IDX                   cons;
+    XENSTORE_RING_IDX                   prod;
+
+    Shared = Context->Shared;
+
+    KeMemoryBarrier();
+
+    cons = Shared->rsp_cons;
+    prod = Shared->rsp_prod;
 
+    KeMemoryBarrier();
+
+    return (prod != cons) ? TRUE : FALSE;
+}
+
+// If Wait is FALSE then either side of the ring is skipped if some
+// other CPU is already working on it.
+static VOID
+__StorePoll(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  BOOLEAN                 Wait
+    )
+{
+    ULONG                       Read;
+    ULONG                       Written;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    do {
+        Written = StorePollSend(Context, Wait);
+        Read = StorePollReceive(Context, Wait);
     } while (Written != 0 || Read != 0);
 }
 
@@ -938,10 +1140,30 @@ StoreDpc(
 
     ASSERT(Context != NULL);
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
-    if (Context->References != 0)
-        StorePollLocked(Context);
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    __StorePoll(Context, TRUE);
+}
+
+static VOID
+StoreQueueRequest(
+    IN  PXENBUS_STORE_CONTEXT   Context,
+    IN  PXENBUS_STORE_REQUEST   Request
+    )
+{
+    PLIST_ENTRY                 Old;
+    PLIST_ENTRY                 New;
+
+    ASSERT(IsZeroMemory(&Request->ListEntry, sizeof (LIST_ENTRY)));
+
+    Request->State = XENBUS_STORE_REQUEST_SUBMITTED;
+
+    New = &Request->ListEntry;
+
+    do {
+        Old = Context->SubmittedQueue;
+        New->Flink = Old;
+    } while (InterlockedCompareExchangePointer(&Context->SubmittedQueue,
+                                               New,
+                                               Old) != Old);
 }
 
 static PXENBUS_STORE_RESPONSE
@@ -951,31 +1173,120 @@ StoreSubmitRequest(
     )
 {
     PXENBUS_STORE_RESPONSE      Response;
+    PVOID                       Caller;
     KIRQL                       Irql;
+    LARGE_INTEGER               XenStart;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               Frequency;
 
     ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_PREPARED);
 
+    // Skip this function and the interface method that called it
+    Caller = NULL;
+    if (Context->Capture != NULL)
+        (VOID) RtlCaptureStackBackTrace(2, 1, &Caller, NULL);
+
+    StoreCaptureMessage(Context,
+                        XENBUS_STORE_CAPTURE_TYPE_REQUEST,
+                        &Request->Header,
+                        &Request->Segment[1],
+                        Request->Count - 1,
+                        Caller);
+
     // Make sure we don't suspend
     ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
+    StoreQueueRequest(Context, Request);
 
-    InsertTailList(&Context->SubmittedList, &Request->ListEntry);
-    Request->State = XENBUS_STORE_REQUEST_SUBMITTED;
+    XenStart.QuadPart = 0;
+    Start.QuadPart = 0;
+    Frequency.QuadPart = 0;
 
     while (Request->State != XENBUS_STORE_REQUEST_COMPLETED) {
-        StorePollLocked(Context);
-        SchedYield();
-    }
+        evtchn_port_t   Port;
+        LARGE_INTEGER   Now;
+        ULONGLONG       Elapsed;
+        LARGE_INTEGER   Deadline;
+
+        __StorePoll(Context, FALSE);
+        if (Request->State == XENBUS_STORE_REQUEST_COMPLETED)
+            break;
+
+        //
+        // Until the whole request is on the ring there is no response to
+        // wait for; it is only held back by a full ring so just let
+        // xenstored run. A request becomes pending before its last byte
+        // is written, so also peek (unlocked: at worst we yield once more)
+        // at whether the sender still has anything left to copy.
+        //
+        if (Context->Channel == NULL ||
+            Request->State != XENBUS_STORE_REQUEST_PENDING ||
+            Context->SendIndex != Context->SendCount) {
+            SchedYield();
+            continue;
+        }
+
+        //
+        // Give up the physical CPU until xenstored signals the channel.
+        // The upcall may already have consumed a notification sent since
+        // the ring was polled, so re-check the ring immediately before
+        // waiting. The short timeout bounds the stall if a response still
+        // lands in the remaining window.
+        //
+        if (__StoreResponsePending(Context))
+            continue;
+
+        //
+        // SCHEDOP_poll wants an absolute Xen system time. Read it once
+        // per request and track elapsed time with the performance
+        // counter from then on, rather than issuing an extra hypercall
+        // for every wait.
+        //
+        Now = KeQueryPerformanceCounter(NULL);
+
+        if (XenStart.QuadPart == 0) {
+            if (!NT_SUCCESS(HvmGetTime(&XenStart))) {
+                SchedYield();
+                continue;
+            }
+
+            Start = KeQueryPerformanceCounter(&Frequency);
+            Now = Start;
+        }
+
+        Elapsed = (ULONGLONG)(Now.QuadPart - Start.QuadPart);
 
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+        Deadline.QuadPart = XenStart.QuadPart +
+                            (LONGLONG)((Elapsed / Frequency.QuadPart) * 1000000000ull) +
+                            (LONGLONG)(((Elapsed % Frequency.QuadPart) * 1000000000ull) /
+                                       Frequency.QuadPart) +
+                            XENBUS_STORE_POLL_TIMEOUT * 100;
+
+        Port = XENBUS_EVTCHN(GetPort,
+                             &Context->EvtchnInterface,
+                             Context->Channel);
+
+        // Don't let SCHEDOP_poll treat an empty port list as 'any event'
+        if (Port == 0)
+            SchedYield();
+        else
+            (VOID) SchedPollDeadline(&Port, 1, &Deadline);
+    }
 
     Response = Request->Response;
     ASSERT(Response == NULL ||
            Response->Header.type == XS_ERROR ||
            Response->Header.type == Request->Header.type);
 
+    if (Response != NULL)
+        StoreCaptureMessage(Context,
+                            XENBUS_STORE_CAPTURE_TYPE_RESPONSE,
+                            &Response->Header,
+                            &Response->Segment[XENBUS_STORE_RESPONSE_PAYLOAD_SEGMENT],
+                            1,
+                            Caller);
+
     RtlZeroMemory(Request, sizeof(XENBUS_STORE_REQUEST));
 
     KeLowerIrql(Irql);
@@ -1095,14 +1406,6 @@ StoreFree(
     StoreFreePayload(Context, Buffer);
 }
 
-extern USHORT
-RtlCaptureStackBackTrace(
-    __in        ULONG   FramesToSkip,
-    __in        ULONG   FramesToCapture,
-    __out       PVOID   *BackTrace,
-    __out_opt   PULONG  BackTraceHash
-    );
-
 static NTSTATUS
 StoreRead(
     IN  PINTERFACE                  Interface,
@@ -1668,11 +1971,11 @@ StoreWatchAdd(
     (*Watch)->Path = Path;
     (*Watch)->Event = Event;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
+    KeAcquireSpinLock(&Context->ReceiveLock, &Irql);
     (*Watch)->Id = StoreNextWatchId(Context);
     (*Watch)->Active = TRUE;
     InsertTailList(&Context->WatchList, &(*Watch)->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    KeReleaseSpinLock(&Context->ReceiveLock, Irql);
 
     status = RtlStringCbPrintfA(Token,
                                 sizeof (Token),
@@ -1720,11 +2023,11 @@ fail3:
 
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
+    KeAcquireSpinLock(&Context->ReceiveLock, &Irql);
     (*Watch)->Active = FALSE;
     (*Watch)->Id = 0;
     RemoveEntryList(&(*Watch)->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    KeReleaseSpinLock(&Context->ReceiveLock, Irql);
 
     RtlZeroMemory(&(*Watch)->ListEntry, sizeof (LIST_ENTRY));
 
@@ -1766,12 +2069,12 @@ StoreWatchRemove(
 
     Path = Watch->Path;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
+    KeAcquireSpinLock(&Context->ReceiveLock, &Irql);
 
     if (!Watch->Active)
         goto done;
 
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    KeReleaseSpinLock(&Context->ReceiveLock, Irql);
 
     status = RtlStringCbPrintfA(Token,
                                 sizeof (Token),
@@ -1807,13 +2110,13 @@ StoreWatchRemove(
     StoreFreeResponse(Response);
     ASSERT(IsZeroMemory(&Request, sizeof (XENBUS_STORE_REQUEST)));
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
+    KeAcquireSpinLock(&Context->ReceiveLock, &Irql);
     Watch->Active = FALSE;
 
 done:
     Watch->Id = 0;
     RemoveEntryList(&Watch->ListEntry);
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    KeReleaseSpinLock(&Context->ReceiveLock, Irql);
 
     RtlZeroMemory(&Watch->ListEntry, sizeof (LIST_ENTRY));
 
@@ -1850,9 +2153,76 @@ StorePoll(
 {
     PXENBUS_STORE_CONTEXT  Context = Interface->Context;
 
-    KeAcquireSpinLockAtDpcLevel(&Context->Lock);
-    StorePollLocked(Context);
-    KeReleaseSpinLockFromDpcLevel(&Context->Lock);
+    __StorePoll(Context, TRUE);
+}
+
+static NTSTATUS
+StoreCaptureExport(
+    IN      PINTERFACE          Interface,
+    OUT     PVOID               Buffer OPTIONAL,
+    IN OUT  PULONG              Length
+    )
+{
+    PXENBUS_STORE_CONTEXT       Context = Interface->Context;
+    PUCHAR                      Cursor;
+    ULONG                       Start;
+    ULONG                       Index;
+    ULONG                       Required;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    status = STATUS_NOT_SUPPORTED;
+    if (Context->Capture == NULL)
+        goto fail1;
+
+    KeAcquireSpinLock(&Context->CaptureLock, &Irql);
+
+    Start = (Context->CaptureIndex > XENBUS_STORE_CAPTURE_COUNT) ?
+            Context->CaptureIndex - XENBUS_STORE_CAPTURE_COUNT :
+            0;
+
+    Required = 0;
+    for (Index = Start; Index != Context->CaptureIndex; Index++) {
+        PXENBUS_STORE_CAPTURE   Capture;
+
+        Capture = &Context->Capture[Index % XENBUS_STORE_CAPTURE_COUNT];
+
+        Required += sizeof (XENBUS_STORE_CAPTURE_RECORD) +
+                    Capture->Record.DataLength;
+    }
+
+    status = STATUS_BUFFER_OVERFLOW;
+    if (Buffer == NULL || *Length < Required)
+        goto done;
+
+    Cursor = Buffer;
+    for (Index = Start; Index != Context->CaptureIndex; Index++) {
+        PXENBUS_STORE_CAPTURE   Capture;
+
+        Capture = &Context->Capture[Index % XENBUS_STORE_CAPTURE_COUNT];
+
+        RtlCopyMemory(Cursor,
+                      &Capture->Record,
+                      sizeof (XENBUS_STORE_CAPTURE_RECORD));
+        Cursor += sizeof (XENBUS_STORE_CAPTURE_RECORD);
+
+        RtlCopyMemory(Cursor,
+                      Capture->Data,
+                      Capture->Record.DataLength);
+        Cursor += Capture->Record.DataLength;
+    }
+
+    status = STATUS_SUCCESS;
+
+done:
+    KeReleaseSpinLock(&Context->CaptureLock, Irql);
+
+    *Length = Required;
+
+    return status;
+
+fail1:
+    return status;
 }
 
 static NTSTATUS
@@ -2142,7 +2512,8 @@ StoreSuspendCallbackLate(
 
     Shared = Context->Shared;
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
+    KeAcquireSpinLock(&Context->SendLock, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Context->ReceiveLock);
 
     StoreDisable(Context);
     StoreResetResponse(Context);
@@ -2158,7 +2529,8 @@ StoreSuspendCallbackLate(
         KeSetEvent(Watch->Event, 0, FALSE);
     }
 
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    KeReleaseSpinLockFromDpcLevel(&Context->ReceiveLock);
+    KeReleaseSpinLock(&Context->SendLock, Irql);
 }
 
 static VOID
@@ -2303,6 +2675,57 @@ StoreDebugCallback(
             }
         }
     }
+
+    if (Context->Capture != NULL) {
+        ULONG   Start;
+        ULONG   Index;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "CAPTURE: (%u)\n",
+                     Context->CaptureIndex);
+
+        Start = (Context->CaptureIndex > XENBUS_STORE_CAPTURE_COUNT) ?
+                Context->CaptureIndex - XENBUS_STORE_CAPTURE_COUNT :
+                0;
+
+        for (Index = Start; Index != Context->CaptureIndex; Index++) {
+            PXENBUS_STORE_CAPTURE   Capture;
+            CHAR                    Data[XENBUS_STORE_CAPTURE_PAYLOAD_MAX + 1];
+            ULONG                   Offset;
+            PCHAR                   Name;
+            ULONG_PTR               Symbol;
+
+            Capture = &Context->Capture[Index % XENBUS_STORE_CAPTURE_COUNT];
+
+            // Payloads are NUL separated so make them printable
+            for (Offset = 0; Offset < Capture->Record.DataLength; Offset++) {
+                CHAR    Character = Capture->Data[Offset];
+
+                Data[Offset] = (Character >= ' ' && Character <= '~') ?
+                               Character :
+                               '.';
+            }
+            Data[Offset] = '\0';
+
+            ModuleLookup((ULONG_PTR)Capture->Record.Caller, &Name, &Symbol);
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "- %016I64x %s type = %u req_id = %08x tx_id = %08x len = %u BY %s + %p: %s\n",
+                         Capture->Record.TimeStamp,
+                         (Capture->Record.CaptureType == XENBUS_STORE_CAPTURE_TYPE_REQUEST) ? "REQ" :
+                         (Capture->Record.CaptureType == XENBUS_STORE_CAPTURE_TYPE_RESPONSE) ? "RSP" :
+                         "EVT",
+                         Capture->Record.Type,
+                         Capture->Record.RequestId,
+                         Capture->Record.TransactionId,
+                         Capture->Record.Length,
+                         (Name != NULL) ? Name : "UNKNOWN",
+                         (Name != NULL) ? (PVOID)Symbol : (PVOID)(ULONG_PTR)Capture->Record.Caller,
+                         Data);
+        }
+    }
 }
 
 static NTSTATUS
@@ -2333,8 +2756,15 @@ StoreAcquire(
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    KeAcquireSpinLockAtDpcLevel(&Context->SendLock);
+    KeAcquireSpinLockAtDpcLevel(&Context->ReceiveLock);
+
     StoreResetResponse(Context);
     StoreEnable(Context);
+    Context->Enabled = TRUE;
+
+    KeReleaseSpinLockFromDpcLevel(&Context->ReceiveLock);
+    KeReleaseSpinLockFromDpcLevel(&Context->SendLock);
 
     status = XENBUS_SUSPEND(Acquire, &Context->SuspendInterface);
     if (!NT_SUCCESS(status))
@@ -2407,9 +2837,16 @@ fail4:
 fail3:
     Error("fail3\n");
 
+    KeAcquireSpinLockAtDpcLevel(&Context->SendLock);
+    KeAcquireSpinLockAtDpcLevel(&Context->ReceiveLock);
+
+    Context->Enabled = FALSE;
     StoreDisable(Context);
     RtlZeroMemory(&Context->Response, sizeof (XENBUS_STORE_RESPONSE));
 
+    KeReleaseSpinLockFromDpcLevel(&Context->ReceiveLock);
+    KeReleaseSpinLockFromDpcLevel(&Context->SendLock);
+
     XENBUS_EVTCHN(Release, &Context->EvtchnInterface);
 
 fail2:
@@ -2473,9 +2910,16 @@ StoreRelease(
 
     XENBUS_SUSPEND(Release, &Context->SuspendInterface);
 
+    KeAcquireSpinLockAtDpcLevel(&Context->SendLock);
+    KeAcquireSpinLockAtDpcLevel(&Context->ReceiveLock);
+
+    Context->Enabled = FALSE;
     StoreDisable(Context);
     RtlZeroMemory(&Context->Response, sizeof (XENBUS_STORE_RESPONSE));
 
+    KeReleaseSpinLockFromDpcLevel(&Context->ReceiveLock);
+    KeReleaseSpinLockFromDpcLevel(&Context->SendLock);
+
     XENBUS_EVTCHN(Release, &Context->EvtchnInterface);
 
     MmUnmapIoSpace(Context->Shared, PAGE_SIZE);
@@ -2522,6 +2966,24 @@ static struct _XENBUS_STORE_INTERFACE_V2 StoreInterfaceVersion2 = {
     StorePermissionsSet,
 };
 
+static struct _XENBUS_STORE_INTERFACE_V3 StoreInterfaceVersion3 = {
+    { sizeof(struct _XENBUS_STORE_INTERFACE_V3), 3, NULL, NULL, NULL },
+    StoreAcquire,
+    StoreRelease,
+    StoreFree,
+    StoreRead,
+    StorePrintf,
+    StoreRemove,
+    StoreDirectory,
+    StoreTransactionStart,
+    StoreTransactionEnd,
+    StoreWatchAdd,
+    StoreWatchRemove,
+    StorePoll,
+    StorePermissionsSet,
+    StoreCaptureExport,
+};
+
 NTSTATUS
 StoreInitialize(
     IN  PXENBUS_FDO             Fdo,
@@ -2530,6 +2992,8 @@ StoreInitialize(
 {
     LARGE_INTEGER               Now;
     ULONG                       Seed;
+    HANDLE                      ParametersKey;
+    ULONG                       StoreCapture;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -2562,6 +3026,8 @@ StoreInitialize(
     ASSERT((*Context)->DebugInterface.Interface.Context != NULL);
 
     KeInitializeSpinLock(&(*Context)->Lock);
+    KeInitializeSpinLock(&(*Context)->SendLock);
+    KeInitializeSpinLock(&(*Context)->ReceiveLock);
 
     KeQuerySystemTime(&Now);
     Seed = Now.LowPart;
@@ -2579,6 +3045,22 @@ StoreInitialize(
 
     KeInitializeDpc(&(*Context)->Dpc, StoreDpc, *Context);
 
+    KeInitializeSpinLock(&(*Context)->CaptureLock);
+
+    ParametersKey = DriverGetParametersKey();
+
+    status = RegistryQueryDwordValue(ParametersKey,
+                                     "StoreCapture",
+                                     &StoreCapture);
+    if (!NT_SUCCESS(status))
+        StoreCapture = 0;
+
+    // The capture ring is purely diagnostic so failing to allocate it
+    // is not fatal
+    if (StoreCapture != 0)
+        (*Context)->Capture = __StoreAllocate(sizeof (XENBUS_STORE_CAPTURE) *
+                                              XENBUS_STORE_CAPTURE_COUNT);
+
     (*Context)->Fdo = Fdo;
 
     Trace("<====\n");
@@ -2638,6 +3120,23 @@ StoreGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 3: {
+        struct _XENBUS_STORE_INTERFACE_V3  *StoreInterface;
+
+        StoreInterface = (struct _XENBUS_STORE_INTERFACE_V3 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof(struct _XENBUS_STORE_INTERFACE_V3))
+            break;
+
+        *StoreInterface = StoreInterfaceVersion3;
+
+        ASSERT3U(Interface->Version, == , Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -2658,6 +3157,14 @@ StoreTeardown(
 
     Context->Fdo = NULL;
 
+    if (Context->Capture != NULL) {
+        __StoreFree(Context->Capture);
+        Context->Capture = NULL;
+    }
+    Context->CaptureIndex = 0;
+
+    RtlZeroMemory(&Context->CaptureLock, sizeof (KSPIN_LOCK));
+
     RtlZeroMemory(&Context->Dpc, sizeof (KDPC));
 
     RtlZeroMemory(&Context->BufferList, sizeof (LIST_ENTRY));
@@ -2667,10 +3174,20 @@ StoreTeardown(
 
     RtlZeroMemory(&Context->TransactionList, sizeof (LIST_ENTRY));
 
+    ASSERT3P(Context->SubmittedQueue, ==, NULL);
+
     RtlZeroMemory(&Context->PendingList, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(Context->SendSegment,
+                  sizeof (XENBUS_STORE_SEGMENT) * XENBUS_STORE_REQUEST_SEGMENT_COUNT);
+    Context->SendCount = 0;
+    Context->SendIndex = 0;
+
     RtlZeroMemory(&Context->SubmittedList, sizeof (LIST_ENTRY));
     Context->RequestId = 0;
 
+    RtlZeroMemory(&Context->ReceiveLock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&Context->SendLock, sizeof (KSPIN_LOCK));
     RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
 
     RtlZeroMemory(&Context->DebugInterface,
@@ -0,0 +1,75 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HARNESS_ASSERT_H
+#define _HARNESS_ASSERT_H
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#include "dbg_print.h"
+
+#define ASSERT(_EXP)                                            \
+        do {                                                    \
+            if (!(_EXP)) {                                      \
+                Error("ASSERTION FAILED: %s (%s:%d)\n",         \
+                      #_EXP, __FILE__, __LINE__);               \
+                abort();                                        \
+            }                                                   \
+        } while (FALSE)
+
+#define BUG(_TEXT)                                              \
+        do {                                                    \
+            Error("BUG: %s (%s:%d)\n",                          \
+                  _TEXT, __FILE__, __LINE__);                   \
+            abort();                                            \
+        } while (FALSE)
+
+#define ASSERT3U(_X, _OP, _Y)   ASSERT((ULONGLONG)(_X) _OP (ULONGLONG)(_Y))
+#define ASSERT3S(_X, _OP, _Y)   ASSERT((LONGLONG)(_X) _OP (LONGLONG)(_Y))
+#define ASSERT3P(_X, _OP, _Y)   ASSERT((PVOID)(_X) _OP (PVOID)(_Y))
+
+static FORCEINLINE BOOLEAN
+IsZeroMemory(
+    IN  PVOID   Buffer,
+    IN  ULONG   Length
+    )
+{
+    const UCHAR *Byte = Buffer;
+
+    while (Length-- != 0)
+        if (*Byte++ != 0)
+            return FALSE;
+
+    return TRUE;
+}
+
+#endif  // _HARNESS_ASSERT_H
@@ -0,0 +1,54 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HARNESS_DBG_PRINT_H
+#define _HARNESS_DBG_PRINT_H
+
+#include <ntddk.h>
+#include <stdio.h>
+
+#define LOG_LEVEL_INFO  0
+
+// Only failures are reported; everything else is type-checked and dropped
+#define __Quiet(...)    do { if (0) printf(__VA_ARGS__); } while (FALSE)
+
+#define Error(...)                                  \
+        do {                                        \
+            fprintf(stderr, "%s: ", __FUNCTION__);  \
+            fprintf(stderr, __VA_ARGS__);           \
+        } while (FALSE)
+
+#define Warning(...)                Error(__VA_ARGS__)
+#define Info(...)                   __Quiet(__VA_ARGS__)
+#define Trace(...)                  __Quiet(__VA_ARGS__)
+#define LogPrintf(_Level, ...)      __Quiet(__VA_ARGS__)
+
+#endif  // _HARNESS_DBG_PRINT_H
@@ -0,0 +1,2292 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// A user-mode harness for event dispatch. The unmodified
+// src/xenbus/evtchn.c and src/xenbus/hash_table.c are built against the
+// shims in include/ and common/ and driven, through the EVTCHN
+// interface, by a simulated kernel and hypervisor. The simulator queues
+// each event on the vCPU its port is bound to, as the FIFO ABI does, and
+// every simulated processor takes its own upcall and runs its own DPCs.
+//
+// The tests check that every event is delivered once, to the callback
+// of the channel that owns the port and on the processor the channel is
+// bound to, including when there are more pending events than a single
+// upcall may deliver, and that channels closed with events pending are
+// neither called back nor leak their ports.
+//
+// The benchmarks then compare the cost of looking a port up in the port
+// table with that of looking it up in a hash table, as event dispatch
+// used to, as the number of open channels grows, and measure the cost
+// of dispatching each event from the upcall as more are pending at once.
+// Finally a thread is run as each of a growing number of processors,
+// raising and taking events on its own channels, to measure how the
+// total event rate scales when processors only touch their own state.
+//
+// Build and run on Linux (x86) from this directory with:
+//
+//   cc -std=gnu11 -O2 -Wall -pthread -Iinclude -I../../include -iquote common -o dispatch dispatch.c
+//   ./dispatch [PROCESSORS]
+//
+
+#include <ntddk.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// evtchn.c needs the FDO type from fdo.h, and the interfaces that fdo.h
+// pulls in. Keep fdo.h itself out, since it drags in every other
+// subsystem, and supply the few FDO functions that are used below.
+//
+#define _XENBUS_FDO_H
+
+typedef struct _XENBUS_FDO          XENBUS_FDO, *PXENBUS_FDO;
+typedef struct _XENBUS_INTERRUPT    XENBUS_INTERRUPT, *PXENBUS_INTERRUPT;
+
+#define __MODULE__  "XENBUS"
+
+#include "../../src/xenbus/suspend.h"
+#include "../../src/xenbus/debug.h"
+#include "../../src/xenbus/shared_info.h"
+#include "../../src/xenbus/evtchn.h"
+#include "../../src/xenbus/evtchn_2l.h"
+#include "../../src/xenbus/evtchn_fifo.h"
+#include "../../src/xenbus/hash_table.h"
+
+//
+// MSVC drops the comma before an empty __VA_ARGS__, and lets "->" be
+// pasted onto a method name. GCC does neither, so the method macros of
+// the interfaces are redefined here.
+//
+#undef  XENBUS_SUSPEND
+#define XENBUS_SUSPEND(_Method, _Interface, ...)    \
+    (_Interface)->_Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_DEBUG
+#define XENBUS_DEBUG(_Method, _Interface, ...)    \
+    (_Interface)->Debug ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_SHARED_INFO
+#define XENBUS_SHARED_INFO(_Method, _Interface, ...)    \
+    (_Interface)->SharedInfo ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_EVTCHN
+#define XENBUS_EVTCHN(_Method, _Interface, ...)    \
+    (_Interface)->Evtchn ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_EVTCHN_ABI
+#define XENBUS_EVTCHN_ABI(_Method, _Abi, ...)   \
+    (_Abi)->EvtchnAbi ## _Method((_Abi)->Context, ##__VA_ARGS__)
+
+//
+// MSVC reads a variable argument back as the narrow type it was promoted
+// from. GCC makes that a trap, so read the promoted type and narrow it.
+//
+#undef  va_arg
+#define va_arg(_Arguments, _Type)                                       \
+    ((_Type)__builtin_va_arg(_Arguments,                                \
+                             __typeof__(__builtin_choose_expr(          \
+                                 sizeof (_Type) < sizeof (int),         \
+                                 0,                                     \
+                                 (_Type)0))))
+
+extern HANDLE
+DriverGetParametersKey(
+    VOID
+    );
+
+PXENBUS_SUSPEND_CONTEXT
+FdoGetSuspendContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+PXENBUS_DEBUG_CONTEXT
+FdoGetDebugContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+PXENBUS_SHARED_INFO_CONTEXT
+FdoGetSharedInfoContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+KIRQL
+FdoAcquireInterruptLock(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    );
+
+VOID
+FdoReleaseInterruptLock(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt,
+    IN  KIRQL               Irql
+    );
+
+PXENBUS_INTERRUPT
+FdoAllocateInterrupt(
+    IN  PXENBUS_FDO         Fdo,
+    IN  KINTERRUPT_MODE     InterruptMode,
+    IN  USHORT              Group,
+    IN  UCHAR               Number,
+    IN  KSERVICE_ROUTINE    Callback,
+    IN  PVOID               Argument OPTIONAL
+    );
+
+UCHAR
+FdoGetInterruptVector(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    );
+
+ULONG
+FdoGetInterruptLine(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    );
+
+VOID
+FdoFreeInterrupt(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    );
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmultichar"        // pool tags and magic numbers
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"  // #pragma warning
+#pragma GCC diagnostic ignored "-Wunused-function"  // EvtchnUnmaskVersion1()
+#pragma GCC diagnostic ignored "-Wincompatible-pointer-types"   // EvtchnSend() returns a status
+
+#include "../../src/xenbus/evtchn.c"
+#include "../../src/xenbus/hash_table.c"
+
+#pragma GCC diagnostic pop
+
+#define HARNESS_PROCESSORS      4
+#define HARNESS_CHANNELS        1024    // More than one upcall's budget on each processor
+#define HARNESS_BENCH_SEQUENCE  4096
+#define HARNESS_BENCH_LOOKUPS   (1u << 24)
+#define HARNESS_BENCH_EVENTS    (1u << 20)
+#define HARNESS_SCALE_CHANNELS  16      // Per processor, within one upcall's budget
+#define HARNESS_SCALE_EVENTS    (1u << 20)  // Per processor
+#define HARNESS_SCALE_MAXIMUM   16
+
+//
+// The simulated hypervisor
+//
+
+#define SIM_PORTS           4096
+#define SIM_BITS_PER_WORD   64
+#define SIM_WORDS           (SIM_PORTS / SIM_BITS_PER_WORD)
+#define SIM_VECTOR_BASE     0x50
+#define SIM_CALLBACK_LINE   28
+
+C_ASSERT(SIM_WORDS <= SIM_BITS_PER_WORD);
+
+//
+// Each port has a cache line to itself, so that the simulator does not
+// add false sharing of its own between processors raising and acking
+// ports that happen to be neighbours.
+//
+typedef struct _SIM_PORT {
+    DECLSPEC_CACHEALIGN volatile LONG   Pending;
+    volatile LONG                       Masked;
+    volatile LONG                       Linked;
+    ULONG                               Vcpu;
+    BOOLEAN                             Allocated;
+} SIM_PORT, *PSIM_PORT;
+
+// The ports linked on a vCPU's queue, and its upcall flag
+typedef struct _SIM_VCPU {
+    DECLSPEC_CACHEALIGN volatile ULONGLONG  Selector;
+    volatile LONG                           UpcallPending;
+    UCHAR                                   Vector;
+    DECLSPEC_CACHEALIGN volatile ULONGLONG  Ready[SIM_WORDS];
+} SIM_VCPU, *PSIM_VCPU;
+
+static SIM_PORT         SimPort[SIM_PORTS];
+static SIM_VCPU         SimVcpu[MAXIMUM_PROCESSORS];
+static pthread_mutex_t  SimPortLock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// The simulated kernel
+//
+
+struct _XENBUS_INTERRUPT {
+    KINTERRUPT_MODE     Mode;
+    ULONG               Index;
+    UCHAR               Vector;
+    ULONG               Line;
+    KSPIN_LOCK          Lock;
+    PKSERVICE_ROUTINE   Callback;
+    PVOID               Argument;
+};
+
+// The DPC queue of a processor, and the interrupt for its upcall vector
+typedef struct _SIM_PROCESSOR {
+    DECLSPEC_CACHEALIGN pthread_mutex_t Lock;
+    PKDPC                               Head;
+    PKDPC                               Tail;
+    PXENBUS_INTERRUPT                   Interrupt;
+} SIM_PROCESSOR, *PSIM_PROCESSOR;
+
+static SIM_PROCESSOR        SimProcessor[MAXIMUM_PROCESSORS];
+static PXENBUS_INTERRUPT    SimCallbackInterrupt;
+
+struct _XENBUS_THREAD {
+    XENBUS_THREAD_FUNCTION  Function;
+    PVOID                   Context;
+    KEVENT                  Event;
+    volatile BOOLEAN        Alerted;
+    pthread_t               Thread;
+};
+
+struct _XENBUS_SUSPEND_CONTEXT {
+    LONG                        References;
+    PXENBUS_SUSPEND_CALLBACK    Early;
+    PXENBUS_SUSPEND_CALLBACK    Late;
+};
+
+struct _XENBUS_SUSPEND_CALLBACK {
+    XENBUS_SUSPEND_FUNCTION Function;
+    PVOID                   Argument;
+};
+
+struct _XENBUS_DEBUG_CONTEXT {
+    LONG                    References;
+    PXENBUS_DEBUG_CALLBACK  Callback;
+    ULONG                   Lines;
+};
+
+struct _XENBUS_DEBUG_CALLBACK {
+    XENBUS_DEBUG_FUNCTION   Function;
+    PVOID                   Argument;
+};
+
+struct _XENBUS_SHARED_INFO_CONTEXT {
+    LONG    References;
+};
+
+static XENBUS_SUSPEND_CONTEXT       SimSuspendContext;
+static XENBUS_DEBUG_CONTEXT         SimDebugContext;
+static XENBUS_SHARED_INFO_CONTEXT   SimSharedInfoContext;
+
+// Link a pending, unmasked port onto its vCPU's queue, unless it already is
+static VOID
+SimLink(
+    IN  ULONG   Port
+    )
+{
+    PSIM_PORT   P = &SimPort[Port];
+    PSIM_VCPU   Vcpu;
+    ULONG       Word = Port / SIM_BITS_PER_WORD;
+
+    if (__atomic_exchange_n(&P->Linked, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    Vcpu = &SimVcpu[P->Vcpu];
+
+    __atomic_fetch_or(&Vcpu->Ready[Word],
+                      1ull << (Port % SIM_BITS_PER_WORD),
+                      __ATOMIC_SEQ_CST);
+    __atomic_fetch_or(&Vcpu->Selector,
+                      1ull << Word,
+                      __ATOMIC_SEQ_CST);
+    __atomic_store_n(&Vcpu->UpcallPending, 1, __ATOMIC_SEQ_CST);
+}
+
+// Raise an event, as the remote end would. Returns FALSE if one was already pending.
+static BOOLEAN
+SimRaise(
+    IN  ULONG   Port
+    )
+{
+    PSIM_PORT   P = &SimPort[Port];
+
+    ASSERT3U(Port, <, SIM_PORTS);
+
+    if (__atomic_exchange_n(&P->Pending, 1, __ATOMIC_SEQ_CST))
+        return FALSE;
+
+    if (!__atomic_load_n(&P->Masked, __ATOMIC_SEQ_CST))
+        SimLink(Port);
+
+    return TRUE;
+}
+
+static BOOLEAN
+SimIsPending(
+    IN  ULONG   Port
+    )
+{
+    return __atomic_load_n(&SimPort[Port].Pending, __ATOMIC_SEQ_CST) != 0;
+}
+
+static VOID
+SimReset(
+    VOID
+    )
+{
+    ULONG   Index;
+
+    RtlZeroMemory(SimPort, sizeof (SimPort));
+    RtlZeroMemory(SimVcpu, sizeof (SimVcpu));
+
+    for (Index = 0; Index < MAXIMUM_PROCESSORS; Index++) {
+        PSIM_PROCESSOR  Processor = &SimProcessor[Index];
+
+        ASSERT3P(Processor->Head, ==, NULL);
+        ASSERT3P(Processor->Interrupt, ==, NULL);
+
+        pthread_mutex_init(&Processor->Lock, NULL);
+    }
+
+    ASSERT3P(SimCallbackInterrupt, ==, NULL);
+}
+
+static NTSTATUS
+SimAbiAcquire(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimAbiRelease(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+}
+
+static BOOLEAN
+SimAbiIsProcessorEnabled(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Index
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Index);
+
+    return TRUE;
+}
+
+static ULONG
+SimAbiGetPortCount(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return SIM_PORTS;
+}
+
+// Unlink everything on the vCPU's queue, in port order
+static BOOLEAN
+SimAbiPoll(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Index,
+    IN  XENBUS_EVTCHN_ABI_EVENT     Event,
+    IN  PVOID                       Argument
+    )
+{
+    PSIM_VCPU                       Vcpu = &SimVcpu[Index];
+    ULONGLONG                       Selector;
+    BOOLEAN                         DoneSomething;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    DoneSomething = FALSE;
+
+    Selector = __atomic_exchange_n(&Vcpu->Selector, 0, __ATOMIC_SEQ_CST);
+    while (Selector != 0) {
+        ULONG       Word = __builtin_ctzll(Selector);
+        ULONGLONG   Ready;
+
+        Selector &= Selector - 1;
+
+        Ready = __atomic_exchange_n(&Vcpu->Ready[Word], 0, __ATOMIC_SEQ_CST);
+        while (Ready != 0) {
+            ULONG   Port = (Word * SIM_BITS_PER_WORD) + __builtin_ctzll(Ready);
+
+            Ready &= Ready - 1;
+
+            __atomic_store_n(&SimPort[Port].Linked, 0, __ATOMIC_SEQ_CST);
+            DoneSomething |= Event(Argument, Port);
+        }
+    }
+
+    return DoneSomething;
+}
+
+static NTSTATUS
+SimAbiPortEnable(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    ASSERT(SimPort[Port].Allocated);
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimAbiPortDisable(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    __atomic_store_n(&SimPort[Port].Masked, 1, __ATOMIC_SEQ_CST);
+}
+
+static VOID
+SimAbiPortAck(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    __atomic_store_n(&SimPort[Port].Pending, 0, __ATOMIC_SEQ_CST);
+}
+
+static VOID
+SimAbiPortMask(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    __atomic_store_n(&SimPort[Port].Masked, 1, __ATOMIC_SEQ_CST);
+}
+
+// Returns TRUE if the event was pending, in which case the hypercall is needed to link it
+static BOOLEAN
+SimAbiPortUnmask(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    IN  ULONG                       Port
+    )
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    __atomic_store_n(&SimPort[Port].Masked, 0, __ATOMIC_SEQ_CST);
+
+    return SimIsPending(Port);
+}
+
+static XENBUS_EVTCHN_ABI SimAbi = {
+    NULL,
+    SimAbiAcquire,
+    SimAbiRelease,
+    SimAbiIsProcessorEnabled,
+    SimAbiGetPortCount,
+    SimAbiPoll,
+    SimAbiPortEnable,
+    SimAbiPortDisable,
+    SimAbiPortAck,
+    SimAbiPortMask,
+    SimAbiPortUnmask
+};
+
+// Both ABIs are the simulated one
+NTSTATUS
+EvtchnFifoInitialize(
+    IN  PXENBUS_FDO                 Fdo,
+    OUT PXENBUS_EVTCHN_ABI_CONTEXT  *Context
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    *Context = (PXENBUS_EVTCHN_ABI_CONTEXT)&SimAbi;
+    return STATUS_SUCCESS;
+}
+
+VOID
+EvtchnFifoGetAbi(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    OUT PXENBUS_EVTCHN_ABI          Abi
+    )
+{
+    *Abi = SimAbi;
+    Abi->Context = Context;
+}
+
+VOID
+EvtchnFifoTeardown(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context
+    )
+{
+    ASSERT3P(Context, ==, (PXENBUS_EVTCHN_ABI_CONTEXT)&SimAbi);
+}
+
+NTSTATUS
+EvtchnTwoLevelInitialize(
+    IN  PXENBUS_FDO                 Fdo,
+    OUT PXENBUS_EVTCHN_ABI_CONTEXT  *Context
+    )
+{
+    return EvtchnFifoInitialize(Fdo, Context);
+}
+
+VOID
+EvtchnTwoLevelGetAbi(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context,
+    OUT PXENBUS_EVTCHN_ABI          Abi
+    )
+{
+    EvtchnFifoGetAbi(Context, Abi);
+}
+
+VOID
+EvtchnTwoLevelTeardown(
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT  Context
+    )
+{
+    EvtchnFifoTeardown(Context);
+}
+
+NTSTATUS
+EventChannelAllocateUnbound(
+    IN  domid_t         Domain,
+    OUT evtchn_port_t   *Port
+    )
+{
+    ULONG               Index;
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(Domain);
+
+    pthread_mutex_lock(&SimPortLock);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+
+    // Xen never allocates port 0
+    for (Index = 1; Index < SIM_PORTS; Index++) {
+        PSIM_PORT   P = &SimPort[Index];
+
+        if (P->Allocated)
+            continue;
+
+        ASSERT(!P->Linked);
+
+        P->Allocated = TRUE;
+        P->Pending = 0;
+        P->Masked = 1;
+        P->Vcpu = 0;
+
+        *Port = Index;
+        status = STATUS_SUCCESS;
+        break;
+    }
+
+    pthread_mutex_unlock(&SimPortLock);
+
+    return status;
+}
+
+NTSTATUS
+EventChannelBindInterDomain(
+    IN  domid_t         RemoteDomain,
+    IN  evtchn_port_t   RemotePort,
+    OUT evtchn_port_t   *LocalPort
+    )
+{
+    UNREFERENCED_PARAMETER(RemoteDomain);
+    UNREFERENCED_PARAMETER(RemotePort);
+    UNREFERENCED_PARAMETER(LocalPort);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS
+EventChannelBindVirq(
+    IN  uint32_t        Virq,
+    OUT evtchn_port_t   *LocalPort
+    )
+{
+    UNREFERENCED_PARAMETER(Virq);
+    UNREFERENCED_PARAMETER(LocalPort);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS
+EventChannelQueryInterDomain(
+    IN  evtchn_port_t   LocalPort,
+    OUT domid_t         *RemoteDomain,
+    OUT evtchn_port_t   *RemotePort
+    )
+{
+    UNREFERENCED_PARAMETER(LocalPort);
+    UNREFERENCED_PARAMETER(RemoteDomain);
+    UNREFERENCED_PARAMETER(RemotePort);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS
+EventChannelClose(
+    IN  evtchn_port_t   LocalPort
+    )
+{
+    PSIM_PORT           P = &SimPort[LocalPort];
+    NTSTATUS            status;
+
+    pthread_mutex_lock(&SimPortLock);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (LocalPort >= SIM_PORTS || !P->Allocated)
+        goto done;
+
+    // Anything still linked is delivered as a spurious event
+    P->Allocated = FALSE;
+    __atomic_store_n(&P->Masked, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&P->Pending, 0, __ATOMIC_SEQ_CST);
+
+    status = STATUS_SUCCESS;
+
+done:
+    pthread_mutex_unlock(&SimPortLock);
+
+    return status;
+}
+
+NTSTATUS
+EventChannelReset(
+    VOID
+    )
+{
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EventChannelBindVirtualCpu(
+    IN  ULONG               LocalPort,
+    IN  unsigned int        vcpu_id
+    )
+{
+    ASSERT3U(vcpu_id, <, MAXIMUM_PROCESSORS);
+
+    // Anything already linked is delivered on the old vCPU
+    SimPort[LocalPort].Vcpu = vcpu_id;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EventChannelUnmask(
+    IN  ULONG   LocalPort
+    )
+{
+    PSIM_PORT   P = &SimPort[LocalPort];
+
+    __atomic_store_n(&P->Masked, 0, __ATOMIC_SEQ_CST);
+
+    if (SimIsPending(LocalPort))
+        SimLink(LocalPort);
+
+    return STATUS_SUCCESS;
+}
+
+// Every channel is a loopback, so sending raises the event locally
+NTSTATUS
+EventChannelSend(
+    IN  evtchn_port_t   Port
+    )
+{
+    (VOID) SimRaise(Port);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EventChannelStatus(
+    IN  ULONG               LocalPort,
+    OUT uint32_t            *Status
+    )
+{
+    UNREFERENCED_PARAMETER(LocalPort);
+    UNREFERENCED_PARAMETER(Status);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS
+EventChannelSetPriority(
+    IN  ULONG               LocalPort,
+    IN  ULONG               Priority
+    )
+{
+    UNREFERENCED_PARAMETER(LocalPort);
+    UNREFERENCED_PARAMETER(Priority);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HypercallMulticall(
+    IN  multicall_entry_t   *Entry,
+    IN  ULONG               Count
+    )
+{
+    ULONG                   Index;
+
+    for (Index = 0; Index < Count; Index++) {
+        PVOID       Op = (PVOID)(ULONG_PTR)Entry[Index].args[1];
+        NTSTATUS    status;
+
+        ASSERT3U(Entry[Index].op, ==, __HYPERVISOR_event_channel_op);
+
+        switch (Entry[Index].args[0]) {
+        case EVTCHNOP_alloc_unbound: {
+            struct evtchn_alloc_unbound *AllocUnbound = Op;
+
+            status = EventChannelAllocateUnbound(AllocUnbound->remote_dom,
+                                                 &AllocUnbound->port);
+            break;
+        }
+        case EVTCHNOP_bind_vcpu: {
+            struct evtchn_bind_vcpu *BindVcpu = Op;
+
+            status = EventChannelBindVirtualCpu(BindVcpu->port,
+                                                BindVcpu->vcpu);
+            break;
+        }
+        case EVTCHNOP_set_priority: {
+            struct evtchn_set_priority  *SetPriority = Op;
+
+            status = EventChannelSetPriority(SetPriority->port,
+                                             SetPriority->priority);
+            break;
+        }
+        case EVTCHNOP_close: {
+            struct evtchn_close *Close = Op;
+
+            status = EventChannelClose(Close->port);
+            break;
+        }
+        default:
+            Entry[Index].result = (xen_ulong_t)-ENOSYS;
+            continue;
+        }
+
+        Entry[Index].result = NT_SUCCESS(status) ? 0 : (xen_ulong_t)-EINVAL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HvmSetParam(
+    IN  ULONG       Parameter,
+    IN  ULONGLONG   Value
+    )
+{
+    UNREFERENCED_PARAMETER(Parameter);
+    UNREFERENCED_PARAMETER(Value);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HvmGetParam(
+    IN  ULONG       Parameter,
+    OUT PULONGLONG  Value
+    )
+{
+    UNREFERENCED_PARAMETER(Parameter);
+    UNREFERENCED_PARAMETER(Value);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS
+HvmSetEvtchnUpcallVector(
+    IN  unsigned int    vcpu_id,
+    IN  UCHAR           Vector
+    )
+{
+    ASSERT3U(vcpu_id, <, MAXIMUM_PROCESSORS);
+
+    SimVcpu[vcpu_id].Vector = Vector;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+SchedPoll(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    )
+{
+    UNREFERENCED_PARAMETER(Port);
+    UNREFERENCED_PARAMETER(Count);
+    UNREFERENCED_PARAMETER(Timeout);
+
+    return STATUS_NOT_SUPPORTED;
+}
+
+VOID
+ModuleLookup(
+    IN  ULONG_PTR   Address,
+    OUT PCHAR       *Name,
+    OUT PULONG_PTR  Offset
+    )
+{
+    UNREFERENCED_PARAMETER(Address);
+
+    *Name = NULL;
+    *Offset = 0;
+}
+
+ULONG
+SystemVirtualCpuIndex(
+    IN  ULONG   Index
+    )
+{
+    return Index;
+}
+
+USHORT
+RtlCaptureStackBackTrace(
+    IN  ULONG   FramesToSkip,
+    IN  ULONG   FramesToCapture,
+    OUT PVOID   *BackTrace,
+    OUT PULONG  BackTraceHash OPTIONAL
+    )
+{
+    ULONG       Index;
+
+    UNREFERENCED_PARAMETER(FramesToSkip);
+    UNREFERENCED_PARAMETER(BackTraceHash);
+
+    for (Index = 0; Index < FramesToCapture; Index++)
+        BackTrace[Index] = NULL;
+
+    return 0;
+}
+
+VOID
+__FreePage(
+    IN  PMDL    Mdl
+    )
+{
+    MmFreePagesFromMdl(Mdl);
+}
+
+HANDLE
+DriverGetParametersKey(
+    VOID
+    )
+{
+    return NULL;
+}
+
+// Only the FIFO ABI is asked for; everything else is left at its default
+NTSTATUS
+RegistryQueryDwordValue(
+    IN  HANDLE  Key,
+    IN  PCHAR   Name,
+    OUT PULONG  Value
+    )
+{
+    UNREFERENCED_PARAMETER(Key);
+
+    if (strcmp(Name, "UseEvtchnFifoAbi") != 0)
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    *Value = 1;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+    IN  PRKDPC      Dpc,
+    IN  PVOID       SystemArgument1,
+    IN  PVOID       SystemArgument2
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor[Dpc->Number];
+    BOOLEAN         Inserted;
+
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    pthread_mutex_lock(&Processor->Lock);
+
+    Inserted = FALSE;
+    if (Dpc->Inserted)
+        goto done;
+
+    Dpc->Inserted = 1;
+    Dpc->Next = NULL;
+
+    if (Processor->Tail != NULL)
+        Processor->Tail->Next = Dpc;
+    else
+        Processor->Head = Dpc;
+    Processor->Tail = Dpc;
+
+    Inserted = TRUE;
+
+done:
+    pthread_mutex_unlock(&Processor->Lock);
+
+    return Inserted;
+}
+
+BOOLEAN
+KeRemoveQueueDpc(
+    IN  PRKDPC      Dpc
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor[Dpc->Number];
+    PKDPC           *Link;
+    PKDPC           Previous;
+    BOOLEAN         Removed;
+
+    pthread_mutex_lock(&Processor->Lock);
+
+    Removed = FALSE;
+    if (!Dpc->Inserted)
+        goto done;
+
+    Previous = NULL;
+    for (Link = &Processor->Head; *Link != Dpc; Link = &(*Link)->Next)
+        Previous = *Link;
+
+    *Link = Dpc->Next;
+    if (Processor->Tail == Dpc)
+        Processor->Tail = Previous;
+
+    Dpc->Next = NULL;
+    Dpc->Inserted = 0;
+
+    Removed = TRUE;
+
+done:
+    pthread_mutex_unlock(&Processor->Lock);
+
+    return Removed;
+}
+
+// Run everything queued on a processor, including anything the DPCs queue
+static BOOLEAN
+SimRunDpcs(
+    IN  ULONG       Index
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor[Index];
+    BOOLEAN         Ran;
+
+    ASSERT3U(KeGetCurrentProcessorNumberEx(NULL), ==, Index);
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    Ran = FALSE;
+
+    for (;;) {
+        PKDPC   Dpc;
+        KIRQL   Irql;
+
+        pthread_mutex_lock(&Processor->Lock);
+
+        Dpc = Processor->Head;
+        if (Dpc != NULL) {
+            Processor->Head = Dpc->Next;
+            if (Processor->Head == NULL)
+                Processor->Tail = NULL;
+
+            Dpc->Next = NULL;
+            Dpc->Inserted = 0;
+        }
+
+        pthread_mutex_unlock(&Processor->Lock);
+
+        if (Dpc == NULL)
+            break;
+
+        // Threaded DPCs run at PASSIVE_LEVEL, as they do unless disabled
+        KeRaiseIrql(Dpc->Threaded ? PASSIVE_LEVEL : DISPATCH_LEVEL, &Irql);
+        Dpc->DeferredRoutine(Dpc, Dpc->DeferredContext, NULL, NULL);
+        KeLowerIrql(Irql);
+
+        Ran = TRUE;
+    }
+
+    return Ran;
+}
+
+// Take the upcall on a vCPU, if one is pending
+static BOOLEAN
+SimUpcall(
+    IN  ULONG           Index
+    )
+{
+    PSIM_VCPU           Vcpu = &SimVcpu[Index];
+    PXENBUS_INTERRUPT   Interrupt;
+    KIRQL               Irql;
+
+    ASSERT3U(KeGetCurrentProcessorNumberEx(NULL), ==, Index);
+
+    if (!__atomic_load_n(&Vcpu->UpcallPending, __ATOMIC_SEQ_CST))
+        return FALSE;
+
+    // Without a per-vCPU vector, upcalls arrive through the callback via
+    Interrupt = (Vcpu->Vector != 0) ?
+                SimProcessor[Index].Interrupt :
+                SimCallbackInterrupt;
+    ASSERT(Interrupt != NULL);
+
+    Irql = FdoAcquireInterruptLock(NULL, Interrupt);
+    (VOID) Interrupt->Callback(NULL, Interrupt->Argument);
+    FdoReleaseInterruptLock(NULL, Interrupt, Irql);
+
+    return TRUE;
+}
+
+// Act as a processor until it has nothing left to do
+static VOID
+SimRunProcessor(
+    IN  ULONG   Index
+    )
+{
+    ULONG       Saved = __HarnessProcessor;
+
+    __HarnessProcessor = Index;
+
+    for (;;) {
+        BOOLEAN Busy;
+
+        Busy = SimUpcall(Index);
+        Busy |= SimRunDpcs(Index);
+
+        if (!Busy)
+            break;
+    }
+
+    __HarnessProcessor = Saved;
+}
+
+// Processor threads are stopped by the time anything flushes
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    )
+{
+    ULONG   Saved = __HarnessProcessor;
+    ULONG   Index;
+
+    for (Index = 0; Index < __HarnessProcessorCount; Index++) {
+        __HarnessProcessor = Index;
+        (VOID) SimRunDpcs(Index);
+    }
+
+    __HarnessProcessor = Saved;
+}
+
+PXENBUS_INTERRUPT
+FdoAllocateInterrupt(
+    IN  PXENBUS_FDO         Fdo,
+    IN  KINTERRUPT_MODE     InterruptMode,
+    IN  USHORT              Group,
+    IN  UCHAR               Number,
+    IN  KSERVICE_ROUTINE    Callback,
+    IN  PVOID               Argument OPTIONAL
+    )
+{
+    PROCESSOR_NUMBER        ProcNumber;
+    PXENBUS_INTERRUPT       Interrupt;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    Interrupt = calloc(1, sizeof (XENBUS_INTERRUPT));
+    if (Interrupt == NULL)
+        return NULL;
+
+    ProcNumber.Group = Group;
+    ProcNumber.Number = Number;
+
+    Interrupt->Mode = InterruptMode;
+    Interrupt->Index = KeGetProcessorIndexFromNumber(&ProcNumber);
+    Interrupt->Callback = Callback;
+    Interrupt->Argument = Argument;
+    KeInitializeSpinLock(&Interrupt->Lock);
+
+    // Latched interrupts are the per-vCPU upcall vectors
+    if (InterruptMode == Latched) {
+        Interrupt->Vector = (UCHAR)(SIM_VECTOR_BASE + Interrupt->Index);
+
+        ASSERT3P(SimProcessor[Interrupt->Index].Interrupt, ==, NULL);
+        SimProcessor[Interrupt->Index].Interrupt = Interrupt;
+    } else {
+        Interrupt->Line = SIM_CALLBACK_LINE;
+
+        ASSERT3P(SimCallbackInterrupt, ==, NULL);
+        SimCallbackInterrupt = Interrupt;
+    }
+
+    return Interrupt;
+}
+
+VOID
+FdoFreeInterrupt(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    if (Interrupt->Mode == Latched) {
+        ASSERT3P(SimProcessor[Interrupt->Index].Interrupt, ==, Interrupt);
+        SimProcessor[Interrupt->Index].Interrupt = NULL;
+    } else {
+        ASSERT3P(SimCallbackInterrupt, ==, Interrupt);
+        SimCallbackInterrupt = NULL;
+    }
+
+    free(Interrupt);
+}
+
+KIRQL
+FdoAcquireInterruptLock(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    )
+{
+    KIRQL                   Irql;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    KeRaiseIrql(HIGH_LEVEL, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Interrupt->Lock);
+
+    return Irql;
+}
+
+VOID
+FdoReleaseInterruptLock(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt,
+    IN  KIRQL               Irql
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    KeReleaseSpinLockFromDpcLevel(&Interrupt->Lock);
+    KeLowerIrql(Irql);
+}
+
+UCHAR
+FdoGetInterruptVector(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return Interrupt->Vector;
+}
+
+ULONG
+FdoGetInterruptLine(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_INTERRUPT   Interrupt
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return Interrupt->Line;
+}
+
+static PVOID
+SimThreadStart(
+    IN  PVOID       Argument
+    )
+{
+    PXENBUS_THREAD  Thread = Argument;
+
+    (VOID) Thread->Function(Thread, Thread->Context);
+
+    return NULL;
+}
+
+NTSTATUS
+ThreadCreate(
+    IN  XENBUS_THREAD_FUNCTION  Function,
+    IN  PVOID                   Context,
+    OUT PXENBUS_THREAD          *Thread
+    )
+{
+    *Thread = calloc(1, sizeof (XENBUS_THREAD));
+    if (*Thread == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Thread)->Function = Function;
+    (*Thread)->Context = Context;
+    KeInitializeEvent(&(*Thread)->Event, NotificationEvent, FALSE);
+
+    if (pthread_create(&(*Thread)->Thread, NULL, SimThreadStart, *Thread) != 0) {
+        free(*Thread);
+        *Thread = NULL;
+
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+PKEVENT
+ThreadGetEvent(
+    IN  PXENBUS_THREAD  Self
+    )
+{
+    return &Self->Event;
+}
+
+BOOLEAN
+ThreadIsAlerted(
+    IN  PXENBUS_THREAD  Self
+    )
+{
+    return __atomic_load_n(&Self->Alerted, __ATOMIC_SEQ_CST);
+}
+
+VOID
+ThreadWake(
+    IN  PXENBUS_THREAD  Thread
+    )
+{
+    (VOID) KeSetEvent(&Thread->Event, 0, FALSE);
+}
+
+VOID
+ThreadAlert(
+    IN  PXENBUS_THREAD  Thread
+    )
+{
+    __atomic_store_n(&Thread->Alerted, TRUE, __ATOMIC_SEQ_CST);
+    ThreadWake(Thread);
+}
+
+VOID
+ThreadJoin(
+    IN  PXENBUS_THREAD  Thread
+    )
+{
+    pthread_join(Thread->Thread, NULL);
+    free(Thread);
+}
+
+static NTSTATUS
+SimSuspendAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSuspendRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static NTSTATUS
+SimSuspendRegister(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_SUSPEND_CALLBACK_TYPE    Type,
+    IN  XENBUS_SUSPEND_FUNCTION         Function,
+    IN  PVOID                           Argument OPTIONAL,
+    OUT PXENBUS_SUSPEND_CALLBACK        *Callback
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT             Context = Interface->Context;
+    PXENBUS_SUSPEND_CALLBACK            *Slot;
+
+    Slot = (Type == SUSPEND_CALLBACK_EARLY) ? &Context->Early : &Context->Late;
+    ASSERT3P(*Slot, ==, NULL);
+
+    *Callback = calloc(1, sizeof (XENBUS_SUSPEND_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    *Slot = *Callback;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSuspendDeregister(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_SUSPEND_CALLBACK    Callback
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT         Context = Interface->Context;
+
+    if (Context->Early == Callback) {
+        Context->Early = NULL;
+    } else {
+        ASSERT3P(Context->Late, ==, Callback);
+        Context->Late = NULL;
+    }
+
+    free(Callback);
+}
+
+static NTSTATUS
+SimSuspendTrigger(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    // Resume is not simulated
+    return STATUS_NOT_SUPPORTED;
+}
+
+static ULONG
+SimSuspendGetCount(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return 0;
+}
+
+static XENBUS_SUSPEND_INTERFACE SimSuspendInterface = {
+    { sizeof (XENBUS_SUSPEND_INTERFACE), 1, NULL, NULL, NULL },
+    SimSuspendAcquire,
+    SimSuspendRelease,
+    SimSuspendRegister,
+    SimSuspendDeregister,
+    SimSuspendTrigger,
+    SimSuspendGetCount
+};
+
+NTSTATUS
+SuspendGetInterface(
+    IN      PXENBUS_SUSPEND_CONTEXT Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, 1);
+    ASSERT3U(Size, >=, sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    *(PXENBUS_SUSPEND_INTERFACE)Interface = SimSuspendInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+SimDebugAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimDebugRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static NTSTATUS
+SimDebugRegister(
+    IN  PINTERFACE              Interface,
+    IN  PCHAR                   Prefix,
+    IN  XENBUS_DEBUG_FUNCTION   Function,
+    IN  PVOID                   Argument OPTIONAL,
+    OUT PXENBUS_DEBUG_CALLBACK  *Callback
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    UNREFERENCED_PARAMETER(Prefix);
+
+    ASSERT3P(Context->Callback, ==, NULL);
+
+    *Callback = calloc(1, sizeof (XENBUS_DEBUG_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    Context->Callback = *Callback;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimDebugPrintf(
+    IN  PINTERFACE          Interface,
+    IN  const CHAR          *Format,
+    ...
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+    CHAR                    Buffer[256];
+    va_list                 Arguments;
+
+    va_start(Arguments, Format);
+    (VOID) vsnprintf(Buffer, sizeof (Buffer), Format, Arguments);
+    va_end(Arguments);
+
+    Context->Lines++;
+}
+
+static VOID
+SimDebugTrigger(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback OPTIONAL
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    if (Callback == NULL)
+        Callback = Context->Callback;
+
+    if (Callback != NULL)
+        Callback->Function(Callback->Argument, FALSE);
+}
+
+static VOID
+SimDebugDeregister(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    ASSERT3P(Context->Callback, ==, Callback);
+    Context->Callback = NULL;
+
+    free(Callback);
+}
+
+static XENBUS_DEBUG_INTERFACE SimDebugInterface = {
+    { sizeof (XENBUS_DEBUG_INTERFACE), 1, NULL, NULL, NULL },
+    SimDebugAcquire,
+    SimDebugRelease,
+    SimDebugRegister,
+    SimDebugPrintf,
+    SimDebugTrigger,
+    SimDebugDeregister
+};
+
+NTSTATUS
+DebugGetInterface(
+    IN      PXENBUS_DEBUG_CONTEXT   Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, 1);
+    ASSERT3U(Size, >=, sizeof (XENBUS_DEBUG_INTERFACE));
+
+    *(PXENBUS_DEBUG_INTERFACE)Interface = SimDebugInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+SimSharedInfoAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSharedInfoRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static BOOLEAN
+SimSharedInfoUpcallPending(
+    IN  PINTERFACE  Interface,
+    IN  ULONG       Index
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return __atomic_exchange_n(&SimVcpu[Index].UpcallPending,
+                               0,
+                               __ATOMIC_SEQ_CST) != 0;
+}
+
+// Only the upcall flag is used with the FIFO ABI
+static XENBUS_SHARED_INFO_INTERFACE SimSharedInfoInterface = {
+    { sizeof (XENBUS_SHARED_INFO_INTERFACE), 2, NULL, NULL, NULL },
+    SimSharedInfoAcquire,
+    SimSharedInfoRelease,
+    SimSharedInfoUpcallPending,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+NTSTATUS
+SharedInfoGetInterface(
+    IN      PXENBUS_SHARED_INFO_CONTEXT Context,
+    IN      ULONG                       Version,
+    IN OUT  PINTERFACE                  Interface,
+    IN      ULONG                       Size
+    )
+{
+    ASSERT3U(Version, ==, 2);
+    ASSERT3U(Size, >=, sizeof (XENBUS_SHARED_INFO_INTERFACE));
+
+    *(PXENBUS_SHARED_INFO_INTERFACE)Interface = SimSharedInfoInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+PXENBUS_SUSPEND_CONTEXT
+FdoGetSuspendContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimSuspendContext;
+}
+
+PXENBUS_DEBUG_CONTEXT
+FdoGetDebugContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimDebugContext;
+}
+
+PXENBUS_SHARED_INFO_CONTEXT
+FdoGetSharedInfoContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimSharedInfoContext;
+}
+
+//
+// The harness, which acts as a driver using the EVTCHN interface
+//
+
+// Each channel has a cache line to itself, as callbacks on different processors update them
+typedef struct _HARNESS_CHANNEL {
+    DECLSPEC_CACHEALIGN PXENBUS_EVTCHN_CHANNEL  Channel;
+    ULONG                   Port;
+    ULONG                   Index;      // The processor it is bound to
+    ULONGLONG               Delivered;
+    ULONGLONG               Misrouted;  // Delivered on any other processor
+} HARNESS_CHANNEL, *PHARNESS_CHANNEL;
+
+typedef struct _HARNESS {
+    PXENBUS_EVTCHN_CONTEXT  Context;
+    XENBUS_EVTCHN_INTERFACE EvtchnInterface;
+    HARNESS_CHANNEL         Channel[SIM_PORTS - 1];
+    ULONG                   Count;
+} HARNESS, *PHARNESS;
+
+static HARNESS  Harness;
+static ULONG    Failures;
+
+#define CHECK(_EXP)                                         \
+        do {                                                \
+            if (!(_EXP)) {                                  \
+                fprintf(stderr, "%s:%d: CHECK FAILED: %s\n",\
+                        __FUNCTION__, __LINE__, #_EXP);     \
+                Failures++;                                 \
+            }                                               \
+        } while (FALSE)
+
+static BOOLEAN
+HarnessCallback(
+    IN  PKINTERRUPT     InterruptObject,
+    IN  PVOID           Argument
+    )
+{
+    PHARNESS_CHANNEL    C = Argument;
+
+    UNREFERENCED_PARAMETER(InterruptObject);
+
+    if (KeGetCurrentProcessorNumberEx(NULL) != C->Index)
+        C->Misrouted++;
+
+    C->Delivered++;
+
+    return TRUE;
+}
+
+// Act as every processor in turn until none of them has anything left to do
+static VOID
+HarnessRun(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Index;
+    BOOLEAN         Busy;
+
+    UNREFERENCED_PARAMETER(H);
+
+    do {
+        Busy = FALSE;
+
+        for (Index = 0; Index < __HarnessProcessorCount; Index++) {
+            if (__atomic_load_n(&SimVcpu[Index].UpcallPending, __ATOMIC_SEQ_CST) ||
+                SimProcessor[Index].Head != NULL)
+                Busy = TRUE;
+
+            SimRunProcessor(Index);
+        }
+    } while (Busy);
+}
+
+// Open channels bound to each processor in turn, and unmask them
+static VOID
+HarnessOpen(
+    IN  PHARNESS    H,
+    IN  ULONG       Count
+    )
+{
+    ULONG           Index;
+    NTSTATUS        status;
+
+    ASSERT3U(H->Count, ==, 0);
+    ASSERT3U(Count, <=, ARRAYSIZE(H->Channel));
+
+    for (Index = 0; Index < Count; Index++) {
+        PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+        RtlZeroMemory(C, sizeof (HARNESS_CHANNEL));
+        C->Index = Index % __HarnessProcessorCount;
+
+        C->Channel = XENBUS_EVTCHN(Open,
+                                   &H->EvtchnInterface,
+                                   XENBUS_EVTCHN_TYPE_UNBOUND,
+                                   HarnessCallback,
+                                   C,
+                                   (USHORT)DOMID_SELF,
+                                   FALSE);
+        ASSERT(C->Channel != NULL);
+
+        C->Port = XENBUS_EVTCHN(GetPort,
+                                &H->EvtchnInterface,
+                                C->Channel);
+
+        status = XENBUS_EVTCHN(Bind,
+                               &H->EvtchnInterface,
+                               C->Channel,
+                               0,
+                               (UCHAR)C->Index);
+        ASSERT(NT_SUCCESS(status));
+
+        XENBUS_EVTCHN(Unmask,
+                      &H->EvtchnInterface,
+                      C->Channel,
+                      FALSE);
+    }
+
+    H->Count = Count;
+}
+
+// Wait for the reaper thread to close the ports of every channel closed so far
+static VOID
+HarnessReap(
+    IN  PHARNESS    H
+    )
+{
+    HarnessRun(H);
+
+    while (__atomic_load_n(&H->Context->ReapPending, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+}
+
+static VOID
+HarnessClose(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Index;
+
+    for (Index = 0; Index < H->Count; Index++) {
+        PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+        if (C->Channel == NULL)
+            continue;
+
+        XENBUS_EVTCHN(Close, &H->EvtchnInterface, C->Channel);
+        C->Channel = NULL;
+    }
+
+    HarnessReap(H);
+
+    H->Count = 0;
+}
+
+static ULONGLONG
+HarnessDelivered(
+    IN  PHARNESS    H
+    )
+{
+    ULONGLONG       Delivered;
+    ULONG           Index;
+
+    Delivered = 0;
+    for (Index = 0; Index < H->Count; Index++)
+        Delivered += H->Channel[Index].Delivered;
+
+    return Delivered;
+}
+
+static VOID
+HarnessSetUp(
+    IN  PHARNESS    H,
+    IN  ULONG       Processors
+    )
+{
+    NTSTATUS        status;
+
+    ASSERT3U(Processors, <=, MAXIMUM_PROCESSORS);
+    __HarnessProcessorCount = Processors;
+
+    SimReset();
+
+    status = EvtchnInitialize(NULL, &H->Context);
+    ASSERT(NT_SUCCESS(status));
+
+    status = EvtchnGetInterface(H->Context,
+                                XENBUS_EVTCHN_INTERFACE_VERSION_MAX,
+                                (PINTERFACE)&H->EvtchnInterface,
+                                sizeof (H->EvtchnInterface));
+    ASSERT(NT_SUCCESS(status));
+
+    status = XENBUS_EVTCHN(Acquire, &H->EvtchnInterface);
+    ASSERT(NT_SUCCESS(status));
+
+    // Every processor has its own upcall vector
+    ASSERT3P(H->Context->Processor[Processors - 1]->Interrupt, !=, NULL);
+    ASSERT(H->Context->Processor[Processors - 1]->UpcallEnabled);
+}
+
+static VOID
+HarnessTearDown(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Port;
+
+    HarnessClose(H);
+
+    XENBUS_EVTCHN(Release, &H->EvtchnInterface);
+    EvtchnTeardown(H->Context);
+
+    for (Port = 0; Port < SIM_PORTS; Port++)
+        ASSERT(!SimPort[Port].Allocated);
+
+    ASSERT3U(SimSuspendContext.References, ==, 0);
+    ASSERT3U(SimDebugContext.References, ==, 0);
+    ASSERT3U(SimSharedInfoContext.References, ==, 0);
+
+    RtlZeroMemory(H, sizeof (HARNESS));
+}
+
+static VOID
+TestDeliver(
+    IN  PHARNESS    H
+    )
+{
+    ULONGLONG       Exhausted;
+    ULONG           Index;
+
+    HarnessOpen(H, HARNESS_CHANNELS);
+
+    // More events than a single upcall may deliver on each processor
+    for (Index = 0; Index < H->Count; Index++)
+        CHECK(SimRaise(H->Channel[Index].Port));
+
+    HarnessRun(H);
+
+    for (Index = 0; Index < H->Count; Index++) {
+        PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+        CHECK(C->Delivered == 1);
+        CHECK(C->Misrouted == 0);
+        CHECK(!SimIsPending(C->Port));
+    }
+
+    Exhausted = 0;
+    for (Index = 0; Index < __HarnessProcessorCount; Index++)
+        Exhausted += H->Context->Processor[Index]->BudgetExhausted;
+
+    CHECK(Exhausted != 0);
+
+    // An event raised again before it is delivered is delivered once
+    for (Index = 0; Index < H->Count; Index++) {
+        CHECK(SimRaise(H->Channel[Index].Port));
+        CHECK(!SimRaise(H->Channel[Index].Port));
+    }
+
+    HarnessRun(H);
+
+    for (Index = 0; Index < H->Count; Index++)
+        CHECK(H->Channel[Index].Delivered == 2);
+
+    // Every channel is a loopback, so what is sent comes back
+    for (Index = 0; Index < H->Count; Index++)
+        XENBUS_EVTCHN(Send, &H->EvtchnInterface, H->Channel[Index].Channel);
+
+    HarnessRun(H);
+
+    for (Index = 0; Index < H->Count; Index++) {
+        PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+        CHECK(C->Delivered == 3);
+        CHECK(C->Misrouted == 0);
+    }
+}
+
+static VOID
+TestClose(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Index;
+
+    HarnessOpen(H, HARNESS_CHANNELS);
+
+    for (Index = 0; Index < H->Count; Index++)
+        CHECK(SimRaise(H->Channel[Index].Port));
+
+    // Close every other channel with its event still pending
+    for (Index = 0; Index < H->Count; Index += 2) {
+        PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+        XENBUS_EVTCHN(Close, &H->EvtchnInterface, C->Channel);
+        C->Channel = NULL;
+    }
+
+    HarnessReap(H);
+
+    for (Index = 0; Index < H->Count; Index++) {
+        PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+        if (C->Channel == NULL) {
+            CHECK(C->Delivered == 0);
+            CHECK(!SimPort[C->Port].Allocated);
+        } else {
+            CHECK(C->Delivered == 1);
+            CHECK(SimPort[C->Port].Allocated);
+        }
+    }
+}
+
+static VOID
+TestDebug(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Index;
+
+    HarnessOpen(H, HARNESS_PROCESSORS * 4);
+
+    for (Index = 0; Index < H->Count; Index++)
+        CHECK(SimRaise(H->Channel[Index].Port));
+
+    HarnessRun(H);
+
+    // The statistics dump walks every processor and channel
+    SimDebugContext.Lines = 0;
+    SimDebugContext.Callback->Function(SimDebugContext.Callback->Argument,
+                                       FALSE);
+    CHECK(SimDebugContext.Lines != 0);
+}
+
+static VOID
+BenchLookup(
+    IN  PHARNESS    H
+    )
+{
+    static const ULONG  Open[] = { 16, 256, SIM_PORTS - 1 };
+    ULONG               Sequence[HARNESS_BENCH_SEQUENCE];
+    unsigned            Seed;
+    ULONG               Index;
+
+    Seed = 1;
+
+    printf("port lookup by open channels:\n");
+
+    for (Index = 0; Index < ARRAYSIZE(Open); Index++) {
+        ULONG               Count = Open[Index];
+        PXENBUS_HASH_TABLE  Table;
+        ULONG_PTR           TableSum;
+        ULONG_PTR           HashSum;
+        struct timespec     Start;
+        struct timespec     End;
+        double              TableElapsed;
+        double              HashElapsed;
+        ULONG               Lookup;
+        ULONG               Next;
+        NTSTATUS            status;
+
+        HarnessOpen(H, Count);
+
+        // The hash table as event dispatch used to populate it
+        status = HashTableCreate(&Table);
+        ASSERT(NT_SUCCESS(status));
+
+        for (Next = 0; Next < Count; Next++) {
+            status = HashTableAdd(Table,
+                                  H->Channel[Next].Port,
+                                  (ULONG_PTR)H->Channel[Next].Channel);
+            ASSERT(NT_SUCCESS(status));
+        }
+
+        // Look up the open ports in a random order
+        for (Next = 0; Next < HARNESS_BENCH_SEQUENCE; Next++)
+            Sequence[Next] = H->Channel[rand_r(&Seed) % Count].Port;
+
+        TableSum = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+
+        for (Lookup = 0; Lookup < HARNESS_BENCH_LOOKUPS; Lookup++) {
+            ULONG   Port = Sequence[Lookup % HARNESS_BENCH_SEQUENCE];
+
+            TableSum += (ULONG_PTR)__EvtchnTableLookup(H->Context, Port);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        TableElapsed = (double)(End.tv_sec - Start.tv_sec) * 1e9 +
+                       (double)(End.tv_nsec - Start.tv_nsec);
+
+        HashSum = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+
+        for (Lookup = 0; Lookup < HARNESS_BENCH_LOOKUPS; Lookup++) {
+            ULONG       Port = Sequence[Lookup % HARNESS_BENCH_SEQUENCE];
+            ULONG_PTR   Value;
+
+            if (NT_SUCCESS(HashTableLookup(Table, Port, &Value)))
+                HashSum += Value;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        HashElapsed = (double)(End.tv_sec - Start.tv_sec) * 1e9 +
+                      (double)(End.tv_nsec - Start.tv_nsec);
+
+        // Both must have found the same channels
+        CHECK(TableSum == HashSum);
+
+        printf("%4u open: table %5.1fns/lookup hash %5.1fns/lookup\n",
+               Count,
+               TableElapsed / HARNESS_BENCH_LOOKUPS,
+               HashElapsed / HARNESS_BENCH_LOOKUPS);
+
+        for (Next = 0; Next < Count; Next++)
+            (VOID) HashTableRemove(Table, H->Channel[Next].Port);
+
+        HashTableDestroy(Table);
+
+        HarnessClose(H);
+    }
+}
+
+static VOID
+BenchDispatch(
+    IN  PHARNESS    H
+    )
+{
+    static const ULONG  Pending[] = { 1, 4, 16, 64, 256, 1024 };
+    ULONG               Port[HARNESS_CHANNELS];
+    unsigned            Seed;
+    ULONG               Index;
+
+    HarnessOpen(H, HARNESS_CHANNELS);
+
+    for (Index = 0; Index < HARNESS_CHANNELS; Index++)
+        Port[Index] = H->Channel[Index].Port;
+
+    Seed = 1;
+
+    printf("dispatch cost by pending events:\n");
+
+    for (Index = 0; Index < ARRAYSIZE(Pending); Index++) {
+        ULONG           Count = Pending[Index];
+        ULONG           Rounds = __max(HARNESS_BENCH_EVENTS / Count, 1);
+        ULONGLONG       Delivered;
+        struct timespec Start;
+        struct timespec End;
+        double          Elapsed;
+        ULONG           Round;
+        ULONG           Next;
+
+        // Pick the pending ports at random from those that are open
+        for (Next = 0; Next < Count; Next++) {
+            ULONG   Swap = Next + (rand_r(&Seed) % (HARNESS_CHANNELS - Next));
+            ULONG   Value = Port[Swap];
+
+            Port[Swap] = Port[Next];
+            Port[Next] = Value;
+        }
+
+        Delivered = HarnessDelivered(H);
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+
+        for (Round = 0; Round < Rounds; Round++) {
+            for (Next = 0; Next < Count; Next++)
+                (VOID) SimRaise(Port[Next]);
+
+            SimRunProcessor(0);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        CHECK(HarnessDelivered(H) - Delivered == (ULONGLONG)Rounds * Count);
+
+        Elapsed = (double)(End.tv_sec - Start.tv_sec) * 1e9 +
+                  (double)(End.tv_nsec - Start.tv_nsec);
+
+        printf("%4u pending: %9.1fns/batch %6.1fns/event\n",
+               Count,
+               Elapsed / Rounds,
+               Elapsed / ((double)Rounds * Count));
+    }
+}
+
+typedef struct _HARNESS_PROCESSOR {
+    PHARNESS            Harness;
+    ULONG               Index;
+    pthread_barrier_t   *Barrier;
+    pthread_t           Thread;
+    double              Elapsed;
+} HARNESS_PROCESSOR, *PHARNESS_PROCESSOR;
+
+static HARNESS_PROCESSOR    Processor[HARNESS_SCALE_MAXIMUM];
+
+// Act as one processor, raising events on its own channels and taking them
+static PVOID
+ProcessorThread(
+    IN  PVOID           Argument
+    )
+{
+    PHARNESS_PROCESSOR  P = Argument;
+    PHARNESS            H = P->Harness;
+    ULONG               Rounds = HARNESS_SCALE_EVENTS / HARNESS_SCALE_CHANNELS;
+    struct timespec     Start;
+    struct timespec     End;
+    ULONG               Round;
+
+    (VOID) pthread_barrier_wait(P->Barrier);
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    for (Round = 0; Round < Rounds; Round++) {
+        ULONG   Next;
+
+        for (Next = P->Index; Next < H->Count; Next += __HarnessProcessorCount)
+            (VOID) SimRaise(H->Channel[Next].Port);
+
+        SimRunProcessor(P->Index);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    P->Elapsed = (double)(End.tv_sec - Start.tv_sec) +
+                 (double)(End.tv_nsec - Start.tv_nsec) / 1e9;
+
+    return NULL;
+}
+
+static VOID
+BenchScale(
+    IN  PHARNESS        H,
+    IN  ULONG           Maximum
+    )
+{
+    ULONG               Rounds = HARNESS_SCALE_EVENTS / HARNESS_SCALE_CHANNELS;
+    double              Base;
+    ULONG               Processors;
+
+    Base = 0.0;
+
+    printf("event rate by processors (%ld online):\n",
+           sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (Processors = 1; Processors <= Maximum; Processors *= 2) {
+        pthread_barrier_t   Barrier;
+        double              Elapsed;
+        double              Rate;
+        ULONG               Index;
+
+        HarnessSetUp(H, Processors);
+        HarnessOpen(H, Processors * HARNESS_SCALE_CHANNELS);
+
+        pthread_barrier_init(&Barrier, NULL, Processors);
+
+        for (Index = 0; Index < Processors; Index++) {
+            PHARNESS_PROCESSOR  P = &Processor[Index];
+
+            RtlZeroMemory(P, sizeof (HARNESS_PROCESSOR));
+            P->Harness = H;
+            P->Index = Index;
+            P->Barrier = &Barrier;
+
+            pthread_create(&P->Thread, NULL, ProcessorThread, P);
+        }
+
+        Elapsed = 0.0;
+        for (Index = 0; Index < Processors; Index++) {
+            pthread_join(Processor[Index].Thread, NULL);
+            Elapsed = __max(Elapsed, Processor[Index].Elapsed);
+        }
+
+        pthread_barrier_destroy(&Barrier);
+
+        for (Index = 0; Index < H->Count; Index++) {
+            PHARNESS_CHANNEL    C = &H->Channel[Index];
+
+            CHECK(C->Delivered == Rounds);
+            CHECK(C->Misrouted == 0);
+        }
+
+        Rate = (double)HarnessDelivered(H) / Elapsed;
+        if (Processors == 1)
+            Base = Rate;
+
+        printf("%2u processor(s): %7.2fM events/s %6.2fM/s each (%3.0f%% of linear)\n",
+               Processors,
+               Rate / 1e6,
+               Rate / Processors / 1e6,
+               100.0 * Rate / (Base * Processors));
+
+        HarnessTearDown(H);
+    }
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    ULONG       Maximum;
+
+    // Run as many processors as the host has, but always more than one
+    Maximum = (argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) :
+                           (ULONG)__max(sysconf(_SC_NPROCESSORS_ONLN), 2);
+    Maximum = __min(__max(Maximum, 1), HARNESS_SCALE_MAXIMUM);
+
+    HarnessSetUp(&Harness, HARNESS_PROCESSORS);
+    TestDeliver(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness, HARNESS_PROCESSORS);
+    TestClose(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness, HARNESS_PROCESSORS);
+    TestDebug(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness, 1);
+    BenchLookup(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness, 1);
+    BenchDispatch(&Harness);
+    HarnessTearDown(&Harness);
+
+    BenchScale(&Harness, Maximum);
+
+    printf("%s\n", (Failures == 0) ? "PASS" : "FAIL");
+
+    return (Failures == 0) ? 0 : 1;
+}
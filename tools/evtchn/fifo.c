@@ -0,0 +1,627 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// A user-mode harness for the FIFO event channel ABI. The unmodified
+// src/xenbus/evtchn_fifo.c is built against the shims in include/ and
+// common/ and driven by a simulated hypervisor. The simulator links
+// events into the per-priority queues of the event array and the
+// control block the same way Xen does.
+//
+// The tests check that a poll pass delivers events in priority order,
+// that masked events are held back until they are unmasked, and that
+// events from several producer threads are neither lost nor delivered
+// twice as they race the consumer's unlink.
+//
+// Build and run on Linux from this directory with:
+//
+//   cc -std=gnu11 -O2 -Wall -pthread -Iinclude -I../../include -iquote common -o fifo fifo.c
+//   ./fifo [ITERATIONS]
+//
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+//
+// evtchn_fifo.c only needs the FDO type from fdo.h, and EvtchnReset()
+// from the evtchn.h that fdo.h pulls in. It does not use shared_info.h
+// at all, so keep the real headers out.
+//
+#define _XENBUS_FDO_H
+#define _XENBUS_SHARED_INFO_H
+
+typedef struct _XENBUS_FDO  XENBUS_FDO, *PXENBUS_FDO;
+
+VOID
+EvtchnReset(
+    VOID
+    );
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmultichar"    // pool tags
+
+#include "../../src/xenbus/evtchn_fifo.c"
+
+#pragma GCC diagnostic pop
+
+#define HARNESS_PORTS       512
+#define HARNESS_PRODUCERS   4
+#define HARNESS_RACE_PORTS  8
+#define HARNESS_ITERATIONS  100000
+
+//
+// The simulated hypervisor
+//
+
+#define SIM_PAGES_MAX   (EVENT_PAGES_MAX + HVM_MAX_VCPUS)
+
+static PVOID                        SimPage[SIM_PAGES_MAX];
+static ULONG                        SimPageCount;
+static event_word_t                 *SimEventArray[EVENT_PAGES_MAX];
+static ULONG                        SimEventArrayCount;
+static evtchn_fifo_control_block_t  *SimControlBlock;
+static ULONG                        SimPriority[HARNESS_PORTS];
+
+typedef struct _SIM_QUEUE {
+    pthread_mutex_t Lock;
+    ULONG           Tail;
+} SIM_QUEUE, *PSIM_QUEUE;
+
+static SIM_QUEUE                    SimQueue[EVTCHN_FIFO_MAX_QUEUES];
+
+PMDL
+__AllocatePage(
+    VOID
+    )
+{
+    PMDL    Mdl;
+
+    if (SimPageCount == SIM_PAGES_MAX)
+        return NULL;
+
+    Mdl = calloc(1, sizeof (MDL));
+    if (Mdl == NULL)
+        return NULL;
+
+    Mdl->MappedSystemVa = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (Mdl->MappedSystemVa == NULL) {
+        free(Mdl);
+        return NULL;
+    }
+
+    RtlZeroMemory(Mdl->MappedSystemVa, PAGE_SIZE);
+
+    Mdl->Pfn = SimPageCount++;
+    SimPage[Mdl->Pfn] = Mdl->MappedSystemVa;
+
+    return Mdl;
+}
+
+VOID
+__FreePage(
+    IN  PMDL    Mdl
+    )
+{
+    ASSERT3P(SimPage[Mdl->Pfn], ==, Mdl->MappedSystemVa);
+    SimPage[Mdl->Pfn] = NULL;
+
+    free(Mdl->MappedSystemVa);
+    free(Mdl);
+}
+
+NTSTATUS
+EventChannelExpandArray(
+    IN  PFN_NUMBER  Pfn
+    )
+{
+    ASSERT3U(Pfn, <, SimPageCount);
+    ASSERT(SimPage[Pfn] != NULL);
+
+    if (SimEventArrayCount == EVENT_PAGES_MAX)
+        return STATUS_INSUFFICIENT_RESOURCES;
+
+    SimEventArray[SimEventArrayCount] = SimPage[Pfn];
+    KeMemoryBarrier();
+    SimEventArrayCount++;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EventChannelInitControl(
+    IN  PFN_NUMBER      Pfn,
+    IN  unsigned int    vcpu_id
+    )
+{
+    ASSERT3U(Pfn, <, SimPageCount);
+    ASSERT3U(vcpu_id, ==, 0);
+
+    SimControlBlock = SimPage[Pfn];
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+SystemVirtualCpuIndex(
+    IN  ULONG   Index
+    )
+{
+    return Index;
+}
+
+VOID
+EvtchnReset(
+    VOID
+    )
+{
+    ULONG   Priority;
+
+    for (Priority = 0; Priority < EVTCHN_FIFO_MAX_QUEUES; Priority++)
+        SimQueue[Priority].Tail = 0;
+
+    SimControlBlock = NULL;
+    SimEventArrayCount = 0;
+}
+
+static event_word_t *
+SimEventWord(
+    IN  ULONG   Port
+    )
+{
+    ULONG       Index = Port / EVENT_WORDS_PER_PAGE;
+
+    ASSERT3U(Index, <, SimEventArrayCount);
+    return &SimEventArray[Index][Port % EVENT_WORDS_PER_PAGE];
+}
+
+// Link Port after the tail, but only if the tail is still on the queue
+static BOOLEAN
+SimSetLink(
+    IN  event_word_t    *Tail,
+    IN  ULONG           Port
+    )
+{
+    event_word_t        Old;
+    event_word_t        New;
+
+    do {
+        Old = __atomic_load_n(Tail, __ATOMIC_SEQ_CST);
+        if ((Old & (1u << EVTCHN_FIFO_LINKED)) == 0)
+            return FALSE;
+
+        New = (Old & ~EVTCHN_FIFO_LINK_MASK) | Port;
+    } while (!__atomic_compare_exchange_n(Tail, &Old, New, FALSE,
+                                          __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST));
+
+    return TRUE;
+}
+
+// Queue a pending event, as Xen does when it is raised or unmasked
+static VOID
+SimLink(
+    IN  ULONG       Port
+    )
+{
+    event_word_t    *EventWord = SimEventWord(Port);
+    ULONG           Priority = SimPriority[Port];
+    PSIM_QUEUE      Queue = &SimQueue[Priority];
+    BOOLEAN         Linked;
+
+    if (__atomic_load_n(EventWord, __ATOMIC_SEQ_CST) &
+        ((1u << EVTCHN_FIFO_MASKED) | (1u << EVTCHN_FIFO_LINKED)))
+        return;
+
+    pthread_mutex_lock(&Queue->Lock);
+
+    if (__atomic_fetch_or(EventWord, 1u << EVTCHN_FIFO_LINKED,
+                          __ATOMIC_SEQ_CST) & (1u << EVTCHN_FIFO_LINKED)) {
+        pthread_mutex_unlock(&Queue->Lock);
+        return;
+    }
+
+    //
+    // If the tail has been unlinked then the queue is empty. If the
+    // tail is this port then the queue is also empty, although the tail
+    // appears linked, so write the head in both cases.
+    //
+    Linked = FALSE;
+    if (Queue->Tail != 0 && Queue->Tail != Port)
+        Linked = SimSetLink(SimEventWord(Queue->Tail), Port);
+
+    if (!Linked)
+        __atomic_store_n(&SimControlBlock->head[Priority], Port,
+                         __ATOMIC_SEQ_CST);
+
+    Queue->Tail = Port;
+
+    pthread_mutex_unlock(&Queue->Lock);
+
+    if (!Linked)
+        (VOID) __atomic_fetch_or(&SimControlBlock->ready, 1u << Priority,
+                                 __ATOMIC_SEQ_CST);
+}
+
+// Returns TRUE if the event was not already pending
+static BOOLEAN
+SimRaise(
+    IN  ULONG       Port
+    )
+{
+    event_word_t    *EventWord = SimEventWord(Port);
+
+    if (__atomic_fetch_or(EventWord, 1u << EVTCHN_FIFO_PENDING,
+                          __ATOMIC_SEQ_CST) & (1u << EVTCHN_FIFO_PENDING))
+        return FALSE;
+
+    SimLink(Port);
+    return TRUE;
+}
+
+//
+// The guest side
+//
+
+typedef struct _HARNESS {
+    PXENBUS_EVTCHN_ABI_CONTEXT  Context;
+    XENBUS_EVTCHN_ABI           Abi;
+    ULONGLONG                   Delivered[HARNESS_PORTS];
+    ULONG                       Order[HARNESS_PORTS];
+    ULONG                       Count;
+    BOOLEAN                     Done;
+} HARNESS, *PHARNESS;
+
+static HARNESS  Harness;
+static ULONG    Failures;
+
+#define CHECK(_EXP)                                         \
+        do {                                                \
+            if (!(_EXP)) {                                  \
+                fprintf(stderr, "%s:%d: CHECK FAILED: %s\n",\
+                        __FUNCTION__, __LINE__, #_EXP);     \
+                Failures++;                                 \
+            }                                               \
+        } while (FALSE)
+
+static BOOLEAN
+HarnessEvent(
+    IN  PVOID   Argument,
+    IN  ULONG   Port
+    )
+{
+    PHARNESS    H = Argument;
+
+    ASSERT3U(Port, <, HARNESS_PORTS);
+
+    XENBUS_EVTCHN_ABI(PortAck, &H->Abi, Port);
+
+    H->Delivered[Port]++;
+    if (H->Count < HARNESS_PORTS)
+        H->Order[H->Count] = Port;
+    H->Count++;
+
+    return TRUE;
+}
+
+static BOOLEAN
+HarnessPoll(
+    IN  PHARNESS    H
+    )
+{
+    return XENBUS_EVTCHN_ABI(Poll, &H->Abi, 0, HarnessEvent, H);
+}
+
+static VOID
+HarnessReset(
+    IN  PHARNESS    H
+    )
+{
+    RtlZeroMemory(H->Delivered, sizeof (H->Delivered));
+    RtlZeroMemory(H->Order, sizeof (H->Order));
+    H->Count = 0;
+    H->Done = FALSE;
+}
+
+static VOID
+HarnessSetUp(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Port;
+    NTSTATUS        status;
+
+    status = EvtchnFifoInitialize(NULL, &H->Context);
+    ASSERT(NT_SUCCESS(status));
+
+    EvtchnFifoGetAbi(H->Context, &H->Abi);
+
+    status = H->Abi.EvtchnAbiAcquire(H->Abi.Context);
+    ASSERT(NT_SUCCESS(status));
+
+    // Port 0 is never used since a link of 0 terminates a queue
+    for (Port = 1; Port < HARNESS_PORTS; Port++) {
+        status = XENBUS_EVTCHN_ABI(PortEnable, &H->Abi, Port);
+        ASSERT(NT_SUCCESS(status));
+
+        (VOID) XENBUS_EVTCHN_ABI(PortUnmask, &H->Abi, Port);
+
+        SimPriority[Port] = Port % EVTCHN_FIFO_MAX_QUEUES;
+    }
+
+    HarnessReset(H);
+}
+
+static VOID
+HarnessTearDown(
+    IN  PHARNESS    H
+    )
+{
+    H->Abi.EvtchnAbiRelease(H->Abi.Context);
+    EvtchnFifoTeardown(H->Context);
+
+    RtlZeroMemory(H, sizeof (HARNESS));
+}
+
+static VOID
+TestPriorityOrder(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Port;
+    ULONG           Index;
+
+    for (Port = 1; Port < HARNESS_PORTS; Port++)
+        CHECK(SimRaise(Port));
+
+    CHECK(HarnessPoll(H));
+    CHECK(H->Count == HARNESS_PORTS - 1);
+
+    for (Port = 1; Port < HARNESS_PORTS; Port++)
+        CHECK(H->Delivered[Port] == 1);
+
+    // Highest priority (lowest number) first, then FIFO within a queue
+    for (Index = 1; Index < H->Count; Index++) {
+        ULONG   Previous = H->Order[Index - 1];
+        ULONG   Next = H->Order[Index];
+
+        CHECK(SimPriority[Previous] < SimPriority[Next] ||
+              (SimPriority[Previous] == SimPriority[Next] &&
+               Previous < Next));
+    }
+
+    CHECK(!HarnessPoll(H));
+}
+
+static VOID
+TestMask(
+    IN  PHARNESS    H
+    )
+{
+    // An event raised while masked is not queued until it is unmasked
+    XENBUS_EVTCHN_ABI(PortMask, &H->Abi, 1);
+
+    CHECK(SimRaise(1));
+    CHECK(!HarnessPoll(H));
+    CHECK(H->Delivered[1] == 0);
+
+    CHECK(XENBUS_EVTCHN_ABI(PortUnmask, &H->Abi, 1));
+    SimLink(1);     // As EVTCHNOP_unmask does for a pending event
+
+    CHECK(HarnessPoll(H));
+    CHECK(H->Delivered[1] == 1);
+
+    // An event masked while queued is unlinked but not delivered
+    CHECK(SimRaise(2));
+    XENBUS_EVTCHN_ABI(PortMask, &H->Abi, 2);
+
+    CHECK(!HarnessPoll(H));
+    CHECK(H->Delivered[2] == 0);
+    CHECK(!(*SimEventWord(2) & (1u << EVTCHN_FIFO_LINKED)));
+
+    CHECK(XENBUS_EVTCHN_ABI(PortUnmask, &H->Abi, 2));
+    SimLink(2);
+
+    CHECK(HarnessPoll(H));
+    CHECK(H->Delivered[2] == 1);
+
+    CHECK(!XENBUS_EVTCHN_ABI(PortUnmask, &H->Abi, 3));
+}
+
+typedef struct _PRODUCER {
+    pthread_t   Thread;
+    unsigned    Seed;
+    ULONG       Iterations;
+    ULONGLONG   Raised[HARNESS_PORTS];
+    BOOLEAN     Stuck[HARNESS_PORTS];
+} PRODUCER, *PPRODUCER;
+
+static PRODUCER Producer[HARNESS_PRODUCERS];
+
+static PVOID
+ProducerThread(
+    IN  PVOID   Argument
+    )
+{
+    PPRODUCER   P = Argument;
+    ULONG       Index;
+
+    for (Index = 0; Index < P->Iterations; Index++) {
+        ULONG           Port = 1 + (rand_r(&P->Seed) % HARNESS_RACE_PORTS);
+        event_word_t    *EventWord = SimEventWord(Port);
+        ULONG           Attempt;
+
+        //
+        // Don't just pile up on events that the consumer hasn't seen yet,
+        // but don't keep waiting for ones that have been lost either.
+        //
+        for (Attempt = 0; Attempt < 1000 && !P->Stuck[Port]; Attempt++) {
+            if (!(__atomic_load_n(EventWord, __ATOMIC_SEQ_CST) &
+                  (1u << EVTCHN_FIFO_PENDING)))
+                break;
+
+            sched_yield();
+        }
+
+        if (Attempt == 1000)
+            P->Stuck[Port] = TRUE;
+
+        if (SimRaise(Port))
+            P->Raised[Port]++;
+    }
+
+    return NULL;
+}
+
+static PVOID
+ConsumerThread(
+    IN  PVOID   Argument
+    )
+{
+    PHARNESS    H = Argument;
+
+    for (;;) {
+        BOOLEAN Done = __atomic_load_n(&H->Done, __ATOMIC_SEQ_CST);
+
+        if (HarnessPoll(H))
+            continue;
+
+        // Nothing was left once every producer had finished
+        if (Done)
+            break;
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static VOID
+TestRace(
+    IN  PHARNESS    H,
+    IN  ULONG       Iterations
+    )
+{
+    pthread_t       Consumer;
+    struct timespec Start;
+    struct timespec End;
+    ULONGLONG       Total;
+    double          Elapsed;
+    ULONG           Index;
+    ULONG           Port;
+
+    //
+    // Keep the queue short, so that the consumer is usually unlinking
+    // the tail just as the producers are trying to link onto it.
+    //
+    for (Port = 1; Port <= HARNESS_RACE_PORTS; Port++)
+        SimPriority[Port] = EVTCHN_FIFO_PRIORITY_DEFAULT;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    pthread_create(&Consumer, NULL, ConsumerThread, H);
+
+    for (Index = 0; Index < HARNESS_PRODUCERS; Index++) {
+        PPRODUCER   P = &Producer[Index];
+
+        RtlZeroMemory(P, sizeof (PRODUCER));
+        P->Seed = Index + 1;
+        P->Iterations = Iterations;
+
+        pthread_create(&P->Thread, NULL, ProducerThread, P);
+    }
+
+    for (Index = 0; Index < HARNESS_PRODUCERS; Index++)
+        pthread_join(Producer[Index].Thread, NULL);
+
+    __atomic_store_n(&H->Done, TRUE, __ATOMIC_SEQ_CST);
+    pthread_join(Consumer, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    // Every raise that made an event pending must be delivered once
+    Total = 0;
+    for (Port = 1; Port < HARNESS_PORTS; Port++) {
+        ULONGLONG       Raised = 0;
+        event_word_t    EventWord = *SimEventWord(Port);
+
+        for (Index = 0; Index < HARNESS_PRODUCERS; Index++)
+            Raised += Producer[Index].Raised[Port];
+
+        CHECK(H->Delivered[Port] == Raised);
+        CHECK(!(EventWord & (1u << EVTCHN_FIFO_PENDING)));
+        CHECK(!(EventWord & (1u << EVTCHN_FIFO_LINKED)));
+
+        Total += Raised;
+    }
+
+    Elapsed = (double)(End.tv_sec - Start.tv_sec) +
+              (double)(End.tv_nsec - Start.tv_nsec) / 1e9;
+
+    printf("%u producer(s): %llu event(s) in %.3fs (%.0f/s)\n",
+           HARNESS_PRODUCERS,
+           (unsigned long long)Total,
+           Elapsed,
+           (double)Total / Elapsed);
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    ULONG       Iterations;
+    ULONG       Priority;
+
+    Iterations = (argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) :
+                              HARNESS_ITERATIONS;
+
+    for (Priority = 0; Priority < EVTCHN_FIFO_MAX_QUEUES; Priority++)
+        pthread_mutex_init(&SimQueue[Priority].Lock, NULL);
+
+    HarnessSetUp(&Harness);
+    TestPriorityOrder(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestMask(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestRace(&Harness, Iterations);
+    HarnessTearDown(&Harness);
+
+    printf("%s\n", (Failures == 0) ? "PASS" : "FAIL");
+
+    return (Failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,989 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// Just enough of the kernel API, implemented with GCC builtins and POSIX
+// threads, to build the event channel code, the shared info page and the
+// store code as user-mode code. Kernel objects whose behaviour depends on the rest of
+// the system (DPCs, interrupts and threads) are left to the simulators.
+//
+
+#ifndef _HARNESS_NTDDK_H
+#define _HARNESS_NTDDK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <x86intrin.h>
+
+#define IN
+#define OUT
+#define OPTIONAL
+
+#define __in
+#define __out
+#define __out_opt
+#define __inout
+
+#define VOID    void
+#define TRUE    1
+#define FALSE   0
+
+#define FORCEINLINE __inline__ __attribute__((always_inline))
+#define NTAPI
+
+#define DECLSPEC_CACHEALIGN __attribute__((aligned(64)))
+
+#define C_ASSERT(_e)    _Static_assert(_e, #_e)
+
+// Code analysis annotations
+#define _Function_class_(_x)
+#define _IRQL_requires_(_x)
+#define _IRQL_requires_max_(_x)
+#define _IRQL_requires_min_(_x)
+#define _IRQL_requires_same_
+#define _IRQL_saves_
+#define _IRQL_restores_
+#define _IRQL_raises_(_x)
+#define __drv_requiresIRQL(_x)
+#define __drv_maxIRQL(_x)
+#define __drv_savesIRQL
+#define __drv_restoresIRQL
+#define _Requires_lock_held_(_x)
+#define _Requires_lock_not_held_(_x)
+#define _Acquires_lock_(_x)
+#define _Releases_lock_(_x)
+#define _Acquires_exclusive_lock_(_x)
+#define _Releases_exclusive_lock_(_x)
+#define _Must_inspect_result_
+#define _Check_return_
+#define _Success_(_x)
+
+typedef unsigned char   UCHAR, *PUCHAR, BOOLEAN;
+typedef short           SHORT, CSHORT;
+typedef unsigned short  USHORT, *PUSHORT;
+typedef int             LONG, *PLONG;
+typedef unsigned int    ULONG, *PULONG;
+typedef long long       LONGLONG, *PLONGLONG;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+typedef intptr_t        LONG_PTR;
+typedef uintptr_t       ULONG_PTR, *PULONG_PTR, SIZE_T;
+typedef void            *PVOID, *HANDLE;
+typedef char            CHAR, *PCHAR;
+
+typedef LONG            NTSTATUS;
+
+#define NT_SUCCESS(_status)             ((NTSTATUS)(_status) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS)0xC0000002)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000D)
+#define STATUS_NO_MEMORY                ((NTSTATUS)0xC0000017)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034)
+#define STATUS_QUOTA_EXCEEDED           ((NTSTATUS)0xC0000044)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009A)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BB)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS)0x80000011)
+#define STATUS_OBJECTID_EXISTS          ((NTSTATUS)0xC000022B)
+#define STATUS_RETRY                    ((NTSTATUS)0xC000022D)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005)
+
+#define UNREFERENCED_PARAMETER(_P)      ((void)(_P))
+
+#define RTL_FIELD_SIZE(_Type, _Field)   (sizeof (((_Type *)0)->_Field))
+#define ARRAYSIZE(_Array)               (sizeof (_Array) / sizeof ((_Array)[0]))
+#define FIELD_OFFSET(_Type, _Field)     ((LONG)__builtin_offsetof(_Type, _Field))
+
+#define CONTAINING_RECORD(_Address, _Type, _Field) \
+        ((_Type *)((PCHAR)(_Address) - FIELD_OFFSET(_Type, _Field)))
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY  *Flink;
+    struct _LIST_ENTRY  *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static FORCEINLINE VOID
+InitializeListHead(
+    IN  PLIST_ENTRY ListHead
+    )
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+static FORCEINLINE BOOLEAN
+IsListEmpty(
+    IN  const LIST_ENTRY    *ListHead
+    )
+{
+    return (ListHead->Flink == ListHead) ? TRUE : FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+RemoveEntryList(
+    IN  PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY     Flink = Entry->Flink;
+    PLIST_ENTRY     Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+
+    return (Flink == Blink) ? TRUE : FALSE;
+}
+
+static FORCEINLINE PLIST_ENTRY
+RemoveHeadList(
+    IN  PLIST_ENTRY ListHead
+    )
+{
+    PLIST_ENTRY     Entry = ListHead->Flink;
+
+    (VOID) RemoveEntryList(Entry);
+    return Entry;
+}
+
+static FORCEINLINE PLIST_ENTRY
+RemoveTailList(
+    IN  PLIST_ENTRY ListHead
+    )
+{
+    PLIST_ENTRY     Entry = ListHead->Blink;
+
+    (VOID) RemoveEntryList(Entry);
+    return Entry;
+}
+
+static FORCEINLINE VOID
+InsertTailList(
+    IN  PLIST_ENTRY ListHead,
+    IN  PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY     Blink = ListHead->Blink;
+
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+static FORCEINLINE VOID
+InsertHeadList(
+    IN  PLIST_ENTRY ListHead,
+    IN  PLIST_ENTRY Entry
+    )
+{
+    PLIST_ENTRY     Flink = ListHead->Flink;
+
+    Entry->Flink = Flink;
+    Entry->Blink = ListHead;
+    Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+// Interface GUIDs are only needed to query interfaces through the PnP manager
+#define DEFINE_GUID(_Name, ...)         extern int __unused_ ## _Name
+
+typedef struct _INTERFACE {
+    USHORT  Size;
+    USHORT  Version;
+    PVOID   Context;
+    PVOID   InterfaceReference;
+    PVOID   InterfaceDereference;
+} INTERFACE, *PINTERFACE;
+
+#define __min(_a, _b)   (((_a) < (_b)) ? (_a) : (_b))
+#define __max(_a, _b)   (((_a) > (_b)) ? (_a) : (_b))
+
+#define MAXUCHAR    0xff
+
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1u << PAGE_SHIFT)
+
+typedef ULONG_PTR       PFN_NUMBER, *PPFN_NUMBER;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG   LowPart;
+        LONG    HighPart;
+    };
+    LONGLONG    QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef enum _POOL_TYPE {
+    NonPagedPool
+} POOL_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY {
+    NormalPagePriority
+} MM_PAGE_PRIORITY;
+
+typedef enum _MEMORY_CACHING_TYPE {
+    MmNonCached,
+    MmCached
+} MEMORY_CACHING_TYPE;
+
+typedef enum _KPROCESSOR_MODE {
+    KernelMode
+} KPROCESSOR_MODE;
+
+// Implemented by the simulated hypervisor, which owns the I/O space
+extern PVOID
+MmMapIoSpace(
+    IN  PHYSICAL_ADDRESS    Address,
+    IN  ULONG_PTR           Length,
+    IN  MEMORY_CACHING_TYPE CacheType
+    );
+
+extern VOID
+MmUnmapIoSpace(
+    IN  PVOID       Buffer,
+    IN  ULONG_PTR   Length
+    );
+
+// The harness hands out pages by index, which stands in for the PFN
+typedef struct _MDL {
+    PVOID       MappedSystemVa;
+    PFN_NUMBER  Pfn;
+} MDL, *PMDL;
+
+#define MmGetSystemAddressForMdlSafe(_Mdl, _Priority)   ((_Mdl)->MappedSystemVa)
+#define MmGetMdlPfnArray(_Mdl)                          (&(_Mdl)->Pfn)
+
+// There is only one node, and pages allocated this way are never mapped
+// by the simulated hypervisor, so they have no PFN
+static FORCEINLINE PMDL
+MmAllocateNodePagesForMdlEx(
+    IN  PHYSICAL_ADDRESS    LowAddress,
+    IN  PHYSICAL_ADDRESS    HighAddress,
+    IN  PHYSICAL_ADDRESS    SkipBytes,
+    IN  SIZE_T              TotalBytes,
+    IN  MEMORY_CACHING_TYPE CacheType,
+    IN  ULONG               IdealNode,
+    IN  ULONG               Flags
+    )
+{
+    PMDL                    Mdl;
+
+    UNREFERENCED_PARAMETER(LowAddress);
+    UNREFERENCED_PARAMETER(HighAddress);
+    UNREFERENCED_PARAMETER(SkipBytes);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(IdealNode);
+    UNREFERENCED_PARAMETER(Flags);
+
+    if (TotalBytes != PAGE_SIZE)
+        return NULL;
+
+    Mdl = calloc(1, sizeof (MDL));
+    if (Mdl == NULL)
+        return NULL;
+
+    Mdl->MappedSystemVa = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (Mdl->MappedSystemVa == NULL) {
+        free(Mdl);
+        return NULL;
+    }
+
+    return Mdl;
+}
+
+static FORCEINLINE PVOID
+MmMapLockedPagesSpecifyCache(
+    IN  PMDL                Mdl,
+    IN  KPROCESSOR_MODE     AccessMode,
+    IN  MEMORY_CACHING_TYPE CacheType,
+    IN  PVOID               BaseAddress,
+    IN  ULONG               BugCheckOnFailure,
+    IN  ULONG               Priority
+    )
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(BaseAddress);
+    UNREFERENCED_PARAMETER(BugCheckOnFailure);
+    UNREFERENCED_PARAMETER(Priority);
+
+    return Mdl->MappedSystemVa;
+}
+
+static FORCEINLINE VOID
+MmFreePagesFromMdl(
+    IN  PMDL    Mdl
+    )
+{
+    free(Mdl->MappedSystemVa);
+    Mdl->MappedSystemVa = NULL;
+}
+
+#define ExFreePoolWithTag(_Buffer, _Tag)    free(_Buffer)
+#define ExFreePool(_Buffer)                 free(_Buffer)
+
+#define RtlZeroMemory(_Buffer, _Length)     memset((PVOID)(_Buffer), 0, (_Length))
+#define RtlCopyMemory(_Destination, _Source, _Length)   \
+        memcpy((_Destination), (_Source), (_Length))
+
+#define _strtoui64  strtoull
+
+typedef UCHAR           KIRQL, *PKIRQL;
+typedef volatile LONG   KSPIN_LOCK, *PKSPIN_LOCK;
+
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+#define HIGH_LEVEL      15
+
+// Each thread tracks its own IRQL, so that assertions about it hold
+static __thread KIRQL   __HarnessIrql __attribute__((unused));
+
+static FORCEINLINE KIRQL
+KeGetCurrentIrql(
+    VOID
+    )
+{
+    return __HarnessIrql;
+}
+
+static FORCEINLINE VOID
+KeRaiseIrql(
+    IN  KIRQL   NewIrql,
+    OUT PKIRQL  OldIrql
+    )
+{
+    *OldIrql = __HarnessIrql;
+    if (NewIrql > __HarnessIrql)
+        __HarnessIrql = NewIrql;
+}
+
+static FORCEINLINE VOID
+KeLowerIrql(
+    IN  KIRQL   NewIrql
+    )
+{
+    __HarnessIrql = NewIrql;
+}
+
+static FORCEINLINE VOID
+KeInitializeSpinLock(
+    IN  PKSPIN_LOCK Lock
+    )
+{
+    *Lock = 0;
+}
+
+static FORCEINLINE VOID
+KeAcquireSpinLockAtDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    )
+{
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0)
+        sched_yield();
+}
+
+static FORCEINLINE VOID
+KeReleaseSpinLockFromDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    )
+{
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+static FORCEINLINE BOOLEAN
+KeTryToAcquireSpinLockAtDpcLevel(
+    IN  PKSPIN_LOCK Lock
+    )
+{
+    return (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) == 0) ? TRUE : FALSE;
+}
+
+static FORCEINLINE VOID
+KeAcquireSpinLock(
+    IN  PKSPIN_LOCK Lock,
+    OUT PKIRQL      Irql
+    )
+{
+    KeRaiseIrql(DISPATCH_LEVEL, Irql);
+    KeAcquireSpinLockAtDpcLevel(Lock);
+}
+
+static FORCEINLINE VOID
+KeReleaseSpinLock(
+    IN  PKSPIN_LOCK Lock,
+    IN  KIRQL       Irql
+    )
+{
+    KeReleaseSpinLockFromDpcLevel(Lock);
+    KeLowerIrql(Irql);
+}
+
+#define KeMemoryBarrier()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define ALL_PROCESSOR_GROUPS    0xffff
+#define MAXIMUM_PROCESSORS      64
+
+typedef ULONG_PTR   KAFFINITY;
+
+typedef struct _GROUP_AFFINITY {
+    KAFFINITY   Mask;
+    USHORT      Group;
+    USHORT      Reserved[3];
+} GROUP_AFFINITY, *PGROUP_AFFINITY;
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT  Group;
+    UCHAR   Number;
+    UCHAR   Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+//
+// A single group of simulated vCPUs on a single node. There is one vCPU
+// unless a simulator says otherwise, and each thread runs on vCPU 0
+// until the simulator puts it on another.
+//
+static ULONG            __HarnessProcessorCount __attribute__((unused)) = 1;
+static __thread ULONG   __HarnessProcessor __attribute__((unused));
+
+static FORCEINLINE ULONG
+KeQueryActiveProcessorCountEx(
+    IN  USHORT  GroupNumber
+    )
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+
+    return __HarnessProcessorCount;
+}
+
+static FORCEINLINE NTSTATUS
+KeGetProcessorNumberFromIndex(
+    IN  ULONG               Index,
+    OUT PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    if (Index >= __HarnessProcessorCount)
+        return STATUS_INVALID_PARAMETER;
+
+    ProcNumber->Group = 0;
+    ProcNumber->Number = (UCHAR)Index;
+    ProcNumber->Reserved = 0;
+
+    return STATUS_SUCCESS;
+}
+
+static FORCEINLINE ULONG
+KeGetProcessorIndexFromNumber(
+    IN  PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    return ProcNumber->Number;
+}
+
+static FORCEINLINE ULONG
+KeGetCurrentProcessorNumberEx(
+    OUT PPROCESSOR_NUMBER   ProcNumber OPTIONAL
+    )
+{
+    if (ProcNumber != NULL)
+        (VOID) KeGetProcessorNumberFromIndex(__HarnessProcessor, ProcNumber);
+
+    return __HarnessProcessor;
+}
+
+static FORCEINLINE USHORT
+KeQueryHighestNodeNumber(
+    VOID
+    )
+{
+    return 0;
+}
+
+static FORCEINLINE VOID
+KeQueryNodeActiveAffinity(
+    IN  USHORT          NodeNumber,
+    OUT PGROUP_AFFINITY Affinity OPTIONAL,
+    OUT PUSHORT         Count OPTIONAL
+    )
+{
+    UNREFERENCED_PARAMETER(NodeNumber);
+
+    if (Affinity != NULL) {
+        memset(Affinity, 0, sizeof (GROUP_AFFINITY));
+        Affinity->Mask = (__HarnessProcessorCount < 64) ?
+                         ((KAFFINITY)1 << __HarnessProcessorCount) - 1 :
+                         ~(KAFFINITY)0;
+    }
+
+    if (Count != NULL)
+        *Count = (USHORT)__HarnessProcessorCount;
+}
+
+//
+// Time is taken from the monotonic clock. The performance counter
+// counts nanoseconds and the interrupt time counts 100ns units.
+//
+static FORCEINLINE LARGE_INTEGER
+KeQueryPerformanceCounter(
+    OUT PLARGE_INTEGER  Frequency OPTIONAL
+    )
+{
+    struct timespec     Time;
+    LARGE_INTEGER       Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    Now.QuadPart = (Time.tv_sec * 1000000000ll) + Time.tv_nsec;
+
+    if (Frequency != NULL)
+        Frequency->QuadPart = 1000000000ll;
+
+    return Now;
+}
+
+static FORCEINLINE ULONGLONG
+KeQueryInterruptTime(
+    VOID
+    )
+{
+    return (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart / 100;
+}
+
+// System time counts 100ns units from 1601, rather than seconds from 1970
+static FORCEINLINE VOID
+KeQuerySystemTime(
+    OUT PLARGE_INTEGER  CurrentTime
+    )
+{
+    struct timespec     Time;
+
+    clock_gettime(CLOCK_REALTIME, &Time);
+    CurrentTime->QuadPart = ((Time.tv_sec + 11644473600ll) * 10000000ll) +
+                            (Time.tv_nsec / 100);
+}
+
+//
+// Dispatcher objects. Only notification and synchronization events are
+// needed, and they are waited on with a relative timeout, if any.
+//
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive
+} KWAIT_REASON;
+
+typedef struct _KEVENT {
+    pthread_mutex_t Mutex;
+    pthread_cond_t  Condition;
+    EVENT_TYPE      Type;
+    LONG            State;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+static FORCEINLINE VOID
+KeInitializeEvent(
+    IN  PKEVENT     Event,
+    IN  EVENT_TYPE  Type,
+    IN  BOOLEAN     State
+    )
+{
+    pthread_mutex_init(&Event->Mutex, NULL);
+    pthread_cond_init(&Event->Condition, NULL);
+    Event->Type = Type;
+    Event->State = State;
+}
+
+static FORCEINLINE LONG
+KeSetEvent(
+    IN  PKEVENT     Event,
+    IN  LONG        Increment,
+    IN  BOOLEAN     Wait
+    )
+{
+    LONG            State;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&Event->Mutex);
+    State = Event->State;
+    Event->State = 1;
+    pthread_cond_broadcast(&Event->Condition);
+    pthread_mutex_unlock(&Event->Mutex);
+
+    return State;
+}
+
+static FORCEINLINE VOID
+KeClearEvent(
+    IN  PKEVENT     Event
+    )
+{
+    pthread_mutex_lock(&Event->Mutex);
+    Event->State = 0;
+    pthread_mutex_unlock(&Event->Mutex);
+}
+
+static FORCEINLINE NTSTATUS
+KeWaitForSingleObject(
+    IN  PVOID           Object,
+    IN  KWAIT_REASON    WaitReason,
+    IN  KPROCESSOR_MODE WaitMode,
+    IN  BOOLEAN         Alertable,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    )
+{
+    PKEVENT             Event = Object;
+    struct timespec     Deadline;
+    NTSTATUS            status;
+
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+
+    if (Timeout != NULL) {
+        LONGLONG    Delay;
+
+        // Only relative timeouts (in 100ns units) are used
+        Delay = -Timeout->QuadPart * 100;
+
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_sec += Delay / 1000000000ll;
+        Deadline.tv_nsec += Delay % 1000000000ll;
+        if (Deadline.tv_nsec >= 1000000000l) {
+            Deadline.tv_sec++;
+            Deadline.tv_nsec -= 1000000000l;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+    pthread_mutex_lock(&Event->Mutex);
+    while (Event->State == 0) {
+        if (Timeout == NULL) {
+            pthread_cond_wait(&Event->Condition, &Event->Mutex);
+        } else if (pthread_cond_timedwait(&Event->Condition,
+                                          &Event->Mutex,
+                                          &Deadline) == ETIMEDOUT) {
+            status = STATUS_TIMEOUT;
+            break;
+        }
+    }
+
+    if (status == STATUS_SUCCESS && Event->Type == SynchronizationEvent)
+        Event->State = 0;
+
+    pthread_mutex_unlock(&Event->Mutex);
+
+    return status;
+}
+
+//
+// DPCs and interrupts. The objects are initialized here, but queuing a
+// DPC, and so running it, is up to the simulator.
+//
+typedef struct _KDPC    KDPC, *PKDPC, *PRKDPC;
+
+typedef VOID
+KDEFERRED_ROUTINE(
+    IN  PKDPC   Dpc,
+    IN  PVOID   DeferredContext,
+    IN  PVOID   SystemArgument1,
+    IN  PVOID   SystemArgument2
+    );
+typedef KDEFERRED_ROUTINE   *PKDEFERRED_ROUTINE;
+
+struct _KDPC {
+    PKDEFERRED_ROUTINE  DeferredRoutine;
+    PVOID               DeferredContext;
+    BOOLEAN             Threaded;
+    ULONG               Number;
+    volatile LONG       Inserted;
+    PKDPC               Next;
+};
+
+static FORCEINLINE VOID
+KeInitializeDpc(
+    IN  PKDPC               Dpc,
+    IN  PKDEFERRED_ROUTINE  DeferredRoutine,
+    IN  PVOID               DeferredContext
+    )
+{
+    memset(Dpc, 0, sizeof (KDPC));
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+}
+
+static FORCEINLINE VOID
+KeInitializeThreadedDpc(
+    IN  PKDPC               Dpc,
+    IN  PKDEFERRED_ROUTINE  DeferredRoutine,
+    IN  PVOID               DeferredContext
+    )
+{
+    KeInitializeDpc(Dpc, DeferredRoutine, DeferredContext);
+    Dpc->Threaded = TRUE;
+}
+
+static FORCEINLINE NTSTATUS
+KeSetTargetProcessorDpcEx(
+    IN  PKDPC               Dpc,
+    IN  PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    Dpc->Number = KeGetProcessorIndexFromNumber(ProcNumber);
+    return STATUS_SUCCESS;
+}
+
+extern BOOLEAN
+KeInsertQueueDpc(
+    IN  PRKDPC  Dpc,
+    IN  PVOID   SystemArgument1,
+    IN  PVOID   SystemArgument2
+    );
+
+extern BOOLEAN
+KeRemoveQueueDpc(
+    IN  PRKDPC  Dpc
+    );
+
+extern VOID
+KeFlushQueuedDpcs(
+    VOID
+    );
+
+typedef struct _KINTERRUPT  KINTERRUPT, *PKINTERRUPT;
+
+typedef BOOLEAN
+KSERVICE_ROUTINE(
+    IN  PKINTERRUPT Interrupt,
+    IN  PVOID       ServiceContext
+    );
+typedef KSERVICE_ROUTINE    *PKSERVICE_ROUTINE;
+
+typedef enum _KINTERRUPT_MODE {
+    LevelSensitive,
+    Latched
+} KINTERRUPT_MODE;
+
+typedef struct _TIME_FIELDS {
+    CSHORT  Year;
+    CSHORT  Month;
+    CSHORT  Day;
+    CSHORT  Hour;
+    CSHORT  Minute;
+    CSHORT  Second;
+    CSHORT  Milliseconds;
+    CSHORT  Weekday;
+} TIME_FIELDS, *PTIME_FIELDS;
+
+static FORCEINLINE VOID
+RtlTimeToTimeFields(
+    IN  PLARGE_INTEGER  Time,
+    OUT PTIME_FIELDS    TimeFields
+    )
+{
+    time_t              Seconds;
+    struct tm           Tm;
+
+    // System time counts 100ns units from 1601, rather than seconds from 1970
+    Seconds = (time_t)(Time->QuadPart / 10000000ll) - 11644473600ll;
+    gmtime_r(&Seconds, &Tm);
+
+    TimeFields->Year = (CSHORT)(Tm.tm_year + 1900);
+    TimeFields->Month = (CSHORT)(Tm.tm_mon + 1);
+    TimeFields->Day = (CSHORT)Tm.tm_mday;
+    TimeFields->Hour = (CSHORT)Tm.tm_hour;
+    TimeFields->Minute = (CSHORT)Tm.tm_min;
+    TimeFields->Second = (CSHORT)Tm.tm_sec;
+    TimeFields->Milliseconds = (CSHORT)((Time->QuadPart / 10000ll) % 1000);
+    TimeFields->Weekday = (CSHORT)Tm.tm_wday;
+}
+
+static FORCEINLINE LONG
+InterlockedExchange(
+    IN  volatile LONG   *Target,
+    IN  LONG            Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONG
+InterlockedCompareExchange(
+    IN  volatile LONG   *Destination,
+    IN  LONG            Exchange,
+    IN  LONG            Comparand
+    )
+{
+    return __sync_val_compare_and_swap(Destination, Comparand, Exchange);
+}
+
+static FORCEINLINE LONG
+InterlockedAdd(
+    IN  volatile LONG   *Addend,
+    IN  LONG            Value
+    )
+{
+    return __atomic_add_fetch(Addend, Value, __ATOMIC_SEQ_CST);
+}
+
+#define InterlockedIncrement(_Addend)   InterlockedAdd((_Addend), 1)
+#define InterlockedDecrement(_Addend)   InterlockedAdd((_Addend), -1)
+
+static FORCEINLINE SHORT
+InterlockedIncrement16(
+    IN  volatile SHORT  *Addend
+    )
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONGLONG
+InterlockedAdd64(
+    IN  volatile LONGLONG   *Addend,
+    IN  LONGLONG            Value
+    )
+{
+    return __atomic_add_fetch(Addend, Value, __ATOMIC_SEQ_CST);
+}
+
+#define InterlockedIncrement64(_Addend) InterlockedAdd64((_Addend), 1)
+
+static FORCEINLINE LONGLONG
+InterlockedExchange64(
+    IN  volatile LONGLONG   *Target,
+    IN  LONGLONG            Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+static FORCEINLINE LONGLONG
+InterlockedCompareExchange64(
+    IN  volatile LONGLONG   *Destination,
+    IN  LONGLONG            Exchange,
+    IN  LONGLONG            Comparand
+    )
+{
+    return __sync_val_compare_and_swap(Destination, Comparand, Exchange);
+}
+
+#define InterlockedCompareExchangePointer(_Destination, _Exchange, _Comparand)    \
+        ((PVOID)__sync_val_compare_and_swap((PVOID volatile *)(_Destination),       \
+                                            (PVOID)(_Comparand),                    \
+                                            (PVOID)(_Exchange)))
+
+// Pointer targets may be of any pointer type, as MSVC allows
+#define InterlockedExchangePointer(_Target, _Value)                                 \
+        ((PVOID)__atomic_exchange_n((PVOID volatile *)(_Target), (PVOID)(_Value),   \
+                                    __ATOMIC_SEQ_CST))
+
+static FORCEINLINE CHAR
+_InterlockedExchange8(
+    IN  volatile CHAR   *Target,
+    IN  CHAR            Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+//
+// As with the bts and btr instructions that these are built from, Bit
+// indexes a bit string that starts at Base, so it may be 32 or more.
+//
+static FORCEINLINE BOOLEAN
+InterlockedBitTestAndSet(
+    IN  volatile LONG   *Base,
+    IN  LONG            Bit
+    )
+{
+    LONG                Mask = (LONG)(1u << (Bit % 32));
+
+    return (__atomic_fetch_or(&Base[Bit / 32], Mask, __ATOMIC_SEQ_CST) & Mask) ? TRUE : FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+InterlockedBitTestAndReset(
+    IN  volatile LONG   *Base,
+    IN  LONG            Bit
+    )
+{
+    LONG                Mask = (LONG)(1u << (Bit % 32));
+
+    return (__atomic_fetch_and(&Base[Bit / 32], ~Mask, __ATOMIC_SEQ_CST) & Mask) ? TRUE : FALSE;
+}
+
+static FORCEINLINE BOOLEAN
+_BitScanForward(
+    OUT ULONG   *Index,
+    IN  ULONG   Mask
+    )
+{
+    if (Mask == 0)
+        return FALSE;
+
+    *Index = (ULONG)__builtin_ctz(Mask);
+    return TRUE;
+}
+
+static FORCEINLINE BOOLEAN
+_BitScanReverse(
+    OUT ULONG   *Index,
+    IN  ULONG   Mask
+    )
+{
+    if (Mask == 0)
+        return FALSE;
+
+    *Index = 31 - (ULONG)__builtin_clz(Mask);
+    return TRUE;
+}
+
+static FORCEINLINE BOOLEAN
+_BitScanForward64(
+    OUT ULONG       *Index,
+    IN  ULONGLONG   Mask
+    )
+{
+    if (Mask == 0)
+        return FALSE;
+
+    *Index = (ULONG)__builtin_ctzll(Mask);
+    return TRUE;
+}
+
+#endif  // _HARNESS_NTDDK_H
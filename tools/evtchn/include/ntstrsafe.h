@@ -0,0 +1,112 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// The counted string functions used by the store code. Formatting is
+// done by vsnprintf(), except that "%p" is printed as the MSVC runtime
+// prints it: every digit of the pointer, in upper case, with no "0x"
+// prefix. Watch tokens depend on that, as they have a fixed length.
+// The arguments are also left for the caller to format again, as they
+// are with MSVC, since the store retries with a bigger buffer.
+//
+
+#ifndef _HARNESS_NTSTRSAFE_H
+#define _HARNESS_NTSTRSAFE_H
+
+#include <ntddk.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+C_ASSERT(sizeof (PVOID) == sizeof (unsigned long));
+
+static __inline__ NTSTATUS
+RtlStringCbVPrintfA(
+    OUT PCHAR       Buffer,
+    IN  SIZE_T      Length,
+    IN  const CHAR  *Format,
+    IN  va_list     Arguments
+    )
+{
+    CHAR            Converted[256];
+    va_list         Copy;
+    ULONG           Index;
+    int             Count;
+
+    Index = 0;
+    while (*Format != '\0') {
+        if (Index >= sizeof (Converted) - 4)
+            return STATUS_INVALID_PARAMETER;
+
+        if (Format[0] == '%' && Format[1] == 'p') {
+            Index += sprintf(&Converted[Index], "%%0%zulX", sizeof (PVOID) * 2);
+            Format += 2;
+            continue;
+        }
+
+        Converted[Index++] = *Format++;
+    }
+    Converted[Index] = '\0';
+
+    if (Length == 0)
+        return STATUS_INVALID_PARAMETER;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+    va_copy(Copy, Arguments);
+    Count = vsnprintf(Buffer, Length, Converted, Copy);
+    va_end(Copy);
+#pragma GCC diagnostic pop
+
+    if (Count < 0)
+        return STATUS_INVALID_PARAMETER;
+
+    return ((SIZE_T)Count < Length) ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW;
+}
+
+static __inline__ NTSTATUS
+RtlStringCbPrintfA(
+    OUT PCHAR       Buffer,
+    IN  SIZE_T      Length,
+    IN  const CHAR  *Format,
+    ...
+    )
+{
+    va_list         Arguments;
+    NTSTATUS        status;
+
+    va_start(Arguments, Format);
+    status = RtlStringCbVPrintfA(Buffer, Length, Format, Arguments);
+    va_end(Arguments);
+
+    return status;
+}
+
+#endif  // _HARNESS_NTSTRSAFE_H
@@ -0,0 +1,401 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// The event channel definitions from xen/public/event_channel.h, the
+// shared info page and multicall entry from xen/public/xen.h, the store
+// wire protocol from xen/public/io/xs_wire.h, and the hypercalls used by
+// the event channel code, shared_info.c and store.c, which are
+// implemented by the simulated hypervisors in fifo.c, two_level.c,
+// dispatch.c and store.c.
+//
+
+#ifndef _HARNESS_XEN_H
+#define _HARNESS_XEN_H
+
+#include <ntddk.h>
+
+#define __checkReturn
+#define XEN_API
+
+#define HVM_MAX_VCPUS   128
+
+#define HVM_PARAM_CALLBACK_IRQ      0
+#define HVM_PARAM_STORE_PFN         1
+#define HVM_PARAM_STORE_EVTCHN      2
+#define HVM_PARAM_CONSOLE_EVTCHN    18
+
+typedef uint16_t domid_t;
+
+#define DOMID_SELF      (0x7FF0U)
+#define DOMID_INVALID   (0x7FF4U)
+
+typedef uint32_t evtchn_port_t;
+
+#define EVTCHNOP_bind_interdomain   0
+#define EVTCHNOP_bind_virq          1
+#define EVTCHNOP_close              3
+#define EVTCHNOP_alloc_unbound      6
+#define EVTCHNOP_bind_vcpu          8
+#define EVTCHNOP_set_priority       13
+
+struct evtchn_alloc_unbound {
+    domid_t dom, remote_dom;
+    evtchn_port_t port;
+};
+
+struct evtchn_bind_interdomain {
+    domid_t remote_dom;
+    evtchn_port_t remote_port;
+    evtchn_port_t local_port;
+};
+
+struct evtchn_bind_virq {
+    uint32_t virq;
+    uint32_t vcpu;
+    evtchn_port_t port;
+};
+
+struct evtchn_close {
+    evtchn_port_t port;
+};
+
+struct evtchn_bind_vcpu {
+    evtchn_port_t port;
+    uint32_t vcpu;
+};
+
+struct evtchn_set_priority {
+    uint32_t port;
+    uint32_t priority;
+};
+
+
+#define EVTCHN_FIFO_PRIORITY_MAX     0
+#define EVTCHN_FIFO_PRIORITY_DEFAULT 7
+#define EVTCHN_FIFO_PRIORITY_MIN     15
+
+#define EVTCHN_FIFO_MAX_QUEUES (EVTCHN_FIFO_PRIORITY_MIN + 1)
+
+typedef uint32_t event_word_t;
+
+#define EVTCHN_FIFO_PENDING 31
+#define EVTCHN_FIFO_MASKED  30
+#define EVTCHN_FIFO_LINKED  29
+#define EVTCHN_FIFO_BUSY    28
+
+#define EVTCHN_FIFO_LINK_BITS 17
+#define EVTCHN_FIFO_LINK_MASK ((1 << EVTCHN_FIFO_LINK_BITS) - 1)
+
+#define EVTCHN_FIFO_NR_CHANNELS (1 << EVTCHN_FIFO_LINK_BITS)
+
+struct evtchn_fifo_control_block {
+    uint32_t ready;
+    uint32_t _rsvd;
+    uint32_t head[EVTCHN_FIFO_MAX_QUEUES];
+};
+typedef struct evtchn_fifo_control_block evtchn_fifo_control_block_t;
+
+typedef ULONG_PTR xen_ulong_t;
+
+#define __HYPERVISOR_event_channel_op   32
+
+struct multicall_entry {
+    xen_ulong_t op, result;
+    xen_ulong_t args[6];
+};
+typedef struct multicall_entry multicall_entry_t;
+
+#define ERRNO_TO_STATUS(_errno, _status)                    \
+        do {                                                \
+            switch (_errno) {                               \
+            case EINVAL:                                    \
+                _status = STATUS_INVALID_PARAMETER;         \
+                break;                                      \
+                                                            \
+            case EEXIST:                                    \
+                _status = STATUS_OBJECTID_EXISTS;           \
+                break;                                      \
+                                                            \
+            case ENOENT:                                    \
+                _status = STATUS_OBJECT_NAME_NOT_FOUND;     \
+                break;                                      \
+                                                            \
+            case ENOMEM:                                    \
+                _status = STATUS_NO_MEMORY;                 \
+                break;                                      \
+                                                            \
+            case ENOSPC:                                    \
+                _status = STATUS_INSUFFICIENT_RESOURCES;    \
+                break;                                      \
+                                                            \
+            default:                                        \
+                _status = STATUS_UNSUCCESSFUL;              \
+                break;                                      \
+            }                                               \
+        } while (FALSE)
+
+// The host's errno values stand in for Xen's, as xs_wire.h needs EINVAL
+#include <xen/public/io/xs_wire.h>
+
+#define XEN_LEGACY_MAX_VCPUS    32
+
+struct vcpu_time_info {
+    uint32_t version;
+    uint32_t pad0;
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    uint32_t tsc_to_system_mul;
+    int8_t   tsc_shift;
+    int8_t   pad1[3];
+};
+
+struct arch_vcpu_info {
+    unsigned long cr2;
+    unsigned long pad;
+};
+
+struct vcpu_info {
+    uint8_t evtchn_upcall_pending;
+    uint8_t evtchn_upcall_mask;
+    xen_ulong_t evtchn_pending_sel;
+    struct arch_vcpu_info arch;
+    struct vcpu_time_info time;
+};
+
+struct arch_shared_info {
+    unsigned long max_pfn;
+    xen_ulong_t   pfn_to_mfn_frame_list_list;
+    unsigned long nmi_reason;
+    uint64_t      pad[32];
+};
+
+struct shared_info {
+    struct vcpu_info vcpu_info[XEN_LEGACY_MAX_VCPUS];
+    xen_ulong_t evtchn_pending[sizeof(xen_ulong_t) * 8];
+    xen_ulong_t evtchn_mask[sizeof(xen_ulong_t) * 8];
+    uint32_t wc_version;
+    uint32_t wc_sec;
+    uint32_t wc_nsec;
+    struct arch_shared_info arch;
+};
+typedef struct shared_info shared_info_t;
+
+#define XENMAPSPACE_shared_info 0
+
+__checkReturn
+XEN_API
+NTSTATUS
+HvmSetParam(
+    IN  ULONG       Parameter,
+    IN  ULONGLONG   Value
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallMulticall(
+    IN  multicall_entry_t   *Entry,
+    IN  ULONG               Count
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+HvmGetParam(
+    IN  ULONG       Parameter,
+    OUT PULONGLONG  Value
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+HvmSetEvtchnUpcallVector(
+    IN  unsigned int    vcpu_id,
+    IN  UCHAR           Vector
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+HvmGetTime(
+    OUT PLARGE_INTEGER  Now
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+MemoryAddToPhysmap(
+    IN  PFN_NUMBER  Pfn,
+    IN  ULONG       Space,
+    IN  ULONG_PTR   Offset
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelSend(
+    IN  evtchn_port_t   Port
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelAllocateUnbound(
+    IN  domid_t         Domain,
+    OUT evtchn_port_t   *Port
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelBindInterDomain(
+    IN  domid_t         RemoteDomain,
+    IN  evtchn_port_t   RemotePort,
+    OUT evtchn_port_t   *LocalPort
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelBindVirq(
+    IN  uint32_t        Virq,
+    OUT evtchn_port_t   *LocalPort
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelQueryInterDomain(
+    IN  evtchn_port_t   LocalPort,
+    OUT domid_t         *RemoteDomain,
+    OUT evtchn_port_t   *RemotePort
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelClose(
+    IN  evtchn_port_t   LocalPort
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelExpandArray(
+    IN  PFN_NUMBER              Pfn
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelInitControl(
+    IN  PFN_NUMBER              Pfn,
+    IN  unsigned int            vcpu_id
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelReset(
+    VOID
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelBindVirtualCpu(
+    IN  ULONG               LocalPort,
+    IN  unsigned int        vcpu_id
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelUnmask(
+    IN  ULONG   LocalPort
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelStatus(
+    IN  ULONG               LocalPort,
+    OUT uint32_t            *Status // EVTCHNSTAT_*
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+EventChannelSetPriority(
+    IN  ULONG               LocalPort,
+    IN  ULONG               Priority    // EVTCHN_FIFO_PRIORITY_*
+    );
+
+XEN_API
+VOID
+SchedYield(
+    VOID
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+SchedPoll(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Timeout OPTIONAL
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+SchedPollDeadline(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Deadline OPTIONAL
+    );
+
+XEN_API
+VOID
+ModuleLookup(
+    IN  ULONG_PTR   Address,
+    OUT PCHAR       *Name,
+    OUT PULONG_PTR  Offset
+    );
+
+XEN_API
+ULONG
+SystemVirtualCpuIndex(
+    IN  ULONG   Index
+    );
+
+#endif  // _HARNESS_XEN_H
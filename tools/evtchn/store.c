@@ -0,0 +1,2845 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// A user-mode harness for the store. The unmodified src/xenbus/store.c
+// is built against the shims in include/ and common/ and driven, through
+// the STORE interface, by a simulated kernel, event channel and
+// xenstored. The simulated xenstored runs on its own thread and serves
+// the shared ring as the real one does, a byte at a time if need be, and
+// signals the store channel whenever it has produced or consumed
+// anything. The store's DPC runs on a thread of its own too.
+//
+// The tests check reads, writes, removal, directories, transactions and
+// watches, including values too large to fit on the ring at once, and
+// that the debug callback runs.
+//
+// The stress test then runs a growing number of threads, each writing,
+// reading back and listing its own nodes as fast as it can, so that
+// requests are submitted, sent and completed on every thread at once,
+// and checks that every response reaches the request it belongs to and
+// that nothing is left queued once they are all done.
+//
+// The store's capture ring (see the StoreCapture parameter) is tested
+// too, and a capture exported from it can be replayed as a benchmark:
+// 'capture' writes one of a small workload to FILE and 'replay' makes
+// each request in FILE again, ROUNDS times over, reporting the rate and
+// any request that xenstored now answers differently. FILE is just what
+// StoreCaptureExport() returned, so it can come from a real guest.
+//
+// Build and run on Linux (x86) from this directory with:
+//
+//   cc -std=gnu11 -O2 -Wall -pthread -Iinclude -I../../include -iquote common -o store store.c
+//   ./store [THREADS]
+//   ./store capture FILE
+//   ./store replay FILE [ROUNDS]
+//
+
+#include <ntddk.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// store.c needs the FDO type from fdo.h, and the interfaces that fdo.h
+// pulls in. Keep fdo.h itself out, since it drags in every other
+// subsystem, and supply the few FDO functions that are used below.
+//
+#define _XENBUS_FDO_H
+
+typedef struct _XENBUS_FDO  XENBUS_FDO, *PXENBUS_FDO;
+
+#define __MODULE__  "XENBUS"
+
+#include "../../src/xenbus/suspend.h"
+#include "../../src/xenbus/debug.h"
+#include "../../src/xenbus/evtchn.h"
+#include "../../src/xenbus/store.h"
+
+//
+// MSVC drops the comma before an empty __VA_ARGS__, and lets "->" be
+// pasted onto a method name. GCC does neither, so the method macros of
+// the interfaces are redefined here.
+//
+#undef  XENBUS_SUSPEND
+#define XENBUS_SUSPEND(_Method, _Interface, ...)    \
+    (_Interface)->_Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_DEBUG
+#define XENBUS_DEBUG(_Method, _Interface, ...)    \
+    (_Interface)->Debug ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_EVTCHN
+#define XENBUS_EVTCHN(_Method, _Interface, ...)    \
+    (_Interface)->Evtchn ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_STORE
+#define XENBUS_STORE(_Method, _Interface, ...)    \
+    (_Interface)->Store ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+//
+// MSVC reads a variable argument back as the narrow type it was promoted
+// from. GCC makes that a trap, so read the promoted type and narrow it.
+//
+#undef  va_arg
+#define va_arg(_Arguments, _Type)                                       \
+    ((_Type)__builtin_va_arg(_Arguments,                                \
+                             __typeof__(__builtin_choose_expr(          \
+                                 sizeof (_Type) < sizeof (int),         \
+                                 0,                                     \
+                                 (_Type)0))))
+
+extern HANDLE
+DriverGetParametersKey(
+    VOID
+    );
+
+PXENBUS_EVTCHN_CONTEXT
+FdoGetEvtchnContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+PXENBUS_SUSPEND_CONTEXT
+FdoGetSuspendContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+PXENBUS_DEBUG_CONTEXT
+FdoGetDebugContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmultichar"        // pool tags and magic numbers
+#pragma GCC diagnostic ignored "-Wunknown-pragmas"  // #pragma warning
+#pragma GCC diagnostic ignored "-Wformat"           // ULONG_PTR offsets printed with %p
+#pragma GCC diagnostic ignored "-Wswitch"           // combined permission masks
+#pragma GCC diagnostic ignored "-Wunused-but-set-variable"  // StoreSuspendCallbackLate()
+
+#include "../../src/xenbus/store.c"
+
+#pragma GCC diagnostic pop
+
+#define HARNESS_LARGE_VALUE     1000    // Too big for the ring along with its header
+#define HARNESS_STRESS_REQUESTS 2048    // Per thread
+#define HARNESS_STRESS_KEYS     16      // Per thread
+#define HARNESS_STRESS_MAXIMUM  16
+
+//
+// The simulated hypervisor and xenstored
+//
+
+#define SIM_STORE_PORT      1
+#define SIM_STORE_BUCKETS   256
+
+static struct xenstore_domain_interface SimShared __attribute__((aligned(PAGE_SIZE)));
+
+// The remote end of the store channel. Generation counts notifications.
+typedef struct _SIM_CHANNEL {
+    pthread_mutex_t         Lock;
+    pthread_cond_t          Condition;
+    ULONGLONG               Generation;
+    PXENBUS_EVTCHN_CHANNEL  Channel;
+} SIM_CHANNEL, *PSIM_CHANNEL;
+
+static SIM_CHANNEL          SimChannel;
+
+static volatile ULONGLONG   SimYields;
+static volatile ULONGLONG   SimPolls;
+
+typedef struct _SIM_NODE {
+    struct _SIM_NODE    *Next;
+    PCHAR               Value;
+    ULONG               Length;
+    CHAR                Path[1];
+} SIM_NODE, *PSIM_NODE;
+
+typedef struct _SIM_WATCH {
+    struct _SIM_WATCH   *Next;
+    PCHAR               Path;
+    PCHAR               Token;
+} SIM_WATCH, *PSIM_WATCH;
+
+//
+// Transactions are accepted but not isolated, and never fail; nothing
+// here depends on what other guests could see in the meantime.
+//
+typedef struct _SIM_STORE {
+    pthread_t           Thread;
+    KEVENT              Event;      // Signalled by the guest
+    volatile BOOLEAN    Stop;
+    CHAR                Request[sizeof (struct xsd_sockmsg) + XENSTORE_PAYLOAD_MAX + 1]
+                        __attribute__((aligned(__alignof__(struct xsd_sockmsg))));
+    ULONG               Received;
+    PSIM_NODE           Node[SIM_STORE_BUCKETS];
+    PSIM_WATCH          Watch;
+    ULONG               TransactionId;
+    ULONGLONG           Requests;
+} SIM_STORE, *PSIM_STORE;
+
+static SIM_STORE    SimStore;
+
+//
+// The simulated kernel
+//
+
+// The single processor that the store's DPC is queued to
+typedef struct _SIM_PROCESSOR {
+    pthread_t           Thread;
+    pthread_mutex_t     Lock;
+    pthread_cond_t      Condition;
+    PKDPC               Head;
+    PKDPC               Tail;
+    ULONG               Running;
+    BOOLEAN             Stop;
+} SIM_PROCESSOR, *PSIM_PROCESSOR;
+
+static SIM_PROCESSOR    SimProcessor;
+
+struct _XENBUS_EVTCHN_CONTEXT {
+    LONG    References;
+};
+
+struct _XENBUS_EVTCHN_CHANNEL {
+    PKSERVICE_ROUTINE   Callback;
+    PVOID               Argument;
+    ULONG               Port;
+    BOOLEAN             Masked;
+};
+
+struct _XENBUS_SUSPEND_CONTEXT {
+    LONG                        References;
+    PXENBUS_SUSPEND_CALLBACK    Early;
+    PXENBUS_SUSPEND_CALLBACK    Late;
+};
+
+struct _XENBUS_SUSPEND_CALLBACK {
+    XENBUS_SUSPEND_FUNCTION Function;
+    PVOID                   Argument;
+};
+
+struct _XENBUS_DEBUG_CONTEXT {
+    LONG                    References;
+    PXENBUS_DEBUG_CALLBACK  Callback;
+    ULONG                   Lines;
+    const CHAR              *Match;
+    ULONG                   Matches;
+};
+
+struct _XENBUS_DEBUG_CALLBACK {
+    XENBUS_DEBUG_FUNCTION   Function;
+    PVOID                   Argument;
+};
+
+static XENBUS_EVTCHN_CONTEXT    SimEvtchnContext;
+static XENBUS_SUSPEND_CONTEXT   SimSuspendContext;
+static XENBUS_DEBUG_CONTEXT     SimDebugContext;
+
+static ULONGLONG
+SimNow(
+    VOID
+    )
+{
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (Time.tv_sec * 1000000000ull) + Time.tv_nsec;
+}
+
+// Raise an event on the store channel, as xenstored would
+static VOID
+SimNotify(
+    VOID
+    )
+{
+    PSIM_CHANNEL    C = &SimChannel;
+
+    pthread_mutex_lock(&C->Lock);
+
+    C->Generation++;
+    pthread_cond_broadcast(&C->Condition);
+
+    if (C->Channel != NULL && !C->Channel->Masked)
+        (VOID) C->Channel->Callback(NULL, C->Channel->Argument);
+
+    pthread_mutex_unlock(&C->Lock);
+}
+
+static ULONG
+SimHash(
+    IN  const CHAR  *Path
+    )
+{
+    ULONG           Hash = 2166136261u;
+
+    while (*Path != '\0')
+        Hash = (Hash ^ (UCHAR)*Path++) * 16777619u;
+
+    return Hash % SIM_STORE_BUCKETS;
+}
+
+static PSIM_NODE
+SimStoreFind(
+    IN  PSIM_STORE  S,
+    IN  const CHAR  *Path
+    )
+{
+    PSIM_NODE       Node;
+
+    for (Node = S->Node[SimHash(Path)]; Node != NULL; Node = Node->Next)
+        if (strcmp(Node->Path, Path) == 0)
+            break;
+
+    return Node;
+}
+
+static VOID
+SimStoreSet(
+    IN  PSIM_STORE  S,
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Value,
+    IN  ULONG       Length
+    )
+{
+    PSIM_NODE       Node;
+
+    Node = SimStoreFind(S, Path);
+    if (Node == NULL) {
+        ULONG   Hash = SimHash(Path);
+
+        Node = calloc(1, sizeof (SIM_NODE) + strlen(Path));
+        ASSERT(Node != NULL);
+
+        strcpy(Node->Path, Path);
+
+        Node->Next = S->Node[Hash];
+        S->Node[Hash] = Node;
+    }
+
+    free(Node->Value);
+    Node->Value = malloc(__max(Length, 1));
+    ASSERT(Node->Value != NULL);
+
+    memcpy(Node->Value, Value, Length);
+    Node->Length = Length;
+}
+
+// Parents are created as they are needed, as xenstored does
+static VOID
+SimStoreCreate(
+    IN  PSIM_STORE  S,
+    IN  PCHAR       Path,
+    IN  const CHAR  *Value,
+    IN  ULONG       Length
+    )
+{
+    PCHAR           Separator;
+
+    for (Separator = strchr(Path, '/');
+         Separator != NULL;
+         Separator = strchr(Separator + 1, '/')) {
+        *Separator = '\0';
+        if (SimStoreFind(S, Path) == NULL)
+            SimStoreSet(S, Path, "", 0);
+        *Separator = '/';
+    }
+
+    SimStoreSet(S, Path, Value, Length);
+}
+
+// Is Path either Parent itself, or underneath it?
+static BOOLEAN
+SimIsUnder(
+    IN  const CHAR  *Path,
+    IN  const CHAR  *Parent
+    )
+{
+    size_t          Length = strlen(Parent);
+
+    return (strncmp(Path, Parent, Length) == 0 &&
+            (Path[Length] == '\0' || Path[Length] == '/')) ? TRUE : FALSE;
+}
+
+static VOID
+SimStoreRemove(
+    IN  PSIM_STORE  S,
+    IN  const CHAR  *Path
+    )
+{
+    ULONG           Index;
+
+    for (Index = 0; Index < SIM_STORE_BUCKETS; Index++) {
+        PSIM_NODE   *Link = &S->Node[Index];
+
+        while (*Link != NULL) {
+            PSIM_NODE   Node = *Link;
+
+            if (!SimIsUnder(Node->Path, Path)) {
+                Link = &Node->Next;
+                continue;
+            }
+
+            *Link = Node->Next;
+
+            free(Node->Value);
+            free(Node);
+        }
+    }
+}
+
+static VOID
+SimStoreReset(
+    IN  PSIM_STORE  S
+    )
+{
+    SimStoreRemove(S, "");
+
+    while (S->Watch != NULL) {
+        PSIM_WATCH  Watch = S->Watch;
+
+        S->Watch = Watch->Next;
+
+        free(Watch->Path);
+        free(Watch->Token);
+        free(Watch);
+    }
+}
+
+static VOID
+SimStoreCopyToRing(
+    IN  PSIM_STORE                      S,
+    IN  const CHAR                      *Data,
+    IN  ULONG                           Length
+    )
+{
+    struct xenstore_domain_interface    *Shared = &SimShared;
+
+    while (Length != 0) {
+        XENSTORE_RING_IDX   cons;
+        XENSTORE_RING_IDX   prod;
+        ULONG               Index;
+        ULONG               CopyLength;
+
+        KeMemoryBarrier();
+
+        cons = Shared->rsp_cons;
+        prod = Shared->rsp_prod;
+
+        KeMemoryBarrier();
+
+        // Wait for the guest to make space, as it says it has by signalling
+        if (prod - cons == XENSTORE_RING_SIZE) {
+            SimNotify();
+            (VOID) KeWaitForSingleObject(&S->Event,
+                                         Executive,
+                                         KernelMode,
+                                         FALSE,
+                                         NULL);
+            continue;
+        }
+
+        Index = MASK_XENSTORE_IDX(prod);
+
+        CopyLength = __min(Length, XENSTORE_RING_SIZE - (prod - cons));
+        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+
+        memcpy(&Shared->rsp[Index], Data, CopyLength);
+
+        Data += CopyLength;
+        Length -= CopyLength;
+
+        KeMemoryBarrier();
+
+        Shared->rsp_prod = prod + CopyLength;
+
+        KeMemoryBarrier();
+    }
+}
+
+static VOID
+SimStoreReply(
+    IN  PSIM_STORE          S,
+    IN  struct xsd_sockmsg  *Request,
+    IN  ULONG               Type,
+    IN  const CHAR          *Data,
+    IN  ULONG               Length
+    )
+{
+    struct xsd_sockmsg      Header;
+
+    Header.type = Type;
+    Header.req_id = Request->req_id;
+    Header.tx_id = Request->tx_id;
+    Header.len = Length;
+
+    SimStoreCopyToRing(S, (PCHAR)&Header, sizeof (Header));
+    SimStoreCopyToRing(S, Data, Length);
+
+    SimNotify();
+}
+
+static VOID
+SimStoreError(
+    IN  PSIM_STORE          S,
+    IN  struct xsd_sockmsg  *Request,
+    IN  const CHAR          *Error
+    )
+{
+    SimStoreReply(S, Request, XS_ERROR, Error, (ULONG)strlen(Error) + 1);
+}
+
+static VOID
+SimStoreOk(
+    IN  PSIM_STORE          S,
+    IN  struct xsd_sockmsg  *Request
+    )
+{
+    SimStoreReply(S, Request, Request->type, "OK", sizeof ("OK"));
+}
+
+static VOID
+SimStoreWatchEvent(
+    IN  PSIM_STORE          S,
+    IN  const CHAR          *Path,
+    IN  PSIM_WATCH          Watch
+    )
+{
+    struct xsd_sockmsg      Header;
+    CHAR                    Data[XENSTORE_PAYLOAD_MAX];
+    ULONG                   Length;
+
+    RtlZeroMemory(&Header, sizeof (Header));
+    Header.type = XS_WATCH_EVENT;
+
+    Length = (ULONG)snprintf(Data, sizeof (Data), "%s", Path) + 1;
+    Length += (ULONG)snprintf(Data + Length, sizeof (Data) - Length, "%s", Watch->Token) + 1;
+
+    SimStoreReply(S, &Header, XS_WATCH_EVENT, Data, Length);
+}
+
+// Fire the watches on, above or underneath Path
+static VOID
+SimStoreFire(
+    IN  PSIM_STORE  S,
+    IN  const CHAR  *Path
+    )
+{
+    PSIM_WATCH      Watch;
+
+    for (Watch = S->Watch; Watch != NULL; Watch = Watch->Next)
+        if (SimIsUnder(Path, Watch->Path) || SimIsUnder(Watch->Path, Path))
+            SimStoreWatchEvent(S, Path, Watch);
+}
+
+static VOID
+SimStoreDirectory(
+    IN  PSIM_STORE          S,
+    IN  struct xsd_sockmsg  *Request,
+    IN  const CHAR          *Path
+    )
+{
+    CHAR                    Data[XENSTORE_PAYLOAD_MAX];
+    size_t                  PathLength = strlen(Path);
+    ULONG                   Length;
+    ULONG                   Index;
+
+    Length = 0;
+    for (Index = 0; Index < SIM_STORE_BUCKETS; Index++) {
+        PSIM_NODE   Node;
+
+        for (Node = S->Node[Index]; Node != NULL; Node = Node->Next) {
+            const CHAR  *Child;
+
+            if (strncmp(Node->Path, Path, PathLength) != 0 ||
+                Node->Path[PathLength] != '/')
+                continue;
+
+            Child = &Node->Path[PathLength + 1];
+            if (strchr(Child, '/') != NULL)
+                continue;
+
+            ASSERT3U(Length + strlen(Child) + 1, <=, sizeof (Data));
+            strcpy(&Data[Length], Child);
+            Length += (ULONG)strlen(Child) + 1;
+        }
+    }
+
+    SimStoreReply(S, Request, Request->type, Data, Length);
+}
+
+static VOID
+SimStoreProcess(
+    IN  PSIM_STORE      S
+    )
+{
+    struct xsd_sockmsg  *Request = (struct xsd_sockmsg *)S->Request;
+    PCHAR               Data = S->Request + sizeof (struct xsd_sockmsg);
+    ULONG               Length = Request->len;
+    ULONG               PathLength;
+
+    // Make sure that the first string is terminated
+    Data[Length] = '\0';
+    PathLength = (ULONG)strlen(Data);
+
+    S->Requests++;
+
+    switch (Request->type) {
+    case XS_READ: {
+        PSIM_NODE   Node = SimStoreFind(S, Data);
+
+        if (Node == NULL) {
+            SimStoreError(S, Request, "ENOENT");
+            break;
+        }
+
+        SimStoreReply(S, Request, XS_READ, Node->Value, Node->Length);
+        break;
+    }
+    case XS_WRITE:
+        if (PathLength == Length) {
+            SimStoreError(S, Request, "EINVAL");
+            break;
+        }
+
+        SimStoreCreate(S, Data, Data + PathLength + 1, Length - PathLength - 1);
+
+        SimStoreOk(S, Request);
+        SimStoreFire(S, Data);
+        break;
+
+    case XS_RM:
+        if (SimStoreFind(S, Data) == NULL) {
+            SimStoreError(S, Request, "ENOENT");
+            break;
+        }
+
+        SimStoreRemove(S, Data);
+
+        SimStoreOk(S, Request);
+        SimStoreFire(S, Data);
+        break;
+
+    case XS_DIRECTORY:
+        if (SimStoreFind(S, Data) == NULL) {
+            SimStoreError(S, Request, "ENOENT");
+            break;
+        }
+
+        SimStoreDirectory(S, Request, Data);
+        break;
+
+    case XS_TRANSACTION_START: {
+        CHAR    Id[16];
+
+        (VOID) snprintf(Id, sizeof (Id), "%u", ++S->TransactionId);
+        SimStoreReply(S, Request, XS_TRANSACTION_START, Id, (ULONG)strlen(Id) + 1);
+        break;
+    }
+    case XS_TRANSACTION_END:
+    case XS_SET_PERMS:
+        SimStoreOk(S, Request);
+        break;
+
+    case XS_WATCH: {
+        PSIM_WATCH  Watch;
+
+        Watch = calloc(1, sizeof (SIM_WATCH));
+        ASSERT(Watch != NULL);
+
+        Watch->Path = strdup(Data);
+        Watch->Token = strdup(Data + PathLength + 1);
+
+        Watch->Next = S->Watch;
+        S->Watch = Watch;
+
+        SimStoreOk(S, Request);
+
+        // A new watch always fires once straight away
+        SimStoreWatchEvent(S, Watch->Path, Watch);
+        break;
+    }
+    case XS_UNWATCH: {
+        PSIM_WATCH  *Link;
+
+        for (Link = &S->Watch; *Link != NULL; Link = &(*Link)->Next)
+            if (strcmp((*Link)->Path, Data) == 0 &&
+                strcmp((*Link)->Token, Data + PathLength + 1) == 0)
+                break;
+
+        if (*Link == NULL) {
+            SimStoreError(S, Request, "ENOENT");
+            break;
+        }
+
+        {
+            PSIM_WATCH  Watch = *Link;
+
+            *Link = Watch->Next;
+
+            free(Watch->Path);
+            free(Watch->Token);
+            free(Watch);
+        }
+
+        SimStoreOk(S, Request);
+        break;
+    }
+    default:
+        SimStoreError(S, Request, "ENOSYS");
+        break;
+    }
+}
+
+static ULONG
+SimStoreCopyFromRing(
+    IN  PCHAR                           Data,
+    IN  ULONG                           Length
+    )
+{
+    struct xenstore_domain_interface    *Shared = &SimShared;
+    XENSTORE_RING_IDX                   cons;
+    XENSTORE_RING_IDX                   prod;
+    ULONG                               Offset;
+
+    KeMemoryBarrier();
+
+    cons = Shared->req_cons;
+    prod = Shared->req_prod;
+
+    KeMemoryBarrier();
+
+    Offset = 0;
+    while (Length != 0 && prod != cons) {
+        ULONG   Index;
+        ULONG   CopyLength;
+
+        Index = MASK_XENSTORE_IDX(cons);
+
+        CopyLength = __min(Length, prod - cons);
+        CopyLength = __min(CopyLength, XENSTORE_RING_SIZE - Index);
+
+        memcpy(Data + Offset, &Shared->req[Index], CopyLength);
+
+        Offset += CopyLength;
+        Length -= CopyLength;
+
+        cons += CopyLength;
+    }
+
+    KeMemoryBarrier();
+
+    Shared->req_cons = cons;
+
+    KeMemoryBarrier();
+
+    return Offset;
+}
+
+// Take what there is of the current request off the ring, and serve it once it is all there
+static BOOLEAN
+SimStoreReceive(
+    IN  PSIM_STORE      S
+    )
+{
+    struct xsd_sockmsg  *Request = (struct xsd_sockmsg *)S->Request;
+    ULONG               Wanted;
+    ULONG               Copied;
+
+    if (S->Received < sizeof (struct xsd_sockmsg)) {
+        Wanted = sizeof (struct xsd_sockmsg) - S->Received;
+    } else {
+        ASSERT3U(Request->len, <=, XENSTORE_PAYLOAD_MAX);
+        Wanted = sizeof (struct xsd_sockmsg) + Request->len - S->Received;
+    }
+
+    Copied = SimStoreCopyFromRing(&S->Request[S->Received], Wanted);
+    S->Received += Copied;
+
+    if (Copied == 0)
+        return FALSE;
+
+    // Let the guest know that there is space
+    SimNotify();
+
+    if (S->Received >= sizeof (struct xsd_sockmsg) &&
+        S->Received == sizeof (struct xsd_sockmsg) + Request->len) {
+        SimStoreProcess(S);
+        S->Received = 0;
+    }
+
+    return TRUE;
+}
+
+static PVOID
+SimStoreThread(
+    IN  PVOID   Argument
+    )
+{
+    PSIM_STORE  S = Argument;
+
+    for (;;) {
+        (VOID) KeWaitForSingleObject(&S->Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        if (__atomic_load_n(&S->Stop, __ATOMIC_ACQUIRE))
+            break;
+
+        while (SimStoreReceive(S))
+            ;
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+HvmGetParam(
+    IN  ULONG       Parameter,
+    OUT PULONGLONG  Value
+    )
+{
+    switch (Parameter) {
+    case HVM_PARAM_STORE_PFN:
+        *Value = (ULONG_PTR)&SimShared >> PAGE_SHIFT;
+        return STATUS_SUCCESS;
+
+    case HVM_PARAM_STORE_EVTCHN:
+        *Value = SIM_STORE_PORT;
+        return STATUS_SUCCESS;
+
+    default:
+        return STATUS_NOT_SUPPORTED;
+    }
+}
+
+// Xen system time counts nanoseconds, as the simulated one does from boot
+NTSTATUS
+HvmGetTime(
+    OUT PLARGE_INTEGER  Now
+    )
+{
+    Now->QuadPart = (LONGLONG)SimNow();
+    return STATUS_SUCCESS;
+}
+
+VOID
+SchedYield(
+    VOID
+    )
+{
+    __atomic_fetch_add(&SimYields, 1, __ATOMIC_RELAXED);
+    (VOID) sched_yield();
+}
+
+// Block until the store channel is signalled, or the deadline passes
+NTSTATUS
+SchedPollDeadline(
+    IN  evtchn_port_t   *Port OPTIONAL,
+    IN  ULONG           Count,
+    IN  PLARGE_INTEGER  Deadline OPTIONAL
+    )
+{
+    PSIM_CHANNEL        C = &SimChannel;
+    struct timespec     Time;
+    ULONGLONG           Generation;
+
+    ASSERT3U(Count, ==, 1);
+    ASSERT3U(*Port, ==, SIM_STORE_PORT);
+    ASSERT(Deadline != NULL);
+
+    __atomic_fetch_add(&SimPolls, 1, __ATOMIC_RELAXED);
+
+    Time.tv_sec = Deadline->QuadPart / 1000000000ll;
+    Time.tv_nsec = Deadline->QuadPart % 1000000000ll;
+
+    pthread_mutex_lock(&C->Lock);
+
+    Generation = C->Generation;
+    while (C->Generation == Generation)
+        if (pthread_cond_timedwait(&C->Condition, &C->Lock, &Time) == ETIMEDOUT)
+            break;
+
+    pthread_mutex_unlock(&C->Lock);
+
+    return STATUS_SUCCESS;
+}
+
+PVOID
+MmMapIoSpace(
+    IN  PHYSICAL_ADDRESS    Address,
+    IN  ULONG_PTR           Length,
+    IN  MEMORY_CACHING_TYPE CacheType
+    )
+{
+    UNREFERENCED_PARAMETER(CacheType);
+
+    ASSERT3U(Address.QuadPart, ==, (ULONG_PTR)&SimShared);
+    ASSERT3U(Length, <=, PAGE_SIZE);
+
+    return (PVOID)(ULONG_PTR)Address.QuadPart;
+}
+
+VOID
+MmUnmapIoSpace(
+    IN  PVOID       Buffer,
+    IN  ULONG_PTR   Length
+    )
+{
+    UNREFERENCED_PARAMETER(Length);
+
+    ASSERT3P(Buffer, ==, &SimShared);
+}
+
+VOID
+ModuleLookup(
+    IN  ULONG_PTR   Address,
+    OUT PCHAR       *Name,
+    OUT PULONG_PTR  Offset
+    )
+{
+    UNREFERENCED_PARAMETER(Address);
+
+    *Name = NULL;
+    *Offset = 0;
+}
+
+ULONG
+NTAPI
+RtlRandomEx(
+    IN OUT  PULONG  Seed
+    )
+{
+    return (ULONG)rand_r(Seed);
+}
+
+USHORT
+RtlCaptureStackBackTrace(
+    IN  ULONG   FramesToSkip,
+    IN  ULONG   FramesToCapture,
+    OUT PVOID   *BackTrace,
+    OUT PULONG  BackTraceHash OPTIONAL
+    )
+{
+    ULONG       Index;
+
+    UNREFERENCED_PARAMETER(FramesToSkip);
+    UNREFERENCED_PARAMETER(BackTraceHash);
+
+    for (Index = 0; Index < FramesToCapture; Index++)
+        BackTrace[Index] = NULL;
+
+    return 0;
+}
+
+HANDLE
+DriverGetParametersKey(
+    VOID
+    )
+{
+    return NULL;
+}
+
+static BOOLEAN  SimStoreCapture;
+
+// Only StoreCapture is ever set; everything else is left at its default
+NTSTATUS
+RegistryQueryDwordValue(
+    IN  HANDLE  Key,
+    IN  PCHAR   Name,
+    OUT PULONG  Value
+    )
+{
+    UNREFERENCED_PARAMETER(Key);
+
+    if (!SimStoreCapture || strcmp(Name, "StoreCapture") != 0)
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+
+    *Value = 1;
+    return STATUS_SUCCESS;
+}
+
+BOOLEAN
+KeInsertQueueDpc(
+    IN  PRKDPC      Dpc,
+    IN  PVOID       SystemArgument1,
+    IN  PVOID       SystemArgument2
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor;
+    BOOLEAN         Inserted;
+
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    pthread_mutex_lock(&Processor->Lock);
+
+    Inserted = FALSE;
+    if (Dpc->Inserted)
+        goto done;
+
+    Dpc->Inserted = 1;
+    Dpc->Next = NULL;
+
+    if (Processor->Tail != NULL)
+        Processor->Tail->Next = Dpc;
+    else
+        Processor->Head = Dpc;
+    Processor->Tail = Dpc;
+
+    pthread_cond_broadcast(&Processor->Condition);
+
+    Inserted = TRUE;
+
+done:
+    pthread_mutex_unlock(&Processor->Lock);
+
+    return Inserted;
+}
+
+BOOLEAN
+KeRemoveQueueDpc(
+    IN  PRKDPC      Dpc
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor;
+    PKDPC           *Link;
+    PKDPC           Previous;
+    BOOLEAN         Removed;
+
+    pthread_mutex_lock(&Processor->Lock);
+
+    Removed = FALSE;
+    if (!Dpc->Inserted)
+        goto done;
+
+    Previous = NULL;
+    for (Link = &Processor->Head; *Link != Dpc; Link = &(*Link)->Next)
+        Previous = *Link;
+
+    *Link = Dpc->Next;
+    if (Processor->Tail == Dpc)
+        Processor->Tail = Previous;
+
+    Dpc->Inserted = 0;
+    Dpc->Next = NULL;
+
+    Removed = TRUE;
+
+done:
+    pthread_mutex_unlock(&Processor->Lock);
+
+    return Removed;
+}
+
+// Wait until every DPC queued so far has run
+VOID
+KeFlushQueuedDpcs(
+    VOID
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor;
+
+    pthread_mutex_lock(&Processor->Lock);
+
+    while (Processor->Head != NULL || Processor->Running != 0)
+        pthread_cond_wait(&Processor->Condition, &Processor->Lock);
+
+    pthread_mutex_unlock(&Processor->Lock);
+}
+
+static PVOID
+SimProcessorThread(
+    IN  PVOID       Argument
+    )
+{
+    PSIM_PROCESSOR  Processor = Argument;
+
+    pthread_mutex_lock(&Processor->Lock);
+
+    for (;;) {
+        PKDPC   Dpc;
+        KIRQL   Irql;
+
+        while (Processor->Head == NULL && !Processor->Stop)
+            pthread_cond_wait(&Processor->Condition, &Processor->Lock);
+
+        if (Processor->Head == NULL)
+            break;
+
+        Dpc = Processor->Head;
+        Processor->Head = Dpc->Next;
+        if (Processor->Head == NULL)
+            Processor->Tail = NULL;
+
+        Dpc->Inserted = 0;
+        Dpc->Next = NULL;
+
+        Processor->Running++;
+        pthread_mutex_unlock(&Processor->Lock);
+
+        KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+        Dpc->DeferredRoutine(Dpc, Dpc->DeferredContext, NULL, NULL);
+        KeLowerIrql(Irql);
+
+        pthread_mutex_lock(&Processor->Lock);
+        --Processor->Running;
+        pthread_cond_broadcast(&Processor->Condition);
+    }
+
+    pthread_mutex_unlock(&Processor->Lock);
+
+    return NULL;
+}
+
+static NTSTATUS
+SimEvtchnAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimEvtchnRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_EVTCHN_CONTEXT  Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+// Only the fixed store channel is simulated
+static PXENBUS_EVTCHN_CHANNEL
+SimEvtchnOpen(
+    IN  PINTERFACE          Interface,
+    IN  XENBUS_EVTCHN_TYPE  Type,
+    IN  PKSERVICE_ROUTINE   Callback,
+    IN  PVOID               Argument OPTIONAL,
+    ...
+    )
+{
+    PSIM_CHANNEL            C = &SimChannel;
+    PXENBUS_EVTCHN_CHANNEL  Channel;
+    va_list                 Arguments;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    ASSERT3U(Type, ==, XENBUS_EVTCHN_TYPE_FIXED);
+
+    Channel = calloc(1, sizeof (XENBUS_EVTCHN_CHANNEL));
+    if (Channel == NULL)
+        return NULL;
+
+    Channel->Callback = Callback;
+    Channel->Argument = Argument;
+    Channel->Masked = TRUE;
+
+    va_start(Arguments, Argument);
+    Channel->Port = va_arg(Arguments, ULONG);
+    va_end(Arguments);
+
+    ASSERT3U(Channel->Port, ==, SIM_STORE_PORT);
+
+    pthread_mutex_lock(&C->Lock);
+    ASSERT3P(C->Channel, ==, NULL);
+    C->Channel = Channel;
+    pthread_mutex_unlock(&C->Lock);
+
+    return Channel;
+}
+
+static VOID
+SimEvtchnUnmask(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel,
+    IN  BOOLEAN                 InCallback
+    )
+{
+    PSIM_CHANNEL                C = &SimChannel;
+
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(InCallback);
+
+    pthread_mutex_lock(&C->Lock);
+    Channel->Masked = FALSE;
+    pthread_mutex_unlock(&C->Lock);
+}
+
+// Signal xenstored
+static VOID
+SimEvtchnSend(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+    UNREFERENCED_PARAMETER(Channel);
+
+    (VOID) KeSetEvent(&SimStore.Event, 0, FALSE);
+}
+
+static ULONG
+SimEvtchnGetPort(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return Channel->Port;
+}
+
+static VOID
+SimEvtchnClose(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_EVTCHN_CHANNEL  Channel
+    )
+{
+    PSIM_CHANNEL                C = &SimChannel;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    pthread_mutex_lock(&C->Lock);
+    ASSERT3P(C->Channel, ==, Channel);
+    C->Channel = NULL;
+    pthread_mutex_unlock(&C->Lock);
+
+    free(Channel);
+}
+
+static XENBUS_EVTCHN_INTERFACE SimEvtchnInterface = {
+    .Interface = { sizeof (XENBUS_EVTCHN_INTERFACE), XENBUS_EVTCHN_INTERFACE_VERSION_MAX, NULL, NULL, NULL },
+    .EvtchnAcquire = SimEvtchnAcquire,
+    .EvtchnRelease = SimEvtchnRelease,
+    .EvtchnOpen = SimEvtchnOpen,
+    .EvtchnUnmask = SimEvtchnUnmask,
+    .EvtchnSend = SimEvtchnSend,
+    .EvtchnGetPort = SimEvtchnGetPort,
+    .EvtchnClose = SimEvtchnClose
+};
+
+NTSTATUS
+EvtchnGetInterface(
+    IN      PXENBUS_EVTCHN_CONTEXT  Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, XENBUS_EVTCHN_INTERFACE_VERSION_MAX);
+    ASSERT3U(Size, >=, sizeof (XENBUS_EVTCHN_INTERFACE));
+
+    *(PXENBUS_EVTCHN_INTERFACE)Interface = SimEvtchnInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+SimSuspendAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSuspendRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static NTSTATUS
+SimSuspendRegister(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_SUSPEND_CALLBACK_TYPE    Type,
+    IN  XENBUS_SUSPEND_FUNCTION         Function,
+    IN  PVOID                           Argument OPTIONAL,
+    OUT PXENBUS_SUSPEND_CALLBACK        *Callback
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT             Context = Interface->Context;
+    PXENBUS_SUSPEND_CALLBACK            *Slot;
+
+    Slot = (Type == SUSPEND_CALLBACK_EARLY) ? &Context->Early : &Context->Late;
+    ASSERT3P(*Slot, ==, NULL);
+
+    *Callback = calloc(1, sizeof (XENBUS_SUSPEND_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    *Slot = *Callback;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSuspendDeregister(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_SUSPEND_CALLBACK    Callback
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT         Context = Interface->Context;
+
+    if (Context->Early == Callback) {
+        Context->Early = NULL;
+    } else {
+        ASSERT3P(Context->Late, ==, Callback);
+        Context->Late = NULL;
+    }
+
+    free(Callback);
+}
+
+static NTSTATUS
+SimSuspendTrigger(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    // Resume is not simulated
+    return STATUS_NOT_SUPPORTED;
+}
+
+static ULONG
+SimSuspendGetCount(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return 0;
+}
+
+static XENBUS_SUSPEND_INTERFACE SimSuspendInterface = {
+    { sizeof (XENBUS_SUSPEND_INTERFACE), 1, NULL, NULL, NULL },
+    SimSuspendAcquire,
+    SimSuspendRelease,
+    SimSuspendRegister,
+    SimSuspendDeregister,
+    SimSuspendTrigger,
+    SimSuspendGetCount
+};
+
+NTSTATUS
+SuspendGetInterface(
+    IN      PXENBUS_SUSPEND_CONTEXT Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, 1);
+    ASSERT3U(Size, >=, sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    *(PXENBUS_SUSPEND_INTERFACE)Interface = SimSuspendInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+SimDebugAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimDebugRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static NTSTATUS
+SimDebugRegister(
+    IN  PINTERFACE              Interface,
+    IN  PCHAR                   Prefix,
+    IN  XENBUS_DEBUG_FUNCTION   Function,
+    IN  PVOID                   Argument OPTIONAL,
+    OUT PXENBUS_DEBUG_CALLBACK  *Callback
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    UNREFERENCED_PARAMETER(Prefix);
+
+    ASSERT3P(Context->Callback, ==, NULL);
+
+    *Callback = calloc(1, sizeof (XENBUS_DEBUG_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    Context->Callback = *Callback;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimDebugPrintf(
+    IN  PINTERFACE          Interface,
+    IN  const CHAR          *Format,
+    ...
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+    CHAR                    Host[256];
+    CHAR                    Buffer[256];
+    const CHAR              *Cursor;
+    ULONG                   Index;
+    va_list                 Arguments;
+
+    // The MSVC I64 size prefix is ll here
+    Index = 0;
+    for (Cursor = Format; *Cursor != '\0' && Index < sizeof (Host) - 2; Cursor++) {
+        if (strncmp(Cursor, "I64", 3) == 0) {
+            Host[Index++] = 'l';
+            Host[Index++] = 'l';
+            Cursor += 2;
+        } else {
+            Host[Index++] = *Cursor;
+        }
+    }
+    Host[Index] = '\0';
+
+    va_start(Arguments, Format);
+    (VOID) vsnprintf(Buffer, sizeof (Buffer), Host, Arguments);
+    va_end(Arguments);
+
+    Context->Lines++;
+
+    if (Context->Match != NULL && strstr(Buffer, Context->Match) != NULL)
+        Context->Matches++;
+}
+
+static VOID
+SimDebugTrigger(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback OPTIONAL
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    if (Callback == NULL)
+        Callback = Context->Callback;
+
+    if (Callback != NULL)
+        Callback->Function(Callback->Argument, FALSE);
+}
+
+static VOID
+SimDebugDeregister(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    ASSERT3P(Context->Callback, ==, Callback);
+    Context->Callback = NULL;
+
+    free(Callback);
+}
+
+static XENBUS_DEBUG_INTERFACE SimDebugInterface = {
+    { sizeof (XENBUS_DEBUG_INTERFACE), 1, NULL, NULL, NULL },
+    SimDebugAcquire,
+    SimDebugRelease,
+    SimDebugRegister,
+    SimDebugPrintf,
+    SimDebugTrigger,
+    SimDebugDeregister
+};
+
+NTSTATUS
+DebugGetInterface(
+    IN      PXENBUS_DEBUG_CONTEXT   Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, 1);
+    ASSERT3U(Size, >=, sizeof (XENBUS_DEBUG_INTERFACE));
+
+    *(PXENBUS_DEBUG_INTERFACE)Interface = SimDebugInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+PXENBUS_EVTCHN_CONTEXT
+FdoGetEvtchnContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimEvtchnContext;
+}
+
+PXENBUS_SUSPEND_CONTEXT
+FdoGetSuspendContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimSuspendContext;
+}
+
+PXENBUS_DEBUG_CONTEXT
+FdoGetDebugContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimDebugContext;
+}
+
+//
+// The harness, which acts as a driver using the STORE interface
+//
+
+typedef struct _HARNESS {
+    PXENBUS_STORE_CONTEXT   Context;
+    XENBUS_STORE_INTERFACE  StoreInterface;
+} HARNESS, *PHARNESS;
+
+static HARNESS  Harness;
+static ULONG    Failures;
+
+#define CHECK(_EXP)                                         \
+        do {                                                \
+            if (!(_EXP)) {                                  \
+                fprintf(stderr, "%s:%d: CHECK FAILED: %s\n",\
+                        __FUNCTION__, __LINE__, #_EXP);     \
+                Failures++;                                 \
+            }                                               \
+        } while (FALSE)
+
+static VOID
+HarnessSetUp(
+    IN  PHARNESS    H
+    )
+{
+    PSIM_CHANNEL        C = &SimChannel;
+    PSIM_PROCESSOR      Processor = &SimProcessor;
+    PSIM_STORE          S = &SimStore;
+    pthread_condattr_t  Attributes;
+    NTSTATUS            status;
+
+    RtlZeroMemory(&SimShared, sizeof (SimShared));
+
+    // Poll deadlines are in (simulated) Xen system time
+    pthread_condattr_init(&Attributes);
+    pthread_condattr_setclock(&Attributes, CLOCK_MONOTONIC);
+
+    RtlZeroMemory(C, sizeof (SIM_CHANNEL));
+    pthread_mutex_init(&C->Lock, NULL);
+    pthread_cond_init(&C->Condition, &Attributes);
+
+    pthread_condattr_destroy(&Attributes);
+
+    RtlZeroMemory(Processor, sizeof (SIM_PROCESSOR));
+    pthread_mutex_init(&Processor->Lock, NULL);
+    pthread_cond_init(&Processor->Condition, NULL);
+    pthread_create(&Processor->Thread, NULL, SimProcessorThread, Processor);
+
+    RtlZeroMemory(S, sizeof (SIM_STORE));
+    KeInitializeEvent(&S->Event, SynchronizationEvent, FALSE);
+    pthread_create(&S->Thread, NULL, SimStoreThread, S);
+
+    SimYields = 0;
+    SimPolls = 0;
+
+    status = StoreInitialize(NULL, &H->Context);
+    ASSERT(NT_SUCCESS(status));
+
+    status = StoreGetInterface(H->Context,
+                               XENBUS_STORE_INTERFACE_VERSION_MAX,
+                               (PINTERFACE)&H->StoreInterface,
+                               sizeof (H->StoreInterface));
+    ASSERT(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Acquire, &H->StoreInterface);
+    ASSERT(NT_SUCCESS(status));
+}
+
+static VOID
+HarnessTearDown(
+    IN  PHARNESS    H
+    )
+{
+    PSIM_PROCESSOR  Processor = &SimProcessor;
+    PSIM_STORE      S = &SimStore;
+
+    XENBUS_STORE(Release, &H->StoreInterface);
+    StoreTeardown(H->Context);
+
+    ASSERT3U(SimEvtchnContext.References, ==, 0);
+    ASSERT3U(SimSuspendContext.References, ==, 0);
+    ASSERT3U(SimDebugContext.References, ==, 0);
+    ASSERT3P(SimChannel.Channel, ==, NULL);
+
+    __atomic_store_n(&S->Stop, TRUE, __ATOMIC_RELEASE);
+    (VOID) KeSetEvent(&S->Event, 0, FALSE);
+    pthread_join(S->Thread, NULL);
+
+    // Nothing may be left half sent
+    ASSERT3U(S->Received, ==, 0);
+    ASSERT3U(SimShared.req_cons, ==, SimShared.req_prod);
+    ASSERT3U(SimShared.rsp_cons, ==, SimShared.rsp_prod);
+
+    SimStoreReset(S);
+
+    pthread_mutex_lock(&Processor->Lock);
+    Processor->Stop = TRUE;
+    pthread_cond_broadcast(&Processor->Condition);
+    pthread_mutex_unlock(&Processor->Lock);
+    pthread_join(Processor->Thread, NULL);
+
+    RtlZeroMemory(H, sizeof (HARNESS));
+}
+
+static VOID
+TestReadWrite(
+    IN  PHARNESS    H
+    )
+{
+    PCHAR           Large;
+    PCHAR           Value;
+    NTSTATUS        status;
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "harness", "node", "%u", 42);
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "harness", "node", &Value);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status)) {
+        CHECK(strcmp(Value, "42") == 0);
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+    }
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, NULL, "harness/missing", &Value);
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    // A request and a response that each take more than one trip round the ring
+    Large = malloc(HARNESS_LARGE_VALUE + 1);
+    ASSERT(Large != NULL);
+
+    memset(Large, 'x', HARNESS_LARGE_VALUE);
+    Large[HARNESS_LARGE_VALUE] = '\0';
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "harness", "large", "%s", Large);
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "harness", "large", &Value);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status)) {
+        CHECK(strcmp(Value, Large) == 0);
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+    }
+
+    free(Large);
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "harness");
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "harness", "node", &Value);
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "harness");
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+}
+
+// Count the entries of a directory listing, checking that each is one of Expected
+static ULONG
+HarnessCountEntries(
+    IN  PCHAR       Listing,
+    IN  const CHAR  *Expected OPTIONAL
+    )
+{
+    ULONG           Count;
+
+    for (Count = 0; *Listing != '\0'; Listing += strlen(Listing) + 1) {
+        if (Expected != NULL)
+            CHECK(strstr(Expected, Listing) != NULL);
+
+        Count++;
+    }
+
+    return Count;
+}
+
+static VOID
+TestDirectory(
+    IN  PHARNESS    H
+    )
+{
+    static const CHAR   *Child[] = { "a", "b", "c" };
+    PCHAR               Listing;
+    ULONG               Index;
+    NTSTATUS            status;
+
+    for (Index = 0; Index < ARRAYSIZE(Child); Index++) {
+        status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "harness/directory", (PCHAR)Child[Index], "%u", Index);
+        CHECK(NT_SUCCESS(status));
+    }
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "harness/directory/a", "grandchild", "");
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Directory, &H->StoreInterface, NULL, NULL, "harness/directory", &Listing);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status)) {
+        CHECK(HarnessCountEntries(Listing, "abc") == ARRAYSIZE(Child));
+        XENBUS_STORE(Free, &H->StoreInterface, Listing);
+    }
+
+    status = XENBUS_STORE(Directory, &H->StoreInterface, NULL, "harness", "missing", &Listing);
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "harness");
+    CHECK(NT_SUCCESS(status));
+}
+
+static VOID
+TestTransaction(
+    IN  PHARNESS                H
+    )
+{
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    PCHAR                       Value;
+    NTSTATUS                    status;
+
+    status = XENBUS_STORE(TransactionStart, &H->StoreInterface, &Transaction);
+    CHECK(NT_SUCCESS(status));
+    if (!NT_SUCCESS(status))
+        return;
+
+    CHECK(Transaction->Id != 0);
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, Transaction, "harness", "transaction", "%s", "committed");
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(TransactionEnd, &H->StoreInterface, Transaction, TRUE);
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "harness", "transaction", &Value);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status)) {
+        CHECK(strcmp(Value, "committed") == 0);
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+    }
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "harness");
+    CHECK(NT_SUCCESS(status));
+
+    CHECK(IsListEmpty(&H->Context->TransactionList));
+}
+
+// Watch events arrive by way of the DPC, as nothing else is polling
+static VOID
+TestWatch(
+    IN  PHARNESS            H
+    )
+{
+    LARGE_INTEGER           Timeout;
+    LARGE_INTEGER           Short;
+    KEVENT                  Event;
+    PXENBUS_STORE_WATCH     Watch;
+    NTSTATUS                status;
+
+    Timeout.QuadPart = -10000000ll;    // 1s
+    Short.QuadPart = -100000ll;        // 10ms
+
+    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+
+    status = XENBUS_STORE(WatchAdd, &H->StoreInterface, "harness", "watch", &Event, &Watch);
+    CHECK(NT_SUCCESS(status));
+    if (!NT_SUCCESS(status))
+        return;
+
+    // A new watch fires straight away
+    status = KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, &Timeout);
+    CHECK(status == STATUS_SUCCESS);
+    KeClearEvent(&Event);
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "harness/watch", "child", "%s", "changed");
+    CHECK(NT_SUCCESS(status));
+
+    status = KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, &Timeout);
+    CHECK(status == STATUS_SUCCESS);
+    KeClearEvent(&Event);
+
+    status = XENBUS_STORE(WatchRemove, &H->StoreInterface, Watch);
+    CHECK(NT_SUCCESS(status));
+
+    CHECK(SimStore.Watch == NULL);
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "harness");
+    CHECK(NT_SUCCESS(status));
+
+    // Once removed, the watch must not fire
+    KeFlushQueuedDpcs();
+    status = KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, &Short);
+    CHECK(status == STATUS_TIMEOUT);
+}
+
+static VOID
+TestDebug(
+    IN  PHARNESS    H
+    )
+{
+    NTSTATUS        status;
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "harness", "debug", "%s", "value");
+    CHECK(NT_SUCCESS(status));
+
+    // The dump includes the ring indices and any outstanding buffers
+    SimDebugContext.Lines = 0;
+    SimDebugContext.Callback->Function(SimDebugContext.Callback->Argument,
+                                       FALSE);
+    CHECK(SimDebugContext.Lines != 0);
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "harness");
+    CHECK(NT_SUCCESS(status));
+}
+
+//
+// Capture and replay. A capture is the packed sequence of records that
+// StoreCaptureExport() produces. To replay one, each request that a
+// driver could have made through the STORE interface is turned back
+// into that call and made again, in the order it was captured, with the
+// simulated xenstored first seeded with whatever the captured reads and
+// directory listings found there. Watches are left out, as are payloads
+// beyond what was captured, which are padded back to their original
+// length.
+//
+
+#define HARNESS_REPLAY_TRANSACTIONS 16
+#define HARNESS_REPLAY_ROUNDS       100
+
+typedef struct _HARNESS_STEP {
+    ULONG   Type;
+    ULONG   TransactionId;  // As captured
+    ULONG   Result;         // The captured response type (0 if it was not captured)
+    PCHAR   Path;
+    PCHAR   Value;          // XS_WRITE
+    BOOLEAN Commit;         // XS_TRANSACTION_END
+    ULONG   Id;             // XS_TRANSACTION_START: as captured
+    PCHAR   Seed;           // XS_READ, XS_DIRECTORY: the captured response
+    ULONG   SeedLength;
+} HARNESS_STEP, *PHARNESS_STEP;
+
+typedef struct _HARNESS_REPLAY {
+    PHARNESS_STEP   Step;
+    ULONG           Count;
+    ULONG           Skipped;
+} HARNESS_REPLAY, *PHARNESS_REPLAY;
+
+typedef struct _HARNESS_TRANSACTION {
+    ULONG                       Id;     // As captured
+    PXENBUS_STORE_TRANSACTION   Transaction;
+} HARNESS_TRANSACTION, *PHARNESS_TRANSACTION;
+
+// Copy out the record at Offset, and its payload, terminated
+static BOOLEAN
+HarnessNextRecord(
+    IN      const UCHAR                 *Buffer,
+    IN      ULONG                       Length,
+    IN OUT  PULONG                      Offset,
+    OUT     PXENBUS_STORE_CAPTURE_RECORD Record,
+    OUT     PCHAR                       Data
+    )
+{
+    if (Length - *Offset < sizeof (XENBUS_STORE_CAPTURE_RECORD))
+        return FALSE;
+
+    RtlCopyMemory(Record, Buffer + *Offset, sizeof (XENBUS_STORE_CAPTURE_RECORD));
+
+    if (Record->DataLength > XENBUS_STORE_CAPTURE_PAYLOAD_MAX ||
+        Length - *Offset - sizeof (XENBUS_STORE_CAPTURE_RECORD) < Record->DataLength)
+        return FALSE;
+
+    *Offset += sizeof (XENBUS_STORE_CAPTURE_RECORD);
+
+    RtlCopyMemory(Data, Buffer + *Offset, Record->DataLength);
+    Data[Record->DataLength] = '\0';
+
+    *Offset += Record->DataLength;
+
+    return TRUE;
+}
+
+// Find the response to RequestId, if it was captured after Offset
+static BOOLEAN
+HarnessFindResponse(
+    IN  const UCHAR                     *Buffer,
+    IN  ULONG                           Length,
+    IN  ULONG                           Offset,
+    IN  ULONG                           RequestId,
+    OUT PXENBUS_STORE_CAPTURE_RECORD    Record,
+    OUT PCHAR                           Data
+    )
+{
+    while (HarnessNextRecord(Buffer, Length, &Offset, Record, Data))
+        if (Record->CaptureType == XENBUS_STORE_CAPTURE_TYPE_RESPONSE &&
+            Record->RequestId == RequestId)
+            return TRUE;
+
+    return FALSE;
+}
+
+// Rebuild a payload of Length bytes from what was captured of it, from Offset on
+static PCHAR
+HarnessPad(
+    IN  const CHAR  *Data,
+    IN  ULONG       DataLength,
+    IN  ULONG       Offset,
+    IN  ULONG       Length
+    )
+{
+    PCHAR           Payload;
+    ULONG           Captured;
+
+    Payload = malloc(Length + 1);
+    ASSERT(Payload != NULL);
+
+    Captured = (DataLength > Offset) ? __min(DataLength - Offset, Length) : 0;
+
+    memcpy(Payload, Data + Offset, Captured);
+    memset(Payload + Captured, '.', Length - Captured);
+    Payload[Length] = '\0';
+
+    return Payload;
+}
+
+static BOOLEAN
+HarnessPlan(
+    IN  const UCHAR                 *Buffer,
+    IN  ULONG                       Length,
+    OUT PHARNESS_REPLAY             Replay
+    )
+{
+    XENBUS_STORE_CAPTURE_RECORD     Record;
+    CHAR                            Data[XENBUS_STORE_CAPTURE_PAYLOAD_MAX + 1];
+    ULONG                           Offset;
+
+    RtlZeroMemory(Replay, sizeof (HARNESS_REPLAY));
+
+    Replay->Step = calloc(Length / sizeof (XENBUS_STORE_CAPTURE_RECORD) + 1,
+                          sizeof (HARNESS_STEP));
+    ASSERT(Replay->Step != NULL);
+
+    Offset = 0;
+    while (HarnessNextRecord(Buffer, Length, &Offset, &Record, Data)) {
+        XENBUS_STORE_CAPTURE_RECORD Response;
+        CHAR                        ResponseData[XENBUS_STORE_CAPTURE_PAYLOAD_MAX + 1];
+        PHARNESS_STEP               Step;
+        ULONG                       PathLength;
+
+        if (Record.CaptureType != XENBUS_STORE_CAPTURE_TYPE_REQUEST)
+            continue;
+
+        if (Record.Type != XS_READ &&
+            Record.Type != XS_WRITE &&
+            Record.Type != XS_RM &&
+            Record.Type != XS_DIRECTORY &&
+            Record.Type != XS_TRANSACTION_START &&
+            Record.Type != XS_TRANSACTION_END) {
+            Replay->Skipped++;
+            continue;
+        }
+
+        Step = &Replay->Step[Replay->Count++];
+
+        Step->Type = Record.Type;
+        Step->TransactionId = Record.TransactionId;
+        Step->Path = strdup(Data);
+        ASSERT(Step->Path != NULL);
+
+        PathLength = (ULONG)strlen(Data);
+
+        RtlZeroMemory(&Response, sizeof (Response));
+        if (HarnessFindResponse(Buffer, Length, Offset, Record.RequestId,
+                                &Response, ResponseData))
+            Step->Result = Response.Type;
+
+        switch (Step->Type) {
+        case XS_WRITE:
+            // The value has to fit through Printf()
+            Step->Value = HarnessPad(Data, Record.DataLength, PathLength + 1,
+                                     (Record.Length > PathLength) ?
+                                     __min(Record.Length - PathLength - 1,
+                                           HARNESS_LARGE_VALUE) :
+                                     0);
+            break;
+
+        case XS_TRANSACTION_START:
+            if (Step->Result == XS_TRANSACTION_START)
+                Step->Id = (ULONG)strtoul(ResponseData, NULL, 10);
+            break;
+
+        case XS_TRANSACTION_END:
+            Step->Commit = (Data[0] == 'T');
+            break;
+
+        case XS_READ:
+            if (Step->Result != XS_READ)
+                break;
+
+            Step->Seed = HarnessPad(ResponseData, Response.DataLength, 0,
+                                    Response.Length);
+            Step->SeedLength = Response.Length;
+            break;
+
+        case XS_DIRECTORY: {
+            ULONG   Index;
+
+            if (Step->Result != XS_DIRECTORY)
+                break;
+
+            // Only the children that were captured whole
+            for (Index = Response.DataLength; Index != 0; --Index)
+                if (ResponseData[Index - 1] == '\0')
+                    break;
+
+            Step->Seed = HarnessPad(ResponseData, Response.DataLength, 0, Index);
+            Step->SeedLength = Index;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    return (Offset == Length) ? TRUE : FALSE;
+}
+
+static VOID
+HarnessFreePlan(
+    IN  PHARNESS_REPLAY Replay
+    )
+{
+    ULONG               Index;
+
+    for (Index = 0; Index < Replay->Count; Index++) {
+        PHARNESS_STEP   Step = &Replay->Step[Index];
+
+        free(Step->Path);
+        free(Step->Value);
+        free(Step->Seed);
+    }
+
+    free(Replay->Step);
+    RtlZeroMemory(Replay, sizeof (HARNESS_REPLAY));
+}
+
+// Put back whatever the captured reads and directory listings found
+static VOID
+HarnessSeed(
+    IN  PHARNESS_REPLAY Replay
+    )
+{
+    PSIM_STORE          S = &SimStore;
+    ULONG               Index;
+
+    for (Index = 0; Index < Replay->Count; Index++) {
+        PHARNESS_STEP   Step = &Replay->Step[Index];
+        PCHAR           Child;
+
+        if (Step->Seed == NULL || SimStoreFind(S, Step->Path) != NULL)
+            continue;
+
+        if (Step->Type == XS_READ) {
+            SimStoreCreate(S, Step->Path, Step->Seed, Step->SeedLength);
+            continue;
+        }
+
+        ASSERT3U(Step->Type, ==, XS_DIRECTORY);
+
+        SimStoreCreate(S, Step->Path, "", 0);
+
+        for (Child = Step->Seed;
+             Child < Step->Seed + Step->SeedLength;
+             Child += strlen(Child) + 1) {
+            CHAR    Path[2 * XENBUS_STORE_CAPTURE_PAYLOAD_MAX + 2];
+
+            (VOID) snprintf(Path, sizeof (Path), "%s/%s", Step->Path, Child);
+            if (SimStoreFind(S, Path) == NULL)
+                SimStoreCreate(S, Path, "", 0);
+        }
+    }
+}
+
+//
+// Make each step's request again, counting those where xenstored did
+// not do what it did when the request was captured.
+//
+static ULONG
+HarnessReplay(
+    IN  PHARNESS                H,
+    IN  PHARNESS_REPLAY         Replay,
+    OUT PULONG                  Mismatches
+    )
+{
+    HARNESS_TRANSACTION         Transaction[HARNESS_REPLAY_TRANSACTIONS];
+    ULONG                       Requests;
+    ULONG                       Index;
+
+    RtlZeroMemory(Transaction, sizeof (Transaction));
+
+    Requests = 0;
+    *Mismatches = 0;
+
+    for (Index = 0; Index < Replay->Count; Index++) {
+        PHARNESS_STEP               Step = &Replay->Step[Index];
+        PHARNESS_TRANSACTION        Slot;
+        PXENBUS_STORE_TRANSACTION   Current;
+        PCHAR                       Value;
+        ULONG                       Entry;
+        NTSTATUS                    status;
+
+        // Transactions that started before the capture did are ignored
+        Slot = NULL;
+        for (Entry = 0; Entry < HARNESS_REPLAY_TRANSACTIONS; Entry++) {
+            if (Step->TransactionId != 0 &&
+                Transaction[Entry].Transaction != NULL &&
+                Transaction[Entry].Id == Step->TransactionId) {
+                Slot = &Transaction[Entry];
+                break;
+            }
+        }
+
+        Current = (Slot != NULL) ? Slot->Transaction : NULL;
+
+        switch (Step->Type) {
+        case XS_READ:
+            status = XENBUS_STORE(Read, &H->StoreInterface, Current, NULL, Step->Path, &Value);
+            if (NT_SUCCESS(status))
+                XENBUS_STORE(Free, &H->StoreInterface, Value);
+            break;
+
+        case XS_WRITE:
+            status = XENBUS_STORE(Printf, &H->StoreInterface, Current, NULL, Step->Path, "%s", Step->Value);
+            break;
+
+        case XS_RM:
+            status = XENBUS_STORE(Remove, &H->StoreInterface, Current, NULL, Step->Path);
+            break;
+
+        case XS_DIRECTORY:
+            status = XENBUS_STORE(Directory, &H->StoreInterface, Current, NULL, Step->Path, &Value);
+            if (NT_SUCCESS(status))
+                XENBUS_STORE(Free, &H->StoreInterface, Value);
+            break;
+
+        case XS_TRANSACTION_START:
+            if (Step->Result != XS_TRANSACTION_START)
+                continue;
+
+            for (Entry = 0; Entry < HARNESS_REPLAY_TRANSACTIONS; Entry++)
+                if (Transaction[Entry].Transaction == NULL)
+                    break;
+
+            if (Entry == HARNESS_REPLAY_TRANSACTIONS)
+                continue;
+
+            Slot = &Transaction[Entry];
+
+            status = XENBUS_STORE(TransactionStart, &H->StoreInterface, &Slot->Transaction);
+            if (NT_SUCCESS(status))
+                Slot->Id = Step->Id;
+            else
+                Slot->Transaction = NULL;
+            break;
+
+        case XS_TRANSACTION_END:
+            if (Slot == NULL)
+                continue;
+
+            status = XENBUS_STORE(TransactionEnd, &H->StoreInterface, Slot->Transaction, Step->Commit);
+            Slot->Transaction = NULL;
+            break;
+
+        default:
+            ASSERT(FALSE);
+            continue;
+        }
+
+        Requests++;
+
+        if (Step->Result != 0 &&
+            NT_SUCCESS(status) != (Step->Result != XS_ERROR))
+            (*Mismatches)++;
+    }
+
+    // Abandon anything the capture ended in the middle of
+    for (Index = 0; Index < HARNESS_REPLAY_TRANSACTIONS; Index++)
+        if (Transaction[Index].Transaction != NULL)
+            (VOID) XENBUS_STORE(TransactionEnd, &H->StoreInterface, Transaction[Index].Transaction, FALSE);
+
+    return Requests;
+}
+
+// Replay a capture as a benchmark, seeding afresh for each round
+static ULONG
+HarnessBenchmarkReplay(
+    IN  PHARNESS        H,
+    IN  PHARNESS_REPLAY Replay,
+    IN  ULONG           Rounds
+    )
+{
+    ULONGLONG           Requests;
+    ULONG               Mismatches;
+    double              Elapsed;
+    ULONG               Round;
+
+    SimYields = 0;
+    SimPolls = 0;
+
+    Requests = 0;
+    Mismatches = 0;
+    Elapsed = 0.0;
+
+    for (Round = 0; Round < Rounds; Round++) {
+        struct timespec Start;
+        struct timespec End;
+        ULONG           Count;
+
+        // Nothing is in flight between rounds, so xenstored is idle
+        SimStoreReset(&SimStore);
+        HarnessSeed(Replay);
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+        Requests += HarnessReplay(H, Replay, &Count);
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        Mismatches += Count;
+        Elapsed += (double)(End.tv_sec - Start.tv_sec) +
+                   (double)(End.tv_nsec - Start.tv_nsec) / 1e9;
+    }
+
+    printf("replay of %u request(s) (%u skipped) x %u: %7.0f requests/s %5.2f yields %5.2f polls per request %u mismatch(es)\n",
+           Replay->Count,
+           Replay->Skipped,
+           Rounds,
+           (double)Requests / Elapsed,
+           (double)SimYields / __max(Requests, 1),
+           (double)SimPolls / __max(Requests, 1),
+           Mismatches);
+
+    return Mismatches;
+}
+
+// Something of everything that a replay covers, and a watch that it does not
+static VOID
+HarnessWorkload(
+    IN  PHARNESS                H
+    )
+{
+    PXENBUS_STORE_TRANSACTION   Transaction;
+    PXENBUS_STORE_WATCH         Watch;
+    KEVENT                      Event;
+    PCHAR                       Large;
+    PCHAR                       Value;
+    NTSTATUS                    status;
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "capture", "node", "%u", 42);
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "capture", "node", &Value);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status))
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+
+    // Too large to be captured whole
+    Large = malloc(HARNESS_LARGE_VALUE + 1);
+    ASSERT(Large != NULL);
+
+    memset(Large, 'x', HARNESS_LARGE_VALUE);
+    Large[HARNESS_LARGE_VALUE] = '\0';
+
+    status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, "capture", "large", "%s", Large);
+    CHECK(NT_SUCCESS(status));
+
+    free(Large);
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "capture", "large", &Value);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status))
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "capture", "missing", &Value);
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    status = XENBUS_STORE(TransactionStart, &H->StoreInterface, &Transaction);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status)) {
+        status = XENBUS_STORE(Printf, &H->StoreInterface, Transaction, "capture", "transaction", "%s", "committed");
+        CHECK(NT_SUCCESS(status));
+
+        status = XENBUS_STORE(Read, &H->StoreInterface, Transaction, "capture", "transaction", &Value);
+        CHECK(NT_SUCCESS(status));
+        if (NT_SUCCESS(status))
+            XENBUS_STORE(Free, &H->StoreInterface, Value);
+
+        status = XENBUS_STORE(TransactionEnd, &H->StoreInterface, Transaction, TRUE);
+        CHECK(NT_SUCCESS(status));
+    }
+
+    status = XENBUS_STORE(Directory, &H->StoreInterface, NULL, NULL, "capture", &Value);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status))
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+
+    KeInitializeEvent(&Event, NotificationEvent, FALSE);
+
+    status = XENBUS_STORE(WatchAdd, &H->StoreInterface, "capture", "node", &Event, &Watch);
+    CHECK(NT_SUCCESS(status));
+    if (NT_SUCCESS(status)) {
+        LARGE_INTEGER   Timeout;
+
+        Timeout.QuadPart = -10000000ll;    // 1s
+
+        status = KeWaitForSingleObject(&Event, Executive, KernelMode, FALSE, &Timeout);
+        CHECK(status == STATUS_SUCCESS);
+
+        status = XENBUS_STORE(WatchRemove, &H->StoreInterface, Watch);
+        CHECK(NT_SUCCESS(status));
+
+        KeFlushQueuedDpcs();
+    }
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "capture");
+    CHECK(NT_SUCCESS(status));
+
+    status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "capture");
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+
+    status = XENBUS_STORE(Read, &H->StoreInterface, NULL, "capture", "node", &Value);
+    CHECK(status == STATUS_OBJECT_NAME_NOT_FOUND);
+}
+
+static PUCHAR
+HarnessExport(
+    IN  PHARNESS    H,
+    OUT PULONG      Length
+    )
+{
+    PUCHAR          Buffer;
+    NTSTATUS        status;
+
+    *Length = 0;
+    status = XENBUS_STORE(CaptureExport, &H->StoreInterface, NULL, Length);
+    if (status != STATUS_BUFFER_OVERFLOW)
+        return NULL;
+
+    Buffer = malloc(__max(*Length, 1));
+    ASSERT(Buffer != NULL);
+
+    status = XENBUS_STORE(CaptureExport, &H->StoreInterface, Buffer, Length);
+    if (!NT_SUCCESS(status)) {
+        free(Buffer);
+        return NULL;
+    }
+
+    return Buffer;
+}
+
+//
+// Capture the workload, check what was captured and that the debug
+// callback dumps it, and then replay it, which must go just as it did.
+//
+static VOID
+TestCapture(
+    IN  PHARNESS                    H
+    )
+{
+    XENBUS_STORE_CAPTURE_RECORD     Record;
+    CHAR                            Data[XENBUS_STORE_CAPTURE_PAYLOAD_MAX + 1];
+    HARNESS_REPLAY                  Replay;
+    PUCHAR                          Buffer;
+    ULONG                           Length;
+    ULONG                           Short;
+    ULONG                           Offset;
+    ULONG                           Records;
+    ULONG                           Requests;
+    ULONG                           Events;
+    ULONG                           Mismatches;
+    NTSTATUS                        status;
+
+    SimStoreCapture = TRUE;
+    HarnessSetUp(H);
+    SimStoreCapture = FALSE;
+
+    HarnessWorkload(H);
+
+    Buffer = HarnessExport(H, &Length);
+    CHECK(Buffer != NULL);
+    if (Buffer == NULL) {
+        HarnessTearDown(H);
+        return;
+    }
+
+    Short = Length - 1;
+    status = XENBUS_STORE(CaptureExport, &H->StoreInterface, Buffer, &Short);
+    CHECK(status == STATUS_BUFFER_OVERFLOW);
+    CHECK(Short == Length);
+
+    Offset = 0;
+    Records = 0;
+    Requests = 0;
+    Events = 0;
+    while (HarnessNextRecord(Buffer, Length, &Offset, &Record, Data)) {
+        XENBUS_STORE_CAPTURE_RECORD Response;
+        CHAR                        ResponseData[XENBUS_STORE_CAPTURE_PAYLOAD_MAX + 1];
+
+        Records++;
+
+        CHECK(Record.DataLength == __min(Record.Length, XENBUS_STORE_CAPTURE_PAYLOAD_MAX));
+
+        if (Record.CaptureType == XENBUS_STORE_CAPTURE_TYPE_WATCH_EVENT) {
+            CHECK(Record.Type == XS_WATCH_EVENT);
+            Events++;
+            continue;
+        }
+
+        if (Record.CaptureType != XENBUS_STORE_CAPTURE_TYPE_REQUEST)
+            continue;
+
+        // Every request was answered
+        Requests++;
+        RtlZeroMemory(&Response, sizeof (Response));
+        CHECK(HarnessFindResponse(Buffer, Length, Offset, Record.RequestId,
+                                  &Response, ResponseData));
+        CHECK(Response.Type == Record.Type || Response.Type == XS_ERROR);
+    }
+
+    CHECK(Offset == Length);
+    CHECK(Records == 2 * Requests + Events);
+    CHECK(Events != 0);
+
+    SimDebugContext.Lines = 0;
+    SimDebugContext.Match = "CAPTURE:";
+    SimDebugContext.Matches = 0;
+    SimDebugContext.Callback->Function(SimDebugContext.Callback->Argument,
+                                       FALSE);
+    CHECK(SimDebugContext.Matches == 1);
+    CHECK(SimDebugContext.Lines > Records);
+    SimDebugContext.Match = NULL;
+
+    HarnessTearDown(H);
+
+    CHECK(HarnessPlan(Buffer, Length, &Replay));
+    CHECK(Replay.Count != 0);
+    CHECK(Replay.Count + Replay.Skipped == Requests);
+
+    free(Buffer);
+
+    HarnessSetUp(H);
+
+    // Without the StoreCapture parameter there is nothing to export
+    Length = 0;
+    status = XENBUS_STORE(CaptureExport, &H->StoreInterface, NULL, &Length);
+    CHECK(status == STATUS_NOT_SUPPORTED);
+
+    HarnessSeed(&Replay);
+    CHECK(HarnessReplay(H, &Replay, &Mismatches) == Replay.Count);
+    CHECK(Mismatches == 0);
+
+    HarnessTearDown(H);
+
+    HarnessFreePlan(&Replay);
+}
+
+typedef struct _HARNESS_THREAD {
+    PHARNESS            Harness;
+    ULONG               Index;
+    pthread_barrier_t   *Barrier;
+    pthread_t           Thread;
+    ULONG               Requests;
+    ULONG               Errors;
+    ULONG               Mismatches;
+    double              Elapsed;
+} HARNESS_THREAD, *PHARNESS_THREAD;
+
+static HARNESS_THREAD   Thread[HARNESS_STRESS_MAXIMUM];
+
+//
+// Write each of a thread's own nodes in turn and read it back, listing
+// them all from time to time and now and then writing a value that
+// takes more than one trip round the ring. Every response must be the
+// one for the request the thread just made.
+//
+static PVOID
+StressThread(
+    IN  PVOID       Argument
+    )
+{
+    PHARNESS_THREAD T = Argument;
+    PHARNESS        H = T->Harness;
+    CHAR            Prefix[32];
+    PCHAR           Large;
+    struct timespec Start;
+    struct timespec End;
+    ULONG           Request;
+
+    (VOID) snprintf(Prefix, sizeof (Prefix), "stress/%u", T->Index);
+
+    Large = malloc(HARNESS_LARGE_VALUE + 1);
+    ASSERT(Large != NULL);
+
+    memset(Large, 'a' + (T->Index % 26), HARNESS_LARGE_VALUE);
+    Large[HARNESS_LARGE_VALUE] = '\0';
+
+    (VOID) pthread_barrier_wait(T->Barrier);
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    for (Request = 0; Request < HARNESS_STRESS_REQUESTS; Request++) {
+        CHAR        Node[16];
+        CHAR        Expected[32];
+        PCHAR       Written;
+        PCHAR       Value;
+        NTSTATUS    status;
+
+        if (Request % 256 == 255) {
+            (VOID) snprintf(Node, sizeof (Node), "large");
+            Written = Large;
+        } else {
+            (VOID) snprintf(Node, sizeof (Node), "key%u", Request % HARNESS_STRESS_KEYS);
+            (VOID) snprintf(Expected, sizeof (Expected), "%u.%u", T->Index, Request);
+            Written = Expected;
+        }
+
+        T->Requests++;
+        status = XENBUS_STORE(Printf, &H->StoreInterface, NULL, Prefix, Node, "%s", Written);
+        if (!NT_SUCCESS(status)) {
+            T->Errors++;
+            continue;
+        }
+
+        T->Requests++;
+        status = XENBUS_STORE(Read, &H->StoreInterface, NULL, Prefix, Node, &Value);
+        if (!NT_SUCCESS(status)) {
+            T->Errors++;
+            continue;
+        }
+
+        if (strcmp(Value, Written) != 0)
+            T->Mismatches++;
+
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+
+        if (Request % 16 != 15)
+            continue;
+
+        T->Requests++;
+        status = XENBUS_STORE(Directory, &H->StoreInterface, NULL, NULL, Prefix, &Value);
+        if (!NT_SUCCESS(status)) {
+            T->Errors++;
+            continue;
+        }
+
+        // Every key has been written by now, and perhaps the large value
+        if (HarnessCountEntries(Value, NULL) != HARNESS_STRESS_KEYS + (Request >= 255))
+            T->Mismatches++;
+
+        XENBUS_STORE(Free, &H->StoreInterface, Value);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    T->Elapsed = (double)(End.tv_sec - Start.tv_sec) +
+                 (double)(End.tv_nsec - Start.tv_nsec) / 1e9;
+
+    free(Large);
+
+    return NULL;
+}
+
+static VOID
+TestStress(
+    IN  PHARNESS    H,
+    IN  ULONG       Maximum
+    )
+{
+    ULONG           Threads;
+
+    printf("store requests by threads (%ld online):\n",
+           sysconf(_SC_NPROCESSORS_ONLN));
+
+    for (Threads = 1; Threads <= Maximum; Threads *= 2) {
+        pthread_barrier_t   Barrier;
+        ULONGLONG           Requests;
+        double              Elapsed;
+        ULONG               Index;
+        NTSTATUS            status;
+
+        HarnessSetUp(H);
+
+        pthread_barrier_init(&Barrier, NULL, Threads);
+
+        for (Index = 0; Index < Threads; Index++) {
+            PHARNESS_THREAD T = &Thread[Index];
+
+            RtlZeroMemory(T, sizeof (HARNESS_THREAD));
+            T->Harness = H;
+            T->Index = Index;
+            T->Barrier = &Barrier;
+
+            pthread_create(&T->Thread, NULL, StressThread, T);
+        }
+
+        Requests = 0;
+        Elapsed = 0.0;
+        for (Index = 0; Index < Threads; Index++) {
+            PHARNESS_THREAD T = &Thread[Index];
+
+            pthread_join(T->Thread, NULL);
+
+            CHECK(T->Errors == 0);
+            CHECK(T->Mismatches == 0);
+
+            Requests += T->Requests;
+            Elapsed = __max(Elapsed, T->Elapsed);
+        }
+
+        pthread_barrier_destroy(&Barrier);
+
+        // Every request made it to xenstored, and nothing is left queued
+        CHECK(SimStore.Requests == Requests);
+        CHECK(H->Context->SubmittedQueue == NULL);
+        CHECK(IsListEmpty(&H->Context->SubmittedList));
+        CHECK(IsListEmpty(&H->Context->PendingList));
+        CHECK(IsListEmpty(&H->Context->BufferList));
+        CHECK(H->Context->SendIndex == H->Context->SendCount);
+
+        printf("%2u thread(s): %7.0f requests/s %5.2f yields %5.2f polls per request\n",
+               Threads,
+               (double)Requests / Elapsed,
+               (double)SimYields / Requests,
+               (double)SimPolls / Requests);
+
+        status = XENBUS_STORE(Remove, &H->StoreInterface, NULL, NULL, "stress");
+        CHECK(NT_SUCCESS(status));
+
+        HarnessTearDown(H);
+    }
+}
+
+// Capture the workload to File, in the form that StoreCaptureExport() uses
+static int
+CaptureFile(
+    IN  const CHAR  *File
+    )
+{
+    PUCHAR          Buffer;
+    ULONG           Length;
+    FILE            *Stream;
+    BOOLEAN         Written;
+
+    SimStoreCapture = TRUE;
+    HarnessSetUp(&Harness);
+    SimStoreCapture = FALSE;
+
+    HarnessWorkload(&Harness);
+
+    Buffer = HarnessExport(&Harness, &Length);
+
+    HarnessTearDown(&Harness);
+
+    if (Buffer == NULL) {
+        fprintf(stderr, "capture export failed\n");
+        return 1;
+    }
+
+    Stream = fopen(File, "wb");
+    if (Stream == NULL) {
+        perror(File);
+        free(Buffer);
+        return 1;
+    }
+
+    Written = (fwrite(Buffer, 1, Length, Stream) == Length) ? TRUE : FALSE;
+    if (fclose(Stream) != 0)
+        Written = FALSE;
+
+    free(Buffer);
+
+    if (!Written) {
+        perror(File);
+        return 1;
+    }
+
+    printf("captured %u bytes to %s\n", Length, File);
+
+    return (Failures == 0) ? 0 : 1;
+}
+
+// Replay a capture from File, which may have come from a real guest
+static int
+ReplayFile(
+    IN  const CHAR  *File,
+    IN  ULONG       Rounds
+    )
+{
+    HARNESS_REPLAY  Replay;
+    PUCHAR          Buffer;
+    long            Length;
+    FILE            *Stream;
+    BOOLEAN         Valid;
+
+    Stream = fopen(File, "rb");
+    if (Stream == NULL) {
+        perror(File);
+        return 1;
+    }
+
+    Buffer = NULL;
+    if (fseek(Stream, 0, SEEK_END) != 0 ||
+        (Length = ftell(Stream)) < 0 ||
+        fseek(Stream, 0, SEEK_SET) != 0 ||
+        (Buffer = malloc(__max(Length, 1))) == NULL ||
+        fread(Buffer, 1, Length, Stream) != (size_t)Length) {
+        perror(File);
+        free(Buffer);
+        fclose(Stream);
+        return 1;
+    }
+
+    fclose(Stream);
+
+    Valid = HarnessPlan(Buffer, (ULONG)Length, &Replay);
+    free(Buffer);
+
+    if (!Valid) {
+        fprintf(stderr, "%s: not a store capture\n", File);
+        HarnessFreePlan(&Replay);
+        return 1;
+    }
+
+    HarnessSetUp(&Harness);
+    (VOID) HarnessBenchmarkReplay(&Harness, &Replay, __max(Rounds, 1));
+    HarnessTearDown(&Harness);
+
+    HarnessFreePlan(&Replay);
+
+    return 0;
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    ULONG       Maximum;
+
+    if (argc > 2 && strcmp(argv[1], "capture") == 0)
+        return CaptureFile(argv[2]);
+
+    if (argc > 2 && strcmp(argv[1], "replay") == 0)
+        return ReplayFile(argv[2],
+                          (argc > 3) ?
+                          (ULONG)strtoul(argv[3], NULL, 0) :
+                          HARNESS_REPLAY_ROUNDS);
+
+    // Contend from at least four threads, however many processors the host has
+    Maximum = (argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) :
+                           (ULONG)__max(sysconf(_SC_NPROCESSORS_ONLN), 4);
+    Maximum = __min(__max(Maximum, 1), HARNESS_STRESS_MAXIMUM);
+
+    HarnessSetUp(&Harness);
+    TestReadWrite(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestDirectory(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestTransaction(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestWatch(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestDebug(&Harness);
+    HarnessTearDown(&Harness);
+
+    TestCapture(&Harness);
+
+    TestStress(&Harness, Maximum);
+
+    printf("%s\n", (Failures == 0) ? "PASS" : "FAIL");
+
+    return (Failures == 0) ? 0 : 1;
+}
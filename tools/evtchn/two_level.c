@@ -0,0 +1,1247 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+//
+// A user-mode harness for the 2-level event channel ABI. The unmodified
+// src/xenbus/evtchn_2l.c and src/xenbus/shared_info.c are built against
+// the shims in include/ and common/ and driven by a simulated
+// hypervisor. The simulator sets pending bits, selector bits and the
+// upcall flag in the shared info page the same way Xen does.
+//
+// The tests check that a poll pass delivers events in port order,
+// starting from the selector after the one it last finished, that a
+// port raised again from its own callback does not hold up the rest of
+// the pass, that masked events are held back until they are unmasked,
+// that every port is masked again on resume, and that events from
+// several producer threads are neither lost nor delivered twice as they
+// race the consumer's acknowledgement.
+//
+// A benchmark then measures the cost of a poll pass, and of each event
+// it delivers, as the fraction of ports that are pending grows.
+//
+// Build and run on Linux (x86) from this directory with:
+//
+//   cc -std=gnu11 -O2 -Wall -pthread -Iinclude -I../../include -iquote common -o two_level two_level.c
+//   ./two_level [ITERATIONS]
+//
+
+#include <ntddk.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+//
+// shared_info.c and evtchn_2l.c need the FDO type from fdo.h, and the
+// suspend and debug interfaces that fdo.h pulls in. Keep fdo.h itself
+// out, since it drags in every other subsystem, and supply the few FDO
+// functions that are used below.
+//
+#define _XENBUS_FDO_H
+
+typedef struct _XENBUS_FDO  XENBUS_FDO, *PXENBUS_FDO;
+
+#define __MODULE__  "XENBUS"
+
+#include "../../src/xenbus/suspend.h"
+#include "../../src/xenbus/debug.h"
+#include "../../src/xenbus/shared_info.h"
+
+//
+// MSVC drops the comma before an empty __VA_ARGS__, and lets "->" be
+// pasted onto a method name. GCC does neither, so the method macros of
+// the interfaces are redefined here.
+//
+#undef  XENBUS_SUSPEND
+#define XENBUS_SUSPEND(_Method, _Interface, ...)    \
+    (_Interface)->_Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_DEBUG
+#define XENBUS_DEBUG(_Method, _Interface, ...)    \
+    (_Interface)->Debug ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+#undef  XENBUS_SHARED_INFO
+#define XENBUS_SHARED_INFO(_Method, _Interface, ...)    \
+    (_Interface)->SharedInfo ## _Method((PINTERFACE)(_Interface), ##__VA_ARGS__)
+
+NTSTATUS
+FdoAllocateIoSpace(
+    IN  PXENBUS_FDO         Fdo,
+    IN  ULONG               Size,
+    OUT PPHYSICAL_ADDRESS   Address
+    );
+
+VOID
+FdoFreeIoSpace(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PHYSICAL_ADDRESS    Address,
+    IN  ULONG               Size
+    );
+
+PXENBUS_SUSPEND_CONTEXT
+FdoGetSuspendContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+PXENBUS_DEBUG_CONTEXT
+FdoGetDebugContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+PXENBUS_SHARED_INFO_CONTEXT
+FdoGetSharedInfoContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmultichar"        // pool tags
+#pragma GCC diagnostic ignored "-Wunused-function"  // SharedInfoClearBitUnlocked()
+
+#include "../../src/xenbus/shared_info.c"
+#include "../../src/xenbus/evtchn_2l.c"
+
+#pragma GCC diagnostic pop
+
+#define HARNESS_PORTS       4096    // Every 2-level port
+#define HARNESS_PRODUCERS   4
+#define HARNESS_RACE_BASE   60      // Straddle a selector boundary
+#define HARNESS_RACE_PORTS  8
+#define HARNESS_ITERATIONS  100000
+#define HARNESS_BENCH_EVENTS (1u << 22)
+
+//
+// The simulated hypervisor
+//
+
+#define SIM_BITS_PER_WORD   (sizeof (xen_ulong_t) * 8)
+#define SIM_WORDS           (RTL_FIELD_SIZE(shared_info_t, evtchn_pending) / sizeof (xen_ulong_t))
+#define SIM_IO_SPACE        0xF0000000ull
+
+static shared_info_t    *SimIoSpace;
+static shared_info_t    *SimShared;
+static ULONG            SimMapped;
+
+struct _XENBUS_SUSPEND_CONTEXT {
+    LONG                        References;
+    PXENBUS_SUSPEND_CALLBACK    Early;
+};
+
+struct _XENBUS_SUSPEND_CALLBACK {
+    XENBUS_SUSPEND_FUNCTION Function;
+    PVOID                   Argument;
+};
+
+struct _XENBUS_DEBUG_CONTEXT {
+    LONG                    References;
+    PXENBUS_DEBUG_CALLBACK  Callback;
+    ULONG                   Lines;
+};
+
+struct _XENBUS_DEBUG_CALLBACK {
+    XENBUS_DEBUG_FUNCTION   Function;
+    PVOID                   Argument;
+};
+
+static XENBUS_SUSPEND_CONTEXT       SimSuspendContext;
+static XENBUS_DEBUG_CONTEXT         SimDebugContext;
+static PXENBUS_SHARED_INFO_CONTEXT  SimSharedInfoContext;
+
+NTSTATUS
+FdoAllocateIoSpace(
+    IN  PXENBUS_FDO         Fdo,
+    IN  ULONG               Size,
+    OUT PPHYSICAL_ADDRESS   Address
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    ASSERT3U(Size, ==, PAGE_SIZE);
+    ASSERT3P(SimShared, ==, NULL);
+
+    RtlZeroMemory(SimIoSpace, PAGE_SIZE);
+    Address->QuadPart = SIM_IO_SPACE;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+FdoFreeIoSpace(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PHYSICAL_ADDRESS    Address,
+    IN  ULONG               Size
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    ASSERT3U(Address.QuadPart, ==, SIM_IO_SPACE);
+    ASSERT3U(Size, ==, PAGE_SIZE);
+
+    SimShared = NULL;
+}
+
+PVOID
+MmMapIoSpace(
+    IN  PHYSICAL_ADDRESS    Address,
+    IN  ULONG_PTR           Length,
+    IN  MEMORY_CACHING_TYPE CacheType
+    )
+{
+    UNREFERENCED_PARAMETER(CacheType);
+
+    ASSERT3U(Address.QuadPart, ==, SIM_IO_SPACE);
+    ASSERT3U(Length, ==, PAGE_SIZE);
+
+    return SimIoSpace;
+}
+
+VOID
+MmUnmapIoSpace(
+    IN  PVOID       Buffer,
+    IN  ULONG_PTR   Length
+    )
+{
+    ASSERT3P(Buffer, ==, SimIoSpace);
+    ASSERT3U(Length, ==, PAGE_SIZE);
+}
+
+NTSTATUS
+HvmSetParam(
+    IN  ULONG       Parameter,
+    IN  ULONGLONG   Value
+    )
+{
+    UNREFERENCED_PARAMETER(Parameter);
+    UNREFERENCED_PARAMETER(Value);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+HvmGetTime(
+    OUT PLARGE_INTEGER  Now
+    )
+{
+    struct timespec     Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    Now->QuadPart = (Time.tv_sec * 1000000000ll) + Time.tv_nsec;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+MemoryAddToPhysmap(
+    IN  PFN_NUMBER  Pfn,
+    IN  ULONG       Space,
+    IN  ULONG_PTR   Offset
+    )
+{
+    ASSERT3U(Pfn, ==, SIM_IO_SPACE >> PAGE_SHIFT);
+    ASSERT3U(Space, ==, XENMAPSPACE_shared_info);
+    ASSERT3U(Offset, ==, 0);
+
+    SimShared = SimIoSpace;
+    SimMapped++;
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+SystemVirtualCpuIndex(
+    IN  ULONG   Index
+    )
+{
+    return Index;
+}
+
+static NTSTATUS
+SimSuspendAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSuspendRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static NTSTATUS
+SimSuspendRegister(
+    IN  PINTERFACE                      Interface,
+    IN  XENBUS_SUSPEND_CALLBACK_TYPE    Type,
+    IN  XENBUS_SUSPEND_FUNCTION         Function,
+    IN  PVOID                           Argument OPTIONAL,
+    OUT PXENBUS_SUSPEND_CALLBACK        *Callback
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT             Context = Interface->Context;
+
+    // Only the shared info page registers, and only for the early phase
+    ASSERT3U(Type, ==, SUSPEND_CALLBACK_EARLY);
+    ASSERT3P(Context->Early, ==, NULL);
+
+    *Callback = calloc(1, sizeof (XENBUS_SUSPEND_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    Context->Early = *Callback;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimSuspendDeregister(
+    IN  PINTERFACE                  Interface,
+    IN  PXENBUS_SUSPEND_CALLBACK    Callback
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT         Context = Interface->Context;
+
+    ASSERT3P(Context->Early, ==, Callback);
+    Context->Early = NULL;
+
+    free(Callback);
+}
+
+static NTSTATUS
+SimSuspendTrigger(
+    IN  PINTERFACE          Interface
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
+
+    // Resume straight away; the shared info page was lost meanwhile
+    SimShared = NULL;
+
+    if (Context->Early != NULL)
+        Context->Early->Function(Context->Early->Argument);
+
+    return STATUS_SUCCESS;
+}
+
+static ULONG
+SimSuspendGetCount(
+    IN  PINTERFACE  Interface
+    )
+{
+    UNREFERENCED_PARAMETER(Interface);
+
+    return 0;
+}
+
+static XENBUS_SUSPEND_INTERFACE SimSuspendInterface = {
+    { sizeof (XENBUS_SUSPEND_INTERFACE), 1, NULL, NULL, NULL },
+    SimSuspendAcquire,
+    SimSuspendRelease,
+    SimSuspendRegister,
+    SimSuspendDeregister,
+    SimSuspendTrigger,
+    SimSuspendGetCount
+};
+
+NTSTATUS
+SuspendGetInterface(
+    IN      PXENBUS_SUSPEND_CONTEXT Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, 1);
+    ASSERT3U(Size, >=, sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    *(PXENBUS_SUSPEND_INTERFACE)Interface = SimSuspendInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+SimDebugAcquire(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+
+    Context->References++;
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimDebugRelease(
+    IN  PINTERFACE  Interface
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+
+    ASSERT(Context->References != 0);
+    --Context->References;
+}
+
+static NTSTATUS
+SimDebugRegister(
+    IN  PINTERFACE              Interface,
+    IN  PCHAR                   Prefix,
+    IN  XENBUS_DEBUG_FUNCTION   Function,
+    IN  PVOID                   Argument OPTIONAL,
+    OUT PXENBUS_DEBUG_CALLBACK  *Callback
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    UNREFERENCED_PARAMETER(Prefix);
+
+    ASSERT3P(Context->Callback, ==, NULL);
+
+    *Callback = calloc(1, sizeof (XENBUS_DEBUG_CALLBACK));
+    if (*Callback == NULL)
+        return STATUS_NO_MEMORY;
+
+    (*Callback)->Function = Function;
+    (*Callback)->Argument = Argument;
+
+    Context->Callback = *Callback;
+
+    return STATUS_SUCCESS;
+}
+
+static VOID
+SimDebugPrintf(
+    IN  PINTERFACE          Interface,
+    IN  const CHAR          *Format,
+    ...
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = Interface->Context;
+    CHAR                    Buffer[256];
+    va_list                 Arguments;
+
+    va_start(Arguments, Format);
+    (VOID) vsnprintf(Buffer, sizeof (Buffer), Format, Arguments);
+    va_end(Arguments);
+
+    Context->Lines++;
+}
+
+static VOID
+SimDebugTrigger(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback OPTIONAL
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    if (Callback == NULL)
+        Callback = Context->Callback;
+
+    if (Callback != NULL)
+        Callback->Function(Callback->Argument, FALSE);
+}
+
+static VOID
+SimDebugDeregister(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+
+    ASSERT3P(Context->Callback, ==, Callback);
+    Context->Callback = NULL;
+
+    free(Callback);
+}
+
+static XENBUS_DEBUG_INTERFACE SimDebugInterface = {
+    { sizeof (XENBUS_DEBUG_INTERFACE), 1, NULL, NULL, NULL },
+    SimDebugAcquire,
+    SimDebugRelease,
+    SimDebugRegister,
+    SimDebugPrintf,
+    SimDebugTrigger,
+    SimDebugDeregister
+};
+
+NTSTATUS
+DebugGetInterface(
+    IN      PXENBUS_DEBUG_CONTEXT   Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    ASSERT3U(Version, ==, 1);
+    ASSERT3U(Size, >=, sizeof (XENBUS_DEBUG_INTERFACE));
+
+    *(PXENBUS_DEBUG_INTERFACE)Interface = SimDebugInterface;
+    Interface->Context = Context;
+
+    return STATUS_SUCCESS;
+}
+
+PXENBUS_SUSPEND_CONTEXT
+FdoGetSuspendContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimSuspendContext;
+}
+
+PXENBUS_DEBUG_CONTEXT
+FdoGetDebugContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return &SimDebugContext;
+}
+
+PXENBUS_SHARED_INFO_CONTEXT
+FdoGetSharedInfoContext(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    UNREFERENCED_PARAMETER(Fdo);
+
+    return SimSharedInfoContext;
+}
+
+static BOOLEAN
+SimTestAndSetBit(
+    IN  xen_ulong_t *Word,
+    IN  ULONG       Bit
+    )
+{
+    xen_ulong_t     Mask = (xen_ulong_t)1 << Bit;
+
+    return (__atomic_fetch_or(Word, Mask, __ATOMIC_SEQ_CST) & Mask) ? TRUE : FALSE;
+}
+
+static BOOLEAN
+SimTestAndClearBit(
+    IN  xen_ulong_t *Word,
+    IN  ULONG       Bit
+    )
+{
+    xen_ulong_t     Mask = (xen_ulong_t)1 << Bit;
+
+    return (__atomic_fetch_and(Word, ~Mask, __ATOMIC_SEQ_CST) & Mask) ? TRUE : FALSE;
+}
+
+static BOOLEAN
+SimTestBit(
+    IN  xen_ulong_t *Word,
+    IN  ULONG       Bit
+    )
+{
+    xen_ulong_t     Mask = (xen_ulong_t)1 << Bit;
+
+    return (__atomic_load_n(Word, __ATOMIC_SEQ_CST) & Mask) ? TRUE : FALSE;
+}
+
+// Flag the selector of a pending, unmasked event and kick vCPU 0
+static VOID
+SimMarkPending(
+    IN  ULONG           Port
+    )
+{
+    struct vcpu_info    *Vcpu = &SimShared->vcpu_info[0];
+
+    if (SimTestAndSetBit(&Vcpu->evtchn_pending_sel, Port / SIM_BITS_PER_WORD))
+        return;
+
+    __atomic_store_n(&Vcpu->evtchn_upcall_pending, 1, __ATOMIC_SEQ_CST);
+}
+
+// Returns TRUE if the event was not already pending
+static BOOLEAN
+SimRaise(
+    IN  ULONG   Port
+    )
+{
+    ULONG       Selector = Port / SIM_BITS_PER_WORD;
+    ULONG       Bit = Port % SIM_BITS_PER_WORD;
+
+    if (SimTestAndSetBit(&SimShared->evtchn_pending[Selector], Bit))
+        return FALSE;
+
+    if (!SimTestBit(&SimShared->evtchn_mask[Selector], Bit))
+        SimMarkPending(Port);
+
+    return TRUE;
+}
+
+// Raise a set of unmasked ports at once, as a burst of sends would
+static VOID
+SimRaiseAll(
+    IN  xen_ulong_t Pending[SIM_WORDS]
+    )
+{
+    xen_ulong_t     Selectors;
+    ULONG           Selector;
+
+    Selectors = 0;
+    for (Selector = 0; Selector < SIM_WORDS; Selector++) {
+        if (Pending[Selector] == 0)
+            continue;
+
+        (VOID) __atomic_fetch_or(&SimShared->evtchn_pending[Selector],
+                                 Pending[Selector],
+                                 __ATOMIC_SEQ_CST);
+        Selectors |= (xen_ulong_t)1 << Selector;
+    }
+
+    (VOID) __atomic_fetch_or(&SimShared->vcpu_info[0].evtchn_pending_sel,
+                             Selectors,
+                             __ATOMIC_SEQ_CST);
+    __atomic_store_n(&SimShared->vcpu_info[0].evtchn_upcall_pending, 1,
+                     __ATOMIC_SEQ_CST);
+}
+
+// As EVTCHNOP_unmask
+static VOID
+SimUnmask(
+    IN  ULONG   Port
+    )
+{
+    ULONG       Selector = Port / SIM_BITS_PER_WORD;
+    ULONG       Bit = Port % SIM_BITS_PER_WORD;
+
+    if (SimTestAndClearBit(&SimShared->evtchn_mask[Selector], Bit) &&
+        SimTestBit(&SimShared->evtchn_pending[Selector], Bit))
+        SimMarkPending(Port);
+}
+
+static BOOLEAN
+SimIsPending(
+    IN  ULONG   Port
+    )
+{
+    return SimTestBit(&SimShared->evtchn_pending[Port / SIM_BITS_PER_WORD],
+                      Port % SIM_BITS_PER_WORD);
+}
+
+static BOOLEAN
+SimIsMasked(
+    IN  ULONG   Port
+    )
+{
+    return SimTestBit(&SimShared->evtchn_mask[Port / SIM_BITS_PER_WORD],
+                      Port % SIM_BITS_PER_WORD);
+}
+
+//
+// The guest side
+//
+
+typedef struct _HARNESS {
+    PXENBUS_SHARED_INFO_CONTEXT     SharedInfoContext;
+    XENBUS_SHARED_INFO_INTERFACE    SharedInfoInterface;
+    XENBUS_SUSPEND_INTERFACE        SuspendInterface;
+    XENBUS_DEBUG_INTERFACE          DebugInterface;
+    PXENBUS_EVTCHN_ABI_CONTEXT      Context;
+    XENBUS_EVTCHN_ABI               Abi;
+    ULONGLONG                       Delivered[HARNESS_PORTS];
+    ULONG                           Order[HARNESS_PORTS];
+    ULONG                           Count;
+    ULONG                           Storm;
+    BOOLEAN                         Done;
+} HARNESS, *PHARNESS;
+
+static HARNESS  Harness;
+static ULONG    Failures;
+
+#define CHECK(_EXP)                                         \
+        do {                                                \
+            if (!(_EXP)) {                                  \
+                fprintf(stderr, "%s:%d: CHECK FAILED: %s\n",\
+                        __FUNCTION__, __LINE__, #_EXP);     \
+                Failures++;                                 \
+            }                                               \
+        } while (FALSE)
+
+static BOOLEAN
+HarnessEvent(
+    IN  PVOID   Argument,
+    IN  ULONG   Port
+    )
+{
+    PHARNESS    H = Argument;
+
+    ASSERT3U(Port, <, HARNESS_PORTS);
+
+    XENBUS_EVTCHN_ABI(PortAck, &H->Abi, Port);
+
+    H->Delivered[Port]++;
+    if (H->Count < HARNESS_PORTS)
+        H->Order[H->Count] = Port;
+    H->Count++;
+
+    if (Port == H->Storm)
+        (VOID) SimRaise(Port);
+
+    return TRUE;
+}
+
+// A single poll pass
+static BOOLEAN
+HarnessPoll(
+    IN  PHARNESS    H
+    )
+{
+    return XENBUS_EVTCHN_ABI(Poll, &H->Abi, 0, HarnessEvent, H);
+}
+
+// Poll for as long as the upcall is pending, as EvtchnInterruptCallback() does
+static BOOLEAN
+HarnessUpcall(
+    IN  PHARNESS    H
+    )
+{
+    BOOLEAN         DoneSomething;
+
+    DoneSomething = FALSE;
+    while (XENBUS_SHARED_INFO(UpcallPending, &H->SharedInfoInterface, 0))
+        DoneSomething |= HarnessPoll(H);
+
+    return DoneSomething;
+}
+
+// Re-mask and use the hypercall if the event was pending, as EvtchnPortUnmask() does
+static BOOLEAN
+HarnessUnmask(
+    IN  PHARNESS    H,
+    IN  ULONG       Port
+    )
+{
+    if (!XENBUS_EVTCHN_ABI(PortUnmask, &H->Abi, Port))
+        return FALSE;
+
+    XENBUS_EVTCHN_ABI(PortMask, &H->Abi, Port);
+    SimUnmask(Port);
+
+    return TRUE;
+}
+
+static VOID
+HarnessReset(
+    IN  PHARNESS    H
+    )
+{
+    RtlZeroMemory(H->Delivered, sizeof (H->Delivered));
+    RtlZeroMemory(H->Order, sizeof (H->Order));
+    H->Count = 0;
+    H->Storm = 0;
+    H->Done = FALSE;
+}
+
+static VOID
+HarnessSetUp(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Port;
+    NTSTATUS        status;
+
+    status = SharedInfoInitialize(NULL, &H->SharedInfoContext);
+    ASSERT(NT_SUCCESS(status));
+
+    SimSharedInfoContext = H->SharedInfoContext;
+
+    status = SharedInfoGetInterface(H->SharedInfoContext,
+                                    XENBUS_SHARED_INFO_INTERFACE_VERSION_MAX,
+                                    (PINTERFACE)&H->SharedInfoInterface,
+                                    sizeof (H->SharedInfoInterface));
+    ASSERT(NT_SUCCESS(status));
+
+    status = SuspendGetInterface(&SimSuspendContext,
+                                 XENBUS_SUSPEND_INTERFACE_VERSION_MAX,
+                                 (PINTERFACE)&H->SuspendInterface,
+                                 sizeof (H->SuspendInterface));
+    ASSERT(NT_SUCCESS(status));
+
+    status = DebugGetInterface(&SimDebugContext,
+                               XENBUS_DEBUG_INTERFACE_VERSION_MAX,
+                               (PINTERFACE)&H->DebugInterface,
+                               sizeof (H->DebugInterface));
+    ASSERT(NT_SUCCESS(status));
+
+    status = EvtchnTwoLevelInitialize(NULL, &H->Context);
+    ASSERT(NT_SUCCESS(status));
+
+    EvtchnTwoLevelGetAbi(H->Context, &H->Abi);
+
+    // Hold the shared info page for the upcall check, as evtchn.c does
+    status = XENBUS_SHARED_INFO(Acquire, &H->SharedInfoInterface);
+    ASSERT(NT_SUCCESS(status));
+
+    status = H->Abi.EvtchnAbiAcquire(H->Abi.Context);
+    ASSERT(NT_SUCCESS(status));
+
+    // Everything starts out masked
+    for (Port = 1; Port < HARNESS_PORTS; Port++)
+        ASSERT(SimIsMasked(Port));
+
+    // Xen never allocates port 0
+    for (Port = 1; Port < HARNESS_PORTS; Port++) {
+        status = XENBUS_EVTCHN_ABI(PortEnable, &H->Abi, Port);
+        ASSERT(NT_SUCCESS(status));
+
+        (VOID) HarnessUnmask(H, Port);
+    }
+
+    HarnessReset(H);
+}
+
+static VOID
+HarnessTearDown(
+    IN  PHARNESS    H
+    )
+{
+    H->Abi.EvtchnAbiRelease(H->Abi.Context);
+    XENBUS_SHARED_INFO(Release, &H->SharedInfoInterface);
+
+    EvtchnTwoLevelTeardown(H->Context);
+    SharedInfoTeardown(H->SharedInfoContext);
+
+    SimSharedInfoContext = NULL;
+
+    ASSERT3U(SimSuspendContext.References, ==, 0);
+    ASSERT3U(SimDebugContext.References, ==, 0);
+
+    RtlZeroMemory(H, sizeof (HARNESS));
+}
+
+static VOID
+TestOrder(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Port;
+    ULONG           Index;
+
+    for (Port = 1; Port < HARNESS_PORTS; Port++)
+        CHECK(SimRaise(Port));
+
+    CHECK(HarnessUpcall(H));
+    CHECK(H->Count == HARNESS_PORTS - 1);
+
+    for (Port = 1; Port < HARNESS_PORTS; Port++) {
+        CHECK(H->Delivered[Port] == 1);
+        CHECK(!SimIsPending(Port));
+    }
+
+    // A pass started at port 0, so everything comes in port order
+    for (Index = 1; Index < H->Count; Index++)
+        CHECK(H->Order[Index - 1] < H->Order[Index]);
+
+    CHECK(!HarnessUpcall(H));
+
+    //
+    // The next pass starts with the selector after the last one that
+    // was serviced, wrapping round to pick up any before it.
+    //
+    HarnessReset(H);
+
+    CHECK(SimRaise(130));
+    CHECK(HarnessUpcall(H));
+    CHECK(H->SharedInfoContext->Port == 3 * SIM_BITS_PER_WORD);
+
+    HarnessReset(H);
+
+    CHECK(SimRaise(5));
+    CHECK(SimRaise(200));
+    CHECK(SimRaise(400));
+    CHECK(HarnessUpcall(H));
+
+    CHECK(H->Count == 3);
+    CHECK(H->Order[0] == 200);
+    CHECK(H->Order[1] == 400);
+    CHECK(H->Order[2] == 5);
+}
+
+static VOID
+TestStorm(
+    IN  PHARNESS    H
+    )
+{
+    //
+    // A port that is raised again from its own callback is not serviced
+    // a second time in the same pass, and does not hold up the ports
+    // behind it.
+    //
+    H->Storm = 1;
+
+    CHECK(SimRaise(1));
+    CHECK(SimRaise(100));
+    CHECK(SimRaise(300));
+
+    CHECK(HarnessPoll(H));
+    CHECK(H->Delivered[1] == 1);
+    CHECK(H->Delivered[100] == 1);
+    CHECK(H->Delivered[300] == 1);
+    CHECK(SimIsPending(1));
+
+    CHECK(HarnessPoll(H));
+    CHECK(H->Delivered[1] == 2);
+    CHECK(H->Count == 4);
+
+    H->Storm = 0;
+
+    CHECK(HarnessUpcall(H));
+    CHECK(H->Delivered[1] == 3);
+    CHECK(!SimIsPending(1));
+    CHECK(!HarnessUpcall(H));
+}
+
+static VOID
+TestMask(
+    IN  PHARNESS    H
+    )
+{
+    // An event raised while masked is not delivered until it is unmasked
+    XENBUS_EVTCHN_ABI(PortMask, &H->Abi, 1);
+
+    CHECK(SimRaise(1));
+    CHECK(!HarnessUpcall(H));
+    CHECK(H->Delivered[1] == 0);
+
+    CHECK(HarnessUnmask(H, 1));
+
+    CHECK(HarnessUpcall(H));
+    CHECK(H->Delivered[1] == 1);
+
+    // An event masked while pending is skipped, but stays pending
+    CHECK(SimRaise(2));
+    XENBUS_EVTCHN_ABI(PortMask, &H->Abi, 2);
+
+    CHECK(!HarnessUpcall(H));
+    CHECK(H->Delivered[2] == 0);
+    CHECK(SimIsPending(2));
+
+    CHECK(HarnessUnmask(H, 2));
+
+    CHECK(HarnessUpcall(H));
+    CHECK(H->Delivered[2] == 1);
+
+    CHECK(!HarnessUnmask(H, 3));
+    CHECK(!SimIsMasked(3));
+}
+
+static VOID
+TestResume(
+    IN  PHARNESS    H
+    )
+{
+    ULONG           Mapped;
+    ULONG           Port;
+    NTSTATUS        status;
+
+    Mapped = SimMapped;
+
+    status = XENBUS_SUSPEND(Trigger, &H->SuspendInterface);
+    CHECK(NT_SUCCESS(status));
+
+    // The page is mapped again and every port is masked
+    CHECK(SimMapped == Mapped + 1);
+    CHECK(SimShared == SimIoSpace);
+
+    for (Port = 1; Port < HARNESS_PORTS; Port++)
+        CHECK(SimIsMasked(Port));
+
+    CHECK(SimRaise(1));
+    CHECK(!HarnessUpcall(H));
+
+    CHECK(HarnessUnmask(H, 1));
+    CHECK(HarnessUpcall(H));
+    CHECK(H->Delivered[1] == 1);
+
+    // The debug callback can walk the page
+    SimDebugContext.Lines = 0;
+    XENBUS_DEBUG(Trigger, &H->DebugInterface, NULL);
+    CHECK(SimDebugContext.Lines != 0);
+}
+
+typedef struct _PRODUCER {
+    pthread_t   Thread;
+    unsigned    Seed;
+    ULONG       Iterations;
+    ULONGLONG   Raised[HARNESS_PORTS];
+    BOOLEAN     Stuck[HARNESS_PORTS];
+} PRODUCER, *PPRODUCER;
+
+static PRODUCER Producer[HARNESS_PRODUCERS];
+
+static PVOID
+ProducerThread(
+    IN  PVOID   Argument
+    )
+{
+    PPRODUCER   P = Argument;
+    ULONG       Index;
+
+    for (Index = 0; Index < P->Iterations; Index++) {
+        ULONG   Port = HARNESS_RACE_BASE +
+                       (rand_r(&P->Seed) % HARNESS_RACE_PORTS);
+        ULONG   Attempt;
+
+        //
+        // Don't just pile up on events that the consumer hasn't seen yet,
+        // but don't keep waiting for ones that have been lost either.
+        //
+        for (Attempt = 0; Attempt < 1000 && !P->Stuck[Port]; Attempt++) {
+            if (!SimIsPending(Port))
+                break;
+
+            sched_yield();
+        }
+
+        if (Attempt == 1000)
+            P->Stuck[Port] = TRUE;
+
+        if (SimRaise(Port))
+            P->Raised[Port]++;
+    }
+
+    return NULL;
+}
+
+static PVOID
+ConsumerThread(
+    IN  PVOID   Argument
+    )
+{
+    PHARNESS    H = Argument;
+
+    for (;;) {
+        BOOLEAN Done = __atomic_load_n(&H->Done, __ATOMIC_SEQ_CST);
+
+        if (HarnessUpcall(H))
+            continue;
+
+        // Nothing was left once every producer had finished
+        if (Done)
+            break;
+
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static VOID
+TestRace(
+    IN  PHARNESS    H,
+    IN  ULONG       Iterations
+    )
+{
+    pthread_t       Consumer;
+    struct timespec Start;
+    struct timespec End;
+    ULONGLONG       Total;
+    double          Elapsed;
+    ULONG           Index;
+    ULONG           Port;
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+
+    pthread_create(&Consumer, NULL, ConsumerThread, H);
+
+    for (Index = 0; Index < HARNESS_PRODUCERS; Index++) {
+        PPRODUCER   P = &Producer[Index];
+
+        RtlZeroMemory(P, sizeof (PRODUCER));
+        P->Seed = Index + 1;
+        P->Iterations = Iterations;
+
+        pthread_create(&P->Thread, NULL, ProducerThread, P);
+    }
+
+    for (Index = 0; Index < HARNESS_PRODUCERS; Index++)
+        pthread_join(Producer[Index].Thread, NULL);
+
+    __atomic_store_n(&H->Done, TRUE, __ATOMIC_SEQ_CST);
+    pthread_join(Consumer, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+
+    // Every raise that made an event pending must be delivered once
+    Total = 0;
+    for (Port = 1; Port < HARNESS_PORTS; Port++) {
+        ULONGLONG   Raised = 0;
+
+        for (Index = 0; Index < HARNESS_PRODUCERS; Index++)
+            Raised += Producer[Index].Raised[Port];
+
+        CHECK(H->Delivered[Port] == Raised);
+        CHECK(!SimIsPending(Port));
+
+        Total += Raised;
+    }
+
+    CHECK(SimShared->vcpu_info[0].evtchn_pending_sel == 0);
+
+    Elapsed = (double)(End.tv_sec - Start.tv_sec) +
+              (double)(End.tv_nsec - Start.tv_nsec) / 1e9;
+
+    printf("%u producer(s): %llu event(s) in %.3fs (%.0f/s)\n",
+           HARNESS_PRODUCERS,
+           (unsigned long long)Total,
+           Elapsed,
+           (double)Total / Elapsed);
+}
+
+static VOID
+BenchDensity(
+    IN  PHARNESS    H
+    )
+{
+    static const ULONG  Density[] = { 1, 4, 16, 64, 256, 1024, HARNESS_PORTS - 1 };
+    ULONG               Port[HARNESS_PORTS - 1];
+    xen_ulong_t         Pending[SIM_WORDS];
+    unsigned            Seed;
+    ULONG               Index;
+
+    for (Index = 0; Index < HARNESS_PORTS - 1; Index++)
+        Port[Index] = Index + 1;
+
+    Seed = 1;
+
+    printf("poll cost by pending density:\n");
+
+    for (Index = 0; Index < ARRAYSIZE(Density); Index++) {
+        ULONG           Count = Density[Index];
+        ULONG           Rounds = __max(HARNESS_BENCH_EVENTS / Count, 1);
+        struct timespec Start;
+        struct timespec End;
+        double          Elapsed;
+        ULONG           Round;
+        ULONG           Next;
+
+        // Spread the pending ports at random over the whole port space
+        RtlZeroMemory(Pending, sizeof (Pending));
+
+        for (Next = 0; Next < Count; Next++) {
+            ULONG   Swap = Next + (rand_r(&Seed) % (HARNESS_PORTS - 1 - Next));
+            ULONG   Value = Port[Swap];
+
+            Port[Swap] = Port[Next];
+            Port[Next] = Value;
+
+            Pending[Value / SIM_BITS_PER_WORD] |=
+                (xen_ulong_t)1 << (Value % SIM_BITS_PER_WORD);
+        }
+
+        H->Count = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &Start);
+
+        for (Round = 0; Round < Rounds; Round++) {
+            SimRaiseAll(Pending);
+            (VOID) HarnessUpcall(H);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &End);
+
+        CHECK((ULONGLONG)H->Count == (ULONGLONG)Rounds * Count);
+
+        Elapsed = (double)(End.tv_sec - Start.tv_sec) * 1e9 +
+                  (double)(End.tv_nsec - Start.tv_nsec);
+
+        printf("%4u/%u pending: %9.1fns/pass %6.1fns/event\n",
+               Count,
+               HARNESS_PORTS,
+               Elapsed / Rounds,
+               Elapsed / ((double)Rounds * Count));
+    }
+}
+
+int
+main(
+    IN  int     argc,
+    IN  char    **argv
+    )
+{
+    ULONG       Iterations;
+
+    Iterations = (argc > 1) ? (ULONG)strtoul(argv[1], NULL, 0) :
+                              HARNESS_ITERATIONS;
+
+    SimIoSpace = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    ASSERT(SimIoSpace != NULL);
+
+    HarnessSetUp(&Harness);
+    TestOrder(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestStorm(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestMask(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestResume(&Harness);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    TestRace(&Harness, Iterations);
+    HarnessTearDown(&Harness);
+
+    HarnessSetUp(&Harness);
+    BenchDensity(&Harness);
+    HarnessTearDown(&Harness);
+
+    free(SimIoSpace);
+
+    printf("%s\n", (Failures == 0) ? "PASS" : "FAIL");
+
+    return (Failures == 0) ? 0 : 1;
+}